@@ -0,0 +1,26 @@
+/*
+ * Minimal NGINX configuration for standalone benchmarks
+ */
+
+
+#ifndef _NGX_CONFIG_H_INCLUDED_
+#define _NGX_CONFIG_H_INCLUDED_
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+
+#define ngx_inline  inline
+
+
+typedef intptr_t   ngx_int_t;
+typedef uintptr_t  ngx_uint_t;
+typedef unsigned char  u_char;
+
+
+#endif /* _NGX_CONFIG_H_INCLUDED_ */
@@ -0,0 +1,58 @@
+/*
+ * Minimal NGINX core for standalone benchmarks
+ */
+
+
+#ifndef _NGX_CORE_H_INCLUDED_
+#define _NGX_CORE_H_INCLUDED_
+
+
+#include <ngx_config.h>
+
+
+#define NGX_LOG_ERR         4
+#define NGX_LOG_DEBUG_HTTP  0x100
+
+
+typedef struct ngx_log_s ngx_log_t;
+typedef struct ngx_queue_s ngx_queue_t;
+
+typedef struct {
+	size_t   len;
+	u_char  *data;
+} ngx_str_t;
+
+struct ngx_queue_s {
+	ngx_queue_t  *prev;
+	ngx_queue_t  *next;
+};
+
+
+#define ngx_alloc(size, log)           malloc(size)
+#define ngx_calloc(size, log)          calloc(1, size)
+#define ngx_free                       free
+#define ngx_memzero(buf, n)            (void)memset(buf, 0, n)
+#define ngx_memset(buf, c, n)          (void)memset(buf, c, n)
+#define ngx_memcpy(dst, src, n)        (void)memcpy(dst, src, n)
+#define ngx_strncmp(s1, s2, n)         strncmp((const char *)s1, (const char *)s2, n)
+#define ngx_strncasecmp(s1, s2, n)     strncasecmp((const char *)s1, (const char *)s2, n)
+#define ngx_tolower(c)                 (u_char)((c >= 'A' && c <= 'Z') ? (c | 0x20) : c)
+#define ngx_log_error(level, log, ...)
+#define ngx_log_debug3(level, log, ...)
+
+#define ngx_queue_init(q)              (q)->prev = q; (q)->next = q
+#define ngx_queue_empty(h)             (h == (h)->prev)
+#define ngx_queue_insert_head(h, x)    (x)->next = (h)->next; (x)->next->prev = x; \
+		(x)->prev = h; (h)->next = x
+#define ngx_queue_insert_tail(h, x)    (x)->prev = (h)->prev; (x)->prev->next = x; \
+		(x)->next = h; (h)->prev = x
+#define ngx_queue_head(h)              (h)->next
+#define ngx_queue_last(h)              (h)->prev
+#define ngx_queue_sentinel(h)          (h)
+#define ngx_queue_next(q)              (q)->next
+#define ngx_queue_prev(q)              (q)->prev
+#define ngx_queue_remove(x)            (x)->next->prev = (x)->prev; (x)->prev->next = (x)->next
+#define ngx_queue_data(q, type, link)  (type *)((u_char *)q - offsetof(type, link))
+
+
+#endif /* _NGX_CORE_H_INCLUDED_ */
@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <lws_table.h>
+
+
+/*
+ * Benchmarks lws_table. The NGINX headers in this directory provide what the table needs.
+ * To compare implementations, build against the src/lws_table.[ch] of each revision.
+ *
+ * Usage: cc -O2 -I bench -I src -o table bench/table.c src/lws_table.c && ./table [n]
+ */
+
+
+#define ROUNDS  5
+
+
+typedef struct {
+	const char  *name;
+	size_t     (*run)(lws_table_t *t, ngx_str_t *keys, size_t n);
+	size_t       setup;  /* number of keys set before timing */
+	unsigned     ci:1;
+	unsigned     capped:1;
+} bench_t;
+
+
+static size_t run_insert(lws_table_t *t, ngx_str_t *keys, size_t n);
+static size_t run_hit(lws_table_t *t, ngx_str_t *keys, size_t n);
+static size_t run_miss(lws_table_t *t, ngx_str_t *keys, size_t n);
+static size_t run_churn(lws_table_t *t, ngx_str_t *keys, size_t n);
+static size_t run_lru(lws_table_t *t, ngx_str_t *keys, size_t n);
+static size_t run_next(lws_table_t *t, ngx_str_t *keys, size_t n);
+static double now(void);
+
+
+static size_t run_insert (lws_table_t *t, ngx_str_t *keys, size_t n) {
+	size_t  i;
+
+	for (i = 0; i < n; i++) {
+		lws_table_set(t, &keys[i], &keys[i]);
+	}
+	return n;
+}
+
+static size_t run_hit (lws_table_t *t, ngx_str_t *keys, size_t n) {
+	size_t  i, r, found;
+
+	found = 0;
+	for (r = 0; r < 4; r++) {
+		for (i = 0; i < n; i++) {
+			found += lws_table_get(t, &keys[(i * 7919) % n]) != NULL;
+		}
+	}
+	if (found != 4 * n) {
+		fprintf(stderr, "table: hit mismatch\n");
+		exit(EXIT_FAILURE);
+	}
+	return 4 * n;
+}
+
+static size_t run_miss (lws_table_t *t, ngx_str_t *keys, size_t n) {
+	size_t  i, r;
+
+	/* keys n..2n - 1 are not set */
+	for (r = 0; r < 4; r++) {
+		for (i = 0; i < n; i++) {
+			if (lws_table_get(t, &keys[n + i])) {
+				fprintf(stderr, "table: miss mismatch\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	return 4 * n;
+}
+
+static size_t run_churn (lws_table_t *t, ngx_str_t *keys, size_t n) {
+	size_t  i;
+
+	/* delete one key and set another, keeping the count constant */
+	for (i = 0; i < 2 * n; i++) {
+		lws_table_set(t, &keys[i % (2 * n)], NULL);
+		lws_table_set(t, &keys[(i + n) % (2 * n)], &keys[i]);
+	}
+	return 4 * n;
+}
+
+static size_t run_lru (lws_table_t *t, ngx_str_t *keys, size_t n) {
+	size_t  i;
+
+	/* cap is n / 2; gets hit about half of the time */
+	for (i = 0; i < 2 * n; i++) {
+		if (!lws_table_get(t, &keys[(i * 7919) % n])) {
+			lws_table_set(t, &keys[(i * 7919) % n], &keys[i]);
+		}
+	}
+	return 2 * n;
+}
+
+static size_t run_next (lws_table_t *t, ngx_str_t *keys, size_t n) {
+	void       *value;
+	size_t      count;
+	ngx_str_t  *key;
+
+	(void)keys;
+	count = 0;
+	key = NULL;
+	while (lws_table_next(t, key, &key, &value) == 0) {
+		count++;
+	}
+	if (count != n) {
+		fprintf(stderr, "table: next mismatch\n");
+		exit(EXIT_FAILURE);
+	}
+	return n;
+}
+
+static double now (void) {
+	struct timespec  ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main (int argc, char *argv[]) {
+	char          *buf, *p;
+	size_t         n, i, b, r, ops;
+	double         start, best, elapsed;
+	ngx_str_t     *keys;
+	lws_table_t   *t;
+	static bench_t  benches[] = {
+		{ "insert", run_insert, 0, 0, 0 },
+		{ "get hit", run_hit, 1, 0, 0 },
+		{ "get miss", run_miss, 1, 0, 0 },
+		{ "get hit ci", run_hit, 1, 1, 0 },
+		{ "delete/set", run_churn, 1, 0, 0 },
+		{ "lru", run_lru, 0, 0, 1 },
+		{ "next", run_next, 1, 0, 0 },
+		{ NULL, NULL, 0, 0, 0 }
+	};
+
+	/* keys; the second half is never set before timing */
+	n = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+	if (n < 2) {
+		fprintf(stderr, "usage: table [n]\n");
+		return EXIT_FAILURE;
+	}
+	keys = malloc(2 * n * sizeof(ngx_str_t));
+	buf = malloc(2 * n * 32);
+	if (!keys || !buf) {
+		fprintf(stderr, "table: failed to allocate keys\n");
+		return EXIT_FAILURE;
+	}
+	p = buf;
+	for (i = 0; i < 2 * n; i++) {
+		keys[i].data = (u_char *)p;
+		keys[i].len = sprintf(p, "Content-Key-%zu", i * 2654435761U % 1000000007);
+		p += 32;
+	}
+
+	/* run; the best of several rounds is reported */
+	printf("n = %zu\n%-12s %10s\n", n, "", "ns/op");
+	for (b = 0; benches[b].name; b++) {
+		best = 0;
+		for (r = 0; r < ROUNDS; r++) {
+			t = lws_table_create(0, NULL);
+			if (!t) {
+				fprintf(stderr, "table: failed to create table\n");
+				return EXIT_FAILURE;
+			}
+			lws_table_set_ci(t, benches[b].ci);
+			if (benches[b].capped) {
+				lws_table_set_cap(t, n / 2);
+			}
+			if (benches[b].setup) {
+				run_insert(t, keys, n);
+			}
+			start = now();
+			ops = benches[b].run(t, keys, n);
+			elapsed = (now() - start) / ops * 1e9;
+			if (r == 0 || elapsed < best) {
+				best = elapsed;
+			}
+			lws_table_free(t);
+		}
+		printf("%-12s %10.1f\n", benches[b].name, best);
+	}
+	free(buf);
+	free(keys);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,208 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define LWS_MMAP_LAYOUT_ONLY
+#include <lws_mmap.h>
+
+
+/*
+ * Builds a file for lws.mmap from lines of the form key<TAB>value read from standard input.
+ * With -x, keys are hexadecimal, e.g., big-endian IPv4 addresses for range lookups. The file
+ * is written to a temporary file and renamed, so workers mapping the previous file are not
+ * affected.
+ *
+ * Usage: cc -I src -o mmap gen/mmap.c && ./mmap [-x] file < input
+ */
+
+
+typedef struct {
+	char    *key;
+	size_t   key_len;
+	char    *value;
+	size_t   value_len;
+} entry_t;
+
+
+static int unhex(char *s, size_t *len);
+static int compare(const void *a, const void *b);
+static void fail(const char *msg, size_t line);
+static void fail_tmp(const char *msg, char *tmp);
+
+
+static int unhex (char *s, size_t *len) {
+	size_t  i;
+	int     hi, lo;
+
+	if (*len % 2 != 0) {
+		return -1;
+	}
+	for (i = 0; i < *len / 2; i++) {
+		hi = s[2 * i];
+		lo = s[2 * i + 1];
+		hi = hi >= '0' && hi <= '9' ? hi - '0' : (hi | 0x20) >= 'a' && (hi | 0x20) <= 'f'
+				? (hi | 0x20) - 'a' + 10 : -1;
+		lo = lo >= '0' && lo <= '9' ? lo - '0' : (lo | 0x20) >= 'a' && (lo | 0x20) <= 'f'
+				? (lo | 0x20) - 'a' + 10 : -1;
+		if (hi < 0 || lo < 0) {
+			return -1;
+		}
+		s[i] = (char)(hi << 4 | lo);
+	}
+	*len /= 2;
+	return 0;
+}
+
+static int compare (const void *a, const void *b) {
+	int             rc;
+	const entry_t  *ea = a, *eb = b;
+
+	rc = memcmp(ea->key, eb->key, ea->key_len < eb->key_len ? ea->key_len : eb->key_len);
+	if (rc != 0) {
+		return rc;
+	}
+	return ea->key_len < eb->key_len ? -1 : ea->key_len > eb->key_len;
+}
+
+static void fail (const char *msg, size_t line) {
+	if (line) {
+		fprintf(stderr, "mmap: %s on line %zu\n", msg, line);
+	} else {
+		fprintf(stderr, "mmap: %s\n", msg);
+	}
+	exit(EXIT_FAILURE);
+}
+
+static void fail_tmp (const char *msg, char *tmp) {
+	(void)unlink(tmp);
+	fail(msg, 0);
+}
+
+int main (int argc, char *argv[]) {
+	int                 hex, rc;
+	char               *buf, *p, *end, *tab, *nl, *path, *tmp;
+	FILE               *f;
+	size_t              len, size, n, alloc, i, line;
+	entry_t            *entries;
+	uint64_t            offset;
+	lws_mmap_index_t    entry;
+	lws_mmap_header_t   header;
+
+	/* arguments */
+	hex = argc == 3 && strcmp(argv[1], "-x") == 0;
+	if (argc != 2 + hex) {
+		fprintf(stderr, "usage: mmap [-x] file < input\n");
+		return EXIT_FAILURE;
+	}
+
+	/* read input */
+	size = 65536;
+	len = 0;
+	buf = malloc(size);
+	while (buf) {
+		len += fread(buf + len, 1, size - len, stdin);
+		if (len < size) {
+			break;
+		}
+		size *= 2;
+		buf = realloc(buf, size);
+	}
+	if (!buf || ferror(stdin)) {
+		fail("failed to read input", 0);
+	}
+
+	/* parse lines */
+	n = 0;
+	alloc = 1024;
+	entries = malloc(alloc * sizeof(entry_t));
+	p = buf;
+	end = buf + len;
+	for (line = 1; p < end && entries; line++) {
+		nl = memchr(p, '\n', end - p);
+		if (!nl) {
+			nl = end;
+		}
+		if (nl > p && nl[-1] == '\r') {
+			nl--;
+		}
+		if (nl == p) {
+			p = nl + 1;
+			continue;
+		}
+		tab = memchr(p, '\t', nl - p);
+		if (!tab) {
+			fail("missing tab", line);
+		}
+		if (n == alloc) {
+			alloc *= 2;
+			entries = realloc(entries, alloc * sizeof(entry_t));
+			if (!entries) {
+				break;
+			}
+		}
+		entries[n].key = p;
+		entries[n].key_len = tab - p;
+		entries[n].value = tab + 1;
+		entries[n].value_len = nl - tab - 1;
+		if (hex && unhex(entries[n].key, &entries[n].key_len) != 0) {
+			fail("bad hexadecimal key", line);
+		}
+		if (entries[n].key_len > UINT32_MAX || entries[n].value_len > UINT32_MAX) {
+			fail("entry too long", line);
+		}
+		n++;
+		p = nl + 1;
+	}
+	if (!entries) {
+		fail("failed to allocate entries", 0);
+	}
+
+	/* sort; keys must be unique */
+	qsort(entries, n, sizeof(entry_t), compare);
+	for (i = 1; i < n; i++) {
+		if (compare(&entries[i - 1], &entries[i]) == 0) {
+			fail("duplicate key", 0);
+		}
+	}
+
+	/* write header, index, and data to a temporary file in the same directory */
+	path = argv[1 + hex];
+	tmp = malloc(strlen(path) + 32);
+	if (!tmp) {
+		fail("failed to allocate path", 0);
+	}
+	sprintf(tmp, "%s.%ld", path, (long)getpid());
+	f = fopen(tmp, "wb");
+	if (!f) {
+		fail("failed to open file", 0);
+	}
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, LWS_MMAP_MAGIC, sizeof(header.magic));
+	header.bom = LWS_MMAP_BOM;
+	header.n = n;
+	fwrite(&header, sizeof(header), 1, f);
+	offset = sizeof(lws_mmap_header_t) + n * sizeof(lws_mmap_index_t);
+	for (i = 0; i < n; i++) {
+		entry.offset = offset;
+		entry.key_len = entries[i].key_len;
+		entry.value_len = entries[i].value_len;
+		fwrite(&entry, sizeof(entry), 1, f);
+		offset += entries[i].key_len + entries[i].value_len;
+	}
+	for (i = 0; i < n; i++) {
+		fwrite(entries[i].key, 1, entries[i].key_len, f);
+		fwrite(entries[i].value, 1, entries[i].value_len, f);
+	}
+	rc = ferror(f) || fflush(f) != 0 || fsync(fileno(f)) != 0;
+	if (fclose(f) != 0 || rc) {
+		fail_tmp("failed to write file", tmp);
+	}
+
+	/* replace; the file must never be rewritten in place while it is mapped */
+	if (rename(tmp, path) != 0) {
+		fail_tmp("failed to rename file", tmp);
+	}
+	return EXIT_SUCCESS;
+}
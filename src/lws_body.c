@@ -0,0 +1,430 @@
+/*
+ * LWS body
+ *
+ * Copyright (C) 2024 Andre Naef
+ */
+
+
+#include <lws_body.h>
+
+
+static lws_body_block_t *lws_body_block(lws_body_t *body);
+static void lws_body_append(lws_body_t *body, lws_body_block_t *block);
+static int lws_body_write_memory(lws_body_t *body, const u_char *data, size_t len);
+static int lws_body_write_file(lws_body_t *body, const u_char *data, size_t len);
+static int lws_body_open_file(lws_body_t *body);
+static uint64_t lws_body_hash_update(uint64_t h, u_char *tail, size_t *n, const u_char *data,
+		size_t len);
+static uint64_t lws_body_hash_mix(uint64_t h, const u_char *p);
+
+
+static ngx_atomic_t  lws_body_file_n;
+
+
+static lws_body_block_t *lws_body_block (lws_body_t *body) {
+	lws_body_block_t  *block;
+
+	/* reuse or allocate */
+	block = body->free;
+	if (block) {
+		body->free = block->next;
+	} else {
+		block = ngx_alloc(sizeof(lws_body_block_t) + LWS_BODY_BLOCK_SIZE, body->log);
+		if (!block) {
+			return NULL;
+		}
+		block->end = (u_char *)&block[1] + LWS_BODY_BLOCK_SIZE;
+		block->ref = 0;
+	}
+	block->next = NULL;
+	block->start = (u_char *)&block[1];
+	block->last = block->start;
+	return block;
+}
+
+static void lws_body_append (lws_body_t *body, lws_body_block_t *block) {
+	if (body->tail) {
+		body->tail->next = block;
+	} else {
+		body->head = block;
+	}
+	body->tail = block;
+}
+
+int lws_body_write (lws_body_t *body, const u_char *data, size_t len) {
+	size_t  n;
+
+	/* data beyond the maximum length in memory is spilled to the temporary file */
+	if (body->file_len > 0 || (body->max && body->len + len > body->max)) {
+		n = body->file_len == 0 && body->len < body->max ? body->max - body->len : 0;
+		if (n > 0 && lws_body_write_memory(body, data, n) != 0) {
+			return -1;
+		}
+		return lws_body_write_file(body, data + n, len - n);
+	}
+	return lws_body_write_memory(body, data, len);
+}
+
+static int lws_body_write_memory (lws_body_t *body, const u_char *data, size_t len) {
+	size_t             n;
+	lws_body_block_t  *block;
+
+	while (len > 0) {
+		/* append block as required */
+		block = body->tail;
+		if (!block || block->last == block->end) {
+			block = lws_body_block(body);
+			if (!block) {
+				return -1;
+			}
+			lws_body_append(body, block);
+		}
+
+		/* copy */
+		n = ngx_min(len, (size_t)(block->end - block->last));
+		block->last = ngx_cpymem(block->last, data, n);
+		data += n;
+		len -= n;
+		body->len += n;
+	}
+	return 0;
+}
+
+static int lws_body_write_file (lws_body_t *body, const u_char *data, size_t len) {
+	ssize_t  n;
+
+	if (!body->file && lws_body_open_file(body) != 0) {
+		return -1;
+	}
+	while (len > 0) {
+		n = pwrite(body->fd, data, len, body->file_len);
+		if (n == -1) {
+			if (ngx_errno == NGX_EINTR) {
+				continue;
+			}
+			ngx_log_error(NGX_LOG_CRIT, body->log, ngx_errno,
+					"[LWS] failed to write temporary file");
+			return -1;
+		}
+		data += n;
+		len -= n;
+		body->file_len += n;
+		body->len += n;
+	}
+	return 0;
+}
+
+static int lws_body_open_file (lws_body_t *body) {
+	u_char  *p, name[NGX_MAX_PATH];
+
+	/* the file is unlinked when opened, and removed when closed */
+	p = ngx_snprintf(name, NGX_MAX_PATH - 1, "%V/lws_%P_%uA", &body->path->name, ngx_pid,
+			ngx_atomic_fetch_add(&lws_body_file_n, 1));
+	*p = '\0';
+	body->fd = ngx_open_tempfile(name, 0, NGX_FILE_OWNER_ACCESS);
+	if (body->fd == NGX_INVALID_FILE) {
+		ngx_log_error(NGX_LOG_CRIT, body->log, ngx_errno,
+				"[LWS] failed to open temporary file \"%s\"", name);
+		return -1;
+	}
+	body->file = 1;
+	body->file_len = 0;
+	return 0;
+}
+
+int lws_body_ref (lws_body_t *body, const u_char *data, size_t len) {
+	lws_body_block_t  *block;
+
+	/* data beyond the maximum length in memory is copied */
+	if (body->file_len > 0 || (body->max && body->len + len > body->max)) {
+		return lws_body_write(body, data, len);
+	}
+
+	/* the data must remain valid until the body is reset */
+	block = ngx_alloc(sizeof(lws_body_block_t), body->log);
+	if (!block) {
+		return -1;
+	}
+	block->next = NULL;
+	block->start = (u_char *)data;
+	block->last = block->start + len;
+	block->end = block->last;
+	block->ref = 1;
+	lws_body_append(body, block);
+	body->len += len;
+	return 0;
+}
+
+size_t lws_body_read (lws_body_t *body, u_char *buf, size_t size) {
+	size_t             n, count;
+	lws_body_block_t  *block;
+
+	/* consume from the head; consumed blocks become reusable */
+	count = 0;
+	while (count < size && body->head) {
+		block = body->head;
+		n = ngx_min(size - count, (size_t)(block->last - block->start));
+		buf = ngx_cpymem(buf, block->start, n);
+		block->start += n;
+		count += n;
+		body->len -= n;
+		if (block->start == block->last) {
+			body->head = block->next;
+			if (!body->head) {
+				body->tail = NULL;
+			}
+			if (!block->ref) {
+				block->next = body->free;
+				body->free = block;
+			} else {
+				ngx_free(block);
+			}
+		}
+	}
+	return count;
+}
+
+ssize_t lws_body_read_file (lws_body_t *body, u_char *buf, size_t size, off_t offset) {
+	ssize_t  n;
+
+	do {
+		n = pread(body->fd, buf, size, offset);
+	} while (n == -1 && ngx_errno == NGX_EINTR);
+	if (n == -1) {
+		ngx_log_error(NGX_LOG_CRIT, body->log, ngx_errno, "[LWS] failed to read temporary file");
+	}
+	return n;
+}
+
+int lws_body_reserve (lws_body_t *body, size_t n) {
+	size_t             avail;
+	lws_body_block_t  *block;
+
+	/* count available space */
+	avail = body->tail ? (size_t)(body->tail->end - body->tail->last) : 0;
+	for (block = body->free; block && avail < n; block = block->next) {
+		avail += LWS_BODY_BLOCK_SIZE;
+	}
+
+	/* add reusable blocks */
+	while (avail < n) {
+		block = ngx_alloc(sizeof(lws_body_block_t) + LWS_BODY_BLOCK_SIZE, body->log);
+		if (!block) {
+			return -1;
+		}
+		block->start = (u_char *)&block[1];
+		block->end = block->start + LWS_BODY_BLOCK_SIZE;
+		block->ref = 0;
+		block->next = body->free;
+		body->free = block;
+		avail += LWS_BODY_BLOCK_SIZE;
+	}
+	return 0;
+}
+
+int lws_body_copy (lws_body_t *dst, lws_body_t *src) {
+	off_t              offset;
+	ssize_t            n;
+	u_char             buf[4096];
+	lws_body_block_t  *block;
+
+	for (block = src->head; block; block = block->next) {
+		if (lws_body_write(dst, block->start, block->last - block->start) != 0) {
+			return -1;
+		}
+	}
+	for (offset = 0; offset < src->file_len; offset += n) {
+		n = lws_body_read_file(src, buf, sizeof(buf), offset);
+		if (n <= 0 || lws_body_write(dst, buf, n) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int lws_body_hash (lws_body_t *body, uint64_t *hash) {
+	off_t              offset;
+	size_t             n, i;
+	ssize_t            len;
+	uint64_t           h;
+	u_char             tail[8], buf[4096];
+	lws_body_block_t  *block;
+
+	/* MurmurHash64A over the data; words may span blocks */
+	h = (uint64_t)body->len * LWS_BODY_HASH_M;  /* the length includes the file */
+	n = 0;
+	for (block = body->head; block; block = block->next) {
+		h = lws_body_hash_update(h, tail, &n, block->start, block->last - block->start);
+	}
+	for (offset = 0; offset < body->file_len; offset += len) {
+		len = lws_body_read_file(body, buf, sizeof(buf), offset);
+		if (len <= 0) {
+			return -1;
+		}
+		h = lws_body_hash_update(h, tail, &n, buf, len);
+	}
+
+	/* finalize */
+	if (n > 0) {
+		for (i = 0; i < n; i++) {
+			h ^= (uint64_t)tail[i] << (8 * i);
+		}
+		h *= LWS_BODY_HASH_M;
+	}
+	h ^= h >> LWS_BODY_HASH_R;
+	h *= LWS_BODY_HASH_M;
+	h ^= h >> LWS_BODY_HASH_R;
+	*hash = h;
+	return 0;
+}
+
+static uint64_t lws_body_hash_update (uint64_t h, u_char *tail, size_t *n, const u_char *data,
+		size_t len) {
+	size_t  c;
+
+	while (len > 0) {
+		/* complete a partial word */
+		if (*n > 0 || len < 8) {
+			c = ngx_min(8 - *n, len);
+			ngx_memcpy(tail + *n, data, c);
+			*n += c;
+			data += c;
+			len -= c;
+			if (*n == 8) {
+				h = lws_body_hash_mix(h, tail);
+				*n = 0;
+			}
+			continue;
+		}
+		h = lws_body_hash_mix(h, data);
+		data += 8;
+		len -= 8;
+	}
+	return h;
+}
+
+static uint64_t lws_body_hash_mix (uint64_t h, const u_char *p) {
+	uint64_t  k;
+
+	ngx_memcpy(&k, p, 8);
+	k *= LWS_BODY_HASH_M;
+	k ^= k >> LWS_BODY_HASH_R;
+	k *= LWS_BODY_HASH_M;
+	h ^= k;
+	h *= LWS_BODY_HASH_M;
+	return h;
+}
+
+ngx_chain_t *lws_body_chain (lws_body_t *body, ngx_pool_t *pool, ngx_chain_t **last) {
+	ngx_buf_t         *b;
+	ngx_file_t        *file;
+	ngx_chain_t       *out, *cl, **ll;
+	lws_body_block_t  *block;
+
+	/* reference the blocks; they remain owned by the body */
+	out = NULL;
+	cl = NULL;
+	ll = &out;
+	for (block = body->head; block; block = block->next) {
+		if (block->last == block->start) {
+			continue;
+		}
+		cl = ngx_alloc_chain_link(pool);
+		b = ngx_calloc_buf(pool);
+		if (!cl || !b) {
+			lws_body_free_chain(out, pool);
+			return NULL;
+		}
+		b->start = block->start;
+		b->pos = b->start;
+		b->last = block->last;
+		b->end = block->end;
+		if (!block->ref) {
+			b->temporary = 1;
+		} else {
+			b->memory = 1;
+		}
+		cl->buf = b;
+		cl->next = NULL;
+		*ll = cl;
+		ll = &cl->next;
+	}
+
+	/* temporary file follows the blocks */
+	if (body->file && body->file_len > 0) {
+		cl = ngx_alloc_chain_link(pool);
+		b = ngx_calloc_buf(pool);
+		file = ngx_pcalloc(pool, sizeof(ngx_file_t));
+		if (!cl || !b || !file) {
+			lws_body_free_chain(out, pool);
+			return NULL;
+		}
+		file->fd = body->fd;
+		file->name = body->path->name;
+		file->log = body->log;
+		b->in_file = 1;
+		b->file = file;
+		b->file_pos = 0;
+		b->file_last = body->file_len;
+		cl->buf = b;
+		cl->next = NULL;
+		*ll = cl;
+	}
+	*last = cl;
+	return out;
+}
+
+void lws_body_free_chain (ngx_chain_t *cl, ngx_pool_t *pool) {
+	ngx_chain_t  *next;
+
+	while (cl) {
+		next = cl->next;
+		ngx_free_chain(pool, cl);
+		cl = next;
+	}
+}
+
+void lws_body_reset (lws_body_t *body) {
+	lws_body_block_t  *block, *next;
+
+	/* the blocks become reusable; references are dropped */
+	for (block = body->head; block; block = next) {
+		next = block->next;
+		if (!block->ref) {
+			block->next = body->free;
+			body->free = block;
+		} else {
+			ngx_free(block);
+		}
+	}
+	body->head = NULL;
+	body->tail = NULL;
+	body->len = 0;
+
+	/* the temporary file is reused */
+	if (body->file && body->file_len > 0) {
+		if (ftruncate(body->fd, 0) == -1) {
+			ngx_log_error(NGX_LOG_ALERT, body->log, ngx_errno,
+					"[LWS] failed to truncate temporary file");
+		}
+		body->file_len = 0;
+	}
+}
+
+void lws_body_free (lws_body_t *body) {
+	lws_body_block_t  *block, *next;
+
+	lws_body_reset(body);
+	for (block = body->free; block; block = next) {
+		next = block->next;
+		ngx_free(block);
+	}
+	body->free = NULL;
+	if (body->file) {
+		if (ngx_close_file(body->fd) == NGX_FILE_ERROR) {
+			ngx_log_error(NGX_LOG_ALERT, body->log, ngx_errno,
+					ngx_close_file_n " temporary file failed");
+		}
+		body->file = 0;
+	}
+}
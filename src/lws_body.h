@@ -0,0 +1,60 @@
+/*
+ * LWS body
+ *
+ * Copyright (C) 2024 Andre Naef
+ */
+
+
+#ifndef _LWS_BODY_INCLUDED
+#define _LWS_BODY_INCLUDED
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+#define LWS_BODY_BLOCK_SIZE  16384  /* size of body blocks */
+#define LWS_BODY_REF_MIN     1024   /* minimum length of referenced data; shorter data is copied */
+#define LWS_BODY_HASH_M      0xc6a4a7935bd1e995ULL  /* MurmurHash64A multiplier */
+#define LWS_BODY_HASH_R      47                     /* MurmurHash64A shift */
+
+
+typedef struct lws_body_s lws_body_t;
+typedef struct lws_body_block_s lws_body_block_t;
+
+struct lws_body_s {
+	ngx_log_t         *log;       /* log */
+	lws_body_block_t  *head;      /* first block with data */
+	lws_body_block_t  *tail;      /* last block with data */
+	lws_body_block_t  *free;      /* reusable blocks */
+	size_t             len;       /* length of data */
+	size_t             max;       /* maximum length of data in memory; 0 = unlimited */
+	ngx_path_t        *path;      /* path of temporary file */
+	ngx_fd_t           fd;        /* temporary file */
+	off_t              file_len;  /* length of data in temporary file */
+	ngx_flag_t         file;      /* temporary file is open */
+};
+
+struct lws_body_block_s {
+	lws_body_block_t  *next;   /* next block */
+	u_char            *start;  /* start of data */
+	u_char            *last;   /* end of data */
+	u_char            *end;    /* end of block */
+	unsigned           ref:1;  /* block references external data */
+};
+
+
+int lws_body_write(lws_body_t *body, const u_char *data, size_t len);
+int lws_body_ref(lws_body_t *body, const u_char *data, size_t len);
+size_t lws_body_read(lws_body_t *body, u_char *buf, size_t size);
+ssize_t lws_body_read_file(lws_body_t *body, u_char *buf, size_t size, off_t offset);
+int lws_body_reserve(lws_body_t *body, size_t n);
+int lws_body_copy(lws_body_t *dst, lws_body_t *src);
+int lws_body_hash(lws_body_t *body, uint64_t *hash);
+ngx_chain_t *lws_body_chain(lws_body_t *body, ngx_pool_t *pool, ngx_chain_t **last);
+void lws_body_free_chain(ngx_chain_t *cl, ngx_pool_t *pool);
+void lws_body_reset(lws_body_t *body);
+void lws_body_free(lws_body_t *body);
+
+
+#endif /* _LWS_BODY_INCLUDED */
@@ -0,0 +1,555 @@
+/*
+ * LWS cache
+ *
+ * Copyright (C) 2024 Andre Naef
+ */
+
+
+#include <lws_cache.h>
+#include <lws_compress.h>
+
+
+#define lws_cache_get_size(p, v)  ngx_memcpy(&(v), p, sizeof(size_t)), (p) += sizeof(size_t)
+#define lws_cache_put_size(p, v)  ngx_cpymem(p, &(v), sizeof(size_t))
+
+
+static ngx_int_t lws_init_cache_zone(ngx_shm_zone_t *zone, void *data);
+static lws_cache_entry_t *lws_cache_lookup(lws_cache_t *cache, ngx_str_t *key);
+static void lws_cache_remove(lws_cache_zone_t *cz, lws_cache_entry_t *entry);
+static void lws_cache_expire(lws_cache_zone_t *cz);
+static lws_cache_entry_t *lws_cache_alloc(lws_cache_zone_t *cz, size_t size);
+static ngx_int_t lws_cache_send(ngx_http_request_t *r, lws_cache_zone_t *cz,
+		lws_cache_entry_t *entry);
+static void lws_cache_cleanup(void *data);
+static ngx_int_t lws_cache_update(ngx_http_request_t *r);
+static time_t lws_cache_valid(lws_request_ctx_t *ctx, time_t valid);
+static void lws_cache_count(ngx_http_request_t *r, ngx_uint_t hit, ngx_uint_t stale);
+
+
+typedef struct {
+	lws_cache_zone_t   *cz;     /* cache zone */
+	lws_cache_entry_t  *entry;  /* entry */
+} lws_cache_ref_t;
+
+
+/*
+ * configuration
+ */
+
+char *lws_cache_zone (ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+	ssize_t            size;
+	ngx_str_t         *values;
+	ngx_shm_zone_t    *zone;
+	lws_cache_zone_t  *cz;
+
+	/* parse */
+	values = cf->args->elts;
+	size = ngx_parse_size(&values[2]);
+	if (size == NGX_ERROR) {
+		return "has invalid size";
+	}
+	if (size < (ssize_t)(8 * ngx_pagesize)) {
+		return "has too small size";
+	}
+
+	/* add shared memory zone */
+	cz = ngx_pcalloc(cf->pool, sizeof(lws_cache_zone_t));
+	if (!cz) {
+		return NGX_CONF_ERROR;
+	}
+	zone = ngx_shared_memory_add(cf, &values[1], size, &lws_module);
+	if (!zone) {
+		return NGX_CONF_ERROR;
+	}
+	if (zone->data) {
+		return "is duplicate";
+	}
+	zone->data = cz;
+	zone->init = lws_init_cache_zone;
+	return NGX_CONF_OK;
+}
+
+char *lws_cache (ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+	ngx_str_t                        *values, value;
+	ngx_uint_t                        i;
+	lws_loc_conf_t                   *llcf;
+	ngx_http_compile_complex_value_t  ccv;
+
+	/* zone */
+	llcf = conf;
+	if (llcf->cache != NGX_CONF_UNSET_PTR) {
+		return "is duplicate";
+	}
+	values = cf->args->elts;
+	if (ngx_strcmp(values[1].data, "off") == 0) {
+		if (cf->args->nelts > 2) {
+			return "has superfluous attributes";
+		}
+		llcf->cache = NULL;
+		return NGX_CONF_OK;
+	}
+	llcf->cache = ngx_shared_memory_add(cf, &values[1], 0, &lws_module);
+	if (!llcf->cache) {
+		return NGX_CONF_ERROR;
+	}
+
+	/* attributes */
+	llcf->cache_valid = NGX_CONF_UNSET;
+	llcf->cache_stale = 0;
+	for (i = 2; i < cf->args->nelts; i++) {
+		if (ngx_strncmp(values[i].data, "key=", 4) == 0) {
+			value.data = values[i].data + 4;
+			value.len = values[i].len - 4;
+			llcf->cache_key = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+			if (!llcf->cache_key) {
+				return NGX_CONF_ERROR;
+			}
+			ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+			ccv.cf = cf;
+			ccv.value = &value;
+			ccv.complex_value = llcf->cache_key;
+			if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+				return NGX_CONF_ERROR;
+			}
+		} else if (ngx_strncmp(values[i].data, "valid=", 6) == 0) {
+			value.data = values[i].data + 6;
+			value.len = values[i].len - 6;
+			llcf->cache_valid = ngx_parse_time(&value, 1);
+			if (llcf->cache_valid == (time_t)NGX_ERROR || llcf->cache_valid == 0) {
+				return "has invalid valid value";
+			}
+		} else if (ngx_strncmp(values[i].data, "stale=", 6) == 0) {
+			value.data = values[i].data + 6;
+			value.len = values[i].len - 6;
+			llcf->cache_stale = ngx_parse_time(&value, 1);
+			if (llcf->cache_stale == (time_t)NGX_ERROR) {
+				return "has invalid stale value";
+			}
+		} else {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid attribute value \"%s\"",
+					values[i].data);
+			return NGX_CONF_ERROR;
+		}
+	}
+	if (!llcf->cache_key) {
+		return "requires key attribute";
+	}
+	if (llcf->cache_valid == NGX_CONF_UNSET) {
+		return "requires valid attribute";
+	}
+	return NGX_CONF_OK;
+}
+
+static ngx_int_t lws_init_cache_zone (ngx_shm_zone_t *zone, void *data) {
+	lws_cache_zone_t  *cz, *ocz;
+
+	/* reuse on reload */
+	cz = zone->data;
+	ocz = data;
+	if (ocz) {
+		cz->sh = ocz->sh;
+		cz->pool = ocz->pool;
+		return NGX_OK;
+	}
+
+	/* initialize */
+	cz->pool = (ngx_slab_pool_t *)zone->shm.addr;
+	if (zone->shm.exists) {
+		cz->sh = cz->pool->data;
+		return NGX_OK;
+	}
+	cz->pool->log_nomem = 0;  /* allocation failures evict entries */
+	cz->sh = ngx_slab_alloc(cz->pool, sizeof(lws_cache_t));
+	if (!cz->sh) {
+		return NGX_ERROR;
+	}
+	cz->pool->data = cz->sh;
+	ngx_rbtree_init(&cz->sh->rbtree, &cz->sh->sentinel, ngx_str_rbtree_insert_value);
+	ngx_queue_init(&cz->sh->lru);
+	return NGX_OK;
+}
+
+
+/*
+ * lookup
+ */
+
+ngx_int_t lws_cache_handler (ngx_http_request_t *r, ngx_str_t *key) {
+	time_t              now;
+	ngx_int_t           update;
+	lws_loc_conf_t     *llcf;
+	lws_cache_zone_t   *cz;
+	lws_cache_entry_t  *entry;
+
+	/* cached? */
+	ngx_str_null(key);
+	llcf = ngx_http_get_module_loc_conf(r, lws_module);
+	if (!llcf->cache || !(r->method & (NGX_HTTP_GET | NGX_HTTP_HEAD))) {
+		return NGX_DECLINED;
+	}
+	if (ngx_http_complex_value(r, llcf->cache_key, key) != NGX_OK) {
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "[LWS] failed to evaluate cache key");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+	if (key->len == 0 || r->background) {
+		/* a background update bypasses the lookup and stores the response */
+		return NGX_DECLINED;
+	}
+
+	/* lookup */
+	cz = llcf->cache->data;
+	now = ngx_time();
+	update = 0;
+	ngx_shmtx_lock(&cz->pool->mutex);
+	entry = lws_cache_lookup(cz->sh, key);
+	if (!entry || now >= entry->stale || (now >= entry->expires && r != r->main)) {
+		ngx_shmtx_unlock(&cz->pool->mutex);
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[LWS] cache miss key:%V",
+				key);
+		lws_cache_count(r, 0, 0);
+		return NGX_DECLINED;
+	}
+	if (now >= entry->expires && now - entry->updating >= LWS_CACHE_UPDATE_TIMEOUT) {
+		entry->updating = now;
+		update = 1;
+	}
+	entry->refs++;
+	ngx_queue_remove(&entry->queue);
+	ngx_queue_insert_head(&cz->sh->lru, &entry->queue);
+	ngx_shmtx_unlock(&cz->pool->mutex);
+	ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"[LWS] cache hit key:%V stale:%d update:%i", key, now >= entry->expires, update);
+	lws_cache_count(r, 1, now >= entry->expires);
+
+	/* refresh stale entry in the background */
+	if (update && lws_cache_update(r) != NGX_OK) {
+		ngx_shmtx_lock(&cz->pool->mutex);
+		entry->updating = 0;
+		ngx_shmtx_unlock(&cz->pool->mutex);
+	}
+	return lws_cache_send(r, cz, entry);
+}
+
+static lws_cache_entry_t *lws_cache_lookup (lws_cache_t *cache, ngx_str_t *key) {
+	return (lws_cache_entry_t *)ngx_str_rbtree_lookup(&cache->rbtree, key,
+			ngx_crc32_short(key->data, key->len));
+}
+
+static ngx_int_t lws_cache_send (ngx_http_request_t *r, lws_cache_zone_t *cz,
+		lws_cache_entry_t *entry) {
+	off_t                offset;
+	u_char              *p, *last;
+	size_t               klen, vlen;
+	ngx_buf_t           *b;
+	ngx_int_t            rc;
+	ngx_chain_t          out;
+	lws_cache_ref_t     *ref;
+	ngx_table_elt_t     *h;
+	ngx_pool_cleanup_t  *cln;
+
+	/* the entry is referenced until the request is done */
+	cln = ngx_pool_cleanup_add(r->pool, sizeof(lws_cache_ref_t));
+	if (!cln) {
+		ngx_shmtx_lock(&cz->pool->mutex);
+		entry->refs--;
+		if (entry->deleted && entry->refs == 0) {
+			ngx_slab_free_locked(cz->pool, entry);
+		}
+		ngx_shmtx_unlock(&cz->pool->mutex);
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+	cln->handler = lws_cache_cleanup;
+	ref = cln->data;
+	ref->cz = cz;
+	ref->entry = entry;
+
+	/* set headers; values reference the entry */
+	r->headers_out.status = entry->status;
+	r->headers_out.content_length_n = entry->body_len;
+	r->headers_out.last_modified_time = entry->last_modified;
+	r->disable_not_modified = 1;
+	p = entry->data + entry->sn.str.len;
+	if (entry->content_type_len) {
+		r->headers_out.content_type.data = p;
+		r->headers_out.content_type.len = entry->content_type_len;
+		r->headers_out.content_type_len = entry->content_type_len;
+	}
+	p += entry->content_type_len;
+	last = p + entry->headers_len;
+	while (p < last) {
+		h = ngx_list_push(&r->headers_out.headers);
+		if (!h) {
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+		lws_cache_get_size(p, klen);
+		lws_cache_get_size(p, vlen);
+		ngx_memcpy(&offset, p, sizeof(off_t));
+		p += sizeof(off_t);
+		h->key.data = p;
+		h->key.len = klen;
+		h->value.data = p + klen;
+		h->value.len = vlen;
+		h->hash = 1;
+		p += klen + vlen;
+		if (offset) {
+			*(ngx_table_elt_t **)((u_char *)&r->headers_out + offset) = h;
+		}
+	}
+
+	/* not modified? the request entity tag is compared with the stored entity tag */
+	if (entry->status == NGX_HTTP_OK && r->headers_out.etag
+			&& lws_is_not_modified(r, &r->headers_out.etag->value)) {
+		r->headers_out.status = NGX_HTTP_NOT_MODIFIED;
+		ngx_http_clear_content_length(r);
+		r->header_only = 1;
+	}
+	rc = ngx_http_send_header(r);
+	if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+		return rc;
+	}
+	if (entry->body_len == 0) {
+		return ngx_http_send_special(r, NGX_HTTP_LAST);
+	}
+
+	/* send body from shared memory */
+	b = ngx_calloc_buf(r->pool);
+	if (!b) {
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+	b->pos = last;
+	b->last = last + entry->body_len;
+	b->memory = 1;
+	b->last_buf = (r == r->main) ? 1 : 0;
+	b->last_in_chain = 1;
+	out.buf = b;
+	out.next = NULL;
+	return ngx_http_output_filter(r, &out);
+}
+
+static void lws_cache_cleanup (void *data) {
+	lws_cache_ref_t  *ref;
+
+	ref = data;
+	ngx_shmtx_lock(&ref->cz->pool->mutex);
+	ref->entry->refs--;
+	if (ref->entry->deleted && ref->entry->refs == 0) {
+		ngx_slab_free_locked(ref->cz->pool, ref->entry);
+	}
+	ngx_shmtx_unlock(&ref->cz->pool->mutex);
+}
+
+static ngx_int_t lws_cache_update (ngx_http_request_t *r) {
+	ngx_http_request_t  *sr;
+
+	/* the background subrequest runs Lua and stores the response; its body is not sent */
+	if (ngx_http_subrequest(r, &r->uri, &r->args, &sr, NULL, NGX_HTTP_SUBREQUEST_BACKGROUND)
+			!= NGX_OK) {
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "[LWS] failed to start cache update");
+		return NGX_ERROR;
+	}
+	sr->header_only = 1;
+	return NGX_OK;
+}
+
+static void lws_cache_count (ngx_http_request_t *r, ngx_uint_t hit, ngx_uint_t stale) {
+	lws_main_conf_t  *lmcf;
+
+	lmcf = ngx_http_get_module_main_conf(r, lws_module);
+	if (!lmcf->monitor) {
+		return;
+	}
+	if (!hit) {
+		ngx_atomic_fetch_add(&lmcf->monitor->cache_misses, 1);
+	} else if (!stale) {
+		ngx_atomic_fetch_add(&lmcf->monitor->cache_hits, 1);
+	} else {
+		ngx_atomic_fetch_add(&lmcf->monitor->cache_stale, 1);
+	}
+}
+
+
+/*
+ * store
+ */
+
+void lws_cache_store (lws_request_ctx_t *ctx) {
+	time_t               now, valid;
+	u_char              *p;
+	size_t               size, klen, vlen;
+	off_t                offset;
+	ngx_str_t            key;
+	ngx_uint_t           i;
+	lws_header_t        *headers;
+	lws_loc_conf_t      *llcf;
+	lws_body_block_t    *block;
+	lws_cache_zone_t    *cz;
+	lws_cache_entry_t   *entry, *existing;
+	ngx_http_request_t  *r;
+
+	/* cacheable? */
+	r = ctx->r;
+	llcf = ngx_http_get_module_loc_conf(r, lws_module);
+	cz = llcf->cache->data;
+	valid = 0;
+	if (r->method == NGX_HTTP_GET && !ctx->sendfile.len && ctx->response_body.file_len == 0
+			&& (ctx->status == NGX_HTTP_OK || ctx->status == NGX_HTTP_MOVED_PERMANENTLY
+			|| ctx->status == NGX_HTTP_MOVED_TEMPORARILY)) {
+		valid = lws_cache_valid(ctx, llcf->cache_valid);
+	}
+	if (valid <= 0) {
+		if (r->background) {
+			/* allow another update */
+			ngx_shmtx_lock(&cz->pool->mutex);
+			existing = lws_cache_lookup(cz->sh, &ctx->cache_key);
+			if (existing) {
+				existing->updating = 0;
+			}
+			ngx_shmtx_unlock(&cz->pool->mutex);
+		}
+		return;
+	}
+
+	/* size */
+	key = ctx->cache_key;
+	size = sizeof(lws_cache_entry_t) + key.len + ctx->content_type.len + ctx->response_body.len;
+	headers = ctx->headers_out.elts;
+	for (i = 0; i < ctx->headers_out.nelts; i++) {
+		size += 2 * sizeof(size_t) + sizeof(off_t) + headers[i].elt.key.len
+				+ headers[i].elt.value.len;
+	}
+
+	/* allocate and replace */
+	now = ngx_time();
+	ngx_shmtx_lock(&cz->pool->mutex);
+	lws_cache_expire(cz);
+	existing = lws_cache_lookup(cz->sh, &key);
+	if (existing) {
+		lws_cache_remove(cz, existing);
+	}
+	entry = lws_cache_alloc(cz, size);
+	if (!entry) {
+		ngx_shmtx_unlock(&cz->pool->mutex);
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+				"[LWS] failed to allocate cache entry size:%uz", size);
+		return;
+	}
+
+	/* copy */
+	ngx_memzero(entry, sizeof(lws_cache_entry_t));
+	entry->expires = now + valid;
+	entry->stale = entry->expires + llcf->cache_stale;
+	entry->last_modified = ctx->last_modified;
+	entry->status = ctx->status;
+	entry->content_type_len = ctx->content_type.len;
+	entry->body_len = ctx->response_body.len;
+	p = ngx_cpymem(entry->data, key.data, key.len);
+	p = ngx_cpymem(p, ctx->content_type.data, ctx->content_type.len);
+	for (i = 0; i < ctx->headers_out.nelts; i++) {
+		klen = headers[i].elt.key.len;
+		vlen = headers[i].elt.value.len;
+		offset = headers[i].ref ? (u_char *)headers[i].ref - (u_char *)&r->headers_out : 0;
+		p = lws_cache_put_size(p, klen);
+		p = lws_cache_put_size(p, vlen);
+		p = ngx_cpymem(p, &offset, sizeof(off_t));
+		p = ngx_cpymem(p, headers[i].elt.key.data, klen);
+		p = ngx_cpymem(p, headers[i].elt.value.data, vlen);
+	}
+	entry->headers_len = p - (entry->data + key.len + ctx->content_type.len);
+	for (block = ctx->response_body.head; block; block = block->next) {
+		p = ngx_cpymem(p, block->start, block->last - block->start);
+	}
+	entry->sn.str.data = entry->data;
+	entry->sn.str.len = key.len;
+	entry->sn.node.key = ngx_crc32_short(key.data, key.len);
+	ngx_rbtree_insert(&cz->sh->rbtree, &entry->sn.node);
+	ngx_queue_insert_head(&cz->sh->lru, &entry->queue);
+	ngx_shmtx_unlock(&cz->pool->mutex);
+	ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"[LWS] cache store key:%V valid:%T size:%uz", &key, valid, size);
+}
+
+static time_t lws_cache_valid (lws_request_ctx_t *ctx, time_t valid) {
+	u_char     *p, *last;
+	ngx_int_t   n;
+	ngx_str_t   key, *value;
+
+	/* responses setting cookies are private */
+	ngx_str_set(&key, "Set-Cookie");
+	if (lws_table_get(ctx->response_headers, &key)) {
+		return 0;
+	}
+
+	/* Cache-Control set by Lua */
+	ngx_str_set(&key, "Cache-Control");
+	value = lws_table_get(ctx->response_headers, &key);
+	if (!value) {
+		return valid;
+	}
+	p = value->data;
+	last = value->data + value->len;
+	if (ngx_strlcasestrn(p, last, (u_char *)"no-store", sizeof("no-store") - 2)
+			|| ngx_strlcasestrn(p, last, (u_char *)"no-cache", sizeof("no-cache") - 2)
+			|| ngx_strlcasestrn(p, last, (u_char *)"private", sizeof("private") - 2)) {
+		return 0;
+	}
+	p = ngx_strlcasestrn(value->data, last, (u_char *)"s-maxage=", sizeof("s-maxage=") - 2);
+	if (!p) {
+		p = ngx_strlcasestrn(value->data, last, (u_char *)"max-age=",
+				sizeof("max-age=") - 2);
+		if (!p) {
+			return valid;
+		}
+		p += sizeof("max-age=") - 1;
+	} else {
+		p += sizeof("s-maxage=") - 1;
+	}
+	for (n = 0; p < last && *p >= '0' && *p <= '9'; p++) {
+		if (n < NGX_MAX_INT_T_VALUE / 10 - 10) {
+			n = n * 10 + (*p - '0');
+		}
+	}
+	return (time_t)n;
+}
+
+static void lws_cache_remove (lws_cache_zone_t *cz, lws_cache_entry_t *entry) {
+	/* referenced entries are freed by the last request sending them */
+	ngx_rbtree_delete(&cz->sh->rbtree, &entry->sn.node);
+	ngx_queue_remove(&entry->queue);
+	if (entry->refs > 0) {
+		entry->deleted = 1;
+		return;
+	}
+	ngx_slab_free_locked(cz->pool, entry);
+}
+
+static void lws_cache_expire (lws_cache_zone_t *cz) {
+	time_t              now;
+	ngx_uint_t          i;
+	ngx_queue_t        *q;
+	lws_cache_entry_t  *entry;
+
+	now = ngx_time();
+	for (i = 0; i < LWS_CACHE_EXPIRE_N && !ngx_queue_empty(&cz->sh->lru); i++) {
+		q = ngx_queue_last(&cz->sh->lru);
+		entry = ngx_queue_data(q, lws_cache_entry_t, queue);
+		if (now < entry->stale) {
+			return;
+		}
+		lws_cache_remove(cz, entry);
+	}
+}
+
+static lws_cache_entry_t *lws_cache_alloc (lws_cache_zone_t *cz, size_t size) {
+	ngx_queue_t        *q;
+	lws_cache_entry_t  *entry;
+
+	/* evict least recently used entries as required */
+	while (1) {
+		entry = ngx_slab_alloc_locked(cz->pool, size);
+		if (entry || ngx_queue_empty(&cz->sh->lru)) {
+			return entry;
+		}
+		q = ngx_queue_last(&cz->sh->lru);
+		lws_cache_remove(cz, ngx_queue_data(q, lws_cache_entry_t, queue));
+	}
+}
@@ -0,0 +1,63 @@
+/*
+ * LWS cache
+ *
+ * Copyright (C) 2024 Andre Naef
+ */
+
+
+#ifndef _LWS_CACHE_INCLUDED
+#define _LWS_CACHE_INCLUDED
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define LWS_CACHE_UPDATE_TIMEOUT  10  /* seconds until a stalled background update is retried */
+#define LWS_CACHE_EXPIRE_N        2   /* expired entries removed per store */
+
+
+typedef struct lws_cache_zone_s lws_cache_zone_t;
+typedef struct lws_cache_s lws_cache_t;
+typedef struct lws_cache_entry_s lws_cache_entry_t;
+
+
+#include <lws_module.h>
+
+
+struct lws_cache_zone_s {
+	lws_cache_t      *sh;    /* shared cache */
+	ngx_slab_pool_t  *pool;  /* slab allocator */
+};
+
+struct lws_cache_s {
+	ngx_rbtree_t       rbtree;    /* entries by key */
+	ngx_rbtree_node_t  sentinel;  /* red-black tree sentinel */
+	ngx_queue_t        lru;       /* entries, most recently used first */
+};
+
+struct lws_cache_entry_s {
+	ngx_str_node_t  sn;                /* red-black tree node; str is the key */
+	ngx_queue_t     queue;             /* LRU queue */
+	ngx_uint_t      refs;              /* requests sending the entry */
+	time_t          expires;           /* time when the entry becomes stale */
+	time_t          stale;             /* time when the entry is removed */
+	time_t          updating;          /* start of a background update; 0 = none */
+	time_t          last_modified;     /* last modified time; -1 = none */
+	ngx_uint_t      status;            /* response status */
+	size_t          content_type_len;  /* length of content type */
+	size_t          headers_len;       /* length of serialized headers */
+	size_t          body_len;          /* length of body */
+	unsigned        deleted:1;         /* entry is removed; freed when unreferenced */
+	u_char          data[];            /* key, content type, headers, body */
+};
+
+
+char *lws_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *lws_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t lws_cache_handler(ngx_http_request_t *r, ngx_str_t *key);
+void lws_cache_store(lws_request_ctx_t *ctx);
+
+
+#endif /* _LWS_CACHE_INCLUDED */
@@ -0,0 +1,449 @@
+/*
+ * LWS compress
+ *
+ * Copyright (C) 2024 Andre Naef
+ */
+
+
+#include <lws_compress.h>
+
+
+#define lws_is_coding(value, literal)  ((value)->len == sizeof(literal) - 1  \
+		&& ngx_strncasecmp((value)->data, (u_char *)literal, sizeof(literal) - 1) == 0)
+
+
+static int lws_accepts_encoding(lws_request_ctx_t *ctx, ngx_str_t *coding);
+static int lws_is_qzero(u_char *p, u_char *last);
+static int lws_set_vary(lws_request_ctx_t *ctx);
+static int lws_matches_etag(ngx_str_t *value, ngx_str_t *etag);
+static int lws_set_response_header(lws_request_ctx_t *ctx, ngx_str_t *key, u_char *value,
+		size_t len);
+static int lws_deflate(z_stream *zs, int flush, lws_body_t *out);
+static int lws_deflate_file(z_stream *zs, lws_body_t *in, lws_body_t *out);
+static ssize_t lws_inflate_read_handler(void *cookie, char *buf, size_t size);
+
+
+static cookie_io_functions_t lws_inflate_functions = {
+	lws_inflate_read_handler,  /* read */
+	NULL,                      /* write */
+	NULL,                      /* seek */
+	NULL                       /* close */
+};
+
+
+void lws_compress_response (lws_request_ctx_t *ctx) {
+	ngx_log_t           *log;
+	ngx_str_t            coding, key;
+	z_stream             zs;
+	lws_body_t           out;
+	lws_loc_conf_t      *llcf;
+	lws_body_block_t    *block;
+	ngx_http_request_t  *r;
+
+	/* compressible response? subrequests other than cache updates are not compressed */
+	r = ctx->r;
+	llcf = ctx->state->llcf;
+	if (llcf->compress == LWS_CO_OFF || (r != r->main && !r->background)
+			|| ctx->redirect.len || ctx->sendfile.len || ctx->streaming
+			|| r->method == NGX_HTTP_HEAD
+			|| ctx->response_body.len < llcf->compress_min_length
+			|| (ctx->status != NGX_HTTP_OK && ctx->status != NGX_HTTP_FORBIDDEN
+			&& ctx->status != NGX_HTTP_NOT_FOUND)) {
+		return;
+	}
+	ngx_str_set(&key, "Content-Encoding");
+	if (lws_table_get(ctx->response_headers, &key)) {
+		return;
+	}
+
+	/* negotiate; the response varies with the request header either way */
+	log = r->connection->log;
+	if (lws_set_vary(ctx) != 0) {
+		return;
+	}
+	if (llcf->compress == LWS_CO_GZIP) {
+		ngx_str_set(&coding, "gzip");
+	} else {
+		ngx_str_set(&coding, "deflate");
+	}
+	if (!lws_accepts_encoding(ctx, &coding)) {
+		return;
+	}
+
+	/* compress */
+	ngx_memzero(&zs, sizeof(z_stream));
+	if (deflateInit2(&zs, (int)llcf->compress_level, Z_DEFLATED,
+			llcf->compress == LWS_CO_GZIP ? MAX_WBITS + 16 : MAX_WBITS, 8,
+			Z_DEFAULT_STRATEGY) != Z_OK) {
+		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to initialize compression");
+		return;
+	}
+	ngx_memzero(&out, sizeof(lws_body_t));
+	out.log = log;
+	out.max = ctx->response_body.max;
+	out.path = ctx->response_body.path;
+	for (block = ctx->response_body.head; block; block = block->next) {
+		zs.next_in = block->start;
+		zs.avail_in = block->last - block->start;
+		if (lws_deflate(&zs, Z_NO_FLUSH, &out) != 0) {
+			goto error;
+		}
+	}
+	if (lws_deflate_file(&zs, &ctx->response_body, &out) != 0) {
+		goto error;
+	}
+	if (lws_deflate(&zs, Z_FINISH, &out) != 0) {
+		goto error;
+	}
+	deflateEnd(&zs);
+
+	/* replace response body */
+	if (lws_set_response_header(ctx, &key, coding.data, coding.len) != 0) {
+		lws_body_free(&out);
+		return;
+	}
+	ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0,
+			"[LWS] response compressed coding:%V len:%uz->%uz", &coding,
+			ctx->response_body.len, out.len);
+	lws_body_free(&ctx->response_body);
+	ctx->response_body = out;
+	r->headers_out.content_length_n = -1;  /* set from the replaced body when sent */
+	r->headers_out.content_length = NULL;
+	return;
+
+	error:
+	ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to compress response");
+	deflateEnd(&zs);
+	lws_body_free(&out);
+}
+
+void lws_etag_response (lws_request_ctx_t *ctx) {
+	u_char              *p, buf[LWS_ETAG_LEN];
+	uint64_t             hash;
+	ngx_str_t            key, *value, *match;
+	lws_loc_conf_t      *llcf;
+	ngx_http_request_t  *r;
+
+	/* taggable response? cache updates are tagged; conditionals apply to the main request */
+	r = ctx->r;
+	llcf = ctx->state->llcf;
+	if (llcf->etag == LWS_ET_OFF || (r != r->main && !r->background)
+			|| ctx->redirect.len || ctx->sendfile.len || ctx->streaming
+			|| ctx->status != NGX_HTTP_OK
+			|| (r->method != NGX_HTTP_GET && r->method != NGX_HTTP_HEAD)) {
+		return;
+	}
+
+	/* an entity tag set by Lua is kept; otherwise, the encoded body is hashed */
+	ngx_str_set(&key, "ETag");
+	value = lws_table_get(ctx->response_headers, &key);
+	if (!value) {
+		if (lws_body_hash(&ctx->response_body, &hash) != 0) {
+			ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "[LWS] failed to hash response");
+			return;
+		}
+		p = ngx_sprintf(buf, "\"%016xL\"", hash);
+		if (lws_set_response_header(ctx, &key, buf, p - buf) != 0) {
+			return;
+		}
+		value = lws_table_get(ctx->response_headers, &key);
+	}
+
+	/* not modified? coalesced and cached responses are complete */
+	if (r != r->main || ctx->flight || ctx->cache_key.len) {
+		return;
+	}
+	ngx_str_set(&key, "If-None-Match");
+	match = lws_table_get(ctx->request_headers, &key);
+	if (!match || !lws_matches_etag(match, value)) {
+		return;
+	}
+	ctx->status = NGX_HTTP_NOT_MODIFIED;
+	lws_body_reset(&ctx->response_body);
+}
+
+int lws_is_not_modified (ngx_http_request_t *r, ngx_str_t *etag) {
+	/* conditionals apply to the main request */
+	if (r != r->main || !r->headers_in.if_none_match
+			|| (r->method != NGX_HTTP_GET && r->method != NGX_HTTP_HEAD)) {
+		return 0;
+	}
+	return lws_matches_etag(&r->headers_in.if_none_match->value, etag);
+}
+
+static int lws_matches_etag (ngx_str_t *value, ngx_str_t *etag) {
+	u_char  *p, *last, *start, *end, *tag;
+	size_t   len;
+
+	/* weak comparison */
+	tag = etag->data;
+	len = etag->len;
+	if (len > 2 && tag[0] == 'W' && tag[1] == '/') {
+		tag += 2;
+		len -= 2;
+	}
+	p = value->data;
+	last = value->data + value->len;
+	while (p < last) {
+		while (p < last && (*p == ' ' || *p == '\t' || *p == ',')) {
+			p++;
+		}
+		start = p;
+		while (p < last && *p != ',' && *p != ' ' && *p != '\t') {
+			p++;
+		}
+		end = p;
+		if (end - start == 1 && *start == '*') {
+			return 1;
+		}
+		if (end - start > 2 && start[0] == 'W' && start[1] == '/') {
+			start += 2;
+		}
+		if ((size_t)(end - start) == len && ngx_strncmp(start, tag, len) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int lws_accepts_encoding (lws_request_ctx_t *ctx, ngx_str_t *coding) {
+	u_char     *p, *last, *start, *end;
+	ngx_str_t   key, *value;
+
+	ngx_str_set(&key, "Accept-Encoding");
+	value = lws_table_get(ctx->request_headers, &key);
+	if (!value) {
+		return 0;
+	}
+	p = value->data;
+	last = value->data + value->len;
+	while (p < last) {
+		/* coding */
+		while (p < last && (*p == ' ' || *p == '\t' || *p == ',')) {
+			p++;
+		}
+		start = p;
+		while (p < last && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') {
+			p++;
+		}
+		end = p;
+
+		/* parameters */
+		while (p < last && *p != ',') {
+			p++;
+		}
+		if ((size_t)(end - start) == coding->len
+				&& ngx_strncasecmp(start, coding->data, coding->len) == 0) {
+			return !lws_is_qzero(end, p);
+		}
+	}
+	return 0;
+}
+
+static int lws_is_qzero (u_char *p, u_char *last) {
+	for ( /* void */ ; p + 1 < last; p++) {
+		if ((*p == 'q' || *p == 'Q') && p[1] == '=') {
+			p += 2;
+			if (p == last || *p != '0') {
+				return 0;
+			}
+			for (p++; p < last && (*p == '.' || *p == '0'); p++) {
+				/* void */
+			}
+			return p == last || *p == ' ' || *p == '\t' || *p == ';';
+		}
+	}
+	return 0;
+}
+
+static int lws_set_vary (lws_request_ctx_t *ctx) {
+	int         rc;
+	u_char     *p;
+	ngx_str_t   key, *value;
+
+	ngx_str_set(&key, "Vary");
+	value = lws_table_get(ctx->response_headers, &key);
+	if (!value) {
+		return lws_set_response_header(ctx, &key, (u_char *)"Accept-Encoding",
+				sizeof("Accept-Encoding") - 1);
+	}
+	if (ngx_strlcasestrn(value->data, value->data + value->len, (u_char *)"accept-encoding",
+			sizeof("accept-encoding") - 2) || (value->len == 1 && value->data[0] == '*')) {
+		return 0;
+	}
+	p = ngx_alloc(value->len + sizeof(", Accept-Encoding") - 1, ctx->r->connection->log);
+	if (!p) {
+		return -1;
+	}
+	ngx_memcpy(p, value->data, value->len);
+	ngx_memcpy(p + value->len, ", Accept-Encoding", sizeof(", Accept-Encoding") - 1);
+	rc = lws_set_response_header(ctx, &key, p, value->len + sizeof(", Accept-Encoding") - 1);
+	ngx_free(p);
+	return rc;
+}
+
+static int lws_set_response_header (lws_request_ctx_t *ctx, ngx_str_t *key, u_char *value,
+		size_t len) {
+	ngx_str_t  *dup;
+
+	/* values are owned by the response headers, as when set from Lua */
+	dup = ngx_alloc(sizeof(ngx_str_t) + len, ctx->r->connection->log);
+	if (!dup) {
+		return -1;
+	}
+	dup->data = (u_char *)dup + sizeof(ngx_str_t);
+	ngx_memcpy(dup->data, value, len);
+	dup->len = len;
+	if (lws_table_set(ctx->response_headers, key, dup) != 0) {
+		ngx_log_error(NGX_LOG_CRIT, ctx->r->connection->log, 0, "[LWS] failed to set header");
+		ngx_free(dup);
+		return -1;
+	}
+	return 0;
+}
+
+static int lws_deflate (z_stream *zs, int flush, lws_body_t *out) {
+	u_char  buf[LWS_COMPRESS_BUF_SIZE];
+
+	do {
+		zs->next_out = buf;
+		zs->avail_out = sizeof(buf);
+		if (deflate(zs, flush) == Z_STREAM_ERROR) {
+			return -1;
+		}
+		if (lws_body_write(out, buf, sizeof(buf) - zs->avail_out) != 0) {
+			return -1;
+		}
+	} while (zs->avail_out == 0);
+	return 0;
+}
+
+static int lws_deflate_file (z_stream *zs, lws_body_t *in, lws_body_t *out) {
+	off_t    offset;
+	ssize_t  n;
+	u_char   buf[LWS_COMPRESS_BUF_SIZE];
+
+	/* spilled part of the response body */
+	for (offset = 0; offset < in->file_len; offset += n) {
+		n = lws_body_read_file(in, buf, sizeof(buf), offset);
+		if (n <= 0) {
+			return -1;
+		}
+		zs->next_in = buf;
+		zs->avail_in = n;
+		if (lws_deflate(zs, Z_NO_FLUSH, out) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+ngx_int_t lws_open_inflate (lws_request_ctx_t *ctx) {
+	FILE                *f;
+	ngx_log_t           *log;
+	ngx_str_t            key, *value;
+	lws_inflate_t       *inf;
+	lws_loc_conf_t      *llcf;
+	ngx_http_request_t  *r;
+
+	/* compressed? */
+	ngx_str_set(&key, "Content-Encoding");
+	value = lws_table_get(ctx->request_headers, &key);
+	if (!value || !(lws_is_coding(value, "gzip") || lws_is_coding(value, "x-gzip")
+			|| lws_is_coding(value, "deflate"))) {
+		return NGX_OK;
+	}
+
+	/* wrap request body stream; zlib is initialized in the pool thread */
+	r = ctx->r;
+	log = r->connection->log;
+	llcf = ngx_http_get_module_loc_conf(r, lws_module);
+	inf = ngx_calloc(sizeof(lws_inflate_t), log);
+	if (!inf) {
+		return NGX_ERROR;
+	}
+	inf->in = ctx->request_body;
+	inf->log = log;
+	inf->max = llcf->decompress_max_size;
+	f = fopencookie(inf, "rb", lws_inflate_functions);
+	if (!f) {
+		ngx_log_error(NGX_LOG_ERR, log, errno, "[LWS] failed to open request body stream");
+		ngx_free(inf);
+		return NGX_ERROR;
+	}
+	ctx->request_body = f;
+	ctx->inflate = inf;
+
+	/* the request body is presented decompressed; its length is unknown */
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "[LWS] request body decompress coding:%V",
+			value);
+	lws_table_set(ctx->request_headers, &key, NULL);
+	ngx_str_set(&key, "Content-Length");
+	lws_table_set(ctx->request_headers, &key, NULL);
+	return NGX_OK;
+}
+
+void lws_close_inflate (lws_inflate_t *inf) {
+	if (inf->init) {
+		inflateEnd(&inf->zs);
+	}
+	fclose(inf->in);
+	ngx_free(inf);
+}
+
+static ssize_t lws_inflate_read_handler (void *cookie, char *buf, size_t size) {
+	int             rc;
+	size_t          n;
+	lws_inflate_t  *inf;
+
+	/* initialize; gzip and zlib formats are detected */
+	inf = cookie;
+	if (!inf->init) {
+		if (inflateInit2(&inf->zs, MAX_WBITS + 32) != Z_OK) {
+			ngx_log_error(NGX_LOG_CRIT, inf->log, 0,
+					"[LWS] failed to initialize decompression");
+			errno = ENOMEM;
+			return -1;
+		}
+		inf->init = 1;
+	}
+
+	/* decompress until there is output */
+	inf->zs.next_out = (u_char *)buf;
+	inf->zs.avail_out = size;
+	while (inf->zs.avail_out == size && !inf->done) {
+		if (inf->zs.avail_in == 0) {
+			n = fread(inf->buf, 1, sizeof(inf->buf), inf->in);
+			if (n == 0) {
+				ngx_log_error(NGX_LOG_INFO, inf->log, 0,
+						"[LWS] failed to decompress request body: %s",
+						ferror(inf->in) ? "read error" : "truncated");
+				errno = EIO;
+				return -1;
+			}
+			inf->zs.next_in = inf->buf;
+			inf->zs.avail_in = n;
+		}
+		rc = inflate(&inf->zs, Z_NO_FLUSH);
+		if (rc == Z_STREAM_END) {
+			inf->done = 1;
+		} else if (rc != Z_OK) {
+			ngx_log_error(NGX_LOG_INFO, inf->log, 0,
+					"[LWS] failed to decompress request body: %s",
+					inf->zs.msg ? inf->zs.msg : "bad data");
+			errno = EIO;
+			return -1;
+		}
+	}
+
+	/* limit */
+	n = size - inf->zs.avail_out;
+	inf->len += n;
+	if (inf->len > inf->max) {
+		ngx_log_error(NGX_LOG_INFO, inf->log, 0,
+				"[LWS] decompressed request body exceeds %uz bytes", inf->max);
+		errno = EFBIG;
+		return -1;
+	}
+	return n;
+}
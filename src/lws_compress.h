@@ -0,0 +1,42 @@
+/*
+ * LWS compress
+ *
+ * Copyright (C) 2024 Andre Naef
+ */
+
+
+#ifndef _LWS_COMPRESS_INCLUDED
+#define _LWS_COMPRESS_INCLUDED
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <zlib.h>
+#include <lws_module.h>
+
+
+#define LWS_COMPRESS_BUF_SIZE  4096  /* size of the compression output buffer */
+#define LWS_INFLATE_BUF_SIZE   4096  /* size of the decompression input buffer */
+#define LWS_ETAG_LEN           18    /* length of generated entity tags */
+
+
+struct lws_inflate_s {
+	FILE       *in;                         /* compressed request body stream */
+	ngx_log_t  *log;                        /* log */
+	z_stream    zs;                         /* zlib stream */
+	size_t      len;                        /* length of decompressed data */
+	size_t      max;                        /* maximum length of decompressed data */
+	u_char      buf[LWS_INFLATE_BUF_SIZE];  /* input buffer */
+	unsigned    init:1;                     /* zlib stream is initialized */
+	unsigned    done:1;                     /* end of compressed data */
+};
+
+
+void lws_compress_response(lws_request_ctx_t *ctx);
+void lws_etag_response(lws_request_ctx_t *ctx);
+int lws_is_not_modified(ngx_http_request_t *r, ngx_str_t *etag);
+ngx_int_t lws_open_inflate(lws_request_ctx_t *ctx);
+void lws_close_inflate(lws_inflate_t *inf);
+
+
+#endif /* _LWS_COMPRESS_INCLUDED */
@@ -0,0 +1,650 @@
+/*
+ * LWS freeze
+ *
+ * Copyright (C) 2024 Andre Naef
+ */
+
+
+#include <lws_freeze.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include <lws_lib.h>
+#include <lws_value.h>
+
+
+#define lws_frozen_values(t)  ((lws_frozen_value_t *)((lws_frozen_table_t *)(t) + 1))
+
+
+static int lws_init_shared(lua_State *L);
+static int lws_lua_freeze(lua_State *L);
+static int lws_lua_freeze_buf_gc(lua_State *L);
+static size_t lws_freeze_reserve(lua_State *L, lws_freeze_buf_t *buf, size_t len);
+static size_t lws_freeze_table(lua_State *L, lws_freeze_buf_t *buf, int index, int depth);
+static void lws_freeze_value(lua_State *L, lws_freeze_buf_t *buf, int index, int depth,
+		lws_frozen_value_t *value);
+static ngx_int_t lws_frozen_key(lua_State *L, int index, lws_frozen_value_t *key,
+		ngx_str_t *str);
+static int lws_frozen_compare(u_char *adata, lws_frozen_value_t *a, u_char *bdata,
+		lws_frozen_value_t *b);
+static void lws_frozen_sort(u_char *data, lws_frozen_value_t *pairs, size_t n);
+static void lws_frozen_sift(u_char *data, lws_frozen_value_t *pairs, size_t i, size_t n);
+static ngx_int_t lws_frozen_find(lws_frozen_t *frozen, lws_frozen_table_t *t,
+		lws_frozen_value_t *key, u_char *kdata, size_t *pos);
+static void lws_push_frozen(lua_State *L, lws_frozen_t *frozen, lws_frozen_value_t *value);
+static lws_lua_frozen_t *lws_check_frozen(lua_State *L, int index);
+static int lws_lua_frozen_lookup(lua_State *L);
+static int lws_lua_frozen_index(lua_State *L);
+static int lws_lua_frozen_newindex(lua_State *L);
+static int lws_lua_frozen_len(lua_State *L);
+static int lws_lua_frozen_next(lua_State *L);
+static int lws_lua_frozen_tostring(lua_State *L);
+
+
+/*
+ * shared init chunk
+ */
+
+char *lws_run_init_shared (ngx_conf_t *cf, lws_main_conf_t *lmcf) {
+	ngx_str_t   msg;
+	lua_State  *L;
+
+	/* the chunk runs once at configuration; worker processes inherit the frozen tables */
+	lmcf->frozen = ngx_array_create(cf->pool, 4, sizeof(lws_frozen_t));
+	if (!lmcf->frozen) {
+		return NGX_CONF_ERROR;
+	}
+	L = luaL_newstate();
+	if (!L) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[LWS] failed to create Lua state");
+		return NGX_CONF_ERROR;
+	}
+	lua_pushcfunction(L, lws_init_shared);
+	lua_pushlightuserdata(L, lmcf->frozen);
+	lua_pushlstring(L, (const char *)lmcf->init_shared.data, lmcf->init_shared.len);
+	if (lua_pcall(L, 2, 0, 0) != 0) {
+		lws_get_msg(L, -1, &msg);
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[LWS] failed to run shared init chunk: %V",
+				&msg);
+		lua_close(L);
+		return NGX_CONF_ERROR;
+	}
+	lua_close(L);
+	return NGX_CONF_OK;
+}
+
+void lws_cleanup_frozen (lws_main_conf_t *lmcf) {
+	ngx_uint_t     i;
+	lws_frozen_t  *frozen;
+
+	if (!lmcf->frozen) {
+		return;
+	}
+	frozen = lmcf->frozen->elts;
+	for (i = 0; i < lmcf->frozen->nelts; i++) {
+		ngx_free(frozen[i].data);
+	}
+}
+
+static int lws_init_shared (lua_State *L) {
+	/* open standard libraries */
+	luaL_openlibs(L);
+
+	/* lws.freeze is the only LWS function */
+	luaL_newmetatable(L, LWS_FREEZE_BUF);
+	lua_pushcfunction(L, lws_lua_freeze_buf_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+	lua_createtable(L, 0, 1);
+	lua_pushvalue(L, 1);
+	lua_pushcclosure(L, lws_lua_freeze, 1);
+	lua_setfield(L, -2, "freeze");
+	lua_setglobal(L, LWS_LIB_NAME);
+
+	/* run */
+	if (luaL_loadfile(L, lua_tostring(L, 2)) != 0) {
+		return lua_error(L);
+	}
+	lua_call(L, 0, 0);
+	return 0;
+}
+
+
+/*
+ * freeze
+ */
+
+static int lws_lua_freeze (lua_State *L) {
+	ngx_str_t          name;
+	ngx_uint_t         i;
+	ngx_array_t       *frozens;
+	lws_frozen_t      *frozen;
+	lws_freeze_buf_t  *buf;
+
+	/* check arguments */
+	frozens = lua_touserdata(L, lua_upvalueindex(1));
+	name.data = (u_char *)luaL_checklstring(L, 1, &name.len);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 2);
+	frozen = frozens->elts;
+	for (i = 0; i < frozens->nelts; i++) {
+		if (frozen[i].name.len == name.len
+				&& ngx_strncmp(frozen[i].name.data, name.data, name.len) == 0) {
+			return luaL_error(L, "frozen table \"%s\" is duplicate", name.data);
+		}
+	}
+
+	/* freeze; tables already frozen are tracked by offset */
+	buf = lua_newuserdata(L, sizeof(lws_freeze_buf_t));
+	ngx_memzero(buf, sizeof(lws_freeze_buf_t));
+	luaL_getmetatable(L, LWS_FREEZE_BUF);
+	lua_setmetatable(L, -2);
+	lua_newtable(L);
+	(void)lws_freeze_table(L, buf, 2, 0);
+
+	/* register */
+	frozen = ngx_array_push(frozens);
+	if (!frozen) {
+		return luaL_error(L, "failed to allocate frozen table");
+	}
+	frozen->name.len = name.len;
+	frozen->name.data = ngx_pnalloc(frozens->pool, name.len + 1);
+	if (!frozen->name.data) {
+		frozens->nelts--;
+		return luaL_error(L, "failed to allocate frozen table");
+	}
+	ngx_memcpy(frozen->name.data, name.data, name.len + 1);
+	frozen->data = buf->data;
+	frozen->len = buf->len;
+	buf->data = NULL;
+	return 0;
+}
+
+static int lws_lua_freeze_buf_gc (lua_State *L) {
+	lws_freeze_buf_t  *buf;
+
+	buf = luaL_checkudata(L, 1, LWS_FREEZE_BUF);
+	ngx_free(buf->data);
+	buf->data = NULL;
+	return 0;
+}
+
+static size_t lws_freeze_reserve (lua_State *L, lws_freeze_buf_t *buf, size_t len) {
+	size_t   offset, size;
+	u_char  *data;
+
+	offset = ngx_align(buf->len, sizeof(uint64_t));
+	if (offset + len > buf->size) {
+		size = buf->size ? buf->size : LWS_FREEZE_BUF_SIZE;
+		while (size < offset + len) {
+			size *= 2;
+		}
+		data = ngx_alloc(size, ngx_cycle->log);
+		if (!data) {
+			luaL_error(L, "failed to allocate frozen table");
+		}
+		if (buf->data) {
+			ngx_memcpy(data, buf->data, buf->len);
+			ngx_free(buf->data);
+		}
+		buf->data = data;
+		buf->size = size;
+	}
+	ngx_memzero(buf->data + buf->len, offset + len - buf->len);
+	buf->len = offset + len;
+	return offset;
+}
+
+static size_t lws_freeze_table (lua_State *L, lws_freeze_buf_t *buf, int index, int depth) {
+	int                  top;
+	size_t               offset, narr, nhash, n, i;
+	ngx_str_t            str;
+	lua_Number           number;
+	lws_frozen_value_t   key, value, *values;
+	lws_frozen_table_t  *t;
+
+	/* tables referenced more than once, including cycles, are frozen once */
+	lua_pushvalue(L, index);
+	lua_rawget(L, 4);
+	if (!lua_isnil(L, -1)) {
+		offset = (size_t)lua_tonumber(L, -1);
+		lua_pop(L, 1);
+		return offset;
+	}
+	lua_pop(L, 1);
+	if (depth > LWS_VALUE_DEPTH_MAX) {
+		luaL_error(L, "table nesting too deep");
+	}
+	luaL_checkstack(L, 4, NULL);
+
+	/* count; the array part has the keys 1..narr */
+	narr = 0;
+	while (lua_rawgeti(L, index, narr + 1), !lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		narr++;
+	}
+	lua_pop(L, 1);
+	n = 0;
+	lua_pushnil(L);
+	while (lua_next(L, index)) {
+		lua_pop(L, 1);
+		n++;
+	}
+	nhash = n - narr;
+	if (narr > UINT32_MAX || nhash > UINT32_MAX) {
+		luaL_error(L, "table too large");
+	}
+	offset = lws_freeze_reserve(L, buf, sizeof(lws_frozen_table_t)
+			+ (narr + 2 * nhash) * sizeof(lws_frozen_value_t));
+	t = (lws_frozen_table_t *)(buf->data + offset);
+	t->narr = narr;
+	t->nhash = nhash;
+	lua_pushvalue(L, index);
+	lua_pushnumber(L, offset);
+	lua_rawset(L, 4);
+
+	/* array values; the buffer may move while values are frozen */
+	for (i = 0; i < narr; i++) {
+		lua_rawgeti(L, index, i + 1);
+		lws_freeze_value(L, buf, lua_gettop(L), depth, &value);
+		lua_pop(L, 1);
+		values = lws_frozen_values(buf->data + offset);
+		values[i] = value;
+	}
+
+	/* key-value pairs */
+	i = 0;
+	lua_pushnil(L);
+	while (lua_next(L, index)) {
+		top = lua_gettop(L);
+		if (lua_type(L, top - 1) == LUA_TNUMBER) {
+			number = lua_tonumber(L, top - 1);
+			if (number >= 1 && number <= narr && number == (lua_Number)(size_t)number) {
+				lua_pop(L, 1);
+				continue;
+			}
+		}
+		if (lws_frozen_key(L, top - 1, &key, &str) != NGX_OK) {
+			luaL_error(L, "unsupported key type: %s", luaL_typename(L, top - 1));
+		}
+		if (key.type == LWS_VT_STRING) {
+			key.v.offset = lws_freeze_reserve(L, buf, str.len);
+			ngx_memcpy(buf->data + key.v.offset, str.data, str.len);
+		}
+		lws_freeze_value(L, buf, top, depth, &value);
+		lua_pop(L, 1);
+		values = lws_frozen_values(buf->data + offset) + narr + 2 * i++;
+		values[0] = key;
+		values[1] = value;
+	}
+	lws_frozen_sort(buf->data, lws_frozen_values(buf->data + offset) + narr, nhash);
+	return offset;
+}
+
+static void lws_freeze_value (lua_State *L, lws_freeze_buf_t *buf, int index, int depth,
+		lws_frozen_value_t *value) {
+	size_t       len;
+	const char  *s;
+
+	ngx_memzero(value, sizeof(lws_frozen_value_t));
+	switch (lua_type(L, index)) {
+	case LUA_TBOOLEAN:
+		value->type = lua_toboolean(L, index) ? LWS_VT_TRUE : LWS_VT_FALSE;
+		break;
+
+	case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+		if (lua_isinteger(L, index)) {
+			value->type = LWS_VT_INTEGER;
+			value->v.i = lua_tointeger(L, index);
+			break;
+		}
+#endif
+		value->type = LWS_VT_NUMBER;
+		value->v.n = lua_tonumber(L, index);
+		break;
+
+	case LUA_TSTRING:
+		s = lua_tolstring(L, index, &len);
+		if (len > UINT32_MAX) {
+			luaL_error(L, "string too long");
+		}
+		value->type = LWS_VT_STRING;
+		value->len = len;
+		value->v.offset = lws_freeze_reserve(L, buf, len);
+		ngx_memcpy(buf->data + value->v.offset, s, len);
+		break;
+
+	case LUA_TTABLE:
+		value->type = LWS_VT_TABLE;
+		value->v.offset = lws_freeze_table(L, buf, index, depth + 1);
+		break;
+
+	default:
+		luaL_error(L, "unsupported type: %s", luaL_typename(L, index));
+	}
+}
+
+
+/*
+ * frozen tables
+ */
+
+static ngx_int_t lws_frozen_key (lua_State *L, int index, lws_frozen_value_t *key,
+		ngx_str_t *str) {
+	lua_Number  number;
+
+	/* numbers with an integer value are integer keys, as in Lua tables */
+	ngx_memzero(key, sizeof(lws_frozen_value_t));
+	switch (lua_type(L, index)) {
+	case LUA_TBOOLEAN:
+		key->type = lua_toboolean(L, index) ? LWS_VT_TRUE : LWS_VT_FALSE;
+		return NGX_OK;
+
+	case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+		if (lua_isinteger(L, index)) {
+			key->type = LWS_VT_INTEGER;
+			key->v.i = lua_tointeger(L, index);
+			return NGX_OK;
+		}
+#endif
+		number = lua_tonumber(L, index);
+#if LUA_VERSION_NUM >= 503
+		if (lua_numbertointeger(number, &key->v.i) && (lua_Number)key->v.i == number) {
+			key->type = LWS_VT_INTEGER;
+			return NGX_OK;
+		}
+#endif
+		key->type = LWS_VT_NUMBER;
+		key->v.n = number;
+		return NGX_OK;
+
+	case LUA_TSTRING:
+		str->data = (u_char *)lua_tolstring(L, index, &str->len);
+		if (str->len > UINT32_MAX) {
+			return NGX_DECLINED;
+		}
+		key->type = LWS_VT_STRING;
+		key->len = str->len;
+		return NGX_OK;
+
+	default:
+		return NGX_DECLINED;
+	}
+}
+
+static int lws_frozen_compare (u_char *adata, lws_frozen_value_t *a, u_char *bdata,
+		lws_frozen_value_t *b) {
+	int  rc;
+
+	/* keys are ordered by type, then value */
+	if (a->type != b->type) {
+		return a->type < b->type ? -1 : 1;
+	}
+	switch (a->type) {
+	case LWS_VT_INTEGER:
+		return a->v.i < b->v.i ? -1 : a->v.i > b->v.i;
+
+	case LWS_VT_NUMBER:
+		return a->v.n < b->v.n ? -1 : a->v.n > b->v.n;
+
+	case LWS_VT_STRING:
+		rc = ngx_memcmp(adata + a->v.offset, bdata + b->v.offset, ngx_min(a->len, b->len));
+		if (rc != 0) {
+			return rc;
+		}
+		return a->len < b->len ? -1 : a->len > b->len;
+
+	default:
+		return 0;
+	}
+}
+
+static void lws_frozen_sort (u_char *data, lws_frozen_value_t *pairs, size_t n) {
+	size_t              i;
+	lws_frozen_value_t  tmp[2];
+
+	/* heapsort of key-value pairs; strings are relative to data */
+	for (i = n / 2; i > 0; i--) {
+		lws_frozen_sift(data, pairs, i - 1, n);
+	}
+	for (i = n; i > 1; i--) {
+		ngx_memcpy(tmp, &pairs[0], sizeof(tmp));
+		ngx_memcpy(&pairs[0], &pairs[2 * (i - 1)], sizeof(tmp));
+		ngx_memcpy(&pairs[2 * (i - 1)], tmp, sizeof(tmp));
+		lws_frozen_sift(data, pairs, 0, i - 1);
+	}
+}
+
+static void lws_frozen_sift (u_char *data, lws_frozen_value_t *pairs, size_t i, size_t n) {
+	size_t              child;
+	lws_frozen_value_t  tmp[2];
+
+	while ((child = 2 * i + 1) < n) {
+		if (child + 1 < n && lws_frozen_compare(data, &pairs[2 * child], data,
+				&pairs[2 * (child + 1)]) < 0) {
+			child++;
+		}
+		if (lws_frozen_compare(data, &pairs[2 * i], data, &pairs[2 * child]) >= 0) {
+			return;
+		}
+		ngx_memcpy(tmp, &pairs[2 * i], sizeof(tmp));
+		ngx_memcpy(&pairs[2 * i], &pairs[2 * child], sizeof(tmp));
+		ngx_memcpy(&pairs[2 * child], tmp, sizeof(tmp));
+		i = child;
+	}
+}
+
+static ngx_int_t lws_frozen_find (lws_frozen_t *frozen, lws_frozen_table_t *t,
+		lws_frozen_value_t *key, u_char *kdata, size_t *pos) {
+	int                  rc;
+	size_t               low, high, mid;
+	lws_frozen_value_t  *pairs;
+
+	/* position in the array values, then in the key-value pairs */
+	if (key->type == LWS_VT_INTEGER && key->v.i >= 1 && (uint64_t)key->v.i <= t->narr) {
+		*pos = key->v.i - 1;
+		return NGX_OK;
+	}
+	if (key->type == LWS_VT_NUMBER && key->v.n >= 1 && key->v.n <= t->narr
+			&& key->v.n == (lua_Number)(size_t)key->v.n) {
+		*pos = (size_t)key->v.n - 1;
+		return NGX_OK;
+	}
+	pairs = lws_frozen_values(t) + t->narr;
+	low = 0;
+	high = t->nhash;
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		rc = lws_frozen_compare(frozen->data, &pairs[2 * mid], kdata, key);
+		if (rc == 0) {
+			*pos = t->narr + mid;
+			return NGX_OK;
+		}
+		if (rc < 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return NGX_DECLINED;
+}
+
+static void lws_push_frozen (lua_State *L, lws_frozen_t *frozen, lws_frozen_value_t *value) {
+	lws_lua_frozen_t  *lf;
+
+	switch (value->type) {
+	case LWS_VT_FALSE:
+	case LWS_VT_TRUE:
+		lua_pushboolean(L, value->type == LWS_VT_TRUE);
+		break;
+
+	case LWS_VT_INTEGER:
+		lua_pushinteger(L, value->v.i);
+		break;
+
+	case LWS_VT_NUMBER:
+		lua_pushnumber(L, value->v.n);
+		break;
+
+	case LWS_VT_STRING:
+		lua_pushlstring(L, (const char *)frozen->data + value->v.offset, value->len);
+		break;
+
+	case LWS_VT_TABLE:
+		lf = lua_newuserdata(L, sizeof(lws_lua_frozen_t));
+		lf->frozen = frozen;
+		lf->t = (lws_frozen_table_t *)(frozen->data + value->v.offset);
+		luaL_getmetatable(L, LWS_FROZEN);
+		lua_setmetatable(L, -2);
+		break;
+
+	default:
+		lua_pushnil(L);
+	}
+}
+
+
+/*
+ * Lua
+ */
+
+static lws_lua_frozen_t *lws_check_frozen (lua_State *L, int index) {
+	return luaL_checkudata(L, index, LWS_FROZEN);
+}
+
+static int lws_lua_frozen_lookup (lua_State *L) {
+	ngx_str_t           name;
+	ngx_uint_t          i;
+	lws_frozen_t       *frozen;
+	lws_main_conf_t    *lmcf;
+	lws_frozen_value_t  root;
+
+	/* find frozen table; the proxy is cached in the table */
+	name.data = (u_char *)luaL_checklstring(L, 2, &name.len);
+	lmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, lws_module);
+	if (lmcf->frozen) {
+		frozen = lmcf->frozen->elts;
+		for (i = 0; i < lmcf->frozen->nelts; i++) {
+			if (frozen[i].name.len == name.len
+					&& ngx_strncmp(frozen[i].name.data, name.data, name.len) == 0) {
+				ngx_memzero(&root, sizeof(lws_frozen_value_t));
+				root.type = LWS_VT_TABLE;
+				lws_push_frozen(L, &frozen[i], &root);
+				lua_pushvalue(L, 2);
+				lua_pushvalue(L, -2);
+				lua_rawset(L, 1);
+				return 1;
+			}
+		}
+	}
+	return luaL_error(L, "frozen table \"%s\" not found", name.data);
+}
+
+static int lws_lua_frozen_index (lua_State *L) {
+	size_t               pos;
+	ngx_str_t            str;
+	lws_lua_frozen_t    *lf;
+	lws_frozen_value_t   key, *values;
+
+	lf = lws_check_frozen(L, 1);
+	str.data = NULL;
+	if (lws_frozen_key(L, 2, &key, &str) != NGX_OK
+			|| lws_frozen_find(lf->frozen, lf->t, &key, str.data, &pos) != NGX_OK) {
+		lua_pushnil(L);
+		return 1;
+	}
+	values = lws_frozen_values(lf->t);
+	lws_push_frozen(L, lf->frozen, pos < lf->t->narr ? &values[pos]
+			: &values[lf->t->narr + 2 * (pos - lf->t->narr) + 1]);
+	return 1;
+}
+
+static int lws_lua_frozen_newindex (lua_State *L) {
+	return luaL_error(L, "frozen table is read-only");
+}
+
+static int lws_lua_frozen_len (lua_State *L) {
+	lws_lua_frozen_t  *lf;
+
+	lf = lws_check_frozen(L, 1);
+	lua_pushinteger(L, lf->t->narr);
+	return 1;
+}
+
+static int lws_lua_frozen_next (lua_State *L) {
+	size_t               pos;
+	ngx_str_t            str;
+	lws_lua_frozen_t    *lf;
+	lws_frozen_value_t   key, *values;
+
+	/* array values in order, then key-value pairs in key order */
+	lf = lws_check_frozen(L, 1);
+	if (lua_isnoneornil(L, 2)) {
+		pos = 0;
+	} else {
+		str.data = NULL;
+		if (lws_frozen_key(L, 2, &key, &str) != NGX_OK
+				|| lws_frozen_find(lf->frozen, lf->t, &key, str.data, &pos) != NGX_OK) {
+			return luaL_error(L, "invalid key to 'next'");
+		}
+		pos++;
+	}
+	values = lws_frozen_values(lf->t);
+	if (pos < lf->t->narr) {
+		lua_pushinteger(L, pos + 1);
+		lws_push_frozen(L, lf->frozen, &values[pos]);
+		return 2;
+	}
+	pos -= lf->t->narr;
+	if (pos < lf->t->nhash) {
+		values += lf->t->narr + 2 * pos;
+		lws_push_frozen(L, lf->frozen, &values[0]);
+		lws_push_frozen(L, lf->frozen, &values[1]);
+		return 2;
+	}
+	lua_pushnil(L);
+	return 1;
+}
+
+int lws_frozen_pairs (lua_State *L) {
+	(void)lws_check_frozen(L, 1);
+	lua_pushcfunction(L, lws_lua_frozen_next);
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	return 3;
+}
+
+static int lws_lua_frozen_tostring (lua_State *L) {
+	lws_lua_frozen_t  *lf;
+
+	lf = lws_check_frozen(L, 1);
+	lua_pushfstring(L, LWS_FROZEN ": %s: %p", lf->frozen->name.data, lf->t);
+	return 1;
+}
+
+int lws_open_frozen (lua_State *L) {
+	/* frozen table */
+	luaL_newmetatable(L, LWS_FROZEN);
+	lua_pushcfunction(L, lws_lua_frozen_index);
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, lws_lua_frozen_newindex);
+	lua_setfield(L, -2, "__newindex");
+	lua_pushcfunction(L, lws_lua_frozen_len);
+	lua_setfield(L, -2, "__len");
+#if LUA_VERSION_NUM >= 502
+	lua_pushcfunction(L, lws_frozen_pairs);
+	lua_setfield(L, -2, "__pairs");
+#endif
+	lua_pushcfunction(L, lws_lua_frozen_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_pop(L, 1);
+
+	/* lws.frozen; frozen tables are looked up by name on first access */
+	lua_newtable(L);
+	lua_createtable(L, 0, 1);
+	lua_pushcfunction(L, lws_lua_frozen_lookup);
+	lua_setfield(L, -2, "__index");
+	lua_setmetatable(L, -2);
+	return 1;
+}
@@ -0,0 +1,72 @@
+/*
+ * LWS freeze
+ *
+ * Copyright (C) 2024 Andre Naef
+ */
+
+
+#ifndef _LWS_FREEZE_INCLUDED
+#define _LWS_FREEZE_INCLUDED
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <lua.h>
+
+
+#define LWS_FROZEN             "lws.frozen"      /* frozen table metatable */
+#define LWS_FREEZE_BUF         "lws.freeze_buf"  /* freeze buffer metatable */
+#define LWS_FREEZE_BUF_SIZE    4096              /* initial size of freeze buffer */
+
+
+typedef struct lws_frozen_s lws_frozen_t;
+typedef struct lws_frozen_table_s lws_frozen_table_t;
+typedef struct lws_frozen_value_s lws_frozen_value_t;
+typedef struct lws_freeze_buf_s lws_freeze_buf_t;
+typedef struct lws_lua_frozen_s lws_lua_frozen_t;
+
+
+#include <lws_module.h>
+
+
+struct lws_frozen_s {
+	ngx_str_t            name;    /* name */
+	u_char              *data;    /* frozen tables; the root table is first */
+	size_t               len;     /* length of frozen tables */
+};
+
+/* a table is followed by its array values, then its key-value pairs sorted by key */
+struct lws_frozen_table_s {
+	uint32_t             narr;    /* number of array values, with keys 1..narr */
+	uint32_t             nhash;   /* number of key-value pairs */
+};
+
+struct lws_frozen_value_s {
+	uint32_t             type;    /* LWS_VT_* */
+	uint32_t             len;     /* length of string */
+	union {
+		lua_Number       n;       /* number */
+		lua_Integer      i;       /* integer */
+		uint64_t         offset;  /* offset of string or table */
+	} v;
+};
+
+struct lws_freeze_buf_s {
+	u_char              *data;    /* frozen tables */
+	size_t               len;     /* length of frozen tables */
+	size_t               size;    /* allocated size */
+};
+
+struct lws_lua_frozen_s {
+	lws_frozen_t        *frozen;  /* frozen tables */
+	lws_frozen_table_t  *t;       /* table */
+};
+
+
+char *lws_run_init_shared(ngx_conf_t *cf, lws_main_conf_t *lmcf);
+void lws_cleanup_frozen(lws_main_conf_t *lmcf);
+int lws_open_frozen(lua_State *L);
+int lws_frozen_pairs(lua_State *L);
+
+
+#endif /* _LWS_FREEZE_INCLUDED */
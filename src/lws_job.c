@@ -0,0 +1,140 @@
+/*
+ * LWS job
+ *
+ * Copyright (C) 2024 Andre Naef
+ */
+
+
+#include <lws_job.h>
+#include <lws_lib.h>
+
+
+#if LUA_VERSION_NUM < 502
+#define LUA_OK  0
+#endif
+
+
+static void lws_job_thread_handler(void *data, ngx_log_t *log);
+static void lws_job_handler(ngx_event_t *ev);
+
+
+lws_job_t *lws_create_job (ngx_str_t *module, ngx_str_t *function, ngx_log_t *log) {
+	u_char     *p;
+	lws_job_t  *job;
+
+	job = ngx_calloc(sizeof(lws_job_t) + module->len + function->len, log);
+	if (!job) {
+		return NULL;
+	}
+	p = (u_char *)&job[1];
+	job->module.data = p;
+	job->module.len = module->len;
+	p = ngx_cpymem(p, module->data, module->len);
+	job->function.data = p;
+	job->function.len = function->len;
+	ngx_memcpy(p, function->data, function->len);
+	job->local = 1;  /* until started in another Lua state */
+	return job;
+}
+
+void lws_start_job (lws_job_t *job) {
+	ngx_log_t           *log;
+	lws_loc_conf_t      *llcf;
+	lws_main_conf_t     *lmcf;
+	ngx_http_request_t  *r;
+
+	/* acquire state; with no state available, the job runs locally when joined */
+	r = job->ctx->r;
+	log = r->connection->log;
+	llcf = ngx_http_get_module_loc_conf(r, lws_module);
+	if (ngx_queue_empty(&llcf->states) && llcf->states_max > 0
+			&& llcf->states_n >= llcf->states_max) {
+		ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0, "[LWS] job local module:%V function:%V",
+				&job->module, &job->function);
+		return;
+	}
+	job->state = lws_get_state(r);
+	if (!job->state) {
+		return;
+	}
+
+	/* setup task */
+	job->task.ctx = job;
+	job->task.handler = lws_job_thread_handler;
+	job->task.event.handler = lws_job_handler;
+	job->task.event.data = job;
+
+	/* post task */
+	lmcf = ngx_http_get_module_main_conf(r, lws_module);
+	if (ngx_thread_task_post(lmcf->thread_pool, &job->task) != NGX_OK) {
+		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to post thread task");
+		lws_put_state(job->state, log);
+		job->state = NULL;
+		return;
+	}
+	job->local = 0;
+	job->running = 1;
+	ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0, "[LWS] job started module:%V function:%V L:%p",
+			&job->module, &job->function, job->state->L);
+}
+
+void lws_free_job (lws_job_t *job) {
+	ngx_free(job->args.data);
+	ngx_free(job->results.data);
+	ngx_free(job->error.data);
+	ngx_free(job);
+}
+
+static void lws_job_thread_handler (void *data, ngx_log_t *log) {
+	lua_State  *L;
+	ngx_str_t   msg;
+	lws_job_t  *job;
+
+	/* prepare stack */
+	job = data;
+	L = job->state->L;
+	lws_observe_invalidations(job->state);
+	lua_pushcfunction(L, lws_run_job);
+	lua_pushlightuserdata(L, job);  /* [traceback, function, job] */
+
+	/* call */
+	if (lua_pcall(L, 1, 0, 1) != LUA_OK) {
+		/* set failed, mark for close */
+		job->failed = 1;
+		job->state->close = 1;
+
+		/* log and store error */
+		lws_get_msg(L, -1, &msg);
+		ngx_log_error(NGX_LOG_ERR, log, 0, "[LWS] %s job error: %V", LUA_VERSION, &msg);
+		job->error.data = ngx_alloc(msg.len, log);
+		if (job->error.data) {
+			ngx_memcpy(job->error.data, msg.data, msg.len);
+			job->error.len = msg.len;
+		}
+		lua_pop(L, 1);  /* [traceback] */
+	}
+}
+
+static void lws_job_handler (ngx_event_t *ev) {
+	lws_job_t  *job;
+
+	/* release state */
+	job = ev->data;
+	lws_put_state(job->state, ngx_cycle->log);
+	job->state = NULL;
+	job->running = 0;
+
+	/* request done? */
+	if (!job->ctx) {
+		lws_free_job(job);
+		return;
+	}
+
+	/* set done; the request thread reads the results after observing it */
+	ngx_memory_barrier();
+	job->done = 1;
+	if (job->joined) {
+		job->joined = 0;
+		lws_resume_request(job->ctx);
+	}
+}
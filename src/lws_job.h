@@ -0,0 +1,46 @@
+/*
+ * LWS job
+ *
+ * Copyright (C) 2024 Andre Naef
+ */
+
+
+#ifndef _LWS_JOB_INCLUDED
+#define _LWS_JOB_INCLUDED
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_thread_pool.h>
+
+
+typedef struct lws_job_s lws_job_t;
+
+
+#include <lws_module.h>
+
+
+struct lws_job_s {
+	lws_job_t          *next;       /* next job of request */
+	lws_request_ctx_t  *ctx;        /* request context; NULL once the request is done */
+	lws_state_t        *state;      /* Lua state running the job */
+	ngx_thread_task_t   task;       /* thread task */
+	ngx_str_t           module;     /* module name */
+	ngx_str_t           function;   /* function name */
+	ngx_str_t           args;       /* encoded arguments */
+	ngx_str_t           results;    /* encoded results */
+	ngx_str_t           error;      /* error message */
+	ngx_atomic_t        done;       /* job is done */
+	ngx_flag_t          failed;     /* job failed; set by the pool thread */
+	ngx_atomic_t        local;      /* job runs in the Lua state of the request when joined */
+	ngx_flag_t          running;    /* job is running in a pool thread; event loop only */
+	ngx_flag_t          joined;     /* request waits for the job; event loop only */
+};
+
+
+lws_job_t *lws_create_job(ngx_str_t *module, ngx_str_t *function, ngx_log_t *log);
+void lws_start_job(lws_job_t *job);
+void lws_free_job(lws_job_t *job);
+
+
+#endif /* _LWS_JOB_INCLUDED */
@@ -10,13 +10,21 @@
 #include <lualib.h>
 #include <lws_profiler.h>
 #include <lws_http.h>
+#include <lws_value.h>
+#include <lws_compress.h>
+#include <lws_shared.h>
+#include <lws_local.h>
+#include <lws_mmap.h>
+#include <lws_freeze.h>
 
 
 #if LUA_VERSION_NUM < 502
 #define LUA_OK                              0
 #define luaL_loadfilex(L, filename, mode)   luaL_loadfile(L, filename)
 #define luaL_testudata(L, index, name)      lws_testudata(L, index, name)
+#define lua_rawlen(L, index)                lua_objlen(L, index)
 #endif
+#define LWS_RESULT_YIELD                    -1  /* chunk yielded; not a valid chunk result */
 
 
 #if LUA_VERSION_NUM < 502
@@ -29,18 +37,22 @@ typedef struct {
 /* compatibility */
 static inline int lws_getfield(lua_State *L, int index, const char *key);
 static inline int lws_rawget(lua_State *L, int index);
+static inline int lws_rawgeti(lua_State *L, int index, lua_Integer i);
+static inline int lws_resume_thread(lua_State *T, lua_State *L, int nargs, int *nresults);
 #if LUA_VERSION_NUM < 502
 static lua_Integer lua_tointegerx(lua_State *L, int index, int *isnum);
 static void luaL_setmetatable(lua_State *L, const char *name);
 #endif
 
 /* helpers */
-static void lws_strdup(lws_lua_request_ctx_t *lctx, ngx_str_t *dst, ngx_str_t *src);
+static void lws_strdup(lua_State *L, lws_lua_request_ctx_t *lctx, ngx_str_t *dst,
+		ngx_str_t *src);
 static void lws_unescape_url(u_char **dst, u_char **src, size_t n);
 
 /* request context */
 static lws_lua_request_ctx_t *lws_create_lua_request_ctx(lua_State *L);
 static lws_lua_request_ctx_t *lws_get_lua_request_ctx(lua_State *L);
+static void lws_check_yield(lua_State *L, lws_lua_request_ctx_t *lctx);
 static int lws_lua_request_ctx_tostring(lua_State *L);
 
 /* table */
@@ -57,6 +69,36 @@ static int lws_lua_table_gc(lua_State *L);
 /* response */
 static int lws_lua_response_index(lua_State *L);
 static int lws_lua_response_newindex(lua_State *L);
+static int lws_lua_response_sendfile(lua_State *L);
+
+/* response body */
+static lws_lua_response_body_t *lws_check_response_body(lua_State *L, int index);
+static int lws_can_flush(lua_State *L, lws_lua_request_ctx_t *lctx);
+static int lws_yield_flush(lua_State *L, lws_lua_request_ctx_t *lctx);
+static int lws_written(lua_State *L, lws_lua_response_body_t *rb);
+static int lws_send_string(lua_State *L, lws_lua_response_body_t *rb, int index);
+static int lws_lua_response_body_write(lua_State *L);
+static int lws_lua_response_body_send(lua_State *L);
+static int lws_lua_response_body_reserve(lua_State *L);
+static int lws_lua_response_body_flush(lua_State *L);
+static int lws_lua_response_body_tostring(lua_State *L);
+static void lws_close_response_body(lua_State *L, lws_request_ctx_t *ctx, int index);
+
+/* request body */
+static lws_request_ctx_t *lws_check_request_body(lua_State *L, int index);
+static void lws_create_request_body(lua_State *L, lws_request_ctx_t *ctx);
+static void lws_map_request_body(lua_State *L, lws_request_ctx_t *ctx);
+static void lws_read_request_body(lua_State *L, lws_request_ctx_t *ctx);
+static int lws_lua_request_body_all(lua_State *L);
+static int lws_lua_request_body_view(lua_State *L);
+static int lws_lua_request_body_method(lua_State *L);
+static int lws_lua_request_body_tostring(lua_State *L);
+
+/* bytes */
+static lws_lua_bytes_t *lws_check_bytes(lua_State *L, int index);
+static int lws_lua_bytes_sub(lua_State *L);
+static int lws_lua_bytes_len(lua_State *L);
+static int lws_lua_bytes_tostring(lua_State *L);
 
 /* strict */
 static int lws_lua_strict_index(lua_State *L);
@@ -65,6 +107,25 @@ static int lws_lua_strict_index(lua_State *L);
 static luaL_Stream *lws_create_file(lua_State *L);
 static int lws_close_file(lua_State *L);
 
+/* job */
+static lws_job_t *lws_check_job(lua_State *L, int index);
+static int lws_push_job(lua_State *L, lws_job_t *job);
+static int lws_lua_job_done(lua_State *L);
+static int lws_lua_job_wait(lua_State *L);
+static int lws_lua_job_result(lua_State *L);
+static int lws_lua_job_tostring(lua_State *L);
+
+/* LRU cache */
+static lws_lua_lru_t *lws_check_lru(lua_State *L, int index);
+static void lws_lru_unref(void *value, void *data);
+static int lws_lua_lru_get(lua_State *L);
+static int lws_lua_lru_set(lua_State *L);
+static int lws_lua_lru_delete(lua_State *L);
+static int lws_lua_lru_clear(lua_State *L);
+static int lws_lua_lru_len(lua_State *L);
+static int lws_lua_lru_tostring(lua_State *L);
+static int lws_lua_lru_gc(lua_State *L);
+
 /* functions */
 static int lws_log(lua_State *L);
 static int lws_getvariable(lua_State *L);
@@ -72,16 +133,45 @@ static int lws_redirect(lua_State *L);
 static int lws_setcomplete(lua_State *L);
 static int lws_setclose(lua_State *L);
 static int lws_parseargs(lua_State *L);
+static void lws_get_subrequest(lua_State *L, int index, ngx_str_t *uri, ngx_str_t *args);
+static int lws_yield_subrequests(lua_State *L, int multi);
+static int lws_subrequest(lua_State *L);
+static int lws_subrequests(lua_State *L);
+static int lws_offload(lua_State *L);
+static int lws_lru(lua_State *L);
+static int lws_invalidate(lua_State *L);
+static int lws_respond(lua_State *L);
+static int lws_add_timer(lua_State *L, int repeat);
+static int lws_timer_every(lua_State *L);
+static int lws_timer_at(lua_State *L);
 #if LUA_VERSION_NUM < 502
 static int lws_pairs(lua_State *L);
 #endif
 
 /* run */
 static void lws_push_env(lws_lua_request_ctx_t *lctx);
+static int lws_push_subrequests(lws_lua_request_ctx_t *lctx);
+static int lws_push_job_handle(lws_lua_request_ctx_t *lctx);
+static int lws_push_flush_result(lws_lua_request_ctx_t *lctx);
+static void lws_close_response(lua_State *L, int index);
+static int lws_result(lws_lua_request_ctx_t *lctx);
+static void lws_push_chunks(lua_State *L);
+static void lws_push_chunk(lua_State *L, int chunks, ngx_str_t *filename, int env);
 static int lws_call(lws_lua_request_ctx_t *lctx, ngx_str_t *filename, lws_lua_chunk_e chunk);
+static int lws_resume(lws_lua_request_ctx_t *lctx, int nargs);
+static int lws_proceed(lws_lua_request_ctx_t *lctx, int result);
+static void lws_init_state(lua_State *L);
 
 
 static const char *lws_chunk_names[] = {"init", "pre", "main", "post"};
+static const char lws_join_chunk[] =
+	"local done, wait, result = ...\n"
+	"return function (job)\n"
+	"\tif not done(job) then\n"
+	"\t\twait(job)\n"
+	"\tend\n"
+	"\treturn result(job)\n"
+	"end\n";
 static const char *const lws_lua_log_levels[] = {
 	"emerg", "alert", "crit", "err", "warn", "notice", "info", "debug", NULL
 };
@@ -110,6 +200,31 @@ static inline int lws_rawget (lua_State *L, int index) {
 #endif
 }
 
+static inline int lws_rawgeti (lua_State *L, int index, lua_Integer i) {
+#if LUA_VERSION_NUM >= 503
+	return lua_rawgeti(L, index, i);
+#else
+	lua_rawgeti(L, index, i);
+	return lua_type(L, -1);
+#endif
+}
+
+static inline int lws_resume_thread (lua_State *T, lua_State *L, int nargs, int *nresults) {
+#if LUA_VERSION_NUM >= 504
+	return lua_resume(T, L, nargs, nresults);
+#else
+	int  status;
+
+#if LUA_VERSION_NUM >= 502
+	status = lua_resume(T, L, nargs);
+#else
+	status = lua_resume(T, nargs);
+#endif
+	*nresults = lua_gettop(T);
+	return status;
+#endif
+}
+
 #if LUA_VERSION_NUM < 502
 static lua_Integer lua_tointegerx (lua_State *L, int index, int *isnum) {
 	if (isnum) {
@@ -144,10 +259,11 @@ void *lws_testudata (lua_State *L, int index, const char *name) {
  * helpers
  */
 
-static void lws_strdup (lws_lua_request_ctx_t *lctx, ngx_str_t *dst, ngx_str_t *src) {
+static void lws_strdup (lua_State *L, lws_lua_request_ctx_t *lctx, ngx_str_t *dst,
+		ngx_str_t *src) {
 	dst->data = ngx_alloc(src->len, lctx->ctx->r->connection->log);
 	if (!dst->data) {
-		luaL_error(lctx->ctx->state->L, "failed to allocate string");
+		luaL_error(L, "failed to allocate string");
 	}
 	ngx_memcpy(dst->data, src->data, src->len);
 	dst->len = src->len;
@@ -242,6 +358,18 @@ static lws_lua_request_ctx_t *lws_get_lua_request_ctx (lua_State *L) {
 	return lctx;
 }
 
+static void lws_check_yield (lua_State *L, lws_lua_request_ctx_t *lctx) {
+	if (lctx->chunk == LWS_LC_INIT) {
+		luaL_error(L, "not allowed in %s chunk", lws_chunk_names[lctx->chunk]);
+	}
+	if (L != lctx->T) {
+		luaL_error(L, "not allowed in coroutine");
+	}
+	if (lctx->ctx->after_response) {
+		luaL_error(L, "not allowed after response");
+	}
+}
+
 static int lws_lua_request_ctx_tostring (lua_State *L) {
 	lws_lua_request_ctx_t  *lctx;
 
@@ -387,6 +515,9 @@ static int lws_lua_response_newindex (lua_State *L) {
 		if (ngx_strncmp(key.data, "status", 6) == 0) {
 			status = luaL_checkinteger(L, 3);
 			lctx = lws_get_lua_request_ctx(L);
+			if (lctx->ctx->streaming) {
+				return luaL_error(L, "response status is sent");
+			}
 			lctx->ctx->status = status;
 			return 0;
 		}
@@ -396,6 +527,507 @@ static int lws_lua_response_newindex (lua_State *L) {
 	return 0;
 }
 
+static int lws_lua_response_sendfile (lua_State *L) {
+	u_char                 *p;
+	ngx_str_t               path;
+	lua_Integer             offset, length;
+	lws_request_ctx_t      *ctx;
+	lws_lua_request_ctx_t  *lctx;
+
+	/* check context and arguments */
+	lctx = lws_get_lua_request_ctx(L);
+	ctx = lctx->ctx;
+	if (ctx->after_response || ctx->streaming) {
+		return luaL_error(L, "response already started");
+	}
+	path.data = (u_char *)luaL_checklstring(L, 1, &path.len);
+	luaL_argcheck(L, path.len > 0 && path.data[0] == '/', 1, "absolute path expected");
+	offset = luaL_optinteger(L, 2, 0);
+	luaL_argcheck(L, offset >= 0, 2, "bad offset");
+	length = luaL_optinteger(L, 3, -1);
+	luaL_argcheck(L, lua_isnoneornil(L, 3) || length >= 0, 3, "bad length");
+
+	/* record file; the event loop opens it when sending the response */
+	p = ngx_alloc(path.len + 1, ctx->r->connection->log);
+	if (!p) {
+		return luaL_error(L, "failed to allocate string");
+	}
+	ngx_memcpy(p, path.data, path.len);
+	p[path.len] = '\0';
+	ngx_free(ctx->sendfile.data);
+	ctx->sendfile.data = p;
+	ctx->sendfile.len = path.len;
+	ctx->sendfile_offset = offset;
+	ctx->sendfile_length = length;
+	return 0;
+}
+
+
+/*
+ * response body
+ */
+
+static lws_lua_response_body_t *lws_check_response_body (lua_State *L, int index) {
+	lws_lua_response_body_t  *rb;
+
+	rb = luaL_checkudata(L, index, LWS_RESPONSE_BODY);
+	if (rb->closed) {
+		luaL_error(L, "response body is closed");
+	}
+	return rb;
+}
+
+static int lws_can_flush (lua_State *L, lws_lua_request_ctx_t *lctx) {
+	return lctx->chunk != LWS_LC_INIT && L == lctx->T && !lctx->ctx->after_response
+			&& lctx->ctx->r == lctx->ctx->r->main;
+}
+
+static int lws_yield_flush (lua_State *L, lws_lua_request_ctx_t *lctx) {
+	lws_lua_table_t  *lt;
+
+	/* the first flush sends the headers, which become read-only */
+	if (!lctx->ctx->streaming) {
+		lua_getfield(L, LUA_REGISTRYINDEX, LWS_REQUEST_ENV);
+		lua_getfield(L, -1, "response");
+		if (lua_istable(L, -1)) {
+			lua_getfield(L, -1, "headers");
+			if ((lt = luaL_testudata(L, -1, LWS_TABLE))) {
+				lt->readonly = 1;
+			}
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 2);
+	}
+
+	/* yield to the event loop, which sends the response body and resumes */
+	lctx->ctx->yield = LWS_YIELD_FLUSH;
+	return lua_yield(L, 0);
+}
+
+static int lws_written (lua_State *L, lws_lua_response_body_t *rb) {
+	lws_loc_conf_t         *llcf;
+	lws_lua_request_ctx_t  *lctx;
+
+	/* flush at the configured size, where possible */
+	llcf = rb->ctx->state->llcf;
+	if (llcf->flush_size && rb->ctx->response_body.len >= llcf->flush_size) {
+		lctx = lws_get_lua_request_ctx(L);
+		if (lws_can_flush(L, lctx)) {
+			return lws_yield_flush(L, lctx);
+		}
+	}
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int lws_send_string (lua_State *L, lws_lua_response_body_t *rb, int index) {
+	size_t       len;
+	const char  *s;
+
+	/* copy short strings */
+	s = luaL_checklstring(L, index, &len);
+	if (len < LWS_BODY_REF_MIN) {
+		if (lws_body_write(&rb->ctx->response_body, (const u_char *)s, len) != 0) {
+			return luaL_error(L, "failed to write response body");
+		}
+		return 0;
+	}
+
+	/* anchor the string until the state is released, and reference it */
+	if (lws_getfield(L, LUA_REGISTRYINDEX, LWS_RESPONSE_ANCHORS) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, LWS_RESPONSE_ANCHORS);
+	}
+	lua_pushvalue(L, index);
+	lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+	lua_pop(L, 1);
+	rb->ctx->state->anchored = 1;
+	if (lws_body_ref(&rb->ctx->response_body, (const u_char *)s, len) != 0) {
+		return luaL_error(L, "failed to write response body");
+	}
+	return 0;
+}
+
+static int lws_lua_response_body_write (lua_State *L) {
+	int                       i, n;
+	size_t                    len;
+	const char               *s;
+	lws_lua_response_body_t  *rb;
+
+	rb = lws_check_response_body(L, 1);
+	n = lua_gettop(L);
+	for (i = 2; i <= n; i++) {
+		s = luaL_checklstring(L, i, &len);
+		if (lws_body_write(&rb->ctx->response_body, (const u_char *)s, len) != 0) {
+			return luaL_error(L, "failed to write response body");
+		}
+	}
+	return lws_written(L, rb);
+}
+
+static int lws_lua_response_body_send (lua_State *L) {
+	lws_lua_response_body_t  *rb;
+
+	rb = lws_check_response_body(L, 1);
+	lws_send_string(L, rb, 2);
+	return lws_written(L, rb);
+}
+
+static int lws_lua_response_body_reserve (lua_State *L) {
+	lua_Integer               n;
+	lws_lua_response_body_t  *rb;
+
+	rb = lws_check_response_body(L, 1);
+	n = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, n >= 0, 2, "bad size");
+	if (lws_body_reserve(&rb->ctx->response_body, (size_t)n) != 0) {
+		return luaL_error(L, "failed to reserve response body");
+	}
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int lws_lua_response_body_flush (lua_State *L) {
+	lws_lua_request_ctx_t  *lctx;
+
+	/* subrequest responses are sent by the parent request */
+	(void)lws_check_response_body(L, 1);
+	lctx = lws_get_lua_request_ctx(L);
+	if (lctx->ctx->r != lctx->ctx->r->main) {
+		lua_settop(L, 1);
+		return 1;
+	}
+	lws_check_yield(L, lctx);
+	return lws_yield_flush(L, lctx);
+}
+
+static int lws_lua_response_body_tostring (lua_State *L) {
+	lws_lua_response_body_t  *rb;
+
+	rb = luaL_checkudata(L, 1, LWS_RESPONSE_BODY);
+	lua_pushfstring(L, LWS_RESPONSE_BODY ": %p", rb->ctx);
+	return 1;
+}
+
+static void lws_close_response_body (lua_State *L, lws_request_ctx_t *ctx, int index) {
+	int                       rc;
+	luaL_Stream              *s;
+	lws_lua_response_body_t  *rb;
+
+	/* response body */
+	if ((rb = luaL_testudata(L, index, LWS_RESPONSE_BODY))) {
+		rb->closed = 1;
+		return;
+	}
+
+	/* file handle; closing writes buffered data to the response body */
+	s = luaL_testudata(L, index, LUA_FILEHANDLE);
+	if (!s || !ctx->response_file) {
+		return;
+	}
+	s->f = NULL;
+#if LUA_VERSION_NUM >= 502
+	s->closef = NULL;
+#endif
+	rc = fclose(ctx->response_file);
+	ctx->response_file = NULL;
+	if (rc != 0) {
+		luaL_error(L, "failed to write response body");
+	}
+}
+
+/*
+ * request body
+ */
+
+static lws_request_ctx_t *lws_check_request_body (lua_State *L, int index) {
+	lws_lua_request_ctx_t   *lctx;
+	lws_lua_request_body_t  *rb;
+
+	rb = luaL_checkudata(L, index, LWS_REQUEST_BODY);
+	lctx = lws_get_lua_request_ctx(L);
+	if (!rb->f || rb->f != lctx->ctx->request_body) {
+		luaL_argerror(L, index, "request body of current request expected");
+	}
+	return lctx->ctx;
+}
+
+static void lws_create_request_body (lua_State *L, lws_request_ctx_t *ctx) {
+	luaL_Stream             *s;
+	lws_lua_request_body_t  *rb;
+
+	/* the request body has its own metatable, and a file handle for the file methods */
+	rb = lua_newuserdata(L, sizeof(lws_lua_request_body_t));
+	rb->f = ctx->request_body;
+	luaL_setmetatable(L, LWS_REQUEST_BODY);
+	lua_getfield(L, LUA_REGISTRYINDEX, LWS_REQUEST_BODIES);
+	lua_pushvalue(L, -2);
+	s = lws_create_file(L);
+	s->f = ctx->request_body;
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+}
+
+static void lws_map_request_body (lua_State *L, lws_request_ctx_t *ctx) {
+	off_t                     size;
+	size_t                    len, n;
+	u_char                   *p;
+	ngx_fd_t                  fd;
+	ngx_chain_t              *cl;
+	ngx_file_info_t           fi;
+	ngx_http_request_body_t  *rb;
+
+	/* mapped? */
+	if (ctx->request_body_type != LWS_BD_NONE) {
+		return;
+	}
+
+	/* unbuffered or compressed request body */
+	if (ctx->stream || ctx->inflate) {
+		lws_read_request_body(L, ctx);
+		return;
+	}
+
+	/* temporary file */
+	rb = ctx->r->request_body;
+	if (rb && rb->temp_file) {
+		fd = rb->temp_file->file.fd;
+		if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+			luaL_error(L, "failed to stat request body");
+		}
+		size = ngx_file_size(&fi);
+		if (size > 0) {
+			p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p == MAP_FAILED) {
+				luaL_error(L, "failed to map request body");
+			}
+			ctx->request_body_data.data = p;
+			ctx->request_body_data.len = size;
+			ctx->request_body_type = LWS_BD_MMAP;
+			return;
+		}
+	} else if (rb) {
+		/* buffers; a single buffer is referenced */
+		len = 0;
+		n = 0;
+		for (cl = rb->bufs; cl; cl = cl->next) {
+			len += cl->buf->last - cl->buf->pos;
+			n++;
+		}
+		if (n == 1) {
+			ctx->request_body_data.data = rb->bufs->buf->pos;
+			ctx->request_body_data.len = len;
+			ctx->request_body_type = LWS_BD_REF;
+			return;
+		}
+		if (len > 0) {
+			p = ngx_alloc(len, ctx->r->connection->log);
+			if (!p) {
+				luaL_error(L, "failed to allocate request body");
+			}
+			ctx->request_body_data.data = p;
+			ctx->request_body_data.len = len;
+			ctx->request_body_type = LWS_BD_ALLOC;
+			for (cl = rb->bufs; cl; cl = cl->next) {
+				p = ngx_cpymem(p, cl->buf->pos, cl->buf->last - cl->buf->pos);
+			}
+			return;
+		}
+	}
+
+	/* empty */
+	ctx->request_body_data.data = (u_char *)"";
+	ctx->request_body_data.len = 0;
+	ctx->request_body_type = LWS_BD_REF;
+}
+
+static void lws_read_request_body (lua_State *L, lws_request_ctx_t *ctx) {
+	off_t    content_length;
+	size_t   len, size, n;
+	u_char  *data, *p;
+
+	/* data read from the stream is not retained */
+	if ((ctx->stream && ctx->stream->read > 0) || (ctx->inflate && ctx->inflate->len > 0)) {
+		luaL_error(L, "request body is partially read");
+	}
+
+	/* read to the end; the content length, if present and not compressed, sizes the buffer */
+	content_length = !ctx->inflate ? ctx->r->headers_in.content_length_n : -1;
+	size = content_length > 0 ? (size_t)content_length : LWS_BODY_BLOCK_SIZE;
+	data = NULL;
+	len = 0;
+	do {
+		if (!data || len == size) {
+			if (data) {
+				size *= 2;
+			}
+			p = realloc(data, size);
+			if (!p) {
+				free(data);
+				luaL_error(L, "failed to allocate request body");
+			}
+			data = p;
+		}
+		n = fread(data + len, 1, size - len, ctx->request_body);
+		len += n;
+	} while (n > 0);
+	if (ferror(ctx->request_body)) {
+		free(data);
+		luaL_error(L, "failed to read request body");
+	}
+	ctx->request_body_data.data = data;
+	ctx->request_body_data.len = len;
+	ctx->request_body_type = LWS_BD_ALLOC;
+}
+
+static int lws_lua_request_body_all (lua_State *L) {
+	off_t               off;
+	size_t              n;
+	luaL_Buffer         B;
+	lws_request_ctx_t  *ctx;
+
+	/* buffered request bodies are mapped; the string starts at the read position */
+	ctx = lws_check_request_body(L, 1);
+	if (!ctx->stream && !ctx->inflate) {
+		off = ftello(ctx->request_body);
+		if (off == -1) {
+			return luaL_error(L, "failed to get request body position");
+		}
+		lws_map_request_body(L, ctx);
+		if ((size_t)off > ctx->request_body_data.len) {
+			off = ctx->request_body_data.len;
+		}
+		lua_pushlstring(L, (const char *)ctx->request_body_data.data + off,
+				ctx->request_body_data.len - off);
+		if (fseeko(ctx->request_body, 0, SEEK_END) == -1) {
+			return luaL_error(L, "failed to set request body position");
+		}
+		return 1;
+	}
+
+	/* unread streams are kept in memory for view; otherwise, the rest is read */
+	if (ctx->request_body_type == LWS_BD_NONE && !(ctx->stream && ctx->stream->read > 0)
+			&& !(ctx->inflate && ctx->inflate->len > 0)) {
+		lws_read_request_body(L, ctx);
+		lua_pushlstring(L, (const char *)ctx->request_body_data.data,
+				ctx->request_body_data.len);
+		return 1;
+	}
+	luaL_buffinit(L, &B);
+	do {
+		n = fread(luaL_prepbuffer(&B), 1, LUAL_BUFFERSIZE, ctx->request_body);
+		luaL_addsize(&B, n);
+	} while (n > 0);
+	if (ferror(ctx->request_body)) {
+		return luaL_error(L, "failed to read request body");
+	}
+	luaL_pushresult(&B);
+	return 1;
+}
+
+static int lws_lua_request_body_view (lua_State *L) {
+	lws_lua_bytes_t    *bytes;
+	lws_request_ctx_t  *ctx;
+
+	/* the view is created once per request */
+	ctx = lws_check_request_body(L, 1);
+	lua_getfield(L, LUA_REGISTRYINDEX, LWS_REQUEST_BODY_VIEW);
+	if (luaL_testudata(L, -1, LWS_BYTES)) {
+		return 1;
+	}
+	lua_pop(L, 1);
+	lws_map_request_body(L, ctx);
+	bytes = lua_newuserdata(L, sizeof(lws_lua_bytes_t));
+	bytes->data = ctx->request_body_data.data;
+	bytes->len = ctx->request_body_data.len;
+	luaL_setmetatable(L, LWS_BYTES);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, LUA_REGISTRYINDEX, LWS_REQUEST_BODY_VIEW);
+	return 1;
+}
+
+static int lws_lua_request_body_method (lua_State *L) {
+	/* call the file method with the file handle of the request body */
+	lws_check_request_body(L, 1);
+	lua_getfield(L, LUA_REGISTRYINDEX, LWS_REQUEST_BODIES);
+	lua_pushvalue(L, 1);
+	lua_rawget(L, -2);
+	lua_replace(L, 1);
+	lua_pop(L, 1);
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_insert(L, 1);
+	lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+	return lua_gettop(L);
+}
+
+static int lws_lua_request_body_tostring (lua_State *L) {
+	lws_lua_request_body_t  *rb;
+
+	rb = luaL_checkudata(L, 1, LWS_REQUEST_BODY);
+	lua_pushfstring(L, LWS_REQUEST_BODY ": %p", rb);
+	return 1;
+}
+
+
+/*
+ * bytes
+ */
+
+static lws_lua_bytes_t *lws_check_bytes (lua_State *L, int index) {
+	lws_lua_bytes_t  *bytes;
+
+	bytes = luaL_checkudata(L, index, LWS_BYTES);
+	if (!bytes->data) {
+		luaL_error(L, "byte view is released");
+	}
+	return bytes;
+}
+
+static int lws_lua_bytes_sub (lua_State *L) {
+	lua_Integer       i, j, len;
+	lws_lua_bytes_t  *bytes;
+
+	/* same indexing as string.sub */
+	bytes = lws_check_bytes(L, 1);
+	len = (lua_Integer)bytes->len;
+	i = luaL_optinteger(L, 2, 1);
+	j = luaL_optinteger(L, 3, -1);
+	if (i < 0) {
+		i = ngx_max(len + i + 1, 1);
+	} else if (i == 0) {
+		i = 1;
+	}
+	if (j < 0) {
+		j = len + j + 1;
+	} else if (j > len) {
+		j = len;
+	}
+	if (i > j) {
+		lua_pushliteral(L, "");
+	} else {
+		lua_pushlstring(L, (const char *)bytes->data + i - 1, j - i + 1);
+	}
+	return 1;
+}
+
+static int lws_lua_bytes_len (lua_State *L) {
+	lws_lua_bytes_t  *bytes;
+
+	bytes = lws_check_bytes(L, 1);
+	lua_pushinteger(L, bytes->len);
+	return 1;
+}
+
+static int lws_lua_bytes_tostring (lua_State *L) {
+	lws_lua_bytes_t  *bytes;
+
+	bytes = luaL_checkudata(L, 1, LWS_BYTES);
+	lua_pushfstring(L, LWS_BYTES ": %p", bytes->data);
+	return 1;
+}
+
 
 /*
  * strict
@@ -437,87 +1069,354 @@ static int lws_close_file (lua_State *L) {
 
 
 /*
- * functions
+ * job
  */
 
-static int lws_log (lua_State *L) {
-	int                     index;
-	ngx_str_t               msg;
-	ngx_uint_t              level;
-	lws_lua_request_ctx_t  *lctx;
+static lws_job_t *lws_check_job (lua_State *L, int index) {
+	lws_lua_job_t  *lj;
 
-	index = 1;
-	level = lua_gettop(L) > 1 ? luaL_checkoption(L, index++, "err", lws_lua_log_levels) + 1
-			: NGX_LOG_ERR;
-	msg.data = (u_char *)luaL_checklstring(L, index, &msg.len);
-	lctx = lws_get_lua_request_ctx(L);
-	if (level != NGX_LOG_DEBUG) {
-		ngx_log_error(level, lctx->ctx->r->connection->log, 0, "[LWS] %V", &msg);
-	} else {
-		level |= NGX_LOG_DEBUG_HTTP;
-		ngx_log_debug(level, lctx->ctx->r->connection->log, 0, "[LWS] %V", &msg);
+	lj = luaL_checkudata(L, index, LWS_JOB);
+	if (!lj->job) {
+		luaL_error(L, "job of completed request");
 	}
-	return 0;
+	return lj->job;
 }
 
-static int lws_getvariable (lua_State *L) {
-	ngx_str_t               key, *value;
-	lws_lua_request_ctx_t  *lctx;
+static int lws_push_job (lua_State *L, lws_job_t *job) {
+	/* get function */
+	lua_getglobal(L, "require");
+	lua_pushlstring(L, (const char *)job->module.data, job->module.len);
+	lua_call(L, 1, 1);  /* [module] */
+	if (!lua_istable(L, -1)) {
+		luaL_error(L, "bad job module (table expected, got %s)", luaL_typename(L, -1));
+	}
+	lua_pushlstring(L, (const char *)job->function.data, job->function.len);
+	lua_pushvalue(L, -1);
+	lua_gettable(L, -3);  /* [module, name, function] */
+	if (!lua_isfunction(L, -1)) {
+		luaL_error(L, "bad job function %s (function expected, got %s)", lua_tostring(L, -2),
+				luaL_typename(L, -1));
+	}
+	lua_replace(L, -3);
+	lua_pop(L, 1);  /* [function] */
 
-	key.data = (u_char *)luaL_checklstring(L, 1, &key.len);
-	lctx = lws_get_lua_request_ctx(L);
-	value = lws_table_get(lctx->ctx->variables, &key);
-	if (value) {
-		lua_pushlstring(L, (const char *)value->data, value->len);
-	} else {
-		lua_pushnil(L);
+	/* push arguments */
+	return lws_decode_values(L, &job->args);  /* [function, args] */
+}
+
+static int lws_lua_job_done (lua_State *L) {
+	lws_job_t  *job;
+
+	job = lws_check_job(L, 1);
+	if (job->local) {
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+	if (job->done) {
+		ngx_memory_barrier();  /* results are read after observing done */
+		lua_pushboolean(L, 1);
+		return 1;
 	}
+	lua_pushboolean(L, 0);
 	return 1;
 }
 
-static int lws_redirect (lua_State *L) {
-	ngx_str_t               redirect, args;
+static int lws_lua_job_wait (lua_State *L) {
+	lws_job_t              *job;
 	lws_lua_request_ctx_t  *lctx;
 
+	/* yield to the event loop, which resumes when the job is done */
+	job = lws_check_job(L, 1);
 	lctx = lws_get_lua_request_ctx(L);
-	if (lctx->chunk != LWS_LC_PRE && lctx->chunk != LWS_LC_MAIN) {
-		return luaL_error(L, "not allowed in %s chunk", lws_chunk_names[lctx->chunk]);
+	lws_check_yield(L, lctx);
+	lctx->ctx->yield = LWS_YIELD_JOIN;
+	lctx->ctx->job = job;
+	return lua_yield(L, 0);
+}
+
+static int lws_lua_job_result (lua_State *L) {
+	int         top, n;
+	lws_job_t  *job;
+
+	/* run local job in the request thread */
+	job = lws_check_job(L, 1);
+	if (job->local && !job->done) {
+		top = lua_gettop(L);
+		n = lws_push_job(L, job);
+		lua_call(L, n, LUA_MULTRET);
+		n = lua_gettop(L) - top;
+		lws_encode_values(L, top + 1, n, &job->results);
+		job->done = 1;
+		return n;
 	}
-	redirect.data = (u_char *)luaL_checklstring(L, 1, &redirect.len);
-	luaL_argcheck(L, redirect.len > (redirect.data[0] != '@' ? 0 : 1), 1, "empty path or name");
-	if (redirect.data[0] != '@') {
-		args.data = (u_char *)luaL_optlstring(L, 2, NULL, &args.len);
-		if (args.data) {
-			lws_strdup(lctx, &lctx->ctx->redirect_args, &args);
+
+	/* error or results */
+	if (job->failed) {
+		if (job->error.len) {
+			lua_pushlstring(L, (const char *)job->error.data, job->error.len);
+		} else {
+			lua_pushliteral(L, "job failed");
 		}
+		return lua_error(L);
 	}
-	lws_strdup(lctx, &lctx->ctx->redirect, &redirect);
-	if (lctx->chunk == LWS_LC_PRE) {
-		lctx->complete = 1;
-	}
-	return 0;
+	return lws_decode_values(L, &job->results);
 }
 
-static int lws_setcomplete (lua_State *L) {
-	lws_lua_request_ctx_t  *lctx;
+static int lws_lua_job_tostring (lua_State *L) {
+	lws_lua_job_t  *lj;
 
-	lctx = lws_get_lua_request_ctx(L);
-	if (lctx->chunk != LWS_LC_PRE) {
-		return luaL_error(L, "not allowed in %s chunk", lws_chunk_names[lctx->chunk]);
-	}
-	lctx->complete = 1;
-	return 0;
+	lj = luaL_checkudata(L, 1, LWS_JOB);
+	lua_pushfstring(L, LWS_JOB ": %p", lj->job);
+	return 1;
 }
 
-static int lws_setclose (lua_State *L) {
-	lws_lua_request_ctx_t  *lctx;
 
-	lctx = lws_get_lua_request_ctx(L);
-	lctx->ctx->state->close = 1;
-	return 0;
-}
+/*
+ * LRU cache
+ */
 
-static int lws_parseargs (lua_State *L) {
+static lws_lua_lru_t *lws_check_lru (lua_State *L, int index) {
+	lws_lua_lru_t  *lru;
+
+	lru = luaL_checkudata(L, index, LWS_LRU);
+	if (!lru->t) {
+		luaL_error(L, "LRU cache is closed");
+	}
+	return lru;
+}
+
+static void lws_lru_unref (void *value, void *data) {
+	lws_lua_lru_t        *lru;
+	lws_lua_lru_entry_t  *entry;
+
+	/* called from table operations of the Lua state in lru->L */
+	lru = data;
+	entry = value;
+	luaL_unref(lru->L, LUA_REGISTRYINDEX, entry->ref);
+	ngx_free(entry);
+}
+
+static int lws_lua_lru_get (lua_State *L) {
+	ngx_str_t             key;
+	lws_lua_lru_t        *lru;
+	lws_lua_lru_entry_t  *entry;
+
+	lru = lws_check_lru(L, 1);
+	key.data = (u_char *)luaL_checklstring(L, 2, &key.len);
+	entry = lws_table_get(lru->t, &key);
+
+	/* a tagged entry is checked once per invalidation generation */
+	if (entry && entry->version && entry->generation != lru->state->generation) {
+		if (*entry->version != entry->tagged) {
+			lru->L = L;
+			lws_table_set(lru->t, &key, NULL);
+			entry = NULL;
+		} else {
+			entry->generation = lru->state->generation;
+		}
+	}
+
+	if (!entry) {
+		/* an expired entry is removed */
+		if (lru->t->timed) {
+			lru->L = L;
+			lws_table_set(lru->t, &key, NULL);
+		}
+		if (lru->stats) {
+			ngx_atomic_fetch_add(&lru->stats->misses, 1);
+		}
+		lua_pushnil(L);
+		return 1;
+	}
+	if (lru->stats) {
+		ngx_atomic_fetch_add(&lru->stats->hits, 1);
+	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, entry->ref);
+	return 1;
+}
+
+static int lws_lua_lru_set (lua_State *L) {
+	size_t                evicted;
+	ngx_str_t             key, tag;
+	lws_lua_lru_t        *lru;
+	lws_lua_lru_entry_t  *entry;
+
+	/* nil deletes */
+	lru = lws_check_lru(L, 1);
+	key.data = (u_char *)luaL_checklstring(L, 2, &key.len);
+	luaL_checkany(L, 3);
+	tag.data = (u_char *)luaL_optlstring(L, 4, NULL, &tag.len);
+	lru->L = L;
+	if (lua_isnil(L, 3)) {
+		lws_table_set(lru->t, &key, NULL);
+		return 0;
+	}
+
+	/* create entry; the tag version is recorded for invalidation */
+	entry = ngx_alloc(sizeof(lws_lua_lru_entry_t), ngx_cycle->log);
+	if (!entry) {
+		return luaL_error(L, "failed to allocate entry");
+	}
+	if (tag.data) {
+		entry->version = lws_tag_version(lru->state->lmcf->tags, &tag);
+		entry->tagged = *entry->version;
+		entry->generation = lru->state->generation;
+	} else {
+		entry->version = NULL;
+	}
+
+	/* the value is referenced from the registry; replaced and evicted values are released */
+	lua_pushvalue(L, 3);
+	entry->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	evicted = lru->t->evicted;
+	if (lws_table_set(lru->t, &key, entry) != 0) {
+		luaL_unref(L, LUA_REGISTRYINDEX, entry->ref);
+		ngx_free(entry);
+		return luaL_error(L, "failed to set value");
+	}
+	if (lru->stats && lru->t->evicted > evicted) {
+		ngx_atomic_fetch_add(&lru->stats->evictions, lru->t->evicted - evicted);
+	}
+	return 0;
+}
+
+static int lws_lua_lru_delete (lua_State *L) {
+	ngx_str_t       key;
+	lws_lua_lru_t  *lru;
+
+	lru = lws_check_lru(L, 1);
+	key.data = (u_char *)luaL_checklstring(L, 2, &key.len);
+	lru->L = L;
+	lws_table_set(lru->t, &key, NULL);
+	return 0;
+}
+
+static int lws_lua_lru_clear (lua_State *L) {
+	lws_lua_lru_t  *lru;
+
+	lru = lws_check_lru(L, 1);
+	lru->L = L;
+	lws_table_clear(lru->t);
+	return 0;
+}
+
+static int lws_lua_lru_len (lua_State *L) {
+	lws_lua_lru_t  *lru;
+
+	lru = lws_check_lru(L, 1);
+	lua_pushinteger(L, lru->t->count);
+	return 1;
+}
+
+static int lws_lua_lru_tostring (lua_State *L) {
+	lws_lua_lru_t  *lru;
+
+	lru = luaL_checkudata(L, 1, LWS_LRU);
+	lua_pushfstring(L, LWS_LRU ": %p", lru->t);
+	return 1;
+}
+
+static int lws_lua_lru_gc (lua_State *L) {
+	lws_lua_lru_t  *lru;
+
+	lru = luaL_checkudata(L, 1, LWS_LRU);
+	if (lru->t) {
+		lru->L = L;
+		lws_table_free(lru->t);
+		lru->t = NULL;
+	}
+	return 0;
+}
+
+
+/*
+ * functions
+ */
+
+static int lws_log (lua_State *L) {
+	int                     index;
+	ngx_str_t               msg;
+	ngx_log_t              *log;
+	ngx_uint_t              level;
+	lws_lua_request_ctx_t  *lctx;
+
+	index = 1;
+	level = lua_gettop(L) > 1 ? luaL_checkoption(L, index++, "err", lws_lua_log_levels) + 1
+			: NGX_LOG_ERR;
+	msg.data = (u_char *)luaL_checklstring(L, index, &msg.len);
+
+	/* outside of requests, such as in jobs, log with the cycle log */
+	lua_getfield(L, LUA_REGISTRYINDEX, LWS_REQUEST_CTX_CURRENT);
+	lctx = luaL_testudata(L, -1, LWS_REQUEST_CTX);
+	lua_pop(L, 1);
+	log = lctx ? lctx->ctx->r->connection->log : ngx_cycle->log;
+	if (level != NGX_LOG_DEBUG) {
+		ngx_log_error(level, log, 0, "[LWS] %V", &msg);
+	} else {
+		level |= NGX_LOG_DEBUG_HTTP;
+		ngx_log_debug(level, log, 0, "[LWS] %V", &msg);
+	}
+	return 0;
+}
+
+static int lws_getvariable (lua_State *L) {
+	ngx_str_t               key, *value;
+	lws_lua_request_ctx_t  *lctx;
+
+	key.data = (u_char *)luaL_checklstring(L, 1, &key.len);
+	lctx = lws_get_lua_request_ctx(L);
+	value = lctx->ctx->variables ? lws_table_get(lctx->ctx->variables, &key) : NULL;
+	if (value) {
+		lua_pushlstring(L, (const char *)value->data, value->len);
+	} else {
+		lua_pushnil(L);
+	}
+	return 1;
+}
+
+static int lws_redirect (lua_State *L) {
+	ngx_str_t               redirect, args;
+	lws_lua_request_ctx_t  *lctx;
+
+	lctx = lws_get_lua_request_ctx(L);
+	if (lctx->chunk != LWS_LC_PRE && lctx->chunk != LWS_LC_MAIN) {
+		return luaL_error(L, "not allowed in %s chunk", lws_chunk_names[lctx->chunk]);
+	}
+	redirect.data = (u_char *)luaL_checklstring(L, 1, &redirect.len);
+	luaL_argcheck(L, redirect.len > (redirect.data[0] != '@' ? 0 : 1), 1, "empty path or name");
+	if (redirect.data[0] != '@') {
+		args.data = (u_char *)luaL_optlstring(L, 2, NULL, &args.len);
+		if (args.data) {
+			lws_strdup(L, lctx, &lctx->ctx->redirect_args, &args);
+		}
+	}
+	lws_strdup(L, lctx, &lctx->ctx->redirect, &redirect);
+	if (lctx->chunk == LWS_LC_PRE) {
+		lctx->complete = 1;
+	}
+	return 0;
+}
+
+static int lws_setcomplete (lua_State *L) {
+	lws_lua_request_ctx_t  *lctx;
+
+	lctx = lws_get_lua_request_ctx(L);
+	if (lctx->chunk != LWS_LC_PRE) {
+		return luaL_error(L, "not allowed in %s chunk", lws_chunk_names[lctx->chunk]);
+	}
+	lctx->complete = 1;
+	return 0;
+}
+
+static int lws_setclose (lua_State *L) {
+	lws_lua_request_ctx_t  *lctx;
+
+	lctx = lws_get_lua_request_ctx(L);
+	lctx->ctx->state->close = 1;
+	return 0;
+}
+
+static int lws_parseargs (lua_State *L) {
 	int          nrec, state;
 	size_t       n;
 	u_char      *start, *pos, *last, *u_start, *u_pos;
@@ -590,8 +1489,297 @@ static int lws_parseargs (lua_State *L) {
 	return 1;
 }
 
+static void lws_get_subrequest (lua_State *L, int index, ngx_str_t *uri, ngx_str_t *args) {
+	/* URI */
+	if (lua_type(L, index) != LUA_TSTRING) {
+		luaL_error(L, "bad subrequest URI (string expected, got %s)",
+				luaL_typename(L, index));
+	}
+	uri->data = (u_char *)lua_tolstring(L, index, &uri->len);
+	if (uri->len == 0 || uri->data[0] != '/') {
+		luaL_error(L, "bad subrequest URI (path expected)");
+	}
+
+	/* options */
+	args->len = 0;
+	if (lua_isnoneornil(L, index + 1)) {
+		return;
+	}
+	if (!lua_istable(L, index + 1)) {
+		luaL_error(L, "bad subrequest options (table expected, got %s)",
+				luaL_typename(L, index + 1));
+	}
+	lua_pushliteral(L, "args");
+	switch (lws_rawget(L, index + 1)) {
+	case LUA_TNIL:
+		break;
+
+	case LUA_TSTRING:
+		args->data = (u_char *)lua_tolstring(L, -1, &args->len);
+		break;  /* string remains referenced by the options table */
+
+	default:
+		luaL_error(L, "bad subrequest args (string expected, got %s)", luaL_typename(L, -1));
+	}
+	lua_pop(L, 1);
+}
+
+static int lws_yield_subrequests (lua_State *L, int multi) {
+	int                     index, pass;
+	size_t                  i, n, len;
+	u_char                 *p;
+	ngx_str_t               uri, args;
+	lws_subrequest_t       *sr;
+	lws_lua_request_ctx_t  *lctx;
+
+	/* check context */
+	lctx = lws_get_lua_request_ctx(L);
+	lws_check_yield(L, lctx);
+
+	/* check arguments, and copy them in a second pass */
+	if (multi) {
+		luaL_checktype(L, 1, LUA_TTABLE);
+		n = lua_rawlen(L, 1);
+		luaL_argcheck(L, n > 0, 1, "no subrequests");
+	} else {
+		n = 1;
+	}
+	sr = NULL;
+	p = NULL;
+	len = 0;
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < n; i++) {
+			if (multi) {
+				if (lws_rawgeti(L, 1, i + 1) != LUA_TTABLE) {
+					return luaL_error(L, "bad subrequest #%d (table expected, got %s)",
+							(int)i + 1, luaL_typename(L, -1));
+				}
+				lua_rawgeti(L, -1, 1);
+				lua_rawgeti(L, -2, 2);
+				index = lua_gettop(L) - 1;
+			} else {
+				index = 1;
+			}
+			lws_get_subrequest(L, index, &uri, &args);
+			if (pass == 0) {
+				len += uri.len + args.len;
+			} else {
+				sr[i].uri.data = p;
+				sr[i].uri.len = uri.len;
+				p = ngx_cpymem(p, uri.data, uri.len);
+				sr[i].args.data = p;
+				sr[i].args.len = args.len;
+				p = ngx_cpymem(p, args.data, args.len);
+			}
+			if (multi) {
+				lua_pop(L, 3);
+			}
+		}
+		if (pass == 0) {
+			sr = ngx_alloc(n * sizeof(lws_subrequest_t) + len, lctx->ctx->r->connection->log);
+			if (!sr) {
+				return luaL_error(L, "failed to allocate subrequests");
+			}
+			ngx_memzero(sr, n * sizeof(lws_subrequest_t));
+			p = (u_char *)&sr[n];
+		}
+	}
+
+	/* yield to the event loop, which performs the subrequests and resumes */
+	lctx->ctx->subrequests = sr;
+	lctx->ctx->subrequests_n = n;
+	lctx->ctx->yield = LWS_YIELD_SUBREQUESTS;
+	lctx->multi = multi;
+	return lua_yield(L, 0);
+}
+
+static int lws_subrequest (lua_State *L) {
+	return lws_yield_subrequests(L, 0);
+}
+
+static int lws_subrequests (lua_State *L) {
+	return lws_yield_subrequests(L, 1);
+}
+
+static int lws_offload (lua_State *L) {
+	ngx_str_t               module, function;
+	lws_job_t              *job;
+	lws_lua_job_t          *lj;
+	lws_lua_request_ctx_t  *lctx;
+
+	/* check context and arguments */
+	lctx = lws_get_lua_request_ctx(L);
+	lws_check_yield(L, lctx);
+	module.data = (u_char *)luaL_checklstring(L, 1, &module.len);
+	function.data = (u_char *)luaL_checklstring(L, 2, &function.len);
+
+	/* create job; the request frees it */
+	job = lws_create_job(&module, &function, lctx->ctx->r->connection->log);
+	if (!job) {
+		return luaL_error(L, "failed to allocate job");
+	}
+	job->ctx = lctx->ctx;
+	job->next = lctx->ctx->jobs;
+	lctx->ctx->jobs = job;
+	lws_encode_values(L, 3, lua_gettop(L) - 2, &job->args);
+
+	/* register handle with the request */
+	lj = lua_newuserdata(L, sizeof(lws_lua_job_t));
+	lj->job = job;
+	luaL_setmetatable(L, LWS_JOB);
+	if (lws_getfield(L, LUA_REGISTRYINDEX, LWS_REQUEST_JOBS) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, LWS_REQUEST_JOBS);
+	}
+	lua_pushvalue(L, -2);
+	lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+	lua_pop(L, 1);
+
+	/* yield to the event loop, which starts the job and resumes with the handle */
+	lctx->ctx->yield = LWS_YIELD_OFFLOAD;
+	lctx->ctx->job = job;
+	return lua_yield(L, 0);
+}
+
+static int lws_respond (lua_State *L) {
+	size_t                    len;
+	const char               *data;
+	luaL_Stream              *s;
+	lws_lua_response_body_t  *rb;
+
+	/* send to the response body of the current request; file handles copy */
+	data = luaL_checklstring(L, 1, &len);
+	lua_getfield(L, LUA_REGISTRYINDEX, LWS_RESPONSE_CURRENT);
+	if ((s = luaL_testudata(L, -1, LUA_FILEHANDLE))) {
+		if (!s->f) {
+			return luaL_error(L, "response body is closed");
+		}
+		if (fwrite(data, 1, len, s->f) != len) {
+			return luaL_error(L, "failed to write response body");
+		}
+		return 0;
+	}
+	if (!luaL_testudata(L, -1, LWS_RESPONSE_BODY)) {
+		return luaL_error(L, "no response body");
+	}
+	rb = lws_check_response_body(L, -1);
+	lws_send_string(L, rb, 1);
+	return 0;
+}
+
+static int lws_add_timer (lua_State *L, int repeat) {
+	lua_Number              seconds;
+	lws_state_t            *state;
+	lws_timer_t            *timers, *timer;
+
+	/* check context and arguments; the init chunk runs in requests, jobs, and timers */
+	lua_getfield(L, LUA_REGISTRYINDEX, LWS_STATE);
+	state = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (state->init) {
+		return luaL_error(L, "not allowed outside init chunk");
+	}
+	seconds = luaL_checknumber(L, 1);
+	luaL_argcheck(L, repeat ? seconds > 0 : seconds >= 0, 1, repeat ? "bad interval"
+			: "bad delay");
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+
+	/* store function */
+	if (lws_getfield(L, LUA_REGISTRYINDEX, LWS_TIMERS) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, LWS_TIMERS);
+	}
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, -2, state->timers_n + 1);
+	lua_pop(L, 1);
+
+	/* add timer; the event loop starts the timers of the first initialized state */
+	timers = realloc(state->timers, (state->timers_n + 1) * sizeof(lws_timer_t));
+	if (!timers) {
+		return luaL_error(L, "failed to allocate timer");
+	}
+	state->timers = timers;
+	timer = &timers[state->timers_n++];
+	ngx_memzero(timer, sizeof(lws_timer_t));
+	timer->index = state->timers_n;
+	timer->delay = (ngx_msec_t)(seconds * 1000);
+	timer->interval = repeat ? timer->delay : 0;
+	return 0;
+}
+
+static int lws_timer_every (lua_State *L) {
+	return lws_add_timer(L, 1);
+}
+
+static int lws_timer_at (lua_State *L) {
+	return lws_add_timer(L, 0);
+}
+
+static int lws_lru (lua_State *L) {
+	ngx_str_t       key;
+	lua_Integer     cap, ttl;
+	lws_lua_lru_t  *lru;
+
+	/* check arguments; the key defaults to the creation site */
+	cap = luaL_checkinteger(L, 1);
+	luaL_argcheck(L, cap > 0, 1, "positive integer expected");
+	ttl = luaL_optinteger(L, 2, 0);
+	luaL_argcheck(L, ttl >= 0, 2, "non-negative integer expected");
+	if (lua_isnoneornil(L, 3)) {
+		luaL_where(L, 1);
+	} else {
+		luaL_checkstring(L, 3);
+		lua_pushvalue(L, 3);
+	}
+	key.data = (u_char *)lua_tolstring(L, -1, &key.len);
+	if (key.len > 0 && key.data[key.len - 1] == ':') {
+		key.len--;
+	}
+
+	/* create */
+	lru = lua_newuserdata(L, sizeof(lws_lua_lru_t));
+	ngx_memzero(lru, sizeof(lws_lua_lru_t));
+	luaL_setmetatable(L, LWS_LRU);
+	lua_getfield(L, LUA_REGISTRYINDEX, LWS_STATE);
+	lru->state = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	lru->t = lws_table_create(ngx_min((size_t)cap, 64), ngx_cycle->log);
+	if (!lru->t) {
+		return luaL_error(L, "failed to allocate LRU cache");
+	}
+	lws_table_set_dup(lru->t, 1);
+	lws_table_set_free_handler(lru->t, lws_lru_unref, lru);
+	lws_table_set_cap(lru->t, cap);
+	if (ttl > 0) {
+		lws_table_set_timeout(lru->t, ttl);
+	}
+	lru->stats = lws_monitor_lru(&key, ngx_cycle->log);
+	return 1;
+}
+
+static int lws_invalidate (lua_State *L) {
+	ngx_str_t     tag;
+	lws_state_t  *state;
+
+	/* the generation is incremented after the version; readers check in reverse order */
+	tag.data = (u_char *)luaL_checklstring(L, 1, &tag.len);
+	lua_getfield(L, LUA_REGISTRYINDEX, LWS_STATE);
+	state = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	(void)ngx_atomic_fetch_add(lws_tag_version(state->lmcf->tags, &tag), 1);
+	state->generation = ngx_atomic_fetch_add(&state->lmcf->tags->generation, 1) + 1;
+	return 0;
+}
+
 #if LUA_VERSION_NUM < 502
 static int lws_pairs (lua_State *L) {
+	if (luaL_testudata(L, 1, LWS_FROZEN)) {
+		return lws_frozen_pairs(L);
+	}
 	(void)luaL_checkudata(L, 1, LWS_TABLE);
 	lua_pushcfunction(L, lws_lua_table_next);
 	lua_pushvalue(L, 1);
@@ -603,6 +1791,11 @@ static int lws_pairs (lua_State *L) {
 int lws_open_lws (lua_State *L) {
 	int                 i;
 	lws_http_status_t  *status;
+	static luaL_Reg     lws_lua_timer_functions[] = {
+		{"every", lws_timer_every},
+		{"at", lws_timer_at},
+		{NULL, NULL}
+	};
 	static luaL_Reg     lws_lua_functions[] = {
 		{"log", lws_log},
 		{"getvariable", lws_getvariable},
@@ -610,6 +1803,12 @@ int lws_open_lws (lua_State *L) {
 		{"setcomplete", lws_setcomplete},
 		{"setclose", lws_setclose},
 		{"parseargs", lws_parseargs},
+		{"subrequest", lws_subrequest},
+		{"subrequests", lws_subrequests},
+		{"offload", lws_offload},
+		{"lru", lws_lru},
+		{"invalidate", lws_invalidate},
+		{"respond", lws_respond},
 #if LUA_VERSION_NUM < 502
 		{"pairs", lws_pairs},
 #endif
@@ -624,6 +1823,30 @@ int lws_open_lws (lua_State *L) {
 	luaL_register(L, luaL_checkstring(L, 1), lws_lua_functions);
 #endif
 
+	/* timer */
+	lua_createtable(L, 0, 2);
+	for (i = 0; lws_lua_timer_functions[i].name; i++) {
+		lua_pushcfunction(L, lws_lua_timer_functions[i].func);
+		lua_setfield(L, -2, lws_lua_timer_functions[i].name);
+	}
+	lua_setfield(L, -2, "timer");
+
+	/* shared */
+	lws_open_shared(L);
+	lua_setfield(L, -2, "shared");
+
+	/* local cache */
+	lws_open_local(L);
+	lua_setfield(L, -2, "localcache");
+
+	/* mapped files */
+	lws_open_mmap(L);
+	lua_setfield(L, -2, "mmap");
+
+	/* frozen tables */
+	lws_open_frozen(L);
+	lua_setfield(L, -2, "frozen");
+
 	/* status */
 	lua_createtable(L, 0, lws_http_status_n);
 	lua_createtable(L, 0, 1);
@@ -668,6 +1891,105 @@ int lws_open_lws (lua_State *L) {
 	lua_setfield(L, -2, "__newindex");
 	lua_pop(L, 1);
 
+	/* HTTP response body */
+	luaL_newmetatable(L, LWS_RESPONSE_BODY);
+	lua_createtable(L, 0, 4);
+	lua_pushcfunction(L, lws_lua_response_body_write);
+	lua_setfield(L, -2, "write");
+	lua_pushcfunction(L, lws_lua_response_body_send);
+	lua_setfield(L, -2, "send");
+	lua_pushcfunction(L, lws_lua_response_body_reserve);
+	lua_setfield(L, -2, "reserve");
+	lua_pushcfunction(L, lws_lua_response_body_flush);
+	lua_setfield(L, -2, "flush");
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, lws_lua_response_body_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_pop(L, 1);
+
+	/* HTTP request body; the file methods are called with the file handle of the request body */
+	luaL_newmetatable(L, LWS_REQUEST_BODY);
+	lua_newtable(L);
+	luaL_getmetatable(L, LUA_FILEHANDLE);
+	lua_getfield(L, -1, "__index");
+	lua_pushnil(L);
+	while (lua_next(L, -2)) {
+		if (lua_type(L, -2) == LUA_TSTRING && lua_iscfunction(L, -1)
+				&& strncmp(lua_tostring(L, -2), "__", 2) != 0) {
+			lua_pushcclosure(L, lws_lua_request_body_method, 1);
+			lua_pushvalue(L, -2);
+			lua_insert(L, -2);
+			lua_rawset(L, -6);
+		} else {
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 2);
+	lua_pushcfunction(L, lws_lua_request_body_all);
+	lua_setfield(L, -2, "all");
+	lua_pushcfunction(L, lws_lua_request_body_view);
+	lua_setfield(L, -2, "view");
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, lws_lua_request_body_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_pop(L, 1);
+
+	/* file handles of request bodies; collected with the request bodies */
+	lua_newtable(L);
+	lua_createtable(L, 0, 1);
+	lua_pushliteral(L, "k");
+	lua_setfield(L, -2, "__mode");
+	lua_setmetatable(L, -2);
+	lua_setfield(L, LUA_REGISTRYINDEX, LWS_REQUEST_BODIES);
+
+	/* byte view */
+	luaL_newmetatable(L, LWS_BYTES);
+	lua_createtable(L, 0, 1);
+	lua_pushcfunction(L, lws_lua_bytes_sub);
+	lua_setfield(L, -2, "sub");
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, lws_lua_bytes_len);
+	lua_setfield(L, -2, "__len");
+	lua_pushcfunction(L, lws_lua_bytes_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_pop(L, 1);
+
+	/* LRU cache */
+	luaL_newmetatable(L, LWS_LRU);
+	lua_createtable(L, 0, 4);
+	lua_pushcfunction(L, lws_lua_lru_get);
+	lua_setfield(L, -2, "get");
+	lua_pushcfunction(L, lws_lua_lru_set);
+	lua_setfield(L, -2, "set");
+	lua_pushcfunction(L, lws_lua_lru_delete);
+	lua_setfield(L, -2, "delete");
+	lua_pushcfunction(L, lws_lua_lru_clear);
+	lua_setfield(L, -2, "clear");
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, lws_lua_lru_len);
+	lua_setfield(L, -2, "__len");
+	lua_pushcfunction(L, lws_lua_lru_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_pushcfunction(L, lws_lua_lru_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	/* LWS job */
+	luaL_newmetatable(L, LWS_JOB);
+	lua_createtable(L, 0, 1);
+	if (luaL_loadbuffer(L, lws_join_chunk, sizeof(lws_join_chunk) - 1, "=join") != LUA_OK) {
+		return lua_error(L);
+	}
+	lua_pushcfunction(L, lws_lua_job_done);
+	lua_pushcfunction(L, lws_lua_job_wait);
+	lua_pushcfunction(L, lws_lua_job_result);
+	lua_call(L, 3, 1);
+	lua_setfield(L, -2, "join");
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, lws_lua_job_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_pop(L, 1);
+
 #if LUA_VERSION_NUM < 502
 	/* file environment */
 	luaL_newmetatable(L, LWS_FILE);
@@ -697,7 +2019,17 @@ void lws_get_msg (lua_State *L, int index, ngx_str_t *msg) {
 }
 
 int lws_traceback (lua_State *L) {
-	ngx_str_t  msg;
+	ngx_str_t               msg;
+	lws_lua_request_ctx_t  *lctx;
+
+	/* error from request thread, with traceback? */
+	lua_getfield(L, LUA_REGISTRYINDEX, LWS_REQUEST_CTX_CURRENT);
+	lctx = luaL_testudata(L, -1, LWS_REQUEST_CTX);
+	lua_pop(L, 1);
+	if (lctx && lctx->traceback) {
+		lua_settop(L, 1);
+		return 1;
+	}
 
 	lws_get_msg(L, 1, &msg);
 #if LUA_VERSION_NUM >= 502
@@ -721,12 +2053,13 @@ int lws_traceback (lua_State *L) {
  */
 
 static void lws_push_env (lws_lua_request_ctx_t *lctx) {
-	lua_State           *L;
-	luaL_Stream         *request_body, *response_body;
-	lws_lua_table_t     *lt;
-	lws_request_ctx_t   *ctx;
-	ngx_connection_t    *c;
-	ngx_http_request_t  *r;
+	lua_State                *L;
+	luaL_Stream              *response_body;
+	lws_lua_table_t          *lt;
+	lws_request_ctx_t        *ctx;
+	ngx_connection_t         *c;
+	ngx_http_request_t       *r;
+	lws_lua_response_body_t  *rb;
 
 	/* create environment */
 	ctx = lctx->ctx;
@@ -757,8 +2090,7 @@ static void lws_push_env (lws_lua_request_ctx_t *lctx) {
 	lt->readonly = 1;  /* required as key dup and free are not enabled */
 	lt->external = 1;  /* will be freed externally */
 	lua_setfield(L, -2, "headers");
-	request_body = lws_create_file(L);
-	request_body->f = ctx->request_body;
+	lws_create_request_body(L, ctx);
 	lua_setfield(L, -2, "body");
 	lua_pushlstring(L, (const char *)ctx->path_info.data, ctx->path_info.len);
 	lua_setfield(L, -2, "path_info");
@@ -771,107 +2103,371 @@ static void lws_push_env (lws_lua_request_ctx_t *lctx) {
 	lua_setfield(L, -2, "request");
 
 	/* response */
-	lua_createtable(L, 0, 2);
+	lua_createtable(L, 0, 3);
 	luaL_getmetatable(L, LWS_RESPONSE);
 	lua_setmetatable(L, -2);
 	lt = lws_create_lua_table(L);
 	lt->t = ctx->response_headers;
 	lt->external = 1;  /* see request above */
 	lua_setfield(L, -2, "headers");
-	response_body = lws_create_file(L);
-	response_body->f = ctx->response_body;
+	if (ctx->response_file) {
+		response_body = lws_create_file(L);
+		response_body->f = ctx->response_file;
+	} else {
+		rb = lua_newuserdata(L, sizeof(lws_lua_response_body_t));
+		rb->ctx = ctx;
+		rb->closed = 0;
+		luaL_setmetatable(L, LWS_RESPONSE_BODY);
+	}
+	lua_pushvalue(L, -1);
+	lua_setfield(L, LUA_REGISTRYINDEX, LWS_RESPONSE_CURRENT);
 	lua_setfield(L, -2, "body");
+	lua_pushcfunction(L, lws_lua_response_sendfile);
+	lua_setfield(L, -2, "sendfile");
 	lua_setfield(L, -2, "response");
 }
 
-static int lws_call (lws_lua_request_ctx_t *lctx, ngx_str_t *filename, lws_lua_chunk_e chunk) {
-	int         result, isint;
-	lua_State  *L;
+static int lws_push_subrequests (lws_lua_request_ctx_t *lctx) {
+	int                 nresults;
+	size_t              i;
+	lua_State          *T;
+	lws_subrequest_t   *sr;
+	lws_request_ctx_t  *ctx;
 
-	/* set chunk */
-	lctx->chunk = chunk;
+	/* push results onto the request thread */
+	T = lctx->T;
+	ctx = lctx->ctx;
+	sr = ctx->subrequests;
+	if (!lctx->multi) {
+		lua_pushinteger(T, sr[0].status);
+		lua_pushlstring(T, (const char *)sr[0].body.data, sr[0].body.len);
+		nresults = 2;
+	} else {
+		lua_createtable(T, ctx->subrequests_n, 0);
+		for (i = 0; i < ctx->subrequests_n; i++) {
+			lua_createtable(T, 0, 2);
+			lua_pushinteger(T, sr[i].status);
+			lua_setfield(T, -2, "status");
+			lua_pushlstring(T, (const char *)sr[i].body.data, sr[i].body.len);
+			lua_setfield(T, -2, "body");
+			lua_rawseti(T, -2, i + 1);
+		}
+		nresults = 1;
+	}
 
+	/* free subrequests */
+	ngx_free(ctx->subrequests);
+	ctx->subrequests = NULL;
+	ctx->subrequests_n = 0;
+	return nresults;
+}
+
+static int lws_push_job_handle (lws_lua_request_ctx_t *lctx) {
+	lua_State  *T;
+
+	/* the handle of the started job is the last one registered */
+	T = lctx->T;
+	lua_getfield(T, LUA_REGISTRYINDEX, LWS_REQUEST_JOBS);
+	lua_rawgeti(T, -1, lua_rawlen(T, -1));
+	lua_remove(T, -2);
+	return 1;
+}
+
+static int lws_push_flush_result (lws_lua_request_ctx_t *lctx) {
+	lua_State  *T;
+
+	/* the flushed response body no longer references the anchored strings */
+	T = lctx->T;
+	if (lctx->ctx->state->anchored) {
+		lua_pushnil(T);
+		lua_setfield(T, LUA_REGISTRYINDEX, LWS_RESPONSE_ANCHORS);
+		lctx->ctx->state->anchored = 0;
+	}
+
+	/* the response body on success, as from write; nil and a message otherwise */
+	if (lctx->ctx->stream_error) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "failed to send response body");
+		return 2;
+	}
+	lua_getfield(T, LUA_REGISTRYINDEX, LWS_RESPONSE_CURRENT);
+	return 1;
+}
+
+static void lws_close_response (lua_State *L, int index) {
+	lws_lua_table_t          *lt;
+
+	/* the response is sent; its headers become read-only, and its body is closed */
+	lua_getfield(L, index, "response");
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 1);
+		return;
+	}
+	lua_getfield(L, -1, "headers");
+	if ((lt = luaL_testudata(L, -1, LWS_TABLE))) {
+		lt->readonly = 1;
+	}
+	lua_getfield(L, -2, "body");
+	lws_close_response_body(L, lws_get_lua_request_ctx(L)->ctx, -1);
+	lua_pop(L, 3);
+}
+
+static int lws_result (lws_lua_request_ctx_t *lctx) {
+	int                 result, isint;
+	ngx_str_t          *filename;
+	lua_State          *L;
+	lws_loc_conf_t     *llcf;
+	lws_request_ctx_t  *ctx;
+
+	/* check result */
+	ctx = lctx->ctx;
+	L = ctx->state->L;  /* [result] */
+	if (lua_isnil(L, -1)) {
+		result = 0;
+	} else {
+		result = lua_tointegerx(L, -1, &isint);
+		if (!isint) {
+			ngx_log_error(NGX_LOG_WARN, ctx->r->connection->log, 0,
+					"[LWS] bad result type (nil or integer expected, got %s)",
+					luaL_typename(L, -1));
+			result = -1;
+		}
+	}
+	if (result < 0) {
+		llcf = ctx->state->llcf;
+		switch (lctx->chunk) {
+		case LWS_LC_INIT:
+			filename = &llcf->init;
+			break;
+
+		case LWS_LC_PRE:
+			filename = &llcf->pre;
+			break;
+
+		case LWS_LC_MAIN:
+			filename = &ctx->main;
+			break;
+
+		default:
+			filename = &llcf->post;
+		}
+		lua_pushlstring(L, (const char *)filename->data, filename->len);
+		return luaL_error(L, "%s: %s chunk failed (%d)", lua_tostring(L, -1),
+				lws_chunk_names[lctx->chunk], result);
+	}
+	if (result > 0 && lctx->chunk == LWS_LC_PRE) {
+		lctx->complete = 1;
+	}
+
+	/* finish */
+	lua_pop(L, 1);  /* [] */
+	return result;
+}
+
+static void lws_push_chunks (lua_State *L) {
+	if (lws_getfield(L, LUA_REGISTRYINDEX, LWS_CHUNKS) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, LWS_CHUNKS);
+	}  /* [chunks] */
+}
+
+static void lws_push_chunk (lua_State *L, int chunks, ngx_str_t *filename, int env) {
 	/* get, or load and store, the function */
-	L = lctx->ctx->state->L;
 	lua_pushlstring(L, (const char *)filename->data, filename->len);  /* [filename] */
-	lua_pushvalue(L, -1);  /* [filename, filename] */
-	if (lws_rawget(L, 2) != LUA_TFUNCTION) {  /* [filename, x] */
-		lua_pop(L, 1);  /* [filename] */
+	if (lws_rawget(L, chunks) != LUA_TFUNCTION) {  /* [x] */
+		lua_pop(L, 1);  /* [] */
+		lua_pushlstring(L, (const char *)filename->data, filename->len);  /* [filename] */
 		if (luaL_loadfilex(L, lua_tostring(L, -1), "bt") != LUA_OK) {
-			return lua_error(L);
+			lua_error(L);
 		}  /* [filename, function] */
-		lua_pushvalue(L, -2);  /* [filename, function, filename] */
-		lua_pushvalue(L, -2);  /* [filename, function, filename, function] */
-		lua_rawset(L, 2);      /* [filename, function] */
-	}  /* [filename, function] */
-
-	/* set _ENV */
-	if (chunk != LWS_LC_INIT) {
-		lua_pushvalue(L, 3);
+		lua_pushvalue(L, -2);   /* [filename, function, filename] */
+		lua_pushvalue(L, -2);   /* [filename, function, filename, function] */
+		lua_rawset(L, chunks);  /* [filename, function] */
+		lua_remove(L, -2);      /* [function] */
+	}  /* [function] */
+
+	/* set _ENV; 0 selects the globals */
+	if (env != 0) {
+		lua_pushvalue(L, env);
 	} else {
 #if LUA_VERSION_NUM >= 502
 		lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
 #else
 		lua_pushvalue(L, LUA_GLOBALSINDEX);
 #endif
-	}  /* [filename, function, env] */
+	}  /* [function, env] */
 #if LUA_VERSION_NUM >= 502
 	lua_setupvalue(L, -2, 1);  /* _ENV is the first upvalue */
 #else
 	lua_setfenv(L, -2);
-#endif  /* [filename, function] */
+#endif  /* [function] */
+}
+
+static int lws_call (lws_lua_request_ctx_t *lctx, ngx_str_t *filename, lws_lua_chunk_e chunk) {
+	lua_State  *L;
+
+	/* set chunk */
+	lctx->chunk = chunk;
 
-	/* call the function */
+	/* push the function; the init chunk runs with the globals */
+	L = lctx->ctx->state->L;
+	lws_push_chunk(L, 2, filename, chunk != LWS_LC_INIT ? 3 : 0);  /* [function] */
+
+	/* call the function; pre, main, and post chunks run in the request thread */
 	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, lctx->ctx->r->connection->log, 0,
 			"[LWS] calling %s chunk filename:%V", lws_chunk_names[chunk],
 			filename);
-	lua_call(L, 0, 1);  /* [filename, result] */
+	if (chunk == LWS_LC_INIT) {
+		lua_call(L, 0, 1);  /* [result] */
+		return lws_result(lctx);
+	}
+	lua_xmove(L, lctx->T, 1);  /* [] */
+	return lws_resume(lctx, 0);
+}
 
-	/* check result */
-	if (lua_isnil(L, -1)) {
-		result = 0;
-	} else {
-		result = lua_tointegerx(L, -1, &isint);
-		if (!isint) {
-			ngx_log_error(NGX_LOG_WARN, lctx->ctx->r->connection->log, 0,
-					"[LWS] bad result type (nil or integer expected, got %s)",
-					luaL_typename(L, -1));
-			result = -1;
+static int lws_resume (lws_lua_request_ctx_t *lctx, int nargs) {
+	int          status, nresults;
+	lua_State   *L, *T;
+	ngx_str_t    msg;
+
+	/* resume request thread */
+	L = lctx->ctx->state->L;
+	T = lctx->T;
+	status = lws_resume_thread(T, L, nargs, &nresults);
+	switch (status) {
+	case LUA_OK:
+		if (nresults > 0) {
+			lua_pop(T, nresults - 1);
+			lua_xmove(T, L, 1);  /* [result] */
+		} else {
+			lua_pushnil(L);  /* [result] */
 		}
+		lua_settop(T, 0);
+		return lws_result(lctx);
+
+	case LUA_YIELD:
+		lua_settop(T, 0);
+		return LWS_RESULT_YIELD;
+
+	default:
+		/* the request thread is not unwound; include its traceback with the error */
+		lws_get_msg(T, -1, &msg);
+#if LUA_VERSION_NUM >= 502
+		luaL_traceback(L, T, (const char *)msg.data, 0);
+#else
+		if (lws_getfield(L, LUA_GLOBALSINDEX, LUA_DBLIBNAME) == LUA_TTABLE
+				&& lws_getfield(L, -1, "traceback") == LUA_TFUNCTION) {
+			lua_pushthread(T);
+			lua_xmove(T, L, 1);
+			lua_pushlstring(L, (char *)msg.data, msg.len);
+			lua_pushinteger(L, 0);
+			lua_call(L, 3, 1);
+		} else {
+			lua_pushlstring(L, (char *)msg.data, msg.len);
+		}
+#endif
+		lctx->traceback = 1;
+		return lua_error(L);
 	}
-	if (result < 0) {
-		return luaL_error(L, "%s: %s chunk failed (%d)", lua_tostring(L, -2),
-				lws_chunk_names[chunk], result);
-	}
-	if (result > 0 && chunk == LWS_LC_PRE) {
-		lctx->complete = 1;
-	}
+}
 
-	/* finish */
-	lua_pop(L, 2);  /* [] */
-	return result;
+static int lws_proceed (lws_lua_request_ctx_t *lctx, int result) {
+	lws_loc_conf_t  *llcf;
+
+	llcf = lctx->ctx->state->llcf;
+	while (result != LWS_RESULT_YIELD) {
+		switch (lctx->chunk) {
+		case LWS_LC_INIT:
+			if (llcf->pre.len) {
+				result = lws_call(lctx, &llcf->pre, LWS_LC_PRE);
+			} else {
+				result = lws_call(lctx, &lctx->ctx->main, LWS_LC_MAIN);
+			}
+			break;
+
+		case LWS_LC_PRE:
+			if (!lctx->complete) {
+				/* result is invariably 0 at this point */
+				result = lws_call(lctx, &lctx->ctx->main, LWS_LC_MAIN);
+				break;
+			}
+			/* fall through */
+
+		case LWS_LC_MAIN:
+			lctx->result = result;
+			if (!llcf->post.len) {
+				return lctx->result;
+			}
+			if (llcf->post_mode == LWS_PM_AFTER_RESPONSE) {
+				lctx->ctx->post = 1;  /* runs in a new thread task after the response */
+				return lctx->result;
+			}
+			result = lws_call(lctx, &llcf->post, LWS_LC_POST);
+			break;
+
+		default:
+			return lctx->result;
+		}
+	}
+	return LWS_RESULT_YIELD;
 }
 
 int lws_run (lua_State *L) {
-	int                     result;
+	int                     result, nargs;
+	size_t                  i, n;
+	lws_lua_job_t          *lj;
+	lws_lua_bytes_t        *bytes;
 	lws_request_ctx_t      *ctx;
 	lws_lua_request_ctx_t  *lctx;
 
 	/* get arguments */
 	ctx = (void *)lua_topointer(L, 1);  /* [ctx] */
 
+	/* observe invalidations */
+	lws_observe_invalidations(ctx->state);
+
+	/* get chunks */
+	lws_push_chunks(L);  /* [ctx, chunks] */
+
+	/* resume yielded request */
+	if (ctx->yield) {
+		lctx = lws_get_lua_request_ctx(L);
+		lua_getfield(L, LUA_REGISTRYINDEX, LWS_REQUEST_ENV);  /* [ctx, chunks, env] */
+		switch (ctx->yield) {
+		case LWS_YIELD_SUBREQUESTS:
+			nargs = lws_push_subrequests(lctx);
+			break;
+
+		case LWS_YIELD_OFFLOAD:
+			nargs = lws_push_job_handle(lctx);
+			break;
+
+		case LWS_YIELD_FLUSH:
+			nargs = lws_push_flush_result(lctx);
+			break;
+
+		default:
+			nargs = 0;
+		}
+		result = lws_resume(lctx, nargs);
+		goto proceed;
+	}
+
+	/* run post chunk after the response */
+	if (ctx->after_response) {
+		lctx = lws_get_lua_request_ctx(L);
+		lua_getfield(L, LUA_REGISTRYINDEX, LWS_REQUEST_ENV);  /* [ctx, chunks, env] */
+		lws_close_response(L, 3);
+		result = lws_call(lctx, &ctx->state->llcf->post, LWS_LC_POST);
+		goto proceed;
+	}
+
 	/* set request context */
 	lctx = lws_create_lua_request_ctx(L);
 	lctx->ctx = ctx;
-	lua_setfield(L, LUA_REGISTRYINDEX, LWS_REQUEST_CTX_CURRENT);  /* [ctx] */
-
-	/* get chunks */
-	if (lws_getfield(L, LUA_REGISTRYINDEX, LWS_CHUNKS) != LUA_TTABLE) {
-		lua_pop(L, 1);
-		lua_newtable(L);
-		lua_pushvalue(L, -1);
-		lua_setfield(L, LUA_REGISTRYINDEX, LWS_CHUNKS);
-	}  /* [ctx, chunks] */
+	lua_setfield(L, LUA_REGISTRYINDEX, LWS_REQUEST_CTX_CURRENT);  /* [ctx, chunks] */
 
 	/* start profiler */
 	if (ctx->state->profiler) {
@@ -888,24 +2484,33 @@ int lws_run (lua_State *L) {
 		ctx->state->init = 1;
 	}
 
+	/* create request thread */
+	lctx->T = lua_newthread(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, LWS_REQUEST_THREAD);
+
 	/* push environment */
 	lws_push_env(lctx);  /* [ctx, chunks, env] */
-
-	/* pre chunk */
-	if (ctx->state->llcf->pre.len) {
-		result = lws_call(lctx, &ctx->state->llcf->pre, LWS_LC_PRE);
-		if (lctx->complete) {
-			goto post;
-		}  /* result is invariably 0 at this point */
+	lua_pushvalue(L, -1);
+	lua_setfield(L, LUA_REGISTRYINDEX, LWS_REQUEST_ENV);
+
+	/* pre, main, and post chunks */
+	lctx->chunk = LWS_LC_INIT;
+	result = 0;
+	proceed:
+	result = lws_proceed(lctx, result);
+	if (result == LWS_RESULT_YIELD) {
+		lua_pushinteger(L, 0);  /* [ctx, chunks, env, 0] */
+		return 1;
 	}
+	ctx->yield = LWS_YIELD_NONE;
 
-	/* main chunk */
-	result = lws_call(lctx, &ctx->main, LWS_LC_MAIN);
-
-	/* post chunk */
-	post:
-	if (ctx->state->llcf->post.len) {
-		(void)lws_call(lctx, &ctx->state->llcf->post, LWS_LC_POST);
+	/* close response body; it is complete once the response is sent */
+	lua_getfield(L, LUA_REGISTRYINDEX, LWS_RESPONSE_CURRENT);
+	lws_close_response_body(L, ctx, -1);
+	lua_pop(L, 1);
+	if (ctx->post && !ctx->after_response) {
+		lua_pushinteger(L, result);  /* [ctx, chunks, env, result] */
+		return 1;
 	}
 
 	/* stop profiler */
@@ -914,11 +2519,108 @@ int lws_run (lua_State *L) {
 		lua_call(L, 0, 0);
 	}
 
+	/* release request body view */
+	lua_getfield(L, LUA_REGISTRYINDEX, LWS_REQUEST_BODY_VIEW);
+	if ((bytes = luaL_testudata(L, -1, LWS_BYTES))) {
+		bytes->data = NULL;
+		bytes->len = 0;
+	}
+	lua_pop(L, 1);
+
+	/* invalidate job handles */
+	if (lws_getfield(L, LUA_REGISTRYINDEX, LWS_REQUEST_JOBS) == LUA_TTABLE) {
+		n = lua_rawlen(L, -1);
+		for (i = 1; i <= n; i++) {
+			lua_rawgeti(L, -1, i);
+			lj = lua_touserdata(L, -1);
+			lj->job = NULL;
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
+
 	/* clear request context */
 	lua_pushnil(L);
-	lua_setfield(L, LUA_REGISTRYINDEX, LWS_REQUEST_CTX_CURRENT);  /* [ctx, chunks, env] */
+	lua_setfield(L, LUA_REGISTRYINDEX, LWS_REQUEST_CTX_CURRENT);
+	lua_pushnil(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, LWS_REQUEST_JOBS);
+	lua_pushnil(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, LWS_RESPONSE_CURRENT);
+	lua_pushnil(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, LWS_REQUEST_BODY_VIEW);
+	lua_pushnil(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, LWS_REQUEST_THREAD);
+	lua_pushnil(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, LWS_REQUEST_ENV);  /* [ctx, chunks, env] */
 
 	/* return result */
 	lua_pushinteger(L, result);  /* [ctx, chunks, env, result] */
 	return 1;
 }
+
+static void lws_init_state (lua_State *L) {
+	int           isint;
+	lua_Integer   result;
+	lws_state_t  *state;
+	ngx_str_t    *filename;
+
+	/* run the init chunk outside of a request, e.g., in a state created for a timer */
+	lua_getfield(L, LUA_REGISTRYINDEX, LWS_STATE);
+	state = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (state->init) {
+		return;
+	}
+	filename = &state->llcf->init;
+	if (filename->len) {
+		lws_push_chunks(L);  /* [chunks] */
+		lws_push_chunk(L, lua_gettop(L), filename, 0);  /* [chunks, function] */
+		lua_call(L, 0, 1);  /* [chunks, result] */
+		if (!lua_isnil(L, -1)) {
+			result = lua_tointegerx(L, -1, &isint);
+			if (!isint || result < 0) {
+				lua_pushlstring(L, (const char *)filename->data, filename->len);
+				luaL_error(L, "%s: init chunk failed", lua_tostring(L, -1));
+			}
+		}
+		lua_pop(L, 2);  /* [] */
+	}
+	state->init = 1;
+}
+
+int lws_run_job (lua_State *L) {
+	int         n;
+	lws_job_t  *job;
+
+	/* get arguments */
+	job = (void *)lua_topointer(L, 1);  /* [job] */
+
+	/* init */
+	lws_init_state(L);
+
+	/* call function */
+	n = lws_push_job(L, job);  /* [job, function, args] */
+	lua_call(L, n, LUA_MULTRET);  /* [job, results] */
+
+	/* store results */
+	lws_encode_values(L, 2, lua_gettop(L) - 1, &job->results);
+	return 0;
+}
+
+int lws_run_timer (lua_State *L) {
+	lua_Integer  index;
+
+	/* get arguments */
+	index = lua_tointeger(L, 1);  /* [index] */
+
+	/* init */
+	lws_init_state(L);
+
+	/* call function */
+	if (lws_getfield(L, LUA_REGISTRYINDEX, LWS_TIMERS) != LUA_TTABLE
+			|| lws_rawgeti(L, -1, index) != LUA_TFUNCTION) {
+		return luaL_error(L, "timer function #%d not found", (int)index);
+	}  /* [index, timers, function] */
+	lua_call(L, 0, 0);  /* [index, timers] */
+	return 0;
+}
@@ -19,12 +19,32 @@
 #define LWS_REQUEST_CTX_CURRENT  "lws.request_ctx_current"  /* current request context */
 #define LWS_TABLE                "lws.table"                /* table metatable */
 #define LWS_RESPONSE             "lws.response"             /* response metatable */
+#define LWS_RESPONSE_BODY        "lws.response_body"        /* response body metatable */
+#define LWS_RESPONSE_CURRENT     "lws.response_current"     /* current response body */
+#define LWS_RESPONSE_ANCHORS     "lws.response_anchors"     /* strings referenced by responses */
+#define LWS_REQUEST_THREAD       "lws.request_thread"       /* current request thread */
+#define LWS_REQUEST_ENV          "lws.request_env"          /* current request environment */
+#define LWS_REQUEST_BODY         "lws.request_body"         /* request body metatable */
+#define LWS_REQUEST_BODIES       "lws.request_bodies"       /* file handles, by request body */
+#define LWS_REQUEST_BODY_VIEW    "lws.request_body_view"    /* byte view of current request body */
+#define LWS_REQUEST_JOBS         "lws.request_jobs"         /* job handles of current request */
+#define LWS_JOB                  "lws.job"                  /* job metatable */
+#define LWS_BYTES                "lws.bytes"                /* byte view metatable */
+#define LWS_LRU                  "lws.lru"                  /* LRU cache metatable */
+#define LWS_TIMERS               "lws.timers"               /* timer functions */
 #define LWS_CHUNKS               "lws.chunks"               /* loaded chunks */
 #define LWS_FILE                 "lws.file"                 /* file environment (Lua 5.1) */
+#define LWS_STATE                "lws.state"                /* state */
 
 
 typedef struct lws_lua_request_ctx_s lws_lua_request_ctx_t;
 typedef struct lws_lua_table_s lws_lua_table_t;
+typedef struct lws_lua_job_s lws_lua_job_t;
+typedef struct lws_lua_response_body_s lws_lua_response_body_t;
+typedef struct lws_lua_request_body_s lws_lua_request_body_t;
+typedef struct lws_lua_bytes_s lws_lua_bytes_t;
+typedef struct lws_lua_lru_s lws_lua_lru_t;
+typedef struct lws_lua_lru_entry_s lws_lua_lru_entry_t;
 
 typedef enum {
 	LWS_LC_INIT,
@@ -34,9 +54,13 @@ typedef enum {
 } lws_lua_chunk_e;
 
 struct lws_lua_request_ctx_s {
-	lws_request_ctx_t  *ctx;         /* request context */
-	lws_lua_chunk_e     chunk;       /* current chunk */
-	unsigned            complete:1;  /* request is complete */
+	lws_request_ctx_t  *ctx;          /* request context */
+	lua_State          *T;            /* request thread running pre, main, and post chunks */
+	lws_lua_chunk_e     chunk;        /* current chunk */
+	int                 result;       /* request result */
+	unsigned            complete:1;   /* request is complete */
+	unsigned            multi:1;      /* multiple subrequests yielded */
+	unsigned            traceback:1;  /* error message includes traceback */
 };
 
 struct lws_lua_table_s {
@@ -45,6 +69,41 @@ struct lws_lua_table_s {
 	unsigned      external:1;  /* managed externally */
 };
 
+struct lws_lua_job_s {
+	lws_job_t  *job;  /* job; NULL once the request is done */
+};
+
+struct lws_lua_response_body_s {
+	lws_request_ctx_t  *ctx;       /* request context */
+	unsigned            closed:1;  /* response body is closed */
+};
+
+
+/* read-only byte view; C functions can access the data with luaL_checkudata */
+struct lws_lua_request_body_s {
+	FILE  *f;  /* request body stream */
+};
+
+struct lws_lua_bytes_s {
+	const u_char  *data;  /* data; NULL once released */
+	size_t         len;   /* length of data */
+};
+
+
+struct lws_lua_lru_s {
+	lws_table_t      *t;      /* entries */
+	lua_State        *L;      /* Lua state releasing references */
+	lws_state_t      *state;  /* state */
+	lws_lru_stats_t  *stats;  /* monitor statistics; NULL = not monitored */
+};
+
+struct lws_lua_lru_entry_s {
+	int                 ref;         /* registry reference of value */
+	ngx_atomic_t       *version;     /* tag version; NULL = untagged */
+	ngx_atomic_uint_t   tagged;      /* tag version when set */
+	ngx_atomic_uint_t   generation;  /* invalidation generation last checked */
+};
+
 
 #if LUA_VERSION_NUM < 502
 void *lws_testudata(lua_State *L, int index, const char *name);
@@ -53,6 +112,8 @@ void lws_get_msg(lua_State *L, int index, ngx_str_t *msg);
 int lws_traceback(lua_State *L);
 int lws_open_lws(lua_State *L);
 int lws_run(lua_State *L);
+int lws_run_job(lua_State *L);
+int lws_run_timer(lua_State *L);
 
 
 #endif /* _LWS_LIBRARY_INCLUDED */
@@ -0,0 +1,444 @@
+/*
+ * LWS local
+ *
+ * Copyright (C) 2024 Andre Naef
+ */
+
+
+#include <lws_local.h>
+#include <lauxlib.h>
+#include <lws_value.h>
+
+
+#define lws_local_expired(node, now)  ((node)->expires  \
+		&& (ngx_msec_int_t)((node)->expires - (now)) <= 0)
+#define lws_local_size(node)  (sizeof(lws_local_node_t) + (node)->key_len + (node)->value_len)
+
+
+static void lws_cleanup_local(void *data);
+static void lws_local_enter(lws_local_reader_t *reader);
+static void lws_local_exit(lws_local_reader_t *reader);
+static lws_local_node_t *lws_local_lookup(lws_local_t *lc, ngx_str_t *key, uint32_t hash);
+static lws_local_node_t *lws_local_store(lws_local_t *lc, ngx_str_t *key, uint32_t hash,
+		lws_local_node_t *node);
+static void lws_local_evict(lws_local_t *lc, size_t size);
+static void lws_local_retire(lws_local_t *lc, lws_local_node_t *retired);
+static void lws_local_reclaim(lws_local_t *lc);
+static lws_local_reader_t *lws_check_local(lua_State *L, int index);
+static int lws_lua_local_get(lua_State *L);
+static int lws_lua_local_set(lua_State *L);
+static int lws_lua_local_delete(lua_State *L);
+static int lws_lua_local_gc(lua_State *L);
+static int lws_lua_local_tostring(lua_State *L);
+
+
+/*
+ * configuration
+ */
+
+char *lws_local_cache (ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+	ssize_t              size;
+	ngx_uint_t           i;
+	ngx_str_t           *values;
+	lws_local_t         *lc;
+	lws_main_conf_t     *lmcf;
+	ngx_pool_cleanup_t  *cln;
+
+	/* parse */
+	lmcf = conf;
+	values = cf->args->elts;
+	if (lmcf->local_cache) {
+		return "is duplicate";
+	}
+	size = ngx_parse_size(&values[1]);
+	if (size == NGX_ERROR || size == 0) {
+		return "has invalid size";
+	}
+
+	/* the cache is in process memory; each worker process has its own */
+	lc = ngx_pcalloc(cf->pool, sizeof(lws_local_t));
+	if (!lc) {
+		return NGX_CONF_ERROR;
+	}
+	lc->max_size = size;
+	ngx_queue_init(&lc->readers);
+	if (ngx_thread_mutex_create(&lc->mutex, cf->log) != NGX_OK) {
+		return NGX_CONF_ERROR;
+	}
+	for (i = 0; i < LWS_LOCAL_STRIPES; i++) {
+		if (ngx_thread_mutex_create(&lc->stripes[i], cf->log) != NGX_OK) {
+			while (i > 0) {
+				(void)ngx_thread_mutex_destroy(&lc->stripes[--i], cf->log);
+			}
+			(void)ngx_thread_mutex_destroy(&lc->mutex, cf->log);
+			return NGX_CONF_ERROR;
+		}
+	}
+	cln = ngx_pool_cleanup_add(cf->pool, 0);
+	if (!cln) {
+		lws_cleanup_local(lc);
+		return NGX_CONF_ERROR;
+	}
+	cln->handler = lws_cleanup_local;
+	cln->data = lc;
+	lmcf->local_cache = lc;
+	return NGX_CONF_OK;
+}
+
+static void lws_cleanup_local (void *data) {
+	ngx_uint_t         i;
+	lws_local_t       *lc;
+	lws_local_node_t  *node, *next;
+
+	lc = data;
+	for (i = 0; i < LWS_LOCAL_BUCKETS; i++) {
+		for (node = lc->buckets[i]; node; node = next) {
+			next = node->next;
+			ngx_free(node);
+		}
+	}
+	for (node = lc->retired; node; node = next) {
+		next = node->retired;
+		ngx_free(node);
+	}
+	for (i = 0; i < LWS_LOCAL_STRIPES; i++) {
+		(void)ngx_thread_mutex_destroy(&lc->stripes[i], ngx_cycle->log);
+	}
+	(void)ngx_thread_mutex_destroy(&lc->mutex, ngx_cycle->log);
+}
+
+
+/*
+ * entries
+ */
+
+static void lws_local_enter (lws_local_reader_t *reader) {
+	ngx_atomic_uint_t  epoch;
+
+	/* announce the observed epoch before reading any entry */
+	do {
+		epoch = reader->lc->epoch;
+		reader->epoch = epoch | 1;
+		ngx_memory_barrier();
+	} while (reader->lc->epoch != epoch);
+}
+
+static void lws_local_exit (lws_local_reader_t *reader) {
+	ngx_memory_barrier();
+	reader->epoch = 0;
+}
+
+static lws_local_node_t *lws_local_lookup (lws_local_t *lc, ngx_str_t *key, uint32_t hash) {
+	lws_local_node_t  *node;
+
+	for (node = lc->buckets[hash & (LWS_LOCAL_BUCKETS - 1)]; node; node = node->next) {
+		if (node->hash == hash && node->key_len == key->len
+				&& ngx_memcmp(node->data, key->data, key->len) == 0) {
+			return lws_local_expired(node, ngx_current_msec) ? NULL : node;
+		}
+	}
+	return NULL;
+}
+
+static lws_local_node_t *lws_local_store (lws_local_t *lc, ngx_str_t *key, uint32_t hash,
+		lws_local_node_t *node) {
+	ngx_uint_t                    bucket;
+	lws_local_node_t             *old, *retired;
+	lws_local_node_t *volatile   *prev;
+
+	/* unlink expired entries while looking for the key; readers may still see them */
+	bucket = hash & (LWS_LOCAL_BUCKETS - 1);
+	retired = NULL;
+	prev = &lc->buckets[bucket];
+	while ((old = *prev)) {
+		if (old->hash == hash && old->key_len == key->len
+				&& ngx_memcmp(old->data, key->data, key->len) == 0) {
+			break;
+		}
+		if (lws_local_expired(old, ngx_current_msec)) {
+			*prev = old->next;
+			old->retired = retired;
+			retired = old;
+			continue;
+		}
+		prev = &old->next;
+	}
+
+	/* publish the new entry fully initialized; it replaces the old entry in one store */
+	if (node) {
+		node->next = old ? old->next : NULL;
+		ngx_memory_barrier();
+		*prev = node;
+	} else if (old) {
+		*prev = old->next;
+	}
+	if (old) {
+		old->retired = retired;
+		retired = old;
+	}
+	return retired;
+}
+
+static void lws_local_evict (lws_local_t *lc, size_t size) {
+	size_t                        freed;
+	ngx_uint_t                    i, pass, bucket;
+	lws_local_node_t             *node, *retired;
+	lws_local_node_t *volatile   *prev;
+	ngx_thread_mutex_t           *stripe;
+
+	/* unlink expired entries, then entries from the bucket at the hand, until size is freed */
+	retired = NULL;
+	freed = 0;
+	for (pass = 0; pass < 2 && freed < size; pass++) {
+		for (i = 0; i < LWS_LOCAL_BUCKETS && freed < size; i++) {
+			bucket = pass == 0 ? i
+					: ngx_atomic_fetch_add(&lc->hand, 1) & (LWS_LOCAL_BUCKETS - 1);
+			stripe = &lc->stripes[bucket & (LWS_LOCAL_STRIPES - 1)];
+			(void)ngx_thread_mutex_lock(stripe, ngx_cycle->log);
+			prev = &lc->buckets[bucket];
+			while ((node = *prev)) {
+				if (pass == 0 && !lws_local_expired(node, ngx_current_msec)) {
+					prev = &node->next;
+					continue;
+				}
+				*prev = node->next;
+				node->retired = retired;
+				retired = node;
+				freed += lws_local_size(node);
+			}
+			(void)ngx_thread_mutex_unlock(stripe, ngx_cycle->log);
+		}
+	}
+
+	/* unlinked entries are freed once no reader can hold them */
+	if (retired) {
+		lws_local_retire(lc, retired);
+	}
+	(void)ngx_thread_mutex_lock(&lc->mutex, ngx_cycle->log);
+	lws_local_reclaim(lc);
+	lws_local_reclaim(lc);
+	(void)ngx_thread_mutex_unlock(&lc->mutex, ngx_cycle->log);
+}
+
+static void lws_local_retire (lws_local_t *lc, lws_local_node_t *retired) {
+	ngx_atomic_uint_t  epoch;
+	lws_local_node_t  *node;
+
+	/* the epoch is read after unlinking; readers from before may still hold the entries */
+	(void)ngx_thread_mutex_lock(&lc->mutex, ngx_cycle->log);
+	ngx_memory_barrier();
+	epoch = lc->epoch;
+	while (retired) {
+		node = retired;
+		retired = node->retired;
+		node->epoch = epoch;
+		node->retired = lc->retired;
+		lc->retired = node;
+	}
+	lws_local_reclaim(lc);
+	(void)ngx_thread_mutex_unlock(&lc->mutex, ngx_cycle->log);
+}
+
+static void lws_local_reclaim (lws_local_t *lc) {
+	ngx_queue_t         *q;
+	ngx_atomic_uint_t    epoch, observed;
+	lws_local_node_t    *node, **prev;
+	lws_local_reader_t  *reader;
+
+	/* advance the epoch if all reading readers have observed it; requires the mutex */
+	epoch = lc->epoch;
+	for (q = ngx_queue_head(&lc->readers); q != ngx_queue_sentinel(&lc->readers);
+			q = ngx_queue_next(q)) {
+		reader = ngx_queue_data(q, lws_local_reader_t, queue);
+		observed = reader->epoch;
+		if (observed && observed != (epoch | 1)) {
+			break;
+		}
+	}
+	if (q == ngx_queue_sentinel(&lc->readers)) {
+		epoch += 2;
+		lc->epoch = epoch;
+		ngx_memory_barrier();
+	}
+
+	/* entries retired two epochs ago are unreachable by any reader */
+	prev = &lc->retired;
+	while ((node = *prev)) {
+		if (epoch - node->epoch >= 4) {
+			*prev = node->retired;
+			(void)ngx_atomic_fetch_add(&lc->size,
+					-(ngx_atomic_int_t)lws_local_size(node));
+			ngx_free(node);
+		} else {
+			prev = &node->retired;
+		}
+	}
+}
+
+
+/*
+ * Lua
+ */
+
+static lws_local_reader_t *lws_check_local (lua_State *L, int index) {
+	return luaL_checkudata(L, index, LWS_LOCAL_CACHE);
+}
+
+static int lws_lua_local_get (lua_State *L) {
+	u_char              *buf, stack[LWS_LOCAL_GET_SIZE];
+	size_t               size;
+	uint32_t             hash;
+	ngx_str_t            key, value;
+	lws_local_node_t    *node;
+	lws_local_reader_t  *reader;
+
+	/* the value is copied while reading, and decoded after; reads take no lock */
+	reader = lws_check_local(L, 1);
+	key.data = (u_char *)luaL_checklstring(L, 2, &key.len);
+	hash = ngx_crc32_short(key.data, key.len);
+	buf = stack;
+	size = sizeof(stack);
+	while (1) {
+		lws_local_enter(reader);
+		node = lws_local_lookup(reader->lc, &key, hash);
+		if (!node) {
+			lws_local_exit(reader);
+			lua_pushnil(L);
+			return 1;
+		}
+		value.len = node->value_len;
+		if (value.len <= size) {
+			ngx_memcpy(buf, node->data + node->key_len, value.len);
+			lws_local_exit(reader);
+			break;
+		}
+		lws_local_exit(reader);
+		size = value.len;
+		buf = lua_newuserdata(L, size);
+	}
+	value.data = buf;
+	return lws_decode_values(L, &value);
+}
+
+static int lws_lua_local_set (lua_State *L) {
+	size_t               size, total;
+	uint32_t             hash;
+	ngx_str_t            key, value;
+	lua_Number           ttl;
+	lws_local_t         *lc;
+	lws_local_node_t    *node, *retired;
+	lws_local_reader_t  *reader;
+	ngx_thread_mutex_t  *stripe;
+
+	/* encode; Lua errors are raised before locking */
+	reader = lws_check_local(L, 1);
+	lc = reader->lc;
+	key.data = (u_char *)luaL_checklstring(L, 2, &key.len);
+	luaL_argcheck(L, key.len > 0, 2, "non-empty string expected");
+	luaL_checkany(L, 3);
+	ttl = luaL_optnumber(L, 4, 0);
+	luaL_argcheck(L, ttl >= 0, 4, "non-negative number expected");
+	hash = ngx_crc32_short(key.data, key.len);
+	node = NULL;
+	if (!lua_isnil(L, 3)) {
+		lws_encode_values(L, 3, 1, &value);
+
+		/* the entry is built before it is published; setting nil deletes */
+		size = sizeof(lws_local_node_t) + key.len + value.len;
+		total = lc->size + size;
+		if (size <= lc->max_size && total > lc->max_size) {
+			/* evict with some slack so that the next sets do not evict again */
+			lws_local_evict(lc, total - lc->max_size + lc->max_size / LWS_LOCAL_SLACK);
+		}
+		if (size <= lc->max_size && lc->size + size <= lc->max_size) {
+			node = ngx_alloc(size, ngx_cycle->log);
+		}
+		if (!node) {
+			ngx_free(value.data);
+			lua_pushboolean(L, 0);
+			lua_pushliteral(L, "no memory");
+			return 2;
+		}
+		node->hash = hash;
+		node->expires = ttl > 0 ? (ngx_current_msec + (ngx_msec_t)(ttl * 1000)) | 1 : 0;
+		node->key_len = key.len;
+		node->value_len = value.len;
+		ngx_memcpy(node->data, key.data, key.len);
+		ngx_memcpy(node->data + key.len, value.data, value.len);
+		ngx_free(value.data);
+		(void)ngx_atomic_fetch_add(&lc->size, size);
+	}
+
+	/* store; each stripe locks every LWS_LOCAL_STRIPES-th bucket */
+	stripe = &lc->stripes[hash & (LWS_LOCAL_STRIPES - 1)];
+	(void)ngx_thread_mutex_lock(stripe, ngx_cycle->log);
+	retired = lws_local_store(lc, &key, hash, node);
+	(void)ngx_thread_mutex_unlock(stripe, ngx_cycle->log);
+	if (retired) {
+		lws_local_retire(lc, retired);
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int lws_lua_local_delete (lua_State *L) {
+	lua_settop(L, 2);
+	lua_pushnil(L);
+	lws_lua_local_set(L);
+	return 0;
+}
+
+static int lws_lua_local_gc (lua_State *L) {
+	lws_local_reader_t  *reader;
+
+	reader = lws_check_local(L, 1);
+	(void)ngx_thread_mutex_lock(&reader->lc->mutex, ngx_cycle->log);
+	ngx_queue_remove(&reader->queue);
+	(void)ngx_thread_mutex_unlock(&reader->lc->mutex, ngx_cycle->log);
+	return 0;
+}
+
+static int lws_lua_local_tostring (lua_State *L) {
+	lws_local_reader_t  *reader;
+
+	reader = lws_check_local(L, 1);
+	lua_pushfstring(L, LWS_LOCAL_CACHE ": %p", reader->lc);
+	return 1;
+}
+
+int lws_open_local (lua_State *L) {
+	lws_main_conf_t     *lmcf;
+	lws_local_reader_t  *reader;
+
+	/* local cache */
+	luaL_newmetatable(L, LWS_LOCAL_CACHE);
+	lua_createtable(L, 0, 3);
+	lua_pushcfunction(L, lws_lua_local_get);
+	lua_setfield(L, -2, "get");
+	lua_pushcfunction(L, lws_lua_local_set);
+	lua_setfield(L, -2, "set");
+	lua_pushcfunction(L, lws_lua_local_delete);
+	lua_setfield(L, -2, "delete");
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, lws_lua_local_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pushcfunction(L, lws_lua_local_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_pop(L, 1);
+
+	/* lws.localcache; the handle registers the state as a reader */
+	lmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, lws_module);
+	if (!lmcf->local_cache) {
+		lua_pushnil(L);
+		return 1;
+	}
+	reader = lua_newuserdata(L, sizeof(lws_local_reader_t));
+	reader->epoch = 0;
+	reader->lc = lmcf->local_cache;
+	(void)ngx_thread_mutex_lock(&reader->lc->mutex, ngx_cycle->log);
+	ngx_queue_insert_tail(&reader->lc->readers, &reader->queue);
+	(void)ngx_thread_mutex_unlock(&reader->lc->mutex, ngx_cycle->log);
+	luaL_getmetatable(L, LWS_LOCAL_CACHE);
+	lua_setmetatable(L, -2);
+	return 1;
+}
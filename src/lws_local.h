@@ -0,0 +1,66 @@
+/*
+ * LWS local
+ *
+ * Copyright (C) 2024 Andre Naef
+ */
+
+
+#ifndef _LWS_LOCAL_INCLUDED
+#define _LWS_LOCAL_INCLUDED
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <lua.h>
+
+
+#define LWS_LOCAL_CACHE     "lws.local_cache"  /* local cache metatable */
+#define LWS_LOCAL_BUCKETS   4096               /* hash buckets; power of 2 */
+#define LWS_LOCAL_STRIPES   64                 /* writer lock stripes; power of 2 */
+#define LWS_LOCAL_GET_SIZE  256                /* size of the get buffer on the C stack */
+#define LWS_LOCAL_SLACK     16                 /* evictions free an extra 1/n of the size */
+
+
+typedef struct lws_local_s lws_local_t;
+typedef struct lws_local_node_s lws_local_node_t;
+typedef struct lws_local_reader_s lws_local_reader_t;
+
+
+#include <lws_module.h>
+
+
+struct lws_local_s {
+	size_t                       max_size;                     /* maximum size of entries */
+	ngx_atomic_t                 size;                         /* size of entries, incl. retired */
+	ngx_atomic_t                 epoch;                        /* global epoch; even */
+	ngx_thread_mutex_t           mutex;                        /* protects readers and retired */
+	ngx_queue_t                  readers;                      /* registered readers */
+	lws_local_node_t            *retired;                      /* unlinked entries pending free */
+	ngx_atomic_t                 hand;                         /* next bucket to evict from */
+	ngx_thread_mutex_t           stripes[LWS_LOCAL_STRIPES];   /* writer locks, by bucket */
+	lws_local_node_t *volatile   buckets[LWS_LOCAL_BUCKETS];   /* entries, by key hash */
+};
+
+struct lws_local_node_s {
+	lws_local_node_t *volatile   next;       /* next entry in bucket */
+	lws_local_node_t            *retired;    /* next retired entry */
+	ngx_atomic_uint_t            epoch;      /* global epoch when retired */
+	uint32_t                     hash;       /* key hash */
+	ngx_msec_t                   expires;    /* time when the entry expires; 0 = never */
+	size_t                       key_len;    /* length of key */
+	size_t                       value_len;  /* length of encoded value */
+	u_char                       data[];     /* key, encoded value */
+};
+
+struct lws_local_reader_s {
+	ngx_queue_t                  queue;      /* registered readers */
+	ngx_atomic_t                 epoch;      /* observed epoch | 1 while reading; 0 = idle */
+	lws_local_t                 *lc;         /* local cache */
+};
+
+
+char *lws_local_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+int lws_open_local(lua_State *L);
+
+
+#endif /* _LWS_LOCAL_INCLUDED */
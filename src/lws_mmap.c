@@ -0,0 +1,268 @@
+/*
+ * LWS mmap
+ *
+ * Copyright (C) 2024 Andre Naef
+ */
+
+
+#include <lws_mmap.h>
+#include <lauxlib.h>
+
+
+static lws_mmap_t *lws_mmap_open(lws_main_conf_t *lmcf, ngx_str_t *path, const char **err);
+static ngx_int_t lws_mmap_check(lws_mmap_t *map);
+static ngx_int_t lws_mmap_compare(lws_mmap_t *map, lws_mmap_index_t *entry, ngx_str_t *key);
+static lws_mmap_index_t *lws_mmap_find(lws_mmap_t *map, ngx_str_t *key, ngx_uint_t range);
+static int lws_lua_mmap(lua_State *L);
+static int lws_lua_mmap_get(lua_State *L);
+static int lws_lua_mmap_len(lua_State *L);
+static int lws_lua_mmap_tostring(lua_State *L);
+
+
+static const char *lws_lua_mmap_formats[] = {
+	"exact",
+	"range",
+	NULL
+};
+
+
+/*
+ * mapped files
+ */
+
+ngx_int_t lws_init_mmaps (lws_main_conf_t *lmcf, ngx_log_t *log) {
+	ngx_queue_init(&lmcf->mmaps);
+	return ngx_thread_mutex_create(&lmcf->mmaps_mutex, log);
+}
+
+void lws_cleanup_mmaps (lws_main_conf_t *lmcf) {
+	lws_mmap_t   *map;
+	ngx_queue_t  *q;
+
+	while (!ngx_queue_empty(&lmcf->mmaps)) {
+		q = ngx_queue_head(&lmcf->mmaps);
+		ngx_queue_remove(q);
+		map = ngx_queue_data(q, lws_mmap_t, queue);
+		(void)munmap(map->data, map->size);
+		ngx_free(map);
+	}
+	(void)ngx_thread_mutex_destroy(&lmcf->mmaps_mutex, ngx_cycle->log);
+}
+
+static lws_mmap_t *lws_mmap_open (lws_main_conf_t *lmcf, ngx_str_t *path, const char **err) {
+	u_char           *data;
+	size_t            size;
+	ngx_fd_t          fd;
+	lws_mmap_t       *map;
+	ngx_queue_t      *q;
+	ngx_file_info_t   fi;
+
+	/* files are mapped once per process; requires the mutex */
+	for (q = ngx_queue_head(&lmcf->mmaps); q != ngx_queue_sentinel(&lmcf->mmaps);
+			q = ngx_queue_next(q)) {
+		map = ngx_queue_data(q, lws_mmap_t, queue);
+		if (map->path.len == path->len
+				&& ngx_strncmp(map->path.data, path->data, path->len) == 0) {
+			return map;
+		}
+	}
+
+	/* map */
+	fd = ngx_open_file(path->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+	if (fd == NGX_INVALID_FILE) {
+		*err = "failed to open";
+		return NULL;
+	}
+	if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+		(void)ngx_close_file(fd);
+		*err = "failed to stat";
+		return NULL;
+	}
+	size = ngx_file_size(&fi);
+	if (size < sizeof(lws_mmap_header_t)) {
+		(void)ngx_close_file(fd);
+		*err = "bad format in";
+		return NULL;
+	}
+	data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	(void)ngx_close_file(fd);
+	if (data == MAP_FAILED) {
+		*err = "failed to map";
+		return NULL;
+	}
+
+	/* check */
+	map = ngx_alloc(sizeof(lws_mmap_t) + path->len + 1, ngx_cycle->log);
+	if (!map) {
+		(void)munmap(data, size);
+		*err = "failed to allocate map for";
+		return NULL;
+	}
+	map->path.data = (u_char *)(map + 1);
+	map->path.len = path->len;
+	ngx_memcpy(map->path.data, path->data, path->len + 1);
+	map->data = data;
+	map->size = size;
+	if (lws_mmap_check(map) != NGX_OK) {
+		(void)munmap(data, size);
+		ngx_free(map);
+		*err = "bad format in";
+		return NULL;
+	}
+	ngx_queue_insert_tail(&lmcf->mmaps, &map->queue);
+	return map;
+}
+
+static ngx_int_t lws_mmap_check (lws_mmap_t *map) {
+	size_t              i, start;
+	ngx_str_t           key;
+	lws_mmap_index_t   *entry;
+	lws_mmap_header_t  *header;
+
+	/* header */
+	header = (lws_mmap_header_t *)map->data;
+	if (ngx_memcmp(header->magic, LWS_MMAP_MAGIC, sizeof(header->magic)) != 0
+			|| header->bom != LWS_MMAP_BOM
+			|| header->n > (map->size - sizeof(lws_mmap_header_t))
+			/ sizeof(lws_mmap_index_t)) {
+		return NGX_ERROR;
+	}
+	map->index = (lws_mmap_index_t *)(header + 1);
+	map->n = header->n;
+
+	/* entries are within the file and sorted; lookups need no further checks */
+	start = sizeof(lws_mmap_header_t) + map->n * sizeof(lws_mmap_index_t);
+	for (i = 0; i < map->n; i++) {
+		entry = &map->index[i];
+		if (entry->offset < start || entry->offset > map->size
+				|| (uint64_t)entry->key_len + entry->value_len > map->size - entry->offset) {
+			return NGX_ERROR;
+		}
+		if (i > 0) {
+			key.data = map->data + entry->offset;
+			key.len = entry->key_len;
+			if (lws_mmap_compare(map, &map->index[i - 1], &key) >= 0) {
+				return NGX_ERROR;
+			}
+		}
+	}
+	return NGX_OK;
+}
+
+static ngx_int_t lws_mmap_compare (lws_mmap_t *map, lws_mmap_index_t *entry, ngx_str_t *key) {
+	ngx_int_t  rc;
+
+	rc = ngx_memcmp(map->data + entry->offset, key->data, ngx_min(entry->key_len, key->len));
+	if (rc != 0) {
+		return rc;
+	}
+	return (ngx_int_t)entry->key_len - (ngx_int_t)key->len;
+}
+
+static lws_mmap_index_t *lws_mmap_find (lws_mmap_t *map, ngx_str_t *key, ngx_uint_t range) {
+	size_t     low, high, mid;
+	ngx_int_t  rc;
+
+	/* binary search; in range mode, the greatest key less or equal is found */
+	low = 0;
+	high = map->n;
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		rc = lws_mmap_compare(map, &map->index[mid], key);
+		if (rc == 0) {
+			return &map->index[mid];
+		}
+		if (rc < 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return range && low > 0 ? &map->index[low - 1] : NULL;
+}
+
+
+/*
+ * Lua
+ */
+
+static int lws_lua_mmap (lua_State *L) {
+	ngx_str_t         path;
+	lws_mmap_t       *map;
+	const char       *err;
+	lws_main_conf_t  *lmcf;
+	lws_lua_mmap_t   *lmap;
+
+	path.data = (u_char *)luaL_checklstring(L, 1, &path.len);
+	lmap = lua_newuserdata(L, sizeof(lws_lua_mmap_t));
+	lmap->map = NULL;
+	lmap->range = luaL_checkoption(L, 2, "exact", lws_lua_mmap_formats);
+	lmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, lws_module);
+	(void)ngx_thread_mutex_lock(&lmcf->mmaps_mutex, ngx_cycle->log);
+	map = lws_mmap_open(lmcf, &path, &err);
+	(void)ngx_thread_mutex_unlock(&lmcf->mmaps_mutex, ngx_cycle->log);
+	if (!map) {
+		return luaL_error(L, "%s \"%s\"", err, path.data);
+	}
+	lmap->map = map;
+	luaL_getmetatable(L, LWS_MMAP);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static int lws_lua_mmap_get (lua_State *L) {
+	ngx_str_t          key;
+	lws_mmap_t        *map;
+	lws_lua_mmap_t    *lmap;
+	lws_mmap_index_t  *entry;
+
+	lmap = luaL_checkudata(L, 1, LWS_MMAP);
+	key.data = (u_char *)luaL_checklstring(L, 2, &key.len);
+	map = lmap->map;
+	entry = lws_mmap_find(map, &key, lmap->range);
+	if (!entry) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_pushlstring(L, (const char *)map->data + entry->offset + entry->key_len,
+			entry->value_len);
+	if (lmap->range) {
+		lua_pushlstring(L, (const char *)map->data + entry->offset, entry->key_len);
+		return 2;
+	}
+	return 1;
+}
+
+static int lws_lua_mmap_len (lua_State *L) {
+	lws_lua_mmap_t  *lmap;
+
+	lmap = luaL_checkudata(L, 1, LWS_MMAP);
+	lua_pushinteger(L, lmap->map->n);
+	return 1;
+}
+
+static int lws_lua_mmap_tostring (lua_State *L) {
+	lws_lua_mmap_t  *lmap;
+
+	lmap = luaL_checkudata(L, 1, LWS_MMAP);
+	lua_pushfstring(L, LWS_MMAP ": %s", lmap->map->path.data);
+	return 1;
+}
+
+int lws_open_mmap (lua_State *L) {
+	/* mapped file */
+	luaL_newmetatable(L, LWS_MMAP);
+	lua_createtable(L, 0, 1);
+	lua_pushcfunction(L, lws_lua_mmap_get);
+	lua_setfield(L, -2, "get");
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, lws_lua_mmap_len);
+	lua_setfield(L, -2, "__len");
+	lua_pushcfunction(L, lws_lua_mmap_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_pop(L, 1);
+
+	/* lws.mmap */
+	lua_pushcfunction(L, lws_lua_mmap);
+	return 1;
+}
@@ -0,0 +1,79 @@
+/*
+ * LWS mmap
+ *
+ * Copyright (C) 2024 Andre Naef
+ */
+
+
+#ifndef _LWS_MMAP_INCLUDED
+#define _LWS_MMAP_INCLUDED
+
+
+#include <stdint.h>
+
+
+#define LWS_MMAP_MAGIC  "LWSMMAP1"    /* file magic */
+#define LWS_MMAP_BOM    0x01020304    /* byte order mark */
+
+
+typedef struct lws_mmap_header_s lws_mmap_header_t;
+typedef struct lws_mmap_index_s lws_mmap_index_t;
+
+
+/* file layout: header, index sorted by key, then keys and values; shared with gen/mmap.c */
+struct lws_mmap_header_s {
+	uint8_t           magic[8];   /* LWS_MMAP_MAGIC */
+	uint32_t          bom;        /* LWS_MMAP_BOM in the byte order of the file */
+	uint32_t          reserved;   /* reserved; 0 */
+	uint64_t          n;          /* number of entries */
+};
+
+struct lws_mmap_index_s {
+	uint64_t          offset;     /* offset of key; the value follows the key */
+	uint32_t          key_len;    /* length of key */
+	uint32_t          value_len;  /* length of value */
+};
+
+
+#ifndef LWS_MMAP_LAYOUT_ONLY
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <lua.h>
+
+
+#define LWS_MMAP        "lws.mmap"    /* mapped file metatable */
+
+
+typedef struct lws_mmap_s lws_mmap_t;
+typedef struct lws_lua_mmap_s lws_lua_mmap_t;
+
+
+#include <lws_module.h>
+
+
+struct lws_mmap_s {
+	ngx_queue_t        queue;     /* mapped files */
+	ngx_str_t          path;      /* path; null-terminated */
+	u_char            *data;      /* mapped file */
+	size_t             size;      /* size of mapped file */
+	lws_mmap_index_t  *index;     /* index */
+	size_t             n;         /* number of entries */
+};
+
+struct lws_lua_mmap_s {
+	lws_mmap_t        *map;       /* mapped file */
+	ngx_uint_t         range;     /* lookup the greatest key less or equal */
+};
+
+
+ngx_int_t lws_init_mmaps(lws_main_conf_t *lmcf, ngx_log_t *log);
+void lws_cleanup_mmaps(lws_main_conf_t *lmcf);
+int lws_open_mmap(lua_State *L);
+
+
+#endif /* LWS_MMAP_LAYOUT_ONLY */
+
+
+#endif /* _LWS_MMAP_INCLUDED */
@@ -8,11 +8,18 @@
 #include <lws_module.h>
 #include <ngx_thread_pool.h>
 #include <lws_http.h>
+#include <lws_compress.h>
+#include <lws_cache.h>
+#include <lws_shared.h>
+#include <lws_mmap.h>
+#include <lws_freeze.h>
 
 
 static void *lws_create_main_conf(ngx_conf_t *cf);
 static char *lws_init_main_conf(ngx_conf_t *cf, void *main);
 static void lws_cleanup_main_conf(void *data);
+static ngx_int_t lws_init_process(ngx_cycle_t *cycle);
+static void lws_exit_process(ngx_cycle_t *cycle);
 static char *lws_stat_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static void *lws_create_loc_conf(ngx_conf_t *cf);
 static char *lws_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child);
@@ -21,16 +28,52 @@ static char *lws(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *lws_max_states(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *lws_variable(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *lws_error_response(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *lws_compress(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *lws_coalesce(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 
 static lws_file_status_e lws_get_file_status(ngx_http_request_t *t, ngx_str_t *filename);
-static int lws_set_header(lws_table_t *t, ngx_http_request_t *r, ngx_table_elt_t *header);
+static int lws_set_header(lws_table_t *t, ngx_pool_t *pool, ngx_table_elt_t *header);
 static ngx_int_t lws_handler(ngx_http_request_t *r);
 static void lws_body_handler(ngx_http_request_t *r);
+static void lws_schedule_request(lws_request_ctx_t *ctx);
+static ngx_int_t lws_join_flight(lws_request_ctx_t *ctx);
+static void lws_land_flight(lws_request_ctx_t *ctx);
+static void lws_send_flight_response(lws_request_ctx_t *ctx, lws_request_ctx_t *leader);
+static void lws_leave_flight(lws_request_ctx_t *ctx);
+static void lws_unref_flight(lws_flight_t *flight);
+static ngx_int_t lws_open_stream(lws_request_ctx_t *ctx);
+static void lws_stream_handler(ngx_http_request_t *r);
+static void lws_stream_thread_handler(void *data, ngx_log_t *log);
+static void lws_stream_event_handler(ngx_event_t *ev);
+static void lws_read_stream(lws_request_ctx_t *ctx);
+static ngx_int_t lws_write_stream(lws_request_ctx_t *ctx, ngx_chain_t *in);
+static void lws_end_stream(lws_request_ctx_t *ctx, ngx_flag_t error);
+static void lws_close_stream(lws_stream_t *s);
+static void lws_free_stream(lws_stream_t *s);
 static void lws_queue_handler(ngx_event_t *ev);
 static void lws_state_handler(lws_request_ctx_t *ctx);
 static void lws_thread_handler(void *data, ngx_log_t *log);
+static ngx_int_t lws_prepare_request(lws_request_ctx_t *ctx);
 static ssize_t lws_read_handler(void *cookie, char *buf, size_t size);
+static int lws_seek_handler(void *cookie, off64_t *offset, int whence);
+static ssize_t lws_stream_read_handler(void *cookie, char *buf, size_t size);
+static ssize_t lws_response_write_handler(void *cookie, const char *buf, size_t size);
+static int lws_response_seek_handler(void *cookie, off64_t *offset, int whence);
 static void lws_finalization_handler(ngx_event_t *ev);
+static void lws_finalize_state(lws_request_ctx_t *ctx);
+static void lws_send_response(lws_request_ctx_t *ctx);
+static ngx_int_t lws_prepare_response_headers(lws_request_ctx_t *ctx);
+static ngx_int_t lws_push_response_header(lws_request_ctx_t *ctx, ngx_str_t *key,
+		ngx_str_t *value, ngx_table_elt_t **ref);
+static ngx_int_t lws_set_response_headers(lws_request_ctx_t *ctx);
+static ngx_int_t lws_open_sendfile(lws_request_ctx_t *ctx, ngx_buf_t **file);
+static void lws_send_response_tail(lws_request_ctx_t *ctx);
+static void lws_flush_response(lws_request_ctx_t *ctx);
+static void lws_flush_handler(ngx_http_request_t *r);
+static void lws_complete_flush(lws_request_ctx_t *ctx, ngx_int_t rc);
+static void lws_start_subrequests(lws_request_ctx_t *ctx);
+static ngx_int_t lws_subrequest_handler(ngx_http_request_t *sr, void *data, ngx_int_t rc);
+static void lws_subrequests_handler(ngx_http_request_t *r);
 static void lws_send_error_response(lws_request_ctx_t *ctx, ngx_int_t rc);
 static void lws_send_json_error_response(lws_request_ctx_t *ctx, ngx_int_t rc);
 static void lws_send_html_error_response(lws_request_ctx_t *ctx, ngx_int_t rc);
@@ -40,16 +83,55 @@ static void lws_cleanup_request_ctx(void *data);
 static cookie_io_functions_t lws_request_read_functions = {
 	lws_read_handler,  /* read */
 	NULL,              /* write */
-	NULL,              /* seek */
+	lws_seek_handler,  /* seek */
 	NULL               /* close */
 };
 
+static cookie_io_functions_t lws_request_stream_functions = {
+	lws_stream_read_handler,  /* read */
+	NULL,                     /* write */
+	NULL,                     /* seek */
+	NULL                      /* close */
+};
+
+static cookie_io_functions_t lws_response_write_functions = {
+	NULL,                        /* read */
+	lws_response_write_handler,  /* write */
+	lws_response_seek_handler,   /* seek */
+	NULL                         /* close */
+};
+
 static ngx_conf_enum_t lws_error_responses[] = {
 	{ngx_string("json"), LWS_ER_JSON},
 	{ngx_string("html"), LWS_ER_HTML},
 	{ngx_null_string, 0}
 };
 
+static ngx_conf_enum_t lws_compress_types[] = {
+	{ngx_string("off"), LWS_CO_OFF},
+	{ngx_string("gzip"), LWS_CO_GZIP},
+	{ngx_string("deflate"), LWS_CO_DEFLATE},
+	{ngx_null_string, 0}
+};
+
+static ngx_conf_enum_t lws_etag_modes[] = {
+	{ngx_string("off"), LWS_ET_OFF},
+	{ngx_string("auto"), LWS_ET_AUTO},
+	{ngx_null_string, 0}
+};
+
+static ngx_conf_enum_t lws_post_modes[] = {
+	{ngx_string("before_response"), LWS_PM_BEFORE_RESPONSE},
+	{ngx_string("after_response"), LWS_PM_AFTER_RESPONSE},
+	{ngx_null_string, 0}
+};
+
+static ngx_conf_enum_t lws_response_bodies[] = {
+	{ngx_string("file"), LWS_RB_FILE},
+	{ngx_string("buffer"), LWS_RB_BUFFER},
+	{ngx_null_string, 0}
+};
+
 static ngx_command_t lws_commands[] = {
 	{
 		ngx_string("lws_thread_pool"),
@@ -99,6 +181,126 @@ static ngx_command_t lws_commands[] = {
 		offsetof(lws_loc_conf_t, post),
 		NULL
 	},
+	{
+		ngx_string("lws_post_mode"),
+		NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+		ngx_conf_set_enum_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(lws_loc_conf_t, post_mode),
+		lws_post_modes
+	},
+	{
+		ngx_string("lws_request_buffering"),
+		NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+		ngx_conf_set_flag_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(lws_loc_conf_t, request_buffering),
+		NULL
+	},
+	{
+		ngx_string("lws_request_decompress"),
+		NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+		ngx_conf_set_flag_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(lws_loc_conf_t, decompress),
+		NULL
+	},
+	{
+		ngx_string("lws_request_decompress_max_size"),
+		NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+		ngx_conf_set_size_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(lws_loc_conf_t, decompress_max_size),
+		NULL
+	},
+	{
+		ngx_string("lws_response_body"),
+		NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+		ngx_conf_set_enum_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(lws_loc_conf_t, response_body),
+		lws_response_bodies
+	},
+	{
+		ngx_string("lws_response_buffer_size"),
+		NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+		ngx_conf_set_size_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(lws_loc_conf_t, response_buffer_size),
+		NULL
+	},
+	{
+		ngx_string("lws_flush_size"),
+		NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+		ngx_conf_set_size_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(lws_loc_conf_t, flush_size),
+		NULL
+	},
+	{
+		ngx_string("lws_coalesce"),
+		NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+		lws_coalesce,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		0,
+		NULL
+	},
+	{
+		ngx_string("lws_cache_zone"),
+		NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE2,
+		lws_cache_zone,
+		NGX_HTTP_MAIN_CONF_OFFSET,
+		0,
+		NULL
+	},
+	{
+		ngx_string("lws_shared_dict"),
+		NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE234,
+		lws_shared_dict,
+		NGX_HTTP_MAIN_CONF_OFFSET,
+		0,
+		NULL
+	},
+	{
+		ngx_string("lws_init_shared"),
+		NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+		ngx_conf_set_str_slot,
+		NGX_HTTP_MAIN_CONF_OFFSET,
+		offsetof(lws_main_conf_t, init_shared),
+		NULL
+	},
+	{
+		ngx_string("lws_local_cache"),
+		NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+		lws_local_cache,
+		NGX_HTTP_MAIN_CONF_OFFSET,
+		0,
+		NULL
+	},
+	{
+		ngx_string("lws_cache"),
+		NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+		lws_cache,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		0,
+		NULL
+	},
+	{
+		ngx_string("lws_compress"),
+		NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE123,
+		lws_compress,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(lws_loc_conf_t, compress),
+		lws_compress_types
+	},
+	{
+		ngx_string("lws_etag"),
+		NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+		ngx_conf_set_enum_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(lws_loc_conf_t, etag),
+		lws_etag_modes
+	},
 	{
 		ngx_string("lws_path"),
 		NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
@@ -208,10 +410,10 @@ ngx_module_t lws_module = {
 	NGX_HTTP_MODULE,
 	NULL,                  /* init master */
 	NULL,                  /* init module */
-	NULL,                  /* init process */
+	lws_init_process,      /* init process */
 	NULL,                  /* init thread */
 	NULL,                  /* exit thread */
-	NULL,                  /* exit process */
+	lws_exit_process,      /* exit process */
 	NULL,                  /* exit master */
 	NGX_MODULE_V1_PADDING
 };
@@ -232,6 +434,9 @@ static void *lws_create_main_conf (ngx_conf_t *cf) {
 	}
 	lmcf->stat_cache_cap = NGX_CONF_UNSET_SIZE;
 	lmcf->stat_cache_timeout = NGX_CONF_UNSET;
+	if (lws_init_mmaps(lmcf, cf->log) != NGX_OK) {
+		return NULL;
+	}
 
 	/* add cleanup */
 	cln = ngx_pool_cleanup_add(cf->pool, 0);
@@ -270,6 +475,11 @@ static char *lws_init_main_conf (ngx_conf_t *cf, void *conf) {
 		lws_table_set_timeout(lmcf->stat_cache, lmcf->stat_cache_timeout);
 	}
 
+	/* shared init chunk */
+	if (lmcf->init_shared.len) {
+		return lws_run_init_shared(cf, lmcf);
+	}
+
 	return NGX_CONF_OK;
 }
 
@@ -280,6 +490,16 @@ static void lws_cleanup_main_conf (void *data) {
 	if (lmcf->stat_cache) {
 		lws_table_free(lmcf->stat_cache);
 	}
+	lws_cleanup_mmaps(lmcf);
+	lws_cleanup_frozen(lmcf);
+}
+
+static ngx_int_t lws_init_process (ngx_cycle_t *cycle) {
+	return lws_init_shared_process(cycle);
+}
+
+static void lws_exit_process (ngx_cycle_t *cycle) {
+	lws_exit_shared_process(cycle);
 }
 
 static char *lws_stat_cache (ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
@@ -318,6 +538,21 @@ static void *lws_create_loc_conf (ngx_conf_t *cf) {
 	llcf->state_requests_max = NGX_CONF_UNSET;
 	llcf->state_time_max = NGX_CONF_UNSET_MSEC;
 	llcf->state_timeout = NGX_CONF_UNSET_MSEC;
+	llcf->post_mode = NGX_CONF_UNSET_UINT;
+	llcf->request_buffering = NGX_CONF_UNSET;
+	llcf->decompress = NGX_CONF_UNSET;
+	llcf->decompress_max_size = NGX_CONF_UNSET_SIZE;
+	llcf->response_body = NGX_CONF_UNSET_UINT;
+	llcf->response_buffer_size = NGX_CONF_UNSET_SIZE;
+	llcf->flush_size = NGX_CONF_UNSET_SIZE;
+	llcf->coalesce = NGX_CONF_UNSET_PTR;
+	llcf->cache = NGX_CONF_UNSET_PTR;
+	llcf->cache_valid = NGX_CONF_UNSET;
+	llcf->cache_stale = NGX_CONF_UNSET;
+	llcf->compress = NGX_CONF_UNSET_UINT;
+	llcf->compress_level = NGX_CONF_UNSET;
+	llcf->compress_min_length = NGX_CONF_UNSET_SIZE;
+	llcf->etag = NGX_CONF_UNSET_UINT;
 	llcf->error_response = NGX_CONF_UNSET_UINT;
 	llcf->diagnostic = NGX_CONF_UNSET;
 	if (ngx_array_init(&llcf->variables, cf->pool, 4, sizeof(lws_variable_t)) != NGX_OK) {
@@ -353,6 +588,27 @@ static char *lws_merge_loc_conf (ngx_conf_t *cf, void *parent, void *child) {
 	ngx_conf_merge_str_value(conf->init, prev->init, "");
 	ngx_conf_merge_str_value(conf->pre, prev->pre, "");
 	ngx_conf_merge_str_value(conf->post, prev->post, "");
+	ngx_conf_merge_uint_value(conf->post_mode, prev->post_mode, LWS_PM_BEFORE_RESPONSE);
+	ngx_conf_merge_value(conf->request_buffering, prev->request_buffering, 1);
+	ngx_conf_merge_value(conf->decompress, prev->decompress, 0);
+	ngx_conf_merge_size_value(conf->decompress_max_size, prev->decompress_max_size,
+			LWS_DECOMPRESS_MAX_SIZE_DEFAULT);
+	ngx_conf_merge_uint_value(conf->response_body, prev->response_body, LWS_RB_FILE);
+	ngx_conf_merge_size_value(conf->response_buffer_size, prev->response_buffer_size, 0);
+	ngx_conf_merge_size_value(conf->flush_size, prev->flush_size, 0);
+	ngx_conf_merge_ptr_value(conf->coalesce, prev->coalesce, NULL);
+	if (conf->cache == NGX_CONF_UNSET_PTR) {
+		conf->cache = prev->cache != NGX_CONF_UNSET_PTR ? prev->cache : NULL;
+		conf->cache_key = prev->cache_key;
+		conf->cache_valid = prev->cache_valid;
+		conf->cache_stale = prev->cache_stale;
+	}
+	ngx_conf_merge_uint_value(conf->compress, prev->compress, LWS_CO_OFF);
+	ngx_conf_merge_value(conf->compress_level, prev->compress_level,
+			LWS_COMPRESS_LEVEL_DEFAULT);
+	ngx_conf_merge_size_value(conf->compress_min_length, prev->compress_min_length,
+			LWS_COMPRESS_MIN_LENGTH_DEFAULT);
+	ngx_conf_merge_uint_value(conf->etag, prev->etag, LWS_ET_OFF);
 	ngx_conf_merge_str_value(conf->path, prev->path, "");
 	ngx_conf_merge_str_value(conf->cpath, prev->cpath, "");
 	ngx_conf_merge_size_value(conf->states_max, prev->states_max, 0);
@@ -387,11 +643,16 @@ static void lws_cleanup_loc_conf (void *data) {
 		state = ngx_queue_data(q, lws_state_t, queue);
 		lws_close_state(state, ngx_cycle->log);
 	}
+	lws_stop_timers(llcf);
+	if (llcf->flights) {
+		lws_table_free(llcf->flights);
+	}
 }
 
 static char *lws (ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
 	ngx_str_t                        *values;
 	lws_loc_conf_t                   *llcf;
+	lws_main_conf_t                  *lmcf;
 	ngx_http_core_loc_conf_t         *clcf;
 	ngx_http_compile_complex_value_t  ccv;
 
@@ -432,6 +693,12 @@ static char *lws (ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
 		}
 	}
 
+	/* add invalidation tags shared memory zone */
+	lmcf = ngx_http_conf_get_module_main_conf(cf, lws_module);
+	if (!lmcf->tags_shm && lws_add_tags(cf, lmcf) != NGX_OK) {
+		return NGX_CONF_ERROR;
+	}
+
 	/* install handler */
 	clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
 	clcf->handler = lws_handler;
@@ -506,6 +773,78 @@ static char *lws_error_response (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 	return NGX_CONF_OK;
 }
 
+static char *lws_compress (ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+	char            *result;
+	ngx_str_t       *values, value;
+	ngx_uint_t       i;
+	lws_loc_conf_t  *llcf;
+
+	if ((result = ngx_conf_set_enum_slot(cf, cmd, conf)) != NGX_CONF_OK) {
+		return result;
+	}
+	llcf = conf;
+	llcf->compress_level = LWS_COMPRESS_LEVEL_DEFAULT;
+	llcf->compress_min_length = LWS_COMPRESS_MIN_LENGTH_DEFAULT;
+	values = cf->args->elts;
+	for (i = 2; i < cf->args->nelts; i++) {
+		if (ngx_strncmp(values[i].data, "level=", 6) == 0) {
+			value.data = values[i].data + 6;
+			value.len = values[i].len - 6;
+			llcf->compress_level = ngx_atoi(value.data, value.len);
+			if (llcf->compress_level < 1 || llcf->compress_level > 9) {
+				return "has invalid level value";
+			}
+		} else if (ngx_strncmp(values[i].data, "min_length=", 11) == 0) {
+			value.data = values[i].data + 11;
+			value.len = values[i].len - 11;
+			llcf->compress_min_length = ngx_parse_size(&value);
+			if (llcf->compress_min_length == (size_t)NGX_ERROR) {
+				return "has invalid min_length value";
+			}
+		} else {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid attribute value \"%s\"",
+					values[i].data);
+			return NGX_CONF_ERROR;
+		}
+	}
+	return NGX_CONF_OK;
+}
+
+static char *lws_coalesce (ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+	ngx_str_t                        *values, value;
+	lws_loc_conf_t                   *llcf;
+	ngx_http_compile_complex_value_t  ccv;
+
+	llcf = conf;
+	if (llcf->coalesce != NGX_CONF_UNSET_PTR) {
+		return "is duplicate";
+	}
+	values = cf->args->elts;
+	if (ngx_strcmp(values[1].data, "off") == 0) {
+		llcf->coalesce = NULL;
+		return NGX_CONF_OK;
+	}
+	if (ngx_strncmp(values[1].data, "key=", 4) != 0) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid attribute value \"%s\"",
+				values[1].data);
+		return NGX_CONF_ERROR;
+	}
+	value.data = values[1].data + 4;
+	value.len = values[1].len - 4;
+	llcf->coalesce = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+	if (!llcf->coalesce) {
+		return NGX_CONF_ERROR;
+	}
+	ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+	ccv.cf = cf;
+	ccv.value = &value;
+	ccv.complex_value = llcf->coalesce;
+	if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+		return NGX_CONF_ERROR;
+	}
+	return NGX_CONF_OK;
+}
+
 
 /*
  * handler
@@ -535,19 +874,19 @@ static lws_file_status_e lws_get_file_status (ngx_http_request_t *r, ngx_str_t *
 	return fs;
 }
 
-static int lws_set_header (lws_table_t *t, ngx_http_request_t *r, ngx_table_elt_t *header) {
+static int lws_set_header (lws_table_t *t, ngx_pool_t *pool, ngx_table_elt_t *header) {
 	size_t      len;
 	u_char     *p;
 	ngx_log_t  *log;
 	ngx_str_t  *existing, *value;
 
-	log = r->connection->log;
+	log = pool->log;
 	existing = lws_table_get(t, &header->key);
 	if (!existing) {
 		value = &header->value;
 	} else {
 		len = existing->len + 2 + header->value.len;
-		value = ngx_palloc(r->pool, sizeof(ngx_str_t) + len);
+		value = ngx_palloc(pool, sizeof(ngx_str_t) + len);
 		if (!value) {
 			ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to allocate header");
 			return -1;
@@ -568,15 +907,14 @@ static int lws_set_header (lws_table_t *t, ngx_http_request_t *r, ngx_table_elt_
 static ngx_int_t lws_handler (ngx_http_request_t *r) {
 	ngx_int_t                   rc;
 	ngx_log_t                  *log;
-	ngx_str_t                   main;
+	ngx_str_t                   main, key;
 	ngx_str_t                  *value;
 	ngx_uint_t                  i;
-	ngx_list_part_t            *part;
-	ngx_table_elt_t            *headers;
 	lws_loc_conf_t             *llcf;
 	lws_variable_t             *variables;
 	lws_request_ctx_t          *ctx;;
 	ngx_pool_cleanup_t         *cln;
+	ngx_http_core_loc_conf_t   *clcf;
 	ngx_http_variable_value_t  *variable_value;
 
 	/* check if enabled */
@@ -585,6 +923,12 @@ static ngx_int_t lws_handler (ngx_http_request_t *r) {
 		return NGX_DECLINED;
 	}
 
+	/* cached response? */
+	rc = lws_cache_handler(r, &key);
+	if (rc != NGX_DECLINED) {
+		return rc;
+	}
+
 	/* check main */
 	log = r->connection->log;
 	if (ngx_http_complex_value(r, llcf->main, &main) != NGX_OK) {
@@ -612,17 +956,20 @@ static ngx_int_t lws_handler (ngx_http_request_t *r) {
 	cln->data = ctx;
 	ctx->r = r;
 	ctx->main = main;
+	ctx->cache_key = key;
 	if (llcf->path_info && ngx_http_complex_value(r, llcf->path_info, &ctx->path_info)
 			!= NGX_OK) {
 		ngx_log_error(NGX_LOG_ERR, log, 0, "[LWS] failed to evaluate path info");
 		return NGX_HTTP_INTERNAL_SERVER_ERROR;
 	}
 
-	/* prepare request variables */
-	ctx->variables = lws_table_create(llcf->variables.nelts, log);
-	if (!ctx->variables) {
-		ngx_log_error(NGX_LOG_ERR, log, 0, "[LWS] failed to create variables");
-		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	/* prepare request variables; NGINX variables are evaluated in the event loop */
+	if (llcf->variables.nelts > 0) {
+		ctx->variables = lws_table_create(llcf->variables.nelts, log);
+		if (!ctx->variables) {
+			ngx_log_error(NGX_LOG_ERR, log, 0, "[LWS] failed to create variables");
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
 	}
 	variables = llcf->variables.elts;
 	for (i = 0; i < llcf->variables.nelts; i++) {
@@ -643,44 +990,25 @@ static ngx_int_t lws_handler (ngx_http_request_t *r) {
 		}
 	}
 
-	/* prepare request headers */
-	ctx->request_headers = lws_table_create(32, log);
-	if (!ctx->request_headers) {
-		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to create request headers");
-		return NGX_HTTP_INTERNAL_SERVER_ERROR;
-	}
-	lws_table_set_ci(ctx->request_headers, 1);
-	part = &r->headers_in.headers.part;
-	while (part) {
-		headers = part->elts;
-		for (i = 0; i < part->nelts; i++) {
-			if (lws_set_header(ctx->request_headers, r, &headers[i]) != 0) {
-				return NGX_HTTP_INTERNAL_SERVER_ERROR;
-			}
-		}
-		part = part->next;
-	}
-
-	/* prepare response headers */
-	ctx->response_headers = lws_table_create(8, log);
-	if (!ctx->response_headers) {
-		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to create response headers");
-		return NGX_HTTP_INTERNAL_SERVER_ERROR;
-	}
-	lws_table_set_dup(ctx->response_headers, 1);
-	lws_table_set_free(ctx->response_headers, 1);
-	lws_table_set_ci(ctx->response_headers, 1);
+	/* prepare response; headers and the request body stream are prepared in the pool thread */
+	clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 	ctx->status = NGX_HTTP_OK;
+	ctx->response_body.log = log;
+	ctx->response_body.max = llcf->response_buffer_size;
+	ctx->response_body.path = clcf->client_body_temp_path;
 
-	/* prepare response body */
-	ctx->response_body = open_memstream((char **)&ctx->response_body_str.data,
-			&ctx->response_body_str.len);
-	if (!ctx->response_body) {
-		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to open response body stream");
-		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	/* no request body? */
+	if ((r->method & (NGX_HTTP_GET | NGX_HTTP_HEAD)) && r->headers_in.content_length_n <= 0
+			&& !r->headers_in.chunked && r->http_version < NGX_HTTP_VERSION_20) {
+		r->main->count++;
+		lws_body_handler(r);
+		return NGX_DONE;
 	}
 
-	/* read request body */
+	/* read request body; unbuffered, the body handler runs before the body is read */
+	if (!llcf->request_buffering) {
+		r->request_body_no_buffering = 1;
+	}
 	rc = ngx_http_read_client_request_body(r, lws_body_handler);
 	if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
 		return rc;
@@ -689,35 +1017,47 @@ static ngx_int_t lws_handler (ngx_http_request_t *r) {
 }
 
 static void lws_body_handler (ngx_http_request_t *r) {
-	ngx_log_t          *log;
 	lws_loc_conf_t     *llcf;
-	lws_main_conf_t    *lmcf;
 	lws_request_ctx_t  *ctx;
 
-	/* prepare request body */
-	log = r->connection->log;
+	/* an unbuffered request body is streamed; other request bodies are complete */
 	ctx = ngx_http_get_module_ctx(r, lws_module);
-	if (!r->request_body) {
-		ngx_log_error(NGX_LOG_ERR, log, errno, "[LWS] missing request body");
+	if (r->reading_body && lws_open_stream(ctx) != NGX_OK) {
 		ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
 		return;
 	}
-	if (r->request_body->temp_file) {
-		ctx->request_body = fdopen(r->request_body->temp_file->file.fd, "rb");
-	} else {
-		ctx->cl = r->request_body->bufs;
-		ctx->request_body = fopencookie(ctx, "rb", lws_request_read_functions);
-	}
-	if (!ctx->request_body) {
-		ngx_log_error(NGX_LOG_ERR, log, errno, "[LWS] failed to open request body stream");
-		ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
-		return;
+
+	/* identical request running? */
+	llcf = ngx_http_get_module_loc_conf(r, lws_module);
+	if (llcf->coalesce && r->method == NGX_HTTP_GET && !ctx->stream) {
+		switch (lws_join_flight(ctx)) {
+		case NGX_OK:
+			break;
+
+		case NGX_DONE:
+			return;
+
+		default:
+			ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+			return;
+		}
 	}
+	lws_schedule_request(ctx);
+}
+
+static void lws_schedule_request (lws_request_ctx_t *ctx) {
+	ngx_log_t           *log;
+	lws_loc_conf_t      *llcf;
+	lws_main_conf_t     *lmcf;
+	ngx_http_request_t  *r;
 
-	/* proceed, queue, or abort */
+	/* proceed, queue, or abort; subrequests are not queued, as their parent request may hold a
+	 * Lua state that queued requests wait for */
+	r = ctx->r;
+	log = r->connection->log;
 	llcf = ngx_http_get_module_loc_conf(r, lws_module);
 	if (!ngx_queue_empty(&llcf->states) || llcf->states_max == 0
-			|| llcf->states_n < llcf->states_max) {
+			|| llcf->states_n < llcf->states_max || r != r->main) {
 		lws_state_handler(ctx);
 	} else if (llcf->requests_max == 0 || llcf->requests_n < llcf->requests_max) {
 		llcf->requests_n++;
@@ -735,69 +1075,513 @@ static void lws_body_handler (ngx_http_request_t *r) {
 	}
 }
 
-static void lws_queue_handler (ngx_event_t *ev) {
-	ngx_queue_t        *q;
-	lws_loc_conf_t     *llcf;
-	lws_main_conf_t    *lmcf;
-	lws_request_ctx_t  *ctx;
+static ngx_int_t lws_join_flight (lws_request_ctx_t *ctx) {
+	ngx_str_t            key;
+	lws_flight_t        *flight;
+	lws_loc_conf_t      *llcf;
+	ngx_http_request_t  *r;
 
-	llcf = ev->data;
-	lmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, lws_module);
-	while (!ngx_queue_empty(&llcf->requests) && (!ngx_queue_empty(&llcf->states)
-			|| llcf->states_max == 0 || llcf->states_n < llcf->states_max)) {
-		q = ngx_queue_head(&llcf->requests);
+	/* evaluate key */
+	r = ctx->r;
+	llcf = ngx_http_get_module_loc_conf(r, lws_module);
+	if (ngx_http_complex_value(r, llcf->coalesce, &key) != NGX_OK) {
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+				"[LWS] failed to evaluate coalescing key");
+		return NGX_ERROR;
+	}
+	if (key.len == 0) {
+		return NGX_OK;
+	}
+	if (!llcf->flights) {
+		llcf->flights = lws_table_create(16, ngx_cycle->log);
+		if (!llcf->flights) {
+			return NGX_ERROR;
+		}
+		lws_table_set_dup(llcf->flights, 1);
+	}
+
+	/* park on the running request */
+	flight = lws_table_get(llcf->flights, &key);
+	if (flight) {
+		ngx_queue_insert_tail(&flight->followers, &ctx->queue);
+		ctx->flight = flight;
+		ctx->parked = 1;
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"[LWS] request parked key:%V", &key);
+		return NGX_DONE;
+	}
+
+	/* lead */
+	flight = ngx_calloc(sizeof(lws_flight_t) + key.len, r->connection->log);
+	if (!flight) {
+		return NGX_ERROR;
+	}
+	flight->key.data = (u_char *)&flight[1];
+	flight->key.len = key.len;
+	ngx_memcpy(flight->key.data, key.data, key.len);
+	flight->llcf = llcf;
+	flight->leader = ctx;
+	ngx_queue_init(&flight->followers);
+	flight->refs = 1;
+	if (lws_table_set(llcf->flights, &flight->key, flight) != 0) {
+		ngx_free(flight);
+		return NGX_ERROR;
+	}
+	ctx->flight = flight;
+	return NGX_OK;
+}
+
+static void lws_land_flight (lws_request_ctx_t *ctx) {
+	ngx_uint_t           share;
+	ngx_queue_t         *q;
+	lws_flight_t        *flight;
+	lws_request_ctx_t   *follower;
+
+	/* new requests start a new flight */
+	flight = ctx->flight;
+	lws_table_set(flight->llcf->flights, &flight->key, NULL);
+	flight->landed = 1;
+
+	/* answer parked requests from the response, or let them run */
+	share = ctx->rc == 0 && !ctx->redirect.len && !ctx->sendfile.len && !ctx->streaming
+			&& ctx->headers_out.elts;
+	while (!ngx_queue_empty(&flight->followers)) {
+		q = ngx_queue_head(&flight->followers);
 		ngx_queue_remove(q);
-		llcf->requests_n--;
-		if (lmcf->monitor) {
-			ngx_atomic_fetch_add(&lmcf->monitor->requests_n, -1);
+		follower = ngx_queue_data(q, lws_request_ctx_t, queue);
+		follower->parked = 0;
+		if (share) {
+			lws_send_flight_response(follower, ctx);
+		} else {
+			follower->flight = NULL;
+			lws_schedule_request(follower);
 		}
-		ctx = ngx_queue_data(q, lws_request_ctx_t, queue);
-		lws_state_handler(ctx);
 	}
 }
 
-static void lws_state_handler (lws_request_ctx_t *ctx) {
-	ngx_log_t           *log;
-	lws_main_conf_t     *lmcf;
-	ngx_thread_task_t   *task;
-	ngx_http_request_t  *r;
-
-	/* acquire state */
-	r = ctx->r;
-	if (lws_acquire_state(ctx) != 0) {
-		ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+static void lws_send_flight_response (lws_request_ctx_t *ctx, lws_request_ctx_t *leader) {
+	ngx_str_t  key, *etag;
+
+	/* headers are shared; the body is shared unless it references Lua strings */
+	ctx->status = leader->status;
+	ctx->headers_out = leader->headers_out;
+	ctx->content_type = leader->content_type;
+	ctx->last_modified = leader->last_modified;
+	ctx->cache_key.len = 0;
+	ctx->flight->refs++;
+
+	/* not modified? the request entity tag is compared with the entity tag of the leader */
+	ngx_str_set(&key, "ETag");
+	if (ctx->status == NGX_HTTP_OK && (etag = lws_table_get(leader->response_headers, &key))
+			&& lws_is_not_modified(ctx->r, etag)) {
+		ctx->status = NGX_HTTP_NOT_MODIFIED;
+	} else if (!leader->state->anchored) {
+		ctx->response_body = leader->response_body;
+		ctx->shared = 1;
+	} else if (lws_body_copy(&ctx->response_body, &leader->response_body) != 0) {
+		ngx_http_finalize_request(ctx->r, NGX_HTTP_INTERNAL_SERVER_ERROR);
 		return;
 	}
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->r->connection->log, 0,
+			"[LWS] request coalesced shared:%d", ctx->shared);
+	lws_send_response(ctx);
+}
 
-	/* setup task */
-	log = r->connection->log;
-	task = ngx_thread_task_alloc(r->pool, sizeof(lws_request_ctx_t *));
-	if (!task) {
-		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to allocate thread task");
-		lws_release_state(ctx);
-		ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
-		return;
-	}
-	*(lws_request_ctx_t **)task->ctx = ctx;
-	task->handler = lws_thread_handler;
-	task->event.handler = lws_finalization_handler;
-	task->event.data = ctx;
+static void lws_leave_flight (lws_request_ctx_t *ctx) {
+	ngx_queue_t        *q;
+	lws_flight_t       *flight;
+	lws_request_ctx_t  *follower;
 
-	/* post task */
-	lmcf = ngx_http_get_module_main_conf(r, lws_module);
-	if (ngx_thread_task_post(lmcf->thread_pool, task) != NGX_OK) {
-		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to post thread task");
-		lws_release_state(ctx);
-		ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+	/* parked */
+	flight = ctx->flight;
+	if (ctx->parked) {
+		ngx_queue_remove(&ctx->queue);
 		return;
 	}
-}
+
+	/* leader terminated before it was done; parked requests run */
+	if (flight->leader == ctx && !flight->landed) {
+		lws_table_set(flight->llcf->flights, &flight->key, NULL);
+		while (!ngx_queue_empty(&flight->followers)) {
+			q = ngx_queue_head(&flight->followers);
+			ngx_queue_remove(q);
+			follower = ngx_queue_data(q, lws_request_ctx_t, queue);
+			follower->parked = 0;
+			follower->flight = NULL;
+			lws_schedule_request(follower);
+		}
+	}
+
+	/* leader done; the response outlives it while referenced */
+	if (flight->leader == ctx) {
+		if (flight->refs > 1) {
+			flight->pool = ctx->pool;
+			flight->headers = ctx->response_headers;
+			flight->body = ctx->response_body;
+			flight->owned = 1;
+			ctx->pool = NULL;
+			ctx->response_headers = NULL;
+			ngx_memzero(&ctx->response_body, sizeof(lws_body_t));
+		}
+		flight->leader = NULL;
+	}
+	lws_unref_flight(flight);
+}
+
+static void lws_unref_flight (lws_flight_t *flight) {
+	if (--flight->refs > 0) {
+		return;
+	}
+	if (flight->owned) {
+		lws_table_free(flight->headers);
+		lws_body_free(&flight->body);
+		ngx_destroy_pool(flight->pool);
+	}
+	ngx_free(flight);
+}
+
+static ngx_int_t lws_open_stream (lws_request_ctx_t *ctx) {
+	ngx_log_t                 *log;
+	lws_stream_t              *s;
+	ngx_http_request_t        *r;
+	ngx_http_core_loc_conf_t  *clcf;
+
+	/* create stream; it outlives the request while its task is posted */
+	r = ctx->r;
+	log = r->connection->log;
+	s = ngx_calloc(sizeof(lws_stream_t), log);
+	if (!s) {
+		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to allocate request body stream");
+		return NGX_ERROR;
+	}
+	if (ngx_thread_mutex_create(&s->mtx, log) != NGX_OK) {
+		ngx_free(s);
+		return NGX_ERROR;
+	}
+	if (ngx_thread_cond_create(&s->cond, log) != NGX_OK) {
+		ngx_thread_mutex_destroy(&s->mtx, log);
+		ngx_free(s);
+		return NGX_ERROR;
+	}
+	clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+	s->data.log = log;
+	s->task.ctx = s;
+	s->task.handler = lws_stream_thread_handler;
+	s->task.event.handler = lws_stream_event_handler;
+	s->task.event.data = s;
+	s->ctx = ctx;
+	s->size = clcf->client_body_buffer_size;
+	ctx->stream = s;
+
+	/* Lua reads the stream in a pool thread while the event loop feeds it */
+	ctx->request_body = fopencookie(ctx, "rb", lws_request_stream_functions);
+	if (!ctx->request_body) {
+		ngx_log_error(NGX_LOG_ERR, log, errno, "[LWS] failed to open request body stream");
+		return NGX_ERROR;
+	}
+	r->read_event_handler = lws_stream_handler;
+	lws_read_stream(ctx);
+	return NGX_OK;
+}
+
+static void lws_stream_handler (ngx_http_request_t *r) {
+	lws_read_stream(ngx_http_get_module_ctx(r, lws_module));
+}
+
+static void lws_stream_thread_handler (void *data, ngx_log_t *log) {
+	/* void; the completion resumes the stream in the event loop */
+}
+
+static void lws_stream_event_handler (ngx_event_t *ev) {
+	lws_stream_t  *s;
+
+	/* the request may have been finalized while the task was posted */
+	s = ev->data;
+	ngx_thread_mutex_lock(&s->mtx, ngx_cycle->log);
+	s->posted = 0;
+	ngx_thread_mutex_unlock(&s->mtx, ngx_cycle->log);
+	if (!s->ctx) {
+		lws_free_stream(s);
+		return;
+	}
+	if (s->ctx->r->read_event_handler != lws_stream_handler) {
+		return;
+	}
+	lws_read_stream(s->ctx);
+}
+
+static void lws_read_stream (lws_request_ctx_t *ctx) {
+	ngx_int_t            rc;
+	ngx_flag_t           paused;
+	lws_stream_t        *s;
+	ngx_connection_t    *c;
+	ngx_http_request_t  *r;
+
+	r = ctx->r;
+	c = r->connection;
+	s = ctx->stream;
+	for ( ;; ) {
+		/* hand over received data */
+		if (r->request_body->bufs) {
+			if (lws_write_stream(ctx, r->request_body->bufs) != NGX_OK) {
+				lws_end_stream(ctx, 1);
+				return;
+			}
+			r->request_body->bufs = NULL;
+		}
+
+		/* complete? */
+		if (!r->reading_body) {
+			lws_end_stream(ctx, 0);
+			return;
+		}
+
+		/* pause while Lua has a buffer of unread data; Lua resumes the stream when drained,
+		 * and the client body timeout is suspended */
+		ngx_thread_mutex_lock(&s->mtx, c->log);
+		s->paused = s->data.len >= s->size;
+		paused = s->paused;
+		ngx_thread_mutex_unlock(&s->mtx, c->log);
+		if (paused) {
+			if (c->read->timer_set) {
+				ngx_del_timer(c->read);
+			}
+			return;
+		}
+
+		/* read */
+		rc = ngx_http_read_unbuffered_request_body(r);
+		if (rc >= NGX_HTTP_SPECIAL_RESPONSE || rc == NGX_ERROR) {
+			ngx_log_error(NGX_LOG_INFO, c->log, 0, "[LWS] failed to read request body rc:%i",
+					rc);
+			lws_end_stream(ctx, 1);
+			return;
+		}
+		if (rc == NGX_AGAIN && !r->request_body->bufs) {
+			return;  /* resumes with the next read event */
+		}
+	}
+}
+
+static ngx_int_t lws_write_stream (lws_request_ctx_t *ctx, ngx_chain_t *in) {
+	ngx_int_t      rc;
+	ngx_buf_t     *b;
+	ngx_log_t     *log;
+	lws_stream_t  *s;
+
+	/* copy; the buffers are consumed and reused by NGINX */
+	s = ctx->stream;
+	log = ctx->r->connection->log;
+	rc = NGX_OK;
+	ngx_thread_mutex_lock(&s->mtx, log);
+	for ( ; in; in = in->next) {
+		b = in->buf;
+		if (rc == NGX_OK && lws_body_write(&s->data, b->pos, b->last - b->pos) != 0) {
+			ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to write request body stream");
+			rc = NGX_ERROR;
+		}
+		b->pos = b->last;
+	}
+	ngx_thread_cond_signal(&s->cond, log);
+	ngx_thread_mutex_unlock(&s->mtx, log);
+	return rc;
+}
+
+static void lws_end_stream (lws_request_ctx_t *ctx, ngx_flag_t error) {
+	lws_stream_t        *s;
+	ngx_http_request_t  *r;
+
+	/* signal the reader */
+	r = ctx->r;
+	s = ctx->stream;
+	ngx_thread_mutex_lock(&s->mtx, r->connection->log);
+	if (error) {
+		s->error = 1;
+	} else {
+		s->eof = 1;
+	}
+	ngx_thread_cond_signal(&s->cond, r->connection->log);
+	ngx_thread_mutex_unlock(&s->mtx, r->connection->log);
+
+	/* stop reading; NGINX discards an incomplete request body when finalizing */
+	r->read_event_handler = ngx_http_block_reading;
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"[LWS] request body stream end eof:%i error:%i", s->eof, s->error);
+}
+
+static void lws_close_stream (lws_stream_t *s) {
+	ngx_flag_t  posted;
+
+	/* a posted task frees the stream when it completes */
+	ngx_thread_mutex_lock(&s->mtx, ngx_cycle->log);
+	s->ctx = NULL;
+	s->data.log = ngx_cycle->log;
+	posted = s->posted;
+	ngx_thread_mutex_unlock(&s->mtx, ngx_cycle->log);
+	if (!posted) {
+		lws_free_stream(s);
+	}
+}
+
+static void lws_free_stream (lws_stream_t *s) {
+	lws_body_free(&s->data);
+	ngx_thread_cond_destroy(&s->cond, ngx_cycle->log);
+	ngx_thread_mutex_destroy(&s->mtx, ngx_cycle->log);
+	ngx_free(s);
+}
+
+static void lws_queue_handler (ngx_event_t *ev) {
+	ngx_queue_t        *q;
+	lws_loc_conf_t     *llcf;
+	lws_main_conf_t    *lmcf;
+	lws_request_ctx_t  *ctx;
+
+	llcf = ev->data;
+	lmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, lws_module);
+	while (!ngx_queue_empty(&llcf->requests) && (!ngx_queue_empty(&llcf->states)
+			|| llcf->states_max == 0 || llcf->states_n < llcf->states_max)) {
+		q = ngx_queue_head(&llcf->requests);
+		ngx_queue_remove(q);
+		llcf->requests_n--;
+		if (lmcf->monitor) {
+			ngx_atomic_fetch_add(&lmcf->monitor->requests_n, -1);
+		}
+		ctx = ngx_queue_data(q, lws_request_ctx_t, queue);
+		lws_state_handler(ctx);
+	}
+}
+
+static void lws_state_handler (lws_request_ctx_t *ctx) {
+	ngx_log_t           *log;
+	lws_main_conf_t     *lmcf;
+	ngx_thread_task_t   *task;
+	ngx_http_request_t  *r;
+
+	/* acquire state */
+	r = ctx->r;
+	if (lws_acquire_state(ctx) != 0) {
+		ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+		return;
+	}
+
+	/* setup task */
+	log = r->connection->log;
+	task = ngx_thread_task_alloc(r->pool, sizeof(lws_request_ctx_t *));
+	if (!task) {
+		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to allocate thread task");
+		lws_release_state(ctx);
+		ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+		return;
+	}
+	*(lws_request_ctx_t **)task->ctx = ctx;
+	task->handler = lws_thread_handler;
+	task->event.handler = lws_finalization_handler;
+	task->event.data = ctx;
+	ctx->task = task;
+
+	/* post task */
+	lmcf = ngx_http_get_module_main_conf(r, lws_module);
+	if (ngx_thread_task_post(lmcf->thread_pool, task) != NGX_OK) {
+		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to post thread task");
+		lws_release_state(ctx);
+		ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+		return;
+	}
+}
 
 static void lws_thread_handler (void *data, ngx_log_t *log) {
 	lws_request_ctx_t  *ctx;
 
+	/* prepare request on the first run */
 	ctx = *(lws_request_ctx_t **)data;
+	if (!ctx->pool && lws_prepare_request(ctx) != NGX_OK) {
+		ctx->rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+		return;
+	}
+
+	/* run */
 	ctx->rc = lws_run_state(ctx);
+
+	/* prepare response headers that are about to be sent */
+	if (ctx->rc >= 0 && !ctx->after_response && !ctx->streaming && !ctx->redirect.len
+			&& (ctx->yield == LWS_YIELD_NONE || ctx->yield == LWS_YIELD_FLUSH)
+			&& lws_prepare_response_headers(ctx) != NGX_OK) {
+		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to prepare response headers");
+	}
+}
+
+static ngx_int_t lws_prepare_request (lws_request_ctx_t *ctx) {
+	ngx_log_t           *log;
+	ngx_uint_t           i;
+	lws_loc_conf_t      *llcf;
+	ngx_list_part_t     *part;
+	ngx_table_elt_t     *headers;
+	ngx_http_request_t  *r;
+
+	/* create arena; the pool thread owns it while running */
+	r = ctx->r;
+	log = r->connection->log;
+	ctx->pool = ngx_create_pool(LWS_REQUEST_POOL_SIZE, log);
+	if (!ctx->pool) {
+		return NGX_ERROR;
+	}
+
+	/* prepare request headers */
+	ctx->request_headers = lws_table_create(32, log);
+	if (!ctx->request_headers) {
+		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to create request headers");
+		return NGX_ERROR;
+	}
+	lws_table_set_ci(ctx->request_headers, 1);
+	part = &r->headers_in.headers.part;
+	while (part) {
+		headers = part->elts;
+		for (i = 0; i < part->nelts; i++) {
+			if (lws_set_header(ctx->request_headers, ctx->pool, &headers[i]) != 0) {
+				return NGX_ERROR;
+			}
+		}
+		part = part->next;
+	}
+
+	/* prepare response headers */
+	ctx->response_headers = lws_table_create(8, log);
+	if (!ctx->response_headers) {
+		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to create response headers");
+		return NGX_ERROR;
+	}
+	lws_table_set_dup(ctx->response_headers, 1);
+	lws_table_set_free(ctx->response_headers, 1);
+	lws_table_set_ci(ctx->response_headers, 1);
+
+	/* prepare response body stream; it writes to the response body */
+	llcf = ngx_http_get_module_loc_conf(r, lws_module);
+	if (llcf->response_body == LWS_RB_FILE) {
+		ctx->response_file = fopencookie(ctx, "wb", lws_response_write_functions);
+		if (!ctx->response_file) {
+			ngx_log_error(NGX_LOG_ERR, log, errno, "[LWS] failed to open response body stream");
+			return NGX_ERROR;
+		}
+	}
+
+	/* prepare request body stream, unless streamed */
+	if (ctx->stream) {
+		/* void */
+	} else if (r->request_body && r->request_body->temp_file) {
+		ctx->request_body = fdopen(r->request_body->temp_file->file.fd, "rb");
+	} else {
+		ctx->cl = r->request_body ? r->request_body->bufs : NULL;
+		ctx->pos = ctx->cl ? ctx->cl->buf->pos : NULL;
+		ctx->request_body = fopencookie(ctx, "rb", lws_request_read_functions);
+	}
+	if (!ctx->request_body) {
+		ngx_log_error(NGX_LOG_ERR, log, errno, "[LWS] failed to open request body stream");
+		return NGX_ERROR;
+	}
+	if (llcf->decompress && lws_open_inflate(ctx) != NGX_OK) {
+		return NGX_ERROR;
+	}
+	return NGX_OK;
 }
 
 static ssize_t lws_read_handler (void *cookie, char *buf, size_t size) {
@@ -805,116 +1589,438 @@ static ssize_t lws_read_handler (void *cookie, char *buf, size_t size) {
 	ngx_buf_t          *b;
 	lws_request_ctx_t  *ctx;
 
-	/* done? */
+	/* skip read buffers; the chain itself is left intact */
 	ctx = cookie;
+	while (ctx->cl && ctx->pos == ctx->cl->buf->last) {
+		ctx->cl = ctx->cl->next;
+		ctx->pos = ctx->cl ? ctx->cl->buf->pos : NULL;
+	}
+
+	/* done? */
 	if (!ctx->cl) {
 		return 0;
 	}
 
 	/* read */
 	b = ctx->cl->buf;
-	count = b->last - b->pos;
+	count = b->last - ctx->pos;
 	if (count > size) {
 		count = size;
 	}
-	ngx_memcpy(buf, b->pos, count);
-	b->pos += count;
-	if (b->pos == b->last) {
-		ctx->cl = ctx->cl->next;
-	}
+	ngx_memcpy(buf, ctx->pos, count);
+	ctx->pos += count;
 	return count;
 }
 
+static int lws_seek_handler (void *cookie, off64_t *offset, int whence) {
+	off_t               pos, len, size;
+	ngx_chain_t        *bufs, *cl;
+	lws_request_ctx_t  *ctx;
+
+	/* get position and length */
+	ctx = cookie;
+	bufs = ctx->r->request_body ? ctx->r->request_body->bufs : NULL;
+	pos = -1;
+	len = 0;
+	for (cl = bufs; cl; cl = cl->next) {
+		if (cl == ctx->cl) {
+			pos = len + (ctx->pos - cl->buf->pos);
+		}
+		len += cl->buf->last - cl->buf->pos;
+	}
+	if (pos == -1) {
+		pos = len;
+	}
+
+	/* get target */
+	switch (whence) {
+	case SEEK_SET:
+		pos = *offset;
+		break;
+
+	case SEEK_CUR:
+		pos += *offset;
+		break;
+
+	case SEEK_END:
+		pos = len + *offset;
+		break;
+
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+	if (pos < 0 || pos > len) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* position */
+	*offset = pos;
+	for (cl = bufs; cl; cl = cl->next) {
+		size = cl->buf->last - cl->buf->pos;
+		if (pos < size) {
+			break;
+		}
+		pos -= size;
+	}
+	ctx->cl = cl;
+	ctx->pos = cl ? cl->buf->pos + pos : NULL;
+	return 0;
+}
+
+static ssize_t lws_stream_read_handler (void *cookie, char *buf, size_t size) {
+	ssize_t             n;
+	ngx_log_t          *log;
+	lws_stream_t       *s;
+	lws_main_conf_t    *lmcf;
+	lws_request_ctx_t  *ctx;
+
+	/* wait for data; runs in the pool thread, and the event loop signals */
+	ctx = cookie;
+	s = ctx->stream;
+	log = s->data.log;
+	if (ngx_thread_mutex_lock(&s->mtx, log) != NGX_OK) {
+		errno = EIO;
+		return -1;
+	}
+	n = 0;
+	while (!s->data.len && !s->eof && !s->error) {
+		if (ngx_thread_cond_wait(&s->cond, &s->mtx, log) != NGX_OK) {
+			n = -1;
+			break;
+		}
+	}
+
+	/* read */
+	if (n == 0 && s->data.len) {
+		n = lws_body_read(&s->data, (u_char *)buf, size);
+		s->read += n;
+	} else if (n == -1 || s->error) {
+		errno = EIO;
+		n = -1;
+	}
+
+	/* resume a paused stream once drained; the task completion signals the event loop */
+	if (s->paused && s->data.len < s->size && !s->eof && !s->error) {
+		lmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, lws_module);
+		s->paused = 0;
+		s->posted = 1;
+		if (ngx_thread_task_post(lmcf->thread_pool, &s->task) != NGX_OK) {
+			ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to post thread task");
+			s->posted = 0;
+			s->error = 1;
+		}
+	}
+	ngx_thread_mutex_unlock(&s->mtx, log);
+	return n;
+}
+
+static ssize_t lws_response_write_handler (void *cookie, const char *buf, size_t size) {
+	lws_request_ctx_t  *ctx;
+
+	/* append; the response body spills to a temporary file as configured */
+	ctx = cookie;
+	if (lws_body_write(&ctx->response_body, (const u_char *)buf, size) != 0) {
+		errno = ENOMEM;
+		return 0;
+	}
+	return size;
+}
+
+static int lws_response_seek_handler (void *cookie, off64_t *offset, int whence) {
+	off_t               pos, len;
+	lws_request_ctx_t  *ctx;
+
+	/* the position can be queried; written data is not repositioned */
+	ctx = cookie;
+	len = ctx->response_body.len;
+	switch (whence) {
+	case SEEK_SET:
+		pos = *offset;
+		break;
+
+	case SEEK_CUR:
+	case SEEK_END:
+		pos = len + *offset;
+		break;
+
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+	if (pos != len) {
+		errno = ESPIPE;
+		return -1;
+	}
+	*offset = pos;
+	return 0;
+}
+
 static void lws_finalization_handler (ngx_event_t *ev) {
-	int                  unfold;
-	u_char              *vstart, *vend, *vpos;
-	ngx_buf_t           *b;
-	ngx_int_t            rc;
-	ngx_log_t           *log;
-	ngx_str_t           *key, *value;
-	ngx_str_t            name;
-	ngx_chain_t         *out;
-	lws_loc_conf_t      *llcf;
-	ngx_table_elt_t     *h;
 	lws_request_ctx_t   *ctx;
 	ngx_http_request_t  *r;
 
 	/* get request */
 	ctx = ev->data;
+	r = ctx->r;
+
+	/* Lua yielded? */
+	switch (ctx->yield) {
+	case LWS_YIELD_NONE:
+		break;
+
+	case LWS_YIELD_SUBREQUESTS:
+		lws_start_subrequests(ctx);
+		return;
+
+	case LWS_YIELD_OFFLOAD:
+		lws_start_job(ctx->job);
+		lws_resume_request(ctx);
+		return;
+
+	case LWS_YIELD_JOIN:
+		if (ctx->job->done) {
+			lws_resume_request(ctx);
+		} else {
+			ctx->job->joined = 1;  /* resumed when the job completes */
+		}
+		return;
+
+	case LWS_YIELD_FLUSH:
+		lws_flush_response(ctx);
+		return;
+	}
+
+	/* Lua is done with an unbuffered request body */
+	if (ctx->stream && !ctx->stream->eof && !ctx->stream->error) {
+		lws_end_stream(ctx, 1);
+	}
+
+	/* answer coalesced requests, unless already released by a flush */
+	if (ctx->flight && ctx->flight->leader == ctx && !ctx->flight->landed) {
+		lws_land_flight(ctx);
+	}
+
+	/* post chunk completed after the response? */
+	if (ctx->after_response) {
+		lws_finalize_state(ctx);
+		ngx_http_finalize_request(r, NGX_DONE);
+		return;
+	}
 
-	/* release state */
+	/* release state and send response */
+	if (!ctx->post) {
+		lws_finalize_state(ctx);
+		lws_send_response(ctx);
+		return;
+	}
+
+	/* send response, then run the post chunk; the state remains acquired */
+	r->main->count++;
+	lws_send_response(ctx);
+	ctx->after_response = 1;
+	lws_resume_request(ctx);
+}
+
+static void lws_finalize_state (lws_request_ctx_t *ctx) {
+	/* a response body referencing Lua strings is sent before the state is released */
+	if (ctx->state->anchored) {
+		ctx->anchored = 1;
+		return;
+	}
 	lws_release_state(ctx);
+}
+
+static void lws_send_response (lws_request_ctx_t *ctx) {
+	off_t                len;
+	ngx_buf_t           *file;
+	ngx_int_t            rc;
+	ngx_log_t           *log;
+	ngx_str_t            name;
+	ngx_chain_t         *out, *last, *cl;
+	ngx_http_request_t  *r;
 
-	/* check for queued requests */
 	r = ctx->r;
-	llcf = ngx_http_get_module_loc_conf(r, lws_module);
-	if (!ngx_queue_empty(&llcf->requests) && !llcf->qev.timer_set) {
-		ngx_add_timer(&llcf->qev, 0);
+
+	/* response started by a flush? */
+	if (ctx->streaming) {
+		lws_send_response_tail(ctx);
+		return;
+	}
+
+	/* Lua error generated? */
+	if (ctx->rc < 0) {
+		lws_send_error_response(ctx, NGX_HTTP_INTERNAL_SERVER_ERROR);
+		return;
+	}
+
+	/* internal redirect? */
+	if (ctx->redirect.len) {
+		if (ctx->redirect.data[0] != '@') {
+			rc = ngx_http_internal_redirect(r, &ctx->redirect, &ctx->redirect_args);
+		} else {
+			name.data = ctx->redirect.data + 1;
+			name.len = ctx->redirect.len - 1;
+			rc = ngx_http_named_location(r, &name);
+		}
+		ngx_http_finalize_request(r, rc);
+		return;
+	}
+
+	/* set headers */
+	if (lws_set_response_headers(ctx) != NGX_OK) {
+		ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+		return;
+	}
+
+	/* error response requested? */
+	if (ctx->rc > 0) {
+		rc = ctx->rc >= 100 && ctx->rc < 600 ? ctx->rc : NGX_HTTP_INTERNAL_SERVER_ERROR;
+		lws_send_error_response(ctx, rc);
+		return;
+	}
+
+	/* store in the response cache */
+	if (ctx->cache_key.len) {
+		lws_cache_store(ctx);
+	}
+
+	/* open file to send after the response body */
+	file = NULL;
+	if (ctx->sendfile.len) {
+		rc = lws_open_sendfile(ctx, &file);
+		if (rc != NGX_OK) {
+			lws_send_error_response(ctx, rc);
+			return;
+		}
+	}
+	len = ctx->response_body.len + (file ? file->file_last - file->file_pos : 0);
+
+	/* send headers */
+	log = r->connection->log;
+	r->headers_out.status = ctx->status;
+	r->disable_not_modified = 1;
+	if (len > 0) {
+		if (r == r->main && (r->method == NGX_HTTP_HEAD
+				|| r->headers_out.status == NGX_HTTP_NO_CONTENT
+				|| r->headers_out.status == NGX_HTTP_NOT_MODIFIED)) {
+			/* body found, but filter modules would flag as header-only */
+			ngx_log_error(NGX_LOG_WARN, log, 0, "[LWS] ignoring response body");
+			r->header_only = 1;
+		} else {
+			r->headers_out.content_length_n = len;
+		}
+	} else {
+		if (r == r->main && (r->method != NGX_HTTP_HEAD
+				&& r->headers_out.status != NGX_HTTP_NO_CONTENT
+				&& r->headers_out.status != NGX_HTTP_NOT_MODIFIED
+				&& r->headers_out.status >= NGX_HTTP_OK)) {
+			/* no body, but filter modules would trigger chunked transfer */
+			ngx_log_error(NGX_LOG_WARN, log, 0, "[LWS] response body expected");
+			r->headers_out.content_length_n = 0;
+			r->header_only = 1;
+		}
 	}
-
-	/* Lua error generated? */
-	if (ctx->rc < 0) {
-		lws_send_error_response(ctx, NGX_HTTP_INTERNAL_SERVER_ERROR);
+	rc = ngx_http_send_header(r);
+	if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+		ngx_http_finalize_request(r, rc);
 		return;
 	}
 
-	/* internal redirect? */
-	if (ctx->redirect.len) {
-		if (ctx->redirect.data[0] != '@') {
-			rc = ngx_http_internal_redirect(r, &ctx->redirect, &ctx->redirect_args);
+	/* send body */
+	out = NULL;
+	last = NULL;
+	if (ctx->response_body.len) {
+		out = lws_body_chain(&ctx->response_body, r->pool, &last);
+		if (!out) {
+			ngx_http_finalize_request(r, NGX_ERROR);
+			return;
+		}
+		if (ctx->shared) {
+			/* the blocks are shared with coalesced requests; filters must not modify them */
+			for (cl = out; cl; cl = cl->next) {
+				if (cl->buf->temporary) {
+					cl->buf->temporary = 0;
+					cl->buf->memory = 1;
+				}
+			}
+		}
+	}
+	if (file) {
+		cl = ngx_alloc_chain_link(r->pool);
+		if (!cl) {
+			ngx_http_finalize_request(r, NGX_ERROR);
+			return;
+		}
+		cl->buf = file;
+		cl->next = NULL;
+		if (last) {
+			last->next = cl;
 		} else {
-			name.data = ctx->redirect.data + 1;
-			name.len = ctx->redirect.len - 1;
-			rc = ngx_http_named_location(r, &name);
+			out = cl;
 		}
-		ngx_http_finalize_request(r, rc);
-		return;
+		last = cl;
 	}
+	last->buf->last_buf = (r == r->main) ? 1 : 0;
+	last->buf->last_in_chain = 1;
+	rc = ngx_http_output_filter(r, out);
+	lws_body_free_chain(out, r->pool);
+	ngx_http_finalize_request(r, rc);
+}
 
-	/* set headers */
+static ngx_int_t lws_prepare_response_headers (lws_request_ctx_t *ctx) {
+	int                      unfold;
+	u_char                  *vstart, *vend, *vpos;
+	ngx_str_t               *key, *value, part;
+	ngx_table_elt_t        **ref;
+	ngx_http_headers_out_t  *ho;
+
+	/* runs in the pool thread; NGINX response headers are only referenced */
+	ho = &ctx->r->headers_out;
+	if (ngx_array_init(&ctx->headers_out, ctx->pool, 8, sizeof(lws_header_t)) != NGX_OK) {
+		return NGX_ERROR;
+	}
+	ngx_str_null(&ctx->content_type);
+	ctx->last_modified = -1;
 	key = NULL;
 	while (lws_table_next(ctx->response_headers, key, &key, (void**)&value) == 0) {
 		#define lws_is_header(literal)  ngx_strncasecmp(key->data, (u_char *)literal,  \
 				 sizeof(literal) - 1) == 0
 		if (key->len == 12 && lws_is_header("Content-Type")) {
-			r->headers_out.content_type = *value;
-			r->headers_out.content_type_len = value->len;
+			ctx->content_type = *value;
 			continue;
 		} else if (key->len == 14 && lws_is_header("Content-Length")) {
-			continue;  /* content length is handled separately below */
-		}
-		h = ngx_list_push(&r->headers_out.headers);
-		if (!h) {
-			ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
-			return;
+			continue;  /* content length is handled separately */
 		}
+		ref = NULL;
 		unfold = 0;
 		switch (key->len) {
 		case 4:
 			if (lws_is_header("Date")) {
-				r->headers_out.date = h;
+				ref = &ho->date;
 			} else if (lws_is_header("ETag")) {
-				r->headers_out.etag = h;
+				ref = &ho->etag;
 			}
 			break;
 
 		case 6:
 			if (lws_is_header("Server")) {
-				r->headers_out.server = h;
+				ref = &ho->server;
 			}
 			break;
 
 		case 7:
 			if (lws_is_header("Refresh")) {
-				r->headers_out.refresh = h;
+				ref = &ho->refresh;
 			} else if (lws_is_header("Expires")) {
-				r->headers_out.expires = h;
+				ref = &ho->expires;
 			}
 			break;
 
 		case 8:
 			if (lws_is_header("Location")) {
-				r->headers_out.location = h;
+				ref = &ho->location;
 			}
 			break;
 
@@ -926,124 +2032,464 @@ static void lws_finalization_handler (ngx_event_t *ev) {
 
 		case 13:
 			if (lws_is_header("Last-Modified")) {
-				r->headers_out.last_modified = h;
-				r->headers_out.last_modified_time = ngx_parse_http_time(value->data,
-						value->len);
+				ref = &ho->last_modified;
+				ctx->last_modified = ngx_parse_http_time(value->data, value->len);
 			} else if (lws_is_header("Content-Range")) {
-				r->headers_out.content_range = h;
+				ref = &ho->content_range;
 			} else if (lws_is_header("Accept-Ranges")) {
-				r->headers_out.accept_ranges = h;
+				ref = &ho->accept_ranges;
 			}
 			break;
 
 		case 16:
 			if (lws_is_header("Content-Encoding")) {
-				r->headers_out.content_encoding = h;
+				ref = &ho->content_encoding;
 			} else if (lws_is_header("WWW-Authenticate")) {
-				r->headers_out.www_authenticate = h;
+				ref = &ho->www_authenticate;
 			}
 			break;
 		}
 		#undef lws_is_header
 		if (!unfold) {
-			h->key = *key;
-			h->value = *value;
-			h->hash = 1;
-		} else {
-			vstart = value->data;
-			vend = value->data + value->len;
-			while (1) {
-				vpos = vstart;
-				while (vpos < vend && *vpos != ',') {
-					vpos++;
-				}
-				h->key = *key;
-				h->value.data = vstart;
-				h->value.len = vpos - vstart;
-				h->hash = 1;
-				if (vpos == vend) {
-					break;
-				}
-				vstart = vpos + 1;
-				while (vstart < vend && *vstart == ' ') {
-					vstart++;
-				}
-				if (vstart == vend) {
-					break;
-				}
-				h = ngx_list_push(&r->headers_out.headers);
-				if (!h) {
-					ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
-					return;
-				}
+			if (lws_push_response_header(ctx, key, value, ref) != NGX_OK) {
+				return NGX_ERROR;
+			}
+			continue;
+		}
+		vstart = value->data;
+		vend = value->data + value->len;
+		while (1) {
+			vpos = vstart;
+			while (vpos < vend && *vpos != ',') {
+				vpos++;
+			}
+			part.data = vstart;
+			part.len = vpos - vstart;
+			if (lws_push_response_header(ctx, key, &part, NULL) != NGX_OK) {
+				return NGX_ERROR;
+			}
+			if (vpos == vend) {
+				break;
+			}
+			vstart = vpos + 1;
+			while (vstart < vend && *vstart == ' ') {
+				vstart++;
+			}
+			if (vstart == vend) {
+				break;
 			}
 		}
 	}
+	return NGX_OK;
+}
 
-	/* error response requested? */
-	if (ctx->rc > 0) {
-		rc = ctx->rc >= 100 && ctx->rc < 600 ? ctx->rc : NGX_HTTP_INTERNAL_SERVER_ERROR;
-		lws_send_error_response(ctx, rc);
-		return;
+static ngx_int_t lws_push_response_header (lws_request_ctx_t *ctx, ngx_str_t *key,
+		ngx_str_t *value, ngx_table_elt_t **ref) {
+	lws_header_t  *h;
+
+	h = ngx_array_push(&ctx->headers_out);
+	if (!h) {
+		return NGX_ERROR;
+	}
+	ngx_memzero(&h->elt, sizeof(ngx_table_elt_t));
+	h->elt.key = *key;
+	h->elt.value = *value;
+	h->elt.hash = 1;
+	h->ref = ref;
+	return NGX_OK;
+}
+
+static ngx_int_t lws_set_response_headers (lws_request_ctx_t *ctx) {
+	ngx_uint_t           i;
+	lws_header_t        *headers;
+	ngx_table_elt_t     *h;
+	ngx_http_request_t  *r;
+
+	/* headers are prepared in the pool thread */
+	r = ctx->r;
+	if (!ctx->headers_out.elts) {
+		return NGX_ERROR;
+	}
+	if (ctx->content_type.data) {
+		r->headers_out.content_type = ctx->content_type;
+		r->headers_out.content_type_len = ctx->content_type.len;
+	}
+	if (ctx->last_modified != -1) {
+		r->headers_out.last_modified_time = ctx->last_modified;
+	}
+	headers = ctx->headers_out.elts;
+	for (i = 0; i < ctx->headers_out.nelts; i++) {
+		h = ngx_list_push(&r->headers_out.headers);
+		if (!h) {
+			return NGX_ERROR;
+		}
+		*h = headers[i].elt;
+		if (headers[i].ref) {
+			*headers[i].ref = h;
+		}
 	}
+	return NGX_OK;
+}
 
-	/* send headers */
+static ngx_int_t lws_open_sendfile (lws_request_ctx_t *ctx, ngx_buf_t **file) {
+	off_t                      length;
+	ngx_buf_t                 *b;
+	ngx_int_t                  rc;
+	ngx_log_t                 *log;
+	ngx_uint_t                 level;
+	ngx_open_file_info_t       of;
+	ngx_http_request_t        *r;
+	ngx_http_core_loc_conf_t  *clcf;
+
+	/* open file through the open file cache of the location */
+	r = ctx->r;
 	log = r->connection->log;
-	r->headers_out.status = ctx->status;
-	r->disable_not_modified = 1;
-	if (fflush(ctx->response_body) != 0) {
-		ngx_log_error(NGX_LOG_CRIT, log, errno, "[LWS] failed to flush response body");;
-		ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
-		return;
+	clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+	ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+	of.read_ahead = clcf->read_ahead;
+	of.directio = clcf->directio;
+	of.valid = clcf->open_file_cache_valid;
+	of.min_uses = clcf->open_file_cache_min_uses;
+	of.errors = clcf->open_file_cache_errors;
+	of.events = clcf->open_file_cache_events;
+	if (ngx_http_set_disable_symlinks(r, clcf, &ctx->sendfile, &of) != NGX_OK) {
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
 	}
-	if (ctx->response_body_str.len > 0) {
-		if (r == r->main && (r->method == NGX_HTTP_HEAD
-				|| r->headers_out.status == NGX_HTTP_NO_CONTENT
-				|| r->headers_out.status == NGX_HTTP_NOT_MODIFIED)) {
-			/* body found, but filter modules would flag as header-only */
-			ngx_log_error(NGX_LOG_WARN, log, 0, "[LWS] ignoring response body");
-			r->header_only = 1;
-		} else {
-			r->headers_out.content_length_n = ctx->response_body_str.len;
+	if (ngx_open_cached_file(clcf->open_file_cache, &ctx->sendfile, &of, r->pool) != NGX_OK) {
+		switch (of.err) {
+		case 0:
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+		case NGX_ENOENT:
+		case NGX_ENOTDIR:
+		case NGX_ENAMETOOLONG:
+			level = NGX_LOG_ERR;
+			rc = NGX_HTTP_NOT_FOUND;
+			break;
+
+		case NGX_EACCES:
+#if (NGX_HAVE_OPENAT)
+		case NGX_EMLINK:
+		case NGX_ELOOP:
+#endif
+			level = NGX_LOG_ERR;
+			rc = NGX_HTTP_FORBIDDEN;
+			break;
+
+		default:
+			level = NGX_LOG_CRIT;
+			rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
 		}
-	} else {
-		if (r == r->main && (r->method != NGX_HTTP_HEAD
-				&& r->headers_out.status != NGX_HTTP_NO_CONTENT
-				&& r->headers_out.status != NGX_HTTP_NOT_MODIFIED
-				&& r->headers_out.status >= NGX_HTTP_OK)) {
-			/* no body, but filter modules would trigger chunked transfer */
-			ngx_log_error(NGX_LOG_WARN, log, 0, "[LWS] response body expected");
-			r->headers_out.content_length_n = 0;
-			r->header_only = 1;
+		ngx_log_error(level, log, of.err, "[LWS] %s \"%V\" failed", of.failed, &ctx->sendfile);
+		return rc;
+	}
+	if (!of.is_file) {
+		ngx_log_error(NGX_LOG_ERR, log, 0, "[LWS] \"%V\" is not a regular file", &ctx->sendfile);
+		return NGX_HTTP_NOT_FOUND;
+	}
+
+	/* check range */
+	if (ctx->sendfile_offset > of.size) {
+		ngx_log_error(NGX_LOG_ERR, log, 0, "[LWS] bad offset of \"%V\" offset:%O size:%O",
+				&ctx->sendfile, ctx->sendfile_offset, of.size);
+		return NGX_HTTP_RANGE_NOT_SATISFIABLE;
+	}
+	length = of.size - ctx->sendfile_offset;
+	if (ctx->sendfile_length >= 0 && ctx->sendfile_length < length) {
+		length = ctx->sendfile_length;
+	}
+	if (ctx->sendfile_offset == 0 && length == of.size
+			&& r->headers_out.last_modified_time == -1) {
+		r->headers_out.last_modified_time = of.mtime;
+	}
+
+	/* create file buffer */
+	*file = NULL;
+	if (!length) {
+		return NGX_OK;
+	}
+	b = ngx_calloc_buf(r->pool);
+	if (!b) {
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+	b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+	if (!b->file) {
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+	b->file_pos = ctx->sendfile_offset;
+	b->file_last = ctx->sendfile_offset + length;
+	b->in_file = 1;
+	b->file->fd = of.fd;
+	b->file->name = ctx->sendfile;
+	b->file->log = log;
+	b->file->directio = of.is_directio;
+	*file = b;
+	return NGX_OK;
+}
+
+static void lws_send_response_tail (lws_request_ctx_t *ctx) {
+	ngx_int_t            rc;
+	ngx_log_t           *log;
+	ngx_chain_t         *out, *last;
+	ngx_http_request_t  *r;
+
+	/* the status and headers are sent; results other than success abort the response */
+	r = ctx->r;
+	log = r->connection->log;
+	if (ctx->stream_error || ctx->rc != 0 || ctx->redirect.len || ctx->sendfile.len) {
+		if (ctx->rc > 0 || ctx->redirect.len || ctx->sendfile.len) {
+			ngx_log_error(NGX_LOG_ERR, log, 0, "[LWS] response already started");
 		}
+		ngx_http_finalize_request(r, NGX_ERROR);
+		return;
 	}
-	rc = ngx_http_send_header(r);
-	if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
-		ngx_http_finalize_request(r, rc);
+	if (r->header_only) {
+		ngx_http_finalize_request(r, ngx_http_send_special(r, NGX_HTTP_LAST));
 		return;
 	}
 
-	/* send body */
-	out = ngx_alloc_chain_link(r->pool);
-	b = ngx_calloc_buf(r->pool);
-	if (!out || !b) {
-		ngx_http_finalize_request(r, rc);
+	/* send remaining body */
+	if (!ctx->response_body.len) {
+		ngx_http_finalize_request(r, ngx_http_send_special(r, NGX_HTTP_LAST));
 		return;
 	}
-	b->start = ctx->response_body_str.data;
-	b->pos = b->start;
-	b->end = ctx->response_body_str.data + ctx->response_body_str.len;
-	b->last = b->end;
-	b->temporary = 1;
-	b->last_buf = (r == r->main) ? 1 : 0;
-	b->last_in_chain = 1;
-	out->buf = b;
-	out->next = NULL;
+	out = lws_body_chain(&ctx->response_body, r->pool, &last);
+	if (!out) {
+		ngx_http_finalize_request(r, NGX_ERROR);
+		return;
+	}
+	last->buf->last_buf = 1;
+	last->buf->last_in_chain = 1;
 	rc = ngx_http_output_filter(r, out);
-	ngx_free_chain(r->pool, out);
+	lws_body_free_chain(out, r->pool);
 	ngx_http_finalize_request(r, rc);
 }
 
+static void lws_flush_response (lws_request_ctx_t *ctx) {
+	ngx_int_t            rc;
+	ngx_log_t           *log;
+	ngx_chain_t         *out, *last;
+	ngx_http_request_t  *r;
+
+	/* send headers; the body is streamed without a content length */
+	r = ctx->r;
+	log = r->connection->log;
+	if (!ctx->streaming) {
+		ctx->streaming = 1;
+
+		/* streamed responses are not shared; coalesced requests run on their own */
+		if (ctx->flight && ctx->flight->leader == ctx && !ctx->flight->landed) {
+			lws_land_flight(ctx);
+		}
+
+		r->headers_out.status = ctx->status;
+		r->disable_not_modified = 1;
+		if (lws_set_response_headers(ctx) != NGX_OK) {
+			ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to set response headers");
+			lws_complete_flush(ctx, NGX_ERROR);
+			return;
+		}
+		rc = ngx_http_send_header(r);
+		if (rc == NGX_ERROR || rc > NGX_OK) {
+			lws_complete_flush(ctx, NGX_ERROR);
+			return;
+		}
+	}
+	if (ctx->stream_error || r->header_only) {
+		lws_complete_flush(ctx, NGX_OK);
+		return;
+	}
+
+	/* send body so far */
+	if (!ctx->response_body.len) {
+		lws_complete_flush(ctx, ngx_http_send_special(r, NGX_HTTP_FLUSH));
+		return;
+	}
+	out = lws_body_chain(&ctx->response_body, r->pool, &last);
+	if (!out) {
+		lws_complete_flush(ctx, NGX_ERROR);
+		return;
+	}
+	last->buf->flush = 1;
+	rc = ngx_http_output_filter(r, out);
+	lws_body_free_chain(out, r->pool);
+	lws_complete_flush(ctx, rc);
+}
+
+static void lws_flush_handler (ngx_http_request_t *r) {
+	ngx_int_t                  rc;
+	ngx_event_t               *wev;
+	ngx_connection_t          *c;
+	lws_request_ctx_t         *ctx;
+	ngx_http_core_loc_conf_t  *clcf;
+
+	/* continue sending, as in the NGINX writer */
+	ctx = ngx_http_get_module_ctx(r, lws_module);
+	c = r->connection;
+	wev = c->write;
+	if (wev->timedout) {
+		ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT, "[LWS] client timed out");
+		c->timedout = 1;
+		lws_complete_flush(ctx, NGX_ERROR);
+		return;
+	}
+	if (wev->delayed || r->aio) {
+		clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+		if (!wev->delayed) {
+			ngx_add_timer(wev, clcf->send_timeout);
+		}
+		if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+			lws_complete_flush(ctx, NGX_ERROR);
+		}
+		return;
+	}
+	rc = ngx_http_output_filter(r, NULL);
+	lws_complete_flush(ctx, rc);
+}
+
+static void lws_complete_flush (lws_request_ctx_t *ctx, ngx_int_t rc) {
+	ngx_event_t               *wev;
+	ngx_connection_t          *c;
+	ngx_http_request_t        *r;
+	ngx_http_core_loc_conf_t  *clcf;
+
+	/* wait while the client is slow; Lua remains suspended */
+	r = ctx->r;
+	c = r->connection;
+	wev = c->write;
+	if (rc == NGX_ERROR) {
+		ctx->stream_error = 1;
+	} else if (!ctx->stream_error && (r->buffered || r->postponed || c->buffered)) {
+		clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+		r->write_event_handler = lws_flush_handler;
+		if (!wev->delayed) {
+			ngx_add_timer(wev, clcf->send_timeout);
+		}
+		if (ngx_handle_write_event(wev, clcf->send_lowat) == NGX_OK) {
+			return;
+		}
+		ctx->stream_error = 1;
+	}
+
+	/* sent; reuse the response body stream and resume */
+	r->write_event_handler = ngx_http_request_empty_handler;
+	if (wev->timer_set && !wev->delayed) {
+		ngx_del_timer(wev);
+	}
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0, "[LWS] response flushed len:%uz error:%d",
+			ctx->response_body.len, ctx->stream_error);
+	lws_body_reset(&ctx->response_body);
+	lws_resume_request(ctx);
+}
+
+void lws_resume_request (lws_request_ctx_t *ctx) {
+	lws_main_conf_t     *lmcf;
+	ngx_http_request_t  *r;
+
+	/* post task again; the Lua state remains acquired */
+	r = ctx->r;
+	lmcf = ngx_http_get_module_main_conf(r, lws_module);
+	if (ngx_thread_task_post(lmcf->thread_pool, ctx->task) == NGX_OK) {
+		return;
+	}
+	ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "[LWS] failed to post thread task");
+
+	/* the yielded Lua state cannot be reused */
+	ctx->yield = LWS_YIELD_NONE;
+	ctx->state->close = 1;
+	lws_release_state(ctx);
+	ngx_http_finalize_request(r, ctx->after_response ? NGX_DONE
+			: NGX_HTTP_INTERNAL_SERVER_ERROR);
+}
+
+static void lws_start_subrequests (lws_request_ctx_t *ctx) {
+	size_t                       i;
+	ngx_str_t                    uri, args;
+	ngx_log_t                   *log;
+	lws_subrequest_t            *s;
+	ngx_http_request_t          *r, *sr;
+	ngx_http_post_subrequest_t  *ps;
+
+	/* start subrequests */
+	r = ctx->r;
+	log = r->connection->log;
+	ctx->subrequests_active = 0;
+	for (i = 0; i < ctx->subrequests_n; i++) {
+		s = &ctx->subrequests[i];
+		s->ctx = ctx;
+		s->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+		ps = ngx_palloc(r->pool, sizeof(ngx_http_post_subrequest_t));
+		uri.data = ngx_pstrdup(r->pool, &s->uri);
+		uri.len = s->uri.len;
+		args.data = s->args.len ? ngx_pstrdup(r->pool, &s->args) : NULL;
+		args.len = s->args.len;
+		if (!ps || !uri.data || (args.len && !args.data)) {
+			ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to allocate subrequest");
+			continue;
+		}
+		ps->handler = lws_subrequest_handler;
+		ps->data = s;
+		if (ngx_http_subrequest(r, &uri, args.len ? &args : NULL, &sr, ps,
+				NGX_HTTP_SUBREQUEST_IN_MEMORY | NGX_HTTP_SUBREQUEST_WAITED) != NGX_OK) {
+			ngx_log_error(NGX_LOG_ERR, log, 0, "[LWS] failed to create subrequest uri:%V",
+					&uri);
+			continue;
+		}
+		ctx->subrequests_active++;
+	}
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0, "[LWS] subrequests n:%z active:%z",
+			ctx->subrequests_n, ctx->subrequests_active);
+
+	/* resume immediately if no subrequest could be started */
+	if (!ctx->subrequests_active) {
+		lws_resume_request(ctx);
+		return;
+	}
+
+	/* run subrequests; the request is posted when they complete */
+	r->write_event_handler = lws_subrequests_handler;
+	ngx_http_run_posted_requests(r->connection);
+}
+
+static ngx_int_t lws_subrequest_handler (ngx_http_request_t *sr, void *data, ngx_int_t rc) {
+	lws_subrequest_t  *s;
+
+	/* the handler can be called more than once */
+	s = data;
+	if (s->done) {
+		return rc;
+	}
+	s->done = 1;
+
+	/* set status and body */
+	if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+		s->status = rc;
+	} else if (rc != NGX_ERROR && sr->headers_out.status) {
+		s->status = sr->headers_out.status;
+	}
+	if (sr->out && sr->out->buf) {
+		s->body.data = sr->out->buf->pos;
+		s->body.len = sr->out->buf->last - sr->out->buf->pos;
+	}
+	s->ctx->subrequests_active--;
+	ngx_log_debug3(NGX_LOG_DEBUG_HTTP, sr->connection->log, 0,
+			"[LWS] subrequest done uri:%V status:%i active:%z", &s->uri, s->status,
+			s->ctx->subrequests_active);
+	return rc;
+}
+
+static void lws_subrequests_handler (ngx_http_request_t *r) {
+	lws_request_ctx_t  *ctx;
+
+	/* resume when all subrequests are done */
+	ctx = ngx_http_get_module_ctx(r, lws_module);
+	if (ctx->subrequests_active) {
+		return;
+	}
+	r->write_event_handler = ngx_http_request_empty_handler;
+	lws_resume_request(ctx);
+}
+
 static void lws_send_error_response (lws_request_ctx_t *ctx, ngx_int_t rc) {
 	lws_loc_conf_t      *llcf;
 	ngx_http_request_t  *r;
@@ -1269,9 +2715,31 @@ static void lws_send_html_error_response (lws_request_ctx_t *ctx, ngx_int_t rc)
 }
 
 static void lws_cleanup_request_ctx (void *data) {
+	lws_job_t          *job, *next;
 	lws_request_ctx_t  *ctx;
 
 	ctx = data;
+	if (ctx->flight) {
+		lws_leave_flight(ctx);
+	}
+	if (ctx->yield) {
+		/* request terminated while Lua is yielded */
+		ctx->state->close = 1;
+		lws_put_state(ctx->state, ngx_cycle->log);
+	}
+	if (ctx->anchored) {
+		/* the response body is sent */
+		lws_release_state(ctx);
+	}
+	ngx_free(ctx->subrequests);
+	for (job = ctx->jobs; job; job = next) {
+		next = job->next;
+		if (job->running) {
+			job->ctx = NULL;  /* freed when the job completes */
+		} else {
+			lws_free_job(job);
+		}
+	}
 	if (ctx->variables) {
 		lws_table_free(ctx->variables);
 	}
@@ -1281,14 +2749,38 @@ static void lws_cleanup_request_ctx (void *data) {
 	if (ctx->request_body) {
 		fclose(ctx->request_body);
 	}
+	if (ctx->inflate) {
+		lws_close_inflate(ctx->inflate);
+	}
+	switch (ctx->request_body_type) {
+	case LWS_BD_ALLOC:
+		ngx_free(ctx->request_body_data.data);
+		break;
+
+	case LWS_BD_MMAP:
+		munmap(ctx->request_body_data.data, ctx->request_body_data.len);
+		break;
+
+	default:
+		break;
+	}
+	if (ctx->stream) {
+		lws_close_stream(ctx->stream);
+	}
 	if (ctx->response_headers) {
 		lws_table_free(ctx->response_headers);
 	}
-	if (ctx->response_body) {
-		fclose(ctx->response_body);
-		free(ctx->response_body_str.data);
+	if (ctx->response_file) {
+		fclose(ctx->response_file);
+	}
+	if (!ctx->shared) {
+		lws_body_free(&ctx->response_body);
+	}
+	if (ctx->pool) {
+		ngx_destroy_pool(ctx->pool);
 	}
 	ngx_free(ctx->redirect.data);
 	ngx_free(ctx->redirect_args.data);
+	ngx_free(ctx->sendfile.data);
 	ngx_free(ctx->diagnostic.data);
 }
@@ -17,18 +17,33 @@
 #define LWS_THREAD_POOL_NAME_DEFAULT    "default"
 #define LWS_STAT_CACHE_CAP_DEFAULT      1024
 #define LWS_STAT_CACHE_TIMEOUT_DEFAULT  30
+#define LWS_COMPRESS_LEVEL_DEFAULT      1
+#define LWS_COMPRESS_MIN_LENGTH_DEFAULT 20
+#define LWS_DECOMPRESS_MAX_SIZE_DEFAULT (10 * 1024 * 1024)
+#define LWS_REQUEST_POOL_SIZE           4096
 #define lws_cpylit(p, lit)              ngx_cpymem(p, lit, sizeof(lit) - 1)
 
 
 typedef struct lws_main_conf_s lws_main_conf_t;
 typedef struct lws_loc_conf_s lws_loc_conf_t;
 typedef struct lws_request_ctx_s lws_request_ctx_t;
+typedef struct lws_stream_s lws_stream_t;
+typedef struct lws_inflate_s lws_inflate_t;
+typedef struct lws_subrequest_s lws_subrequest_t;
+typedef struct lws_timer_s lws_timer_t;
 typedef struct lws_variable_s lws_variable_t;
+typedef struct lws_header_s lws_header_t;
+typedef struct lws_flight_s lws_flight_t;
 
 
 #include <lws_monitor.h>
 #include <lws_state.h>
+#include <lws_job.h>
+#include <lws_timer.h>
 #include <lws_table.h>
+#include <lws_body.h>
+#include <lws_local.h>
+#include <lws_shared.h>
 
 
 typedef enum {
@@ -42,6 +57,42 @@ typedef enum {
 	LWS_ER_HTML
 } lws_error_response_e;
 
+typedef enum {
+	LWS_CO_OFF,
+	LWS_CO_GZIP,
+	LWS_CO_DEFLATE
+} lws_compress_e;
+
+typedef enum {
+	LWS_ET_OFF,
+	LWS_ET_AUTO
+} lws_etag_e;
+
+typedef enum {
+	LWS_PM_BEFORE_RESPONSE,
+	LWS_PM_AFTER_RESPONSE
+} lws_post_mode_e;
+
+typedef enum {
+	LWS_RB_FILE,
+	LWS_RB_BUFFER
+} lws_response_body_e;
+
+typedef enum {
+	LWS_BD_NONE,
+	LWS_BD_REF,
+	LWS_BD_ALLOC,
+	LWS_BD_MMAP
+} lws_body_data_e;
+
+typedef enum {
+	LWS_YIELD_NONE,
+	LWS_YIELD_SUBREQUESTS,
+	LWS_YIELD_OFFLOAD,
+	LWS_YIELD_JOIN,
+	LWS_YIELD_FLUSH
+} lws_yield_e;
+
 struct lws_main_conf_s {
 	ngx_thread_pool_t  *thread_pool;         /* thread pool for async execution of Lua */
 	ngx_str_t           thread_pool_name;    /* name of thread pool */
@@ -51,6 +102,14 @@ struct lws_main_conf_s {
 	ngx_shm_zone_t     *monitor_shm;         /* monitor shared memory zone */
 	ngx_slab_pool_t    *monitor_pool;        /* monitor slab allocator */
 	lws_monitor_t      *monitor;             /* monitor */
+	ngx_array_t        *shared_dicts;        /* shared dictionaries */
+	lws_local_t        *local_cache;         /* worker-local cache; NULL = off */
+	ngx_queue_t         mmaps;               /* mapped files */
+	ngx_thread_mutex_t  mmaps_mutex;         /* mapped files mutex */
+	ngx_str_t           init_shared;         /* filename of shared init Lua chunk */
+	ngx_array_t        *frozen;              /* frozen tables */
+	ngx_shm_zone_t     *tags_shm;            /* invalidation tags shared memory zone */
+	lws_tags_t         *tags;                /* invalidation tags */
 };
 
 struct lws_loc_conf_s {
@@ -59,6 +118,22 @@ struct lws_loc_conf_s {
 	ngx_str_t    init;                     /* filename of init Lua chunk (runs once) */
 	ngx_str_t    pre;                      /* filename of pre Lua chunk */
 	ngx_str_t    post;                     /* filename of post Lua chunk */
+	ngx_uint_t   post_mode;                /* post chunk mode [before_response, after_response] */
+	ngx_flag_t   request_buffering;        /* read the request body before running Lua */
+	ngx_flag_t   decompress;               /* decompress request bodies */
+	size_t       decompress_max_size;      /* maximum decompressed request body size */
+	ngx_uint_t   response_body;            /* response body type [file, buffer] */
+	size_t       response_buffer_size;     /* response body size kept in memory; 0 = unlimited */
+	size_t       flush_size;               /* response body size that triggers a flush; 0 = never */
+	ngx_http_complex_value_t  *coalesce;   /* coalescing key; NULL = off */
+	ngx_shm_zone_t  *cache;                /* response cache zone; NULL = off */
+	ngx_http_complex_value_t  *cache_key;  /* response cache key */
+	time_t       cache_valid;              /* response cache validity */
+	time_t       cache_stale;              /* response cache stale period */
+	ngx_uint_t   compress;                 /* response compression [off, gzip, deflate] */
+	ngx_int_t    compress_level;           /* response compression level */
+	size_t       compress_min_length;      /* minimum length of compressed responses */
+	ngx_uint_t   etag;                     /* response entity tags [off, auto] */
 	ngx_str_t    path;                     /* Lua path */
 	ngx_str_t    cpath;                    /* Lua C path */
 	size_t       states_max;               /* maximum Lua states; 0 = unrestricted */
@@ -76,7 +151,11 @@ struct lws_loc_conf_s {
 	ngx_queue_t  states;                   /* inactive Lua states */
 	ngx_uint_t   requests_n;               /* number of queued requests */
 	ngx_queue_t  requests;                 /* queued requests */
+	lws_table_t *flights;                  /* coalesced requests by key */
 	ngx_event_t  qev;                      /* queue event */
+	lws_timer_t *timers;                   /* timers */
+	ngx_uint_t   timers_n;                 /* number of timers */
+	ngx_flag_t   timers_started;           /* timers started */
 };
 
 struct lws_request_ctx_s {
@@ -84,19 +163,88 @@ struct lws_request_ctx_s {
 	ngx_http_request_t  *r;                  /* NGINX HTTP request */
 	ngx_str_t            main;               /* filename of main Lua chunk */
 	ngx_str_t            path_info;          /* request path info */
+	ngx_pool_t          *pool;               /* request arena; prepared in the pool thread */
 	lws_state_t         *state;              /* active Lua state */
 	lws_table_t         *variables;          /* request variables */
 	lws_table_t         *request_headers;    /* request headers */
 	FILE                *request_body;       /* HTTP request body stream */
 	ngx_chain_t         *cl;                 /* HTTP request body chain */
+	u_char              *pos;                /* read position in HTTP request body chain */
+	ngx_str_t            request_body_data;  /* contiguous HTTP request body */
+	lws_body_data_e      request_body_type;  /* memory of contiguous HTTP request body */
+	lws_stream_t        *stream;             /* unbuffered HTTP request body stream */
+	lws_inflate_t       *inflate;            /* HTTP request body decompression */
 	ngx_int_t            rc;                 /* NGINX response code */
 	ngx_int_t            status;             /* HTTP reponse status */
 	lws_table_t         *response_headers;   /* HTTP response headers */
-	FILE                *response_body;      /* HTTP response body stream */
-	ngx_str_t            response_body_str;  /* HTTP response body string */
+	ngx_str_t            cache_key;          /* response cache key; empty = not cached */
+	lws_flight_t        *flight;             /* coalesced requests */
+	ngx_array_t          headers_out;        /* response headers prepared for NGINX */
+	ngx_str_t            content_type;       /* prepared content type */
+	time_t               last_modified;      /* prepared last modified time; -1 = none */
+	lws_body_t           response_body;      /* HTTP response body */
+	FILE                *response_file;      /* HTTP response body stream; file type */
 	ngx_str_t            redirect;           /* NGINX internal redirect; @ prefix for name */
 	ngx_str_t            redirect_args;      /* NGINX internal redirect args */
+	ngx_str_t            sendfile;           /* file to send after the response body */
+	off_t                sendfile_offset;    /* offset of file to send */
+	off_t                sendfile_length;    /* length of file to send; -1 = to end */
 	ngx_str_t            diagnostic;         /* diagnostic response */
+	ngx_thread_task_t   *task;               /* thread task */
+	lws_subrequest_t    *subrequests;        /* subrequests of yielded Lua */
+	size_t               subrequests_n;      /* number of subrequests */
+	size_t               subrequests_active; /* number of active subrequests */
+	lws_job_t           *jobs;               /* offloaded jobs */
+	lws_job_t           *job;                /* job to start or join */
+	lws_yield_e          yield;              /* Lua yielded; resumes in a new thread task */
+	unsigned             post:1;             /* post chunk runs after the response */
+	unsigned             after_response:1;   /* response is sent */
+	unsigned             streaming:1;        /* response headers are sent; body is streamed */
+	unsigned             stream_error:1;     /* streaming the response body failed */
+	unsigned             anchored:1;         /* state is released with the request */
+	unsigned             parked:1;           /* request waits for the coalesced response */
+	unsigned             shared:1;           /* response body is shared with the leader */
+};
+
+struct lws_stream_s {
+	ngx_thread_mutex_t   mtx;     /* mutex guarding data, eof, error, paused, and posted */
+	ngx_thread_cond_t    cond;    /* signaled when data, eof, or error is available */
+	lws_body_t           data;    /* data received and not yet read by Lua */
+	ngx_thread_task_t    task;    /* task whose completion resumes a paused stream */
+	lws_request_ctx_t   *ctx;     /* request context; NULL once the request is done */
+	size_t               size;    /* unread data pausing the stream */
+	ngx_flag_t           eof;     /* request body is complete */
+	ngx_flag_t           error;   /* reading the request body failed */
+	ngx_flag_t           paused;  /* reading waits for Lua to drain the data */
+	ngx_flag_t           posted;  /* task is posted */
+	size_t               read;    /* bytes read by Lua; pool thread only */
+};
+
+struct lws_subrequest_s {
+	lws_request_ctx_t  *ctx;     /* request context */
+	ngx_str_t           uri;     /* URI */
+	ngx_str_t           args;    /* query parameters */
+	ngx_int_t           status;  /* response status */
+	ngx_str_t           body;    /* response body */
+	unsigned            done:1;  /* subrequest is done */
+};
+
+struct lws_header_s {
+	ngx_table_elt_t    elt;  /* response header */
+	ngx_table_elt_t  **ref;  /* reference in NGINX response headers; NULL = none */
+};
+
+struct lws_flight_s {
+	ngx_str_t           key;        /* coalescing key */
+	lws_loc_conf_t     *llcf;       /* location configuration */
+	lws_request_ctx_t  *leader;     /* request running Lua; NULL once terminated */
+	ngx_queue_t         followers;  /* parked requests */
+	ngx_uint_t          refs;       /* requests referencing the response */
+	ngx_pool_t         *pool;       /* response arena; owned after the leader is done */
+	lws_table_t        *headers;    /* response headers; owned after the leader is done */
+	lws_body_t          body;       /* response body; owned after the leader is done */
+	unsigned            landed:1;   /* leader is done; parked requests are answered */
+	unsigned            owned:1;    /* response is owned */
 };
 
 struct lws_variable_s {
@@ -108,4 +256,7 @@ struct lws_variable_s {
 extern ngx_module_t lws_module;
 
 
+void lws_resume_request(lws_request_ctx_t *ctx);
+
+
 #endif /* _LWS_MODULE_INCLUDED */
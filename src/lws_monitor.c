@@ -69,9 +69,50 @@ static ngx_int_t lws_init_monitor (ngx_shm_zone_t *zone, void *data) {
 	if (!lmcf->monitor->functions) {
 		return NGX_ERROR;
 	}
+	lmcf->monitor->lrus = ngx_slab_calloc(lmcf->monitor_pool,
+			LWS_MONITOR_LRUS * sizeof(lws_lru_stats_t));
+	if (!lmcf->monitor->lrus) {
+		return NGX_ERROR;
+	}
 	return NGX_OK;
 }
 
+lws_lru_stats_t *lws_monitor_lru (ngx_str_t *key, ngx_log_t *log) {
+	size_t            i;
+	lws_lru_stats_t  *l;
+	lws_main_conf_t  *lmcf;
+
+	/* caches with the same key share statistics across states and workers */
+	lmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, lws_module);
+	if (!lmcf->monitor) {
+		return NULL;
+	}
+	ngx_shmtx_lock(&lmcf->monitor_pool->mutex);
+	for (i = 0; i < lmcf->monitor->lrus_n; i++) {
+		l = &lmcf->monitor->lrus[i];
+		if (l->key.len == key->len && ngx_strncmp(l->key.data, key->data, key->len) == 0) {
+			ngx_shmtx_unlock(&lmcf->monitor_pool->mutex);
+			return l;
+		}
+	}
+	l = NULL;
+	if (lmcf->monitor->lrus_n < LWS_MONITOR_LRUS && !lmcf->monitor->out_of_memory) {
+		l = &lmcf->monitor->lrus[lmcf->monitor->lrus_n];
+		l->key.data = ngx_slab_alloc_locked(lmcf->monitor_pool, key->len);
+		if (l->key.data) {
+			ngx_memcpy(l->key.data, key->data, key->len);
+			l->key.len = key->len;
+			lmcf->monitor->lrus_n++;
+		} else {
+			ngx_log_error(NGX_LOG_ERR, log, 0, "[LWS] failed to allocate monitor LRU key");
+			lmcf->monitor->out_of_memory = 1;
+			l = NULL;
+		}
+	}
+	ngx_shmtx_unlock(&lmcf->monitor_pool->mutex);
+	return l;
+}
+
 static ngx_int_t lws_monitor_handler (ngx_http_request_t *r) {
 	switch (r->method) {
 	case NGX_HTTP_GET:
@@ -91,6 +132,7 @@ static ngx_int_t lws_monitor_content_handler (ngx_http_request_t *r) {
 	ngx_int_t         rc;
 	ngx_chain_t      *out;
 	lws_function_t   *f;
+	lws_lru_stats_t  *l;
 	lws_main_conf_t  *lmcf;
 	ngx_table_elt_t  *h;
 
@@ -110,7 +152,17 @@ static ngx_int_t lws_monitor_content_handler (ngx_http_request_t *r) {
 	len += sizeof("\t\"memory_used\": ,\n") - 1  + 20;
 	len += sizeof("\t\"request_count\": ,\n") - 1  + 20;
 	len += sizeof("\t\"profiler\": ,\n") - 1  + 1;
+	len += sizeof("\t\"cache_hits\": ,\n") - 1  + 20;
+	len += sizeof("\t\"cache_stale\": ,\n") - 1  + 20;
+	len += sizeof("\t\"cache_misses\": ,\n") - 1  + 20;
 	len += sizeof("\t\"out_of_memory\": ,\n") - 1  + 1;
+	len += sizeof("\t\"lrus\": [\n") - 1;
+	for (i = 0; i < lmcf->monitor->lrus_n; i++) {
+		l = &lmcf->monitor->lrus[i];
+		len += sizeof("\t\t[\"\", , , ],\n") - 1 + 3 * 20;
+		len += l->key.len + ngx_escape_json(NULL, l->key.data, l->key.len);
+	}
+	len += sizeof("\t],\n") - 1;
 	len += sizeof("\t\"functions\": [\n") - 1;
 	for (i = 0; i < lmcf->monitor->functions_n; i++) {
 		f = &lmcf->monitor->functions[i];
@@ -132,13 +184,39 @@ static ngx_int_t lws_monitor_content_handler (ngx_http_request_t *r) {
 			"\t\"memory_used\": %i,\n"
 			"\t\"request_count\": %i,\n"
 			"\t\"profiler\": %i,\n"
+			"\t\"cache_hits\": %i,\n"
+			"\t\"cache_stale\": %i,\n"
+			"\t\"cache_misses\": %i,\n"
 			"\t\"out_of_memory\": %i,\n",
 			(ngx_int_t)lmcf->monitor->states_n,
 			(ngx_int_t)lmcf->monitor->requests_n,
 			(ngx_int_t)lmcf->monitor->memory_used,
 			(ngx_int_t)lmcf->monitor->request_count,
 			(ngx_int_t)lmcf->monitor->profiler,
+			(ngx_int_t)lmcf->monitor->cache_hits,
+			(ngx_int_t)lmcf->monitor->cache_stale,
+			(ngx_int_t)lmcf->monitor->cache_misses,
 			(ngx_int_t)lmcf->monitor->out_of_memory);
+	if (lmcf->monitor->lrus_n == 0) {
+		b->last = lws_cpylit(b->last, "\t\"lrus\": [],\n");
+	} else {
+		b->last = lws_cpylit(b->last, "\t\"lrus\": [\n");
+		for (i = 0; i < lmcf->monitor->lrus_n; i++) {
+			l = &lmcf->monitor->lrus[i];
+			b->last = lws_cpylit(b->last, "\t\t[\"");
+			b->last = (u_char *)ngx_escape_json(b->last, l->key.data, l->key.len);
+			b->last = ngx_sprintf(b->last, "\", %i, %i, %i]",
+					(ngx_int_t)l->hits,
+					(ngx_int_t)l->misses,
+					(ngx_int_t)l->evictions);
+			if (i < lmcf->monitor->lrus_n - 1) {
+				b->last = lws_cpylit(b->last, ",\n");
+			} else {
+				b->last = lws_cpylit(b->last, "\n");
+			}
+		}
+		b->last = lws_cpylit(b->last, "\t],\n");
+	}
 	if (lmcf->monitor->functions_n == 0) {
 		b->last = lws_cpylit(b->last, "\t\"functions\": []\n");
 	} else {
@@ -14,10 +14,19 @@
 
 
 #define LWS_MONITOR_SIZE  (128 * 4096)
+#define LWS_MONITOR_LRUS  64  /* maximum number of monitored LRU caches */
 
 
 typedef struct lws_monitor_s lws_monitor_t;
 typedef struct lws_function_s lws_function_t;
+typedef struct lws_lru_stats_s lws_lru_stats_t;
+
+struct lws_lru_stats_s {
+	ngx_str_t     key;        /* key */
+	ngx_atomic_t  hits;       /* hits */
+	ngx_atomic_t  misses;     /* misses */
+	ngx_atomic_t  evictions;  /* entries evicted due to the cap */
+};
 
 struct lws_monitor_s {
 	ngx_atomic_t     states_n;         /* number of Lua states (active + inactive) */
@@ -25,10 +34,15 @@ struct lws_monitor_s {
 	ngx_atomic_t     memory_used;      /* used memory */
 	ngx_atomic_t     request_count;    /* requests served */
 	ngx_atomic_t     profiler;         /* profiler state; 0 = disabled, 1 = CPU, 2 = wall */
+	ngx_atomic_t     cache_hits;       /* response cache hits */
+	ngx_atomic_t     cache_stale;      /* response cache hits served stale */
+	ngx_atomic_t     cache_misses;     /* response cache misses */
 	ngx_int_t        out_of_memory;    /* out-of-memory; 0 = no */
 	size_t           functions_n;      /* number of profiled functions */
 	size_t           functions_alloc;  /* allocated profiled functions */
 	lws_function_t  *functions;        /* profiled functions */
+	size_t           lrus_n;           /* number of LRU caches */
+	lws_lru_stats_t *lrus;             /* LRU caches; fixed for lock-free counting */
 };
 
 struct lws_function_s {
@@ -41,6 +55,7 @@ struct lws_function_s {
 
 
 char *lws_monitor(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+lws_lru_stats_t *lws_monitor_lru(ngx_str_t *key, ngx_log_t *log);
 
 
 #endif /* _LWS_MONITOR_INCLUDED */
@@ -0,0 +1,964 @@
+/*
+ * LWS shared
+ *
+ * Copyright (C) 2024 Andre Naef
+ */
+
+
+#include <lws_shared.h>
+#include <ngx_thread_pool.h>
+#include <lauxlib.h>
+#include <lws_value.h>
+
+
+#define lws_shared_expired(node, now)  ((node)->expires  \
+		&& (ngx_msec_int_t)((node)->expires - (now)) <= 0)
+
+
+static ngx_int_t lws_init_shared_zone(ngx_shm_zone_t *zone, void *data);
+static ngx_int_t lws_init_tags_zone(ngx_shm_zone_t *zone, void *data);
+static void lws_shared_load(lws_shared_dict_t *dict, ngx_log_t *log);
+static ngx_int_t lws_shared_claim(lws_shared_dict_t *dict, ngx_flag_t exiting);
+static void lws_shared_persist_handler(ngx_event_t *ev);
+static void lws_shared_persist_thread_handler(void *data, ngx_log_t *log);
+static void lws_shared_persist_done_handler(ngx_event_t *ev);
+static ngx_int_t lws_shared_save(lws_shared_dict_t *dict, ngx_log_t *log);
+static ngx_int_t lws_shared_save_stripe(lws_shared_stripe_t *stripe, u_char **buf,
+		size_t *size, size_t *len, int64_t now, ngx_log_t *log);
+static ngx_int_t lws_shared_write(ngx_fd_t fd, u_char *buf, size_t len);
+static lws_shared_stripe_t *lws_shared_stripe(lws_shared_dict_t *dict, ngx_str_t *key,
+		uint32_t *hash);
+static lws_shared_node_t *lws_shared_lookup(lws_shared_dict_t *dict,
+		lws_shared_stripe_t *stripe, ngx_str_t *key, uint32_t hash);
+static void lws_shared_remove(lws_shared_dict_t *dict, lws_shared_stripe_t *stripe,
+		lws_shared_node_t *node);
+static ngx_int_t lws_shared_store(lws_shared_dict_t *dict, lws_shared_stripe_t *stripe,
+		lws_shared_node_t *node, ngx_str_t *key, uint32_t hash, u_char *value, size_t len,
+		ngx_msec_t expires);
+static lws_shared_node_t *lws_shared_alloc(lws_shared_dict_t *dict,
+		lws_shared_stripe_t *stripe, size_t size);
+static ngx_int_t lws_shared_evict(lws_shared_dict_t *dict, lws_shared_stripe_t *stripe,
+		size_t *freed);
+static lws_shared_dict_t *lws_check_shared_dict(lua_State *L, int index);
+static ngx_msec_t lws_check_ttl(lua_State *L, int index);
+static int lws_lua_shared_index(lua_State *L);
+static int lws_lua_shared_dict_get(lua_State *L);
+static int lws_lua_shared_dict_set(lua_State *L);
+static int lws_lua_shared_dict_add(lua_State *L);
+static int lws_lua_shared_dict_incr(lua_State *L);
+static int lws_lua_shared_dict_delete(lua_State *L);
+static int lws_lua_shared_dict_tostring(lua_State *L);
+static int lws_shared_put(lua_State *L, int add);
+
+
+/*
+ * configuration
+ */
+
+char *lws_shared_dict (ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+	ssize_t             size;
+	ngx_str_t          *values, value;
+	ngx_uint_t          i;
+	ngx_shm_zone_t     *zone;
+	lws_main_conf_t    *lmcf;
+	lws_shared_dict_t  *dict, **dictp;
+
+	/* parse */
+	lmcf = conf;
+	values = cf->args->elts;
+	size = ngx_parse_size(&values[2]);
+	if (size == NGX_ERROR) {
+		return "has invalid size";
+	}
+	if (size < (ssize_t)(8 * ngx_pagesize)) {
+		return "has too small size";
+	}
+	dict = ngx_pcalloc(cf->pool, sizeof(lws_shared_dict_t));
+	if (!dict) {
+		return NGX_CONF_ERROR;
+	}
+	dict->name = values[1];
+
+	/* attributes */
+	dict->persist_interval = LWS_SHARED_PERSIST_INTERVAL;
+	for (i = 3; i < cf->args->nelts; i++) {
+		if (ngx_strncmp(values[i].data, "persist=", 8) == 0) {
+			dict->persist.data = values[i].data + 8;
+			dict->persist.len = values[i].len - 8;
+			if (dict->persist.len == 0) {
+				return "has invalid persist value";
+			}
+			if (ngx_conf_full_name(cf->cycle, &dict->persist, 0) != NGX_OK) {
+				return NGX_CONF_ERROR;
+			}
+		} else if (ngx_strncmp(values[i].data, "persist_interval=", 17) == 0) {
+			value.data = values[i].data + 17;
+			value.len = values[i].len - 17;
+			dict->persist_interval = ngx_parse_time(&value, 1);
+			if (dict->persist_interval == (time_t)NGX_ERROR || dict->persist_interval == 0) {
+				return "has invalid persist_interval value";
+			}
+		} else {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid attribute value \"%s\"",
+					values[i].data);
+			return NGX_CONF_ERROR;
+		}
+	}
+
+	/* add shared memory zone */
+	zone = ngx_shared_memory_add(cf, &values[1], size, &lws_module);
+	if (!zone) {
+		return NGX_CONF_ERROR;
+	}
+	if (zone->data) {
+		return "is duplicate";
+	}
+	zone->data = dict;
+	zone->init = lws_init_shared_zone;
+
+	/* register for lookup by name from Lua */
+	if (!lmcf->shared_dicts) {
+		lmcf->shared_dicts = ngx_array_create(cf->pool, 4, sizeof(lws_shared_dict_t *));
+		if (!lmcf->shared_dicts) {
+			return NGX_CONF_ERROR;
+		}
+	}
+	dictp = ngx_array_push(lmcf->shared_dicts);
+	if (!dictp) {
+		return NGX_CONF_ERROR;
+	}
+	*dictp = dict;
+	return NGX_CONF_OK;
+}
+
+static ngx_int_t lws_init_shared_zone (ngx_shm_zone_t *zone, void *data) {
+	ngx_uint_t            i;
+	lws_shared_dict_t    *dict, *odict;
+	lws_shared_stripe_t  *stripe;
+
+	/* reuse on reload */
+	dict = zone->data;
+	odict = data;
+	if (odict) {
+		dict->sh = odict->sh;
+		dict->pool = odict->pool;
+		return NGX_OK;
+	}
+
+	/* initialize */
+	dict->pool = (ngx_slab_pool_t *)zone->shm.addr;
+	if (zone->shm.exists) {
+		dict->sh = dict->pool->data;
+		return NGX_OK;
+	}
+	dict->pool->log_nomem = 0;  /* allocation failures evict entries */
+	dict->sh = ngx_slab_calloc(dict->pool, sizeof(lws_shared_t));
+	if (!dict->sh) {
+		return NGX_ERROR;
+	}
+	dict->pool->data = dict->sh;
+	for (i = 0; i < LWS_SHARED_STRIPES; i++) {
+		stripe = &dict->sh->stripes[i];
+		if (ngx_shmtx_create(&stripe->mutex, &stripe->lock, NULL) != NGX_OK) {
+			return NGX_ERROR;
+		}
+		ngx_rbtree_init(&stripe->rbtree, &stripe->sentinel, ngx_str_rbtree_insert_value);
+		ngx_queue_init(&stripe->lru);
+	}
+	dict->sh->persisted = ngx_time();
+
+	/* warm start */
+	if (dict->persist.len) {
+		lws_shared_load(dict, zone->shm.log);
+	}
+	return NGX_OK;
+}
+
+
+/*
+ * invalidation tags
+ */
+
+ngx_int_t lws_add_tags (ngx_conf_t *cf, lws_main_conf_t *lmcf) {
+	ngx_str_t  name;
+
+	ngx_str_set(&name, LWS_TAGS_NAME);
+	lmcf->tags_shm = ngx_shared_memory_add(cf, &name, 8 * ngx_pagesize, &lws_module);
+	if (!lmcf->tags_shm) {
+		return NGX_ERROR;
+	}
+	lmcf->tags_shm->data = lmcf;
+	lmcf->tags_shm->init = lws_init_tags_zone;
+	return NGX_OK;
+}
+
+static ngx_int_t lws_init_tags_zone (ngx_shm_zone_t *zone, void *data) {
+	lws_main_conf_t  *lmcf, *olmcf;
+	ngx_slab_pool_t  *pool;
+
+	/* reuse on reload; invalidations remain effective */
+	lmcf = zone->data;
+	olmcf = data;
+	if (olmcf) {
+		lmcf->tags = olmcf->tags;
+		return NGX_OK;
+	}
+
+	/* initialize */
+	pool = (ngx_slab_pool_t *)zone->shm.addr;
+	if (zone->shm.exists) {
+		lmcf->tags = pool->data;
+		return NGX_OK;
+	}
+	lmcf->tags = ngx_slab_calloc(pool, sizeof(lws_tags_t));
+	if (!lmcf->tags) {
+		return NGX_ERROR;
+	}
+	pool->data = lmcf->tags;
+	return NGX_OK;
+}
+
+ngx_atomic_t *lws_tag_version (lws_tags_t *tags, ngx_str_t *tag) {
+	/* tags sharing a slot are invalidated together */
+	return &tags->versions[ngx_crc32_short(tag->data, tag->len) & (LWS_TAGS_N - 1)];
+}
+
+
+/*
+ * persistence
+ */
+
+static void lws_shared_load (lws_shared_dict_t *dict, ngx_log_t *log) {
+	u_char               *data, *p, *end;
+	size_t                size, n;
+	int64_t               now, ttl;
+	uint32_t              hash;
+	ngx_fd_t              fd;
+	ngx_str_t             key;
+	ngx_msec_t            expires;
+	ngx_time_t           *tp;
+	ngx_file_info_t       fi;
+	lws_shared_node_t    *node;
+	lws_shared_record_t   record;
+	lws_shared_header_t  *header;
+	lws_shared_stripe_t  *stripe;
+
+	/* map snapshot; a missing snapshot is a cold start */
+	fd = ngx_open_file(dict->persist.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+	if (fd == NGX_INVALID_FILE) {
+		if (ngx_errno != NGX_ENOENT) {
+			ngx_log_error(NGX_LOG_WARN, log, ngx_errno, "[LWS] failed to open snapshot \"%V\"",
+					&dict->persist);
+		}
+		return;
+	}
+	if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+		ngx_log_error(NGX_LOG_WARN, log, ngx_errno, "[LWS] failed to stat snapshot \"%V\"",
+				&dict->persist);
+		(void)ngx_close_file(fd);
+		return;
+	}
+	size = ngx_file_size(&fi);
+	if (size < sizeof(lws_shared_header_t)) {
+		(void)ngx_close_file(fd);
+		ngx_log_error(NGX_LOG_WARN, log, 0, "[LWS] bad snapshot \"%V\"", &dict->persist);
+		return;
+	}
+	data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	(void)ngx_close_file(fd);
+	if (data == MAP_FAILED) {
+		ngx_log_error(NGX_LOG_WARN, log, ngx_errno, "[LWS] failed to map snapshot \"%V\"",
+				&dict->persist);
+		return;
+	}
+	header = (lws_shared_header_t *)data;
+	if (ngx_memcmp(header->magic, LWS_SHARED_PERSIST_MAGIC, sizeof(header->magic)) != 0
+			|| header->bom != LWS_SHARED_PERSIST_BOM) {
+		(void)munmap(data, size);
+		ngx_log_error(NGX_LOG_WARN, log, 0, "[LWS] bad snapshot \"%V\"", &dict->persist);
+		return;
+	}
+
+	/* insert unexpired entries; expiry times are converted from wall clock time */
+	tp = ngx_timeofday();
+	now = (int64_t)tp->sec * 1000 + tp->msec;
+	n = 0;
+	p = data + sizeof(lws_shared_header_t);
+	end = data + size;
+	while (p < end) {
+		if ((size_t)(end - p) < sizeof(lws_shared_record_t)) {
+			break;
+		}
+		ngx_memcpy(&record, p, sizeof(lws_shared_record_t));
+		p += sizeof(lws_shared_record_t);
+		if (record.key_len == 0 || (uint64_t)record.key_len + record.value_len
+				> (uint64_t)(end - p)) {
+			break;
+		}
+		key.data = p;
+		key.len = record.key_len;
+		p += record.key_len + record.value_len;
+		expires = 0;
+		if (record.expires) {
+			ttl = record.expires - now;
+			if (ttl <= 0) {
+				continue;
+			}
+			expires = (ngx_current_msec + (ngx_msec_t)ttl) | 1;
+		}
+		stripe = lws_shared_stripe(dict, &key, &hash);
+		node = lws_shared_lookup(dict, stripe, &key, hash);
+		if (lws_shared_store(dict, stripe, node, &key, hash, key.data + key.len,
+				record.value_len, expires) != NGX_OK) {
+			break;
+		}
+		n++;
+	}
+	if (p < end) {
+		ngx_log_error(NGX_LOG_WARN, log, 0, "[LWS] snapshot \"%V\" partially loaded",
+				&dict->persist);
+	}
+	(void)munmap(data, size);
+	ngx_log_error(NGX_LOG_NOTICE, log, 0, "[LWS] loaded %uz entries from snapshot \"%V\"", n,
+			&dict->persist);
+}
+
+ngx_int_t lws_init_shared_process (ngx_cycle_t *cycle) {
+	ngx_uint_t           i;
+	lws_main_conf_t     *lmcf;
+	lws_shared_dict_t  **dicts, *dict;
+
+	/* each worker process has a timer; the first to claim a due snapshot writes it */
+	lmcf = ngx_http_cycle_get_module_main_conf(cycle, lws_module);
+	if (!lmcf || !lmcf->shared_dicts) {
+		return NGX_OK;
+	}
+	dicts = lmcf->shared_dicts->elts;
+	for (i = 0; i < lmcf->shared_dicts->nelts; i++) {
+		dict = dicts[i];
+		if (!dict->persist.len) {
+			continue;
+		}
+		dict->persist_task = ngx_thread_task_alloc(cycle->pool, 0);
+		if (!dict->persist_task) {
+			return NGX_ERROR;
+		}
+		dict->persist_task->ctx = dict;
+		dict->persist_task->handler = lws_shared_persist_thread_handler;
+		dict->persist_task->event.handler = lws_shared_persist_done_handler;
+		dict->persist_task->event.data = dict;
+		dict->persist_ev.handler = lws_shared_persist_handler;
+		dict->persist_ev.data = dict;
+		dict->persist_ev.log = cycle->log;
+		dict->persist_ev.cancelable = 1;
+		ngx_add_timer(&dict->persist_ev, dict->persist_interval * 1000);
+	}
+	return NGX_OK;
+}
+
+void lws_exit_shared_process (ngx_cycle_t *cycle) {
+	ngx_uint_t           i;
+	lws_main_conf_t     *lmcf;
+	lws_shared_dict_t  **dicts, *dict;
+
+	/* the first worker process to exit writes a final snapshot */
+	lmcf = ngx_http_cycle_get_module_main_conf(cycle, lws_module);
+	if (!lmcf || !lmcf->shared_dicts) {
+		return;
+	}
+	dicts = lmcf->shared_dicts->elts;
+	for (i = 0; i < lmcf->shared_dicts->nelts; i++) {
+		dict = dicts[i];
+		if (dict->persist.len && lws_shared_claim(dict, 1) == NGX_OK) {
+			(void)lws_shared_save(dict, cycle->log);
+		}
+	}
+}
+
+static ngx_int_t lws_shared_claim (lws_shared_dict_t *dict, ngx_flag_t exiting) {
+	time_t  now, persisted;
+
+	now = ngx_time();
+	persisted = dict->sh->persisted;
+	if (exiting ? persisted == now : now - persisted < dict->persist_interval) {
+		return NGX_DECLINED;
+	}
+	return ngx_atomic_cmp_set(&dict->sh->persisted, persisted, now) ? NGX_OK : NGX_DECLINED;
+}
+
+static void lws_shared_persist_handler (ngx_event_t *ev) {
+	lws_main_conf_t    *lmcf;
+	lws_shared_dict_t  *dict;
+
+	/* snapshots are written by the thread pool */
+	dict = ev->data;
+	if (!dict->persisting && lws_shared_claim(dict, 0) == NGX_OK) {
+		lmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, lws_module);
+		if (ngx_thread_task_post(lmcf->thread_pool, dict->persist_task) == NGX_OK) {
+			dict->persisting = 1;
+		} else {
+			ngx_log_error(NGX_LOG_CRIT, ev->log, 0, "[LWS] failed to post thread task");
+		}
+	}
+	if (!ngx_exiting) {
+		ngx_add_timer(ev, dict->persist_interval * 1000);
+	}
+}
+
+static void lws_shared_persist_thread_handler (void *data, ngx_log_t *log) {
+	(void)lws_shared_save(data, log);
+}
+
+static void lws_shared_persist_done_handler (ngx_event_t *ev) {
+	lws_shared_dict_t  *dict;
+
+	dict = ev->data;
+	dict->persisting = 0;
+}
+
+static ngx_int_t lws_shared_save (lws_shared_dict_t *dict, ngx_log_t *log) {
+	u_char               *buf, *temp;
+	size_t                size, len;
+	int64_t               now;
+	ngx_fd_t              fd;
+	ngx_uint_t            i;
+	ngx_time_t           *tp;
+	ngx_int_t             rc;
+	lws_shared_header_t   header;
+
+	/* the snapshot is written to a temporary file, then renamed */
+	temp = ngx_alloc(dict->persist.len + 1 + NGX_INT64_LEN + 1, log);
+	if (!temp) {
+		return NGX_ERROR;
+	}
+	ngx_sprintf(temp, "%V.%P%Z", &dict->persist, ngx_pid);
+	fd = ngx_open_file(temp, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+	if (fd == NGX_INVALID_FILE) {
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno, "[LWS] failed to create snapshot \"%s\"",
+				temp);
+		ngx_free(temp);
+		return NGX_ERROR;
+	}
+	ngx_memzero(&header, sizeof(lws_shared_header_t));
+	ngx_memcpy(header.magic, LWS_SHARED_PERSIST_MAGIC, sizeof(header.magic));
+	header.bom = LWS_SHARED_PERSIST_BOM;
+	rc = lws_shared_write(fd, (u_char *)&header, sizeof(lws_shared_header_t));
+
+	/* each stripe is copied under its lock, and written after */
+	tp = ngx_timeofday();
+	now = (int64_t)tp->sec * 1000 + tp->msec;
+	buf = NULL;
+	size = 0;
+	for (i = 0; i < LWS_SHARED_STRIPES && rc == NGX_OK; i++) {
+		rc = lws_shared_save_stripe(&dict->sh->stripes[i], &buf, &size, &len, now, log);
+		if (rc == NGX_OK) {
+			rc = lws_shared_write(fd, buf, len);
+		}
+	}
+	ngx_free(buf);
+	if (rc != NGX_OK) {
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno, "[LWS] failed to write snapshot \"%s\"",
+				temp);
+	}
+	if (ngx_close_file(fd) == NGX_FILE_ERROR && rc == NGX_OK) {
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno, "[LWS] failed to close snapshot \"%s\"",
+				temp);
+		rc = NGX_ERROR;
+	}
+	if (rc == NGX_OK && ngx_rename_file(temp, dict->persist.data) == NGX_FILE_ERROR) {
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno, "[LWS] failed to rename snapshot \"%s\"",
+				temp);
+		rc = NGX_ERROR;
+	}
+	if (rc != NGX_OK) {
+		(void)ngx_delete_file(temp);
+	}
+	ngx_free(temp);
+	return rc;
+}
+
+static ngx_int_t lws_shared_save_stripe (lws_shared_stripe_t *stripe, u_char **buf,
+		size_t *size, size_t *len, int64_t now, ngx_log_t *log) {
+	u_char               *p;
+	size_t                need;
+	ngx_queue_t          *q;
+	lws_shared_node_t    *node;
+	lws_shared_record_t   record;
+
+	/* least recently used first, so that loading restores the order */
+	*len = 0;
+	ngx_shmtx_lock(&stripe->mutex);
+	for (q = ngx_queue_last(&stripe->lru); q != ngx_queue_sentinel(&stripe->lru);
+			q = ngx_queue_prev(q)) {
+		node = ngx_queue_data(q, lws_shared_node_t, queue);
+		if (lws_shared_expired(node, ngx_current_msec)) {
+			continue;
+		}
+		need = sizeof(lws_shared_record_t) + node->sn.str.len + node->value_len;
+		if (*len + need > *size) {
+			*size = ngx_max(*size ? *size * 2 : LWS_SHARED_PERSIST_BUF_SIZE, *len + need);
+			p = ngx_alloc(*size, log);
+			if (!p) {
+				ngx_shmtx_unlock(&stripe->mutex);
+				return NGX_ERROR;
+			}
+			ngx_memcpy(p, *buf, *len);
+			ngx_free(*buf);
+			*buf = p;
+		}
+		record.key_len = node->sn.str.len;
+		record.value_len = node->value_len;
+		record.expires = node->expires
+				? now + (ngx_msec_int_t)(node->expires - ngx_current_msec) : 0;
+		p = ngx_cpymem(*buf + *len, &record, sizeof(lws_shared_record_t));
+		ngx_memcpy(p, node->data, record.key_len + record.value_len);
+		*len += need;
+	}
+	ngx_shmtx_unlock(&stripe->mutex);
+	return NGX_OK;
+}
+
+static ngx_int_t lws_shared_write (ngx_fd_t fd, u_char *buf, size_t len) {
+	ssize_t  n;
+
+	while (len > 0) {
+		n = ngx_write_fd(fd, buf, len);
+		if (n == -1) {
+			if (ngx_errno == NGX_EINTR) {
+				continue;
+			}
+			return NGX_ERROR;
+		}
+		buf += n;
+		len -= n;
+	}
+	return NGX_OK;
+}
+
+
+/*
+ * entries
+ */
+
+static lws_shared_stripe_t *lws_shared_stripe (lws_shared_dict_t *dict, ngx_str_t *key,
+		uint32_t *hash) {
+	*hash = ngx_crc32_short(key->data, key->len);
+	return &dict->sh->stripes[*hash & (LWS_SHARED_STRIPES - 1)];
+}
+
+static lws_shared_node_t *lws_shared_lookup (lws_shared_dict_t *dict,
+		lws_shared_stripe_t *stripe, ngx_str_t *key, uint32_t hash) {
+	lws_shared_node_t  *node;
+
+	/* expired entries are removed on access */
+	node = (lws_shared_node_t *)ngx_str_rbtree_lookup(&stripe->rbtree, key, hash);
+	if (!node) {
+		return NULL;
+	}
+	if (lws_shared_expired(node, ngx_current_msec)) {
+		lws_shared_remove(dict, stripe, node);
+		return NULL;
+	}
+	ngx_queue_remove(&node->queue);
+	ngx_queue_insert_head(&stripe->lru, &node->queue);
+	return node;
+}
+
+static void lws_shared_remove (lws_shared_dict_t *dict, lws_shared_stripe_t *stripe,
+		lws_shared_node_t *node) {
+	ngx_rbtree_delete(&stripe->rbtree, &node->sn.node);
+	ngx_queue_remove(&node->queue);
+	ngx_slab_free(dict->pool, node);
+}
+
+static ngx_int_t lws_shared_store (lws_shared_dict_t *dict, lws_shared_stripe_t *stripe,
+		lws_shared_node_t *node, ngx_str_t *key, uint32_t hash, u_char *value, size_t len,
+		ngx_msec_t expires) {
+	/* replace in place if the encoded value has the same length */
+	if (node && node->value_len == len) {
+		ngx_memcpy(node->data + node->sn.str.len, value, len);
+		node->expires = expires;
+		return NGX_OK;
+	}
+	if (node) {
+		lws_shared_remove(dict, stripe, node);
+	}
+
+	/* insert */
+	node = lws_shared_alloc(dict, stripe, sizeof(lws_shared_node_t) + key->len + len);
+	if (!node) {
+		return NGX_ERROR;
+	}
+	node->sn.node.key = hash;
+	node->sn.str.data = node->data;
+	node->sn.str.len = key->len;
+	ngx_memcpy(node->data, key->data, key->len);
+	ngx_memcpy(node->data + key->len, value, len);
+	node->value_len = len;
+	node->expires = expires;
+	ngx_rbtree_insert(&stripe->rbtree, &node->sn.node);
+	ngx_queue_insert_head(&stripe->lru, &node->queue);
+	return NGX_OK;
+}
+
+static lws_shared_node_t *lws_shared_alloc (lws_shared_dict_t *dict,
+		lws_shared_stripe_t *stripe, size_t size) {
+	size_t                freed;
+	ngx_uint_t            i, evicted;
+	lws_shared_node_t    *node;
+	lws_shared_stripe_t  *other;
+
+	/* a size the pool can never hold fails without evicting */
+	if (size > (size_t)(dict->pool->end - dict->pool->start)) {
+		return NULL;
+	}
+
+	freed = 0;
+	while (1) {
+		node = ngx_slab_alloc(dict->pool, size);
+		if (node) {
+			return node;
+		}
+
+		/* eviction is limited, as fragmentation can keep an allocation from succeeding */
+		if (freed >= LWS_SHARED_EVICT_FACTOR * size + ngx_pagesize) {
+			return NULL;
+		}
+
+		/* evict least recently used entries, of the locked stripe first */
+		if (lws_shared_evict(dict, stripe, &freed) == NGX_OK) {
+			continue;
+		}
+
+		/* other stripes are only tried to avoid lock order inversion */
+		evicted = 0;
+		for (i = 0; i < LWS_SHARED_STRIPES && !evicted; i++) {
+			other = &dict->sh->stripes[i];
+			if (other == stripe || !ngx_shmtx_trylock(&other->mutex)) {
+				continue;
+			}
+			evicted = lws_shared_evict(dict, other, &freed) == NGX_OK;
+			ngx_shmtx_unlock(&other->mutex);
+		}
+		if (!evicted) {
+			return NULL;
+		}
+	}
+}
+
+static ngx_int_t lws_shared_evict (lws_shared_dict_t *dict, lws_shared_stripe_t *stripe,
+		size_t *freed) {
+	ngx_queue_t        *q;
+	lws_shared_node_t  *node;
+
+	if (ngx_queue_empty(&stripe->lru)) {
+		return NGX_DECLINED;
+	}
+	q = ngx_queue_last(&stripe->lru);
+	node = ngx_queue_data(q, lws_shared_node_t, queue);
+	*freed += sizeof(lws_shared_node_t) + node->sn.str.len + node->value_len;
+	lws_shared_remove(dict, stripe, node);
+	return NGX_OK;
+}
+
+
+/*
+ * Lua
+ */
+
+static lws_shared_dict_t *lws_check_shared_dict (lua_State *L, int index) {
+	return *(lws_shared_dict_t **)luaL_checkudata(L, index, LWS_SHARED_DICT);
+}
+
+static ngx_msec_t lws_check_ttl (lua_State *L, int index) {
+	lua_Number  ttl;
+
+	ttl = luaL_optnumber(L, index, 0);
+	luaL_argcheck(L, ttl >= 0, index, "non-negative number expected");
+	if (ttl == 0) {
+		return 0;
+	}
+	return (ngx_current_msec + (ngx_msec_t)(ttl * 1000)) | 1;  /* 0 is no expiry */
+}
+
+static int lws_lua_shared_index (lua_State *L) {
+	ngx_str_t           name;
+	ngx_uint_t          i;
+	lws_main_conf_t    *lmcf;
+	lws_shared_dict_t  *dict, **dicts, **ud;
+
+	/* find dictionary; the handle is cached in the table */
+	name.data = (u_char *)luaL_checklstring(L, 2, &name.len);
+	lmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, lws_module);
+	dict = NULL;
+	if (lmcf->shared_dicts) {
+		dicts = lmcf->shared_dicts->elts;
+		for (i = 0; i < lmcf->shared_dicts->nelts; i++) {
+			if (dicts[i]->name.len == name.len
+					&& ngx_strncmp(dicts[i]->name.data, name.data, name.len) == 0) {
+				dict = dicts[i];
+				break;
+			}
+		}
+	}
+	if (!dict) {
+		return luaL_error(L, "shared dictionary \"%s\" not found", name.data);
+	}
+	ud = lua_newuserdata(L, sizeof(lws_shared_dict_t *));
+	*ud = dict;
+	luaL_getmetatable(L, LWS_SHARED_DICT);
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, 2);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, 1);
+	return 1;
+}
+
+static int lws_lua_shared_dict_get (lua_State *L) {
+	u_char               *buf, stack[LWS_SHARED_GET_SIZE];
+	size_t                size;
+	uint32_t              hash;
+	ngx_str_t             key, value;
+	lws_shared_dict_t    *dict;
+	lws_shared_node_t    *node;
+	lws_shared_stripe_t  *stripe;
+
+	/* the value is copied under the lock, and decoded after */
+	dict = lws_check_shared_dict(L, 1);
+	key.data = (u_char *)luaL_checklstring(L, 2, &key.len);
+	stripe = lws_shared_stripe(dict, &key, &hash);
+	buf = stack;
+	size = sizeof(stack);
+	while (1) {
+		ngx_shmtx_lock(&stripe->mutex);
+		node = lws_shared_lookup(dict, stripe, &key, hash);
+		if (!node) {
+			ngx_shmtx_unlock(&stripe->mutex);
+			lua_pushnil(L);
+			return 1;
+		}
+		value.len = node->value_len;
+		if (value.len <= size) {
+			ngx_memcpy(buf, node->data + node->sn.str.len, value.len);
+			ngx_shmtx_unlock(&stripe->mutex);
+			break;
+		}
+		ngx_shmtx_unlock(&stripe->mutex);
+		size = value.len;
+		buf = lua_newuserdata(L, size);
+	}
+	value.data = buf;
+	return lws_decode_values(L, &value);
+}
+
+static int lws_lua_shared_dict_set (lua_State *L) {
+	return lws_shared_put(L, 0);
+}
+
+static int lws_lua_shared_dict_add (lua_State *L) {
+	return lws_shared_put(L, 1);
+}
+
+static int lws_shared_put (lua_State *L, int add) {
+	uint32_t              hash;
+	ngx_int_t             rc;
+	ngx_str_t             key, value;
+	ngx_msec_t            expires;
+	lws_shared_dict_t    *dict;
+	lws_shared_node_t    *node;
+	lws_shared_stripe_t  *stripe;
+
+	/* encode; Lua errors are raised before locking */
+	dict = lws_check_shared_dict(L, 1);
+	key.data = (u_char *)luaL_checklstring(L, 2, &key.len);
+	luaL_argcheck(L, key.len > 0, 2, "non-empty string expected");
+	luaL_checkany(L, 3);
+	expires = lws_check_ttl(L, 4);
+	ngx_str_null(&value);
+	if (!lua_isnil(L, 3)) {
+		lws_encode_values(L, 3, 1, &value);
+	}
+
+	/* store; setting nil deletes */
+	stripe = lws_shared_stripe(dict, &key, &hash);
+	ngx_shmtx_lock(&stripe->mutex);
+	node = lws_shared_lookup(dict, stripe, &key, hash);
+	if (add && node) {
+		ngx_shmtx_unlock(&stripe->mutex);
+		ngx_free(value.data);
+		lua_pushboolean(L, 0);
+		lua_pushliteral(L, "exists");
+		return 2;
+	}
+	if (!value.data) {
+		if (node) {
+			lws_shared_remove(dict, stripe, node);
+		}
+		rc = NGX_OK;
+	} else {
+		rc = lws_shared_store(dict, stripe, node, &key, hash, value.data, value.len, expires);
+	}
+	ngx_shmtx_unlock(&stripe->mutex);
+	ngx_free(value.data);
+	if (rc != NGX_OK) {
+		lua_pushboolean(L, 0);
+		lua_pushliteral(L, "no memory");
+		return 2;
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int lws_lua_shared_dict_incr (lua_State *L) {
+	u_char                buf[1 + sizeof(lua_Number) + sizeof(lua_Integer)], *p;
+	size_t                len;
+	uint32_t              hash;
+	ngx_int_t             rc;
+	ngx_str_t             key;
+	lua_Number            number;
+	ngx_msec_t            expires;
+	lws_shared_dict_t    *dict;
+	lws_shared_node_t    *node;
+	lws_shared_stripe_t  *stripe;
+#if LUA_VERSION_NUM >= 503
+	int                   integer;
+	lua_Integer           i;
+#endif
+
+	/* check arguments */
+	dict = lws_check_shared_dict(L, 1);
+	key.data = (u_char *)luaL_checklstring(L, 2, &key.len);
+	luaL_argcheck(L, key.len > 0, 2, "non-empty string expected");
+	(void)luaL_checknumber(L, 3);
+	if (!lua_isnoneornil(L, 4)) {
+		(void)luaL_checknumber(L, 4);
+	}
+	expires = lws_check_ttl(L, 5);
+
+	/* current value, or initial value */
+	stripe = lws_shared_stripe(dict, &key, &hash);
+	ngx_shmtx_lock(&stripe->mutex);
+	node = lws_shared_lookup(dict, stripe, &key, hash);
+	if (node) {
+		p = node->data + node->sn.str.len;
+		expires = node->expires;
+	} else if (!lua_isnoneornil(L, 4)) {
+		p = NULL;
+	} else {
+		ngx_shmtx_unlock(&stripe->mutex);
+		lua_pushnil(L);
+		lua_pushliteral(L, "not found");
+		return 2;
+	}
+	/* integers remain integers; other sums are numbers */
+#if LUA_VERSION_NUM >= 503
+	integer = 0;
+	if (p ? *p == LWS_VT_INTEGER : lua_isinteger(L, 4)) {
+		if (p) {
+			ngx_memcpy(&i, p + 1, sizeof(lua_Integer));
+		} else {
+			i = lua_tointeger(L, 4);
+		}
+		integer = lua_isinteger(L, 3);
+		number = (lua_Number)i;
+	} else
+#endif
+	if (!p || *p == LWS_VT_NUMBER) {
+		if (p) {
+			ngx_memcpy(&number, p + 1, sizeof(lua_Number));
+		} else {
+			number = lua_tonumber(L, 4);
+		}
+	} else {
+		ngx_shmtx_unlock(&stripe->mutex);
+		lua_pushnil(L);
+		lua_pushliteral(L, "not a number");
+		return 2;
+	}
+
+	/* encode and store the sum */
+#if LUA_VERSION_NUM >= 503
+	if (integer) {
+		i += lua_tointeger(L, 3);
+		buf[0] = LWS_VT_INTEGER;
+		ngx_memcpy(buf + 1, &i, sizeof(lua_Integer));
+		len = 1 + sizeof(lua_Integer);
+	} else
+#endif
+	{
+		number += lua_tonumber(L, 3);
+		buf[0] = LWS_VT_NUMBER;
+		ngx_memcpy(buf + 1, &number, sizeof(lua_Number));
+		len = 1 + sizeof(lua_Number);
+	}
+	rc = lws_shared_store(dict, stripe, node, &key, hash, buf, len, expires);
+	ngx_shmtx_unlock(&stripe->mutex);
+	if (rc != NGX_OK) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "no memory");
+		return 2;
+	}
+#if LUA_VERSION_NUM >= 503
+	if (integer) {
+		lua_pushinteger(L, i);
+		return 1;
+	}
+#endif
+	lua_pushnumber(L, number);
+	return 1;
+}
+
+static int lws_lua_shared_dict_delete (lua_State *L) {
+	uint32_t              hash;
+	ngx_str_t             key;
+	lws_shared_dict_t    *dict;
+	lws_shared_node_t    *node;
+	lws_shared_stripe_t  *stripe;
+
+	dict = lws_check_shared_dict(L, 1);
+	key.data = (u_char *)luaL_checklstring(L, 2, &key.len);
+	stripe = lws_shared_stripe(dict, &key, &hash);
+	ngx_shmtx_lock(&stripe->mutex);
+	node = lws_shared_lookup(dict, stripe, &key, hash);
+	if (node) {
+		lws_shared_remove(dict, stripe, node);
+	}
+	ngx_shmtx_unlock(&stripe->mutex);
+	return 0;
+}
+
+static int lws_lua_shared_dict_tostring (lua_State *L) {
+	lws_shared_dict_t  *dict;
+
+	dict = lws_check_shared_dict(L, 1);
+	lua_pushfstring(L, LWS_SHARED_DICT ": %s", dict->name.data);
+	return 1;
+}
+
+int lws_open_shared (lua_State *L) {
+	/* shared dictionary */
+	luaL_newmetatable(L, LWS_SHARED_DICT);
+	lua_createtable(L, 0, 5);
+	lua_pushcfunction(L, lws_lua_shared_dict_get);
+	lua_setfield(L, -2, "get");
+	lua_pushcfunction(L, lws_lua_shared_dict_set);
+	lua_setfield(L, -2, "set");
+	lua_pushcfunction(L, lws_lua_shared_dict_add);
+	lua_setfield(L, -2, "add");
+	lua_pushcfunction(L, lws_lua_shared_dict_incr);
+	lua_setfield(L, -2, "incr");
+	lua_pushcfunction(L, lws_lua_shared_dict_delete);
+	lua_setfield(L, -2, "delete");
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, lws_lua_shared_dict_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_pop(L, 1);
+
+	/* lws.shared; dictionaries are looked up by name on first access */
+	lua_newtable(L);
+	lua_createtable(L, 0, 1);
+	lua_pushcfunction(L, lws_lua_shared_index);
+	lua_setfield(L, -2, "__index");
+	lua_setmetatable(L, -2);
+	return 1;
+}
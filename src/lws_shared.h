@@ -0,0 +1,100 @@
+/*
+ * LWS shared
+ *
+ * Copyright (C) 2024 Andre Naef
+ */
+
+
+#ifndef _LWS_SHARED_INCLUDED
+#define _LWS_SHARED_INCLUDED
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <lua.h>
+
+
+#define LWS_SHARED_DICT              "lws.shared_dict"  /* shared dictionary metatable */
+#define LWS_SHARED_STRIPES           32                 /* lock stripes; power of 2 */
+#define LWS_SHARED_GET_SIZE          256                /* size of the get buffer on the C stack */
+#define LWS_SHARED_EVICT_FACTOR      8                  /* eviction limit per allocation, in sizes */
+#define LWS_SHARED_PERSIST_MAGIC     "LWSDICT1"         /* snapshot file magic */
+#define LWS_SHARED_PERSIST_BOM       0x01020304         /* byte order mark */
+#define LWS_SHARED_PERSIST_INTERVAL  60                 /* default seconds between snapshots */
+#define LWS_SHARED_PERSIST_BUF_SIZE  65536              /* initial size of the snapshot buffer */
+#define LWS_TAGS_NAME                "lws_tags"         /* invalidation tags zone name */
+#define LWS_TAGS_N                   1024               /* invalidation tag slots; power of 2 */
+
+
+typedef struct lws_shared_dict_s lws_shared_dict_t;
+typedef struct lws_shared_s lws_shared_t;
+typedef struct lws_shared_stripe_s lws_shared_stripe_t;
+typedef struct lws_shared_node_s lws_shared_node_t;
+typedef struct lws_shared_header_s lws_shared_header_t;
+typedef struct lws_shared_record_s lws_shared_record_t;
+typedef struct lws_tags_s lws_tags_t;
+
+
+#include <lws_module.h>
+
+
+struct lws_shared_dict_s {
+	ngx_str_t           name;              /* name */
+	lws_shared_t       *sh;                /* shared dictionary */
+	ngx_slab_pool_t    *pool;              /* slab allocator */
+	ngx_str_t           persist;           /* snapshot filename; empty = not persisted */
+	time_t              persist_interval;  /* seconds between snapshots */
+	ngx_event_t         persist_ev;        /* snapshot timer */
+	ngx_thread_task_t  *persist_task;      /* snapshot thread task */
+	unsigned            persisting:1;      /* snapshot thread task is running */
+};
+
+struct lws_shared_stripe_s {
+	ngx_shmtx_sh_t     lock;      /* lock */
+	ngx_shmtx_t        mutex;     /* mutex */
+	ngx_rbtree_t       rbtree;    /* entries by key */
+	ngx_rbtree_node_t  sentinel;  /* red-black tree sentinel */
+	ngx_queue_t        lru;       /* entries, most recently used first */
+};
+
+struct lws_shared_s {
+	lws_shared_stripe_t  stripes[LWS_SHARED_STRIPES];  /* entries, striped by key hash */
+	ngx_atomic_t         persisted;                    /* time of the last snapshot */
+};
+
+struct lws_shared_node_s {
+	ngx_str_node_t  sn;         /* red-black tree node; str is the key */
+	ngx_queue_t     queue;      /* LRU queue */
+	ngx_msec_t      expires;    /* time when the entry expires; 0 = never */
+	size_t          value_len;  /* length of encoded value */
+	u_char          data[];     /* key, encoded value */
+};
+
+struct lws_tags_s {
+	ngx_atomic_t  generation;            /* incremented by each invalidation */
+	ngx_atomic_t  versions[LWS_TAGS_N];  /* tag versions, by tag hash */
+};
+
+/* snapshot file layout: header, then records, each followed by its key and encoded value */
+struct lws_shared_header_s {
+	u_char    magic[8];   /* LWS_SHARED_PERSIST_MAGIC */
+	uint32_t  bom;        /* LWS_SHARED_PERSIST_BOM in the byte order of the file */
+	uint32_t  reserved;   /* reserved; 0 */
+};
+
+struct lws_shared_record_s {
+	uint32_t  key_len;    /* length of key */
+	uint32_t  value_len;  /* length of encoded value */
+	int64_t   expires;    /* wall clock time in milliseconds when the entry expires; 0 = never */
+};
+
+
+char *lws_shared_dict(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t lws_add_tags(ngx_conf_t *cf, lws_main_conf_t *lmcf);
+ngx_atomic_t *lws_tag_version(lws_tags_t *tags, ngx_str_t *tag);
+ngx_int_t lws_init_shared_process(ngx_cycle_t *cycle);
+void lws_exit_shared_process(ngx_cycle_t *cycle);
+int lws_open_shared(lua_State *L);
+
+
+#endif /* _LWS_SHARED_INCLUDED */
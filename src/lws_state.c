@@ -10,6 +10,7 @@
 #include <lauxlib.h>
 #include <lws_lib.h>
 #include <lws_profiler.h>
+#include <lws_compress.h>
 
 
 #if LUA_VERSION_NUM < 502
@@ -28,7 +29,9 @@ static void lws_set_path(lua_State *L, int index, const char *field);
 static int lws_init(lua_State *L);
 static void lws_set_state_timer(lws_state_t *state);
 static void lws_state_timer_handler(ngx_event_t *ev);
-static lws_state_t *lws_create_state(lws_request_ctx_t *ctx);
+static lws_state_t *lws_create_state(lws_main_conf_t *lmcf, lws_loc_conf_t *llcf,
+		ngx_log_t *log);
+static void lws_reuse_state(lws_state_t *state);
 
 
 static inline int lws_getfield (lua_State *L, int index, const char *key) {
@@ -146,6 +149,10 @@ static int lws_init (lua_State *L) {
 		lua_call(L, 0, 0);
 	}
 
+	/* register state */
+	lua_pushvalue(L, 4);
+	lua_setfield(L, LUA_REGISTRYINDEX, LWS_STATE);
+
 	return 0;
 }
 
@@ -173,23 +180,18 @@ static void lws_state_timer_handler (ngx_event_t *ev) {
 	}
 }
 
-static lws_state_t *lws_create_state (lws_request_ctx_t *ctx) {
-	ngx_log_t        *log;
-	ngx_str_t         msg;
-	lws_state_t      *state;
-	lws_loc_conf_t   *llcf;
-	lws_main_conf_t  *lmcf;
+static lws_state_t *lws_create_state (lws_main_conf_t *lmcf, lws_loc_conf_t *llcf,
+		ngx_log_t *log) {
+	ngx_str_t     msg;
+	lws_state_t  *state;
 
 	/* create state */
-	log = ctx->r->connection->log;
 	state = ngx_calloc(sizeof(lws_state_t), log);
 	if (!state) {
 		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to allocate state");
 		return NULL;
 	}
-	lmcf = ngx_http_get_module_main_conf(ctx->r, lws_module);
 	state->lmcf = lmcf;
-	llcf = ngx_http_get_module_loc_conf(ctx->r, lws_module);
 	state->llcf = llcf;
 
 	/* create Lua state */
@@ -209,7 +211,8 @@ static lws_state_t *lws_create_state (lws_request_ctx_t *ctx) {
 	lua_pushlstring(state->L, (const char *)llcf->path.data, llcf->path.len);
 	lua_pushlstring(state->L, (const char *)llcf->cpath.data, llcf->cpath.len);
 	lua_pushboolean(state->L, lmcf->monitor != NULL);
-	if (lua_pcall(state->L, 3, 0, 0) != LUA_OK) {
+	lua_pushlightuserdata(state->L, state);
+	if (lua_pcall(state->L, 4, 0, 0) != LUA_OK) {
 		lws_get_msg(state->L, -1, &msg);
 		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to initialize Lua state: %V",
 				&msg);
@@ -242,6 +245,14 @@ static lws_state_t *lws_create_state (lws_request_ctx_t *ctx) {
 	return state;
 }
 
+static void lws_reuse_state (lws_state_t *state) {
+	ngx_queue_remove(&state->queue);
+	if (state->llcf->state_timeout > 0) {
+		state->timeout = NGX_TIMER_INFINITE;
+		lws_set_state_timer(state);
+	}
+}
+
 void lws_close_state (lws_state_t *state, ngx_log_t *log) {
 	lws_main_conf_t  *lmcf;
 
@@ -249,63 +260,107 @@ void lws_close_state (lws_state_t *state, ngx_log_t *log) {
 	state->time_max = NGX_TIMER_INFINITE;
 	state->timeout = NGX_TIMER_INFINITE;
 	lws_set_state_timer(state);
-	state->llcf->states_n--;
+	if (state->llcf) {
+		state->llcf->states_n--;
+	}
 	lmcf = state->lmcf;
-	if (lmcf->monitor) {
+	if (lmcf && lmcf->monitor) {
 		ngx_atomic_fetch_add(&lmcf->monitor->states_n, -1);
 		ngx_atomic_fetch_add(&lmcf->monitor->memory_used, 0 - state->memory_monitor);
 	}
 	ngx_log_error(NGX_LOG_INFO, log, 0, "[LWS] %s state closed L:%p", LUA_VERSION, state->L);
+	ngx_free(state->timers);
 	ngx_free(state);
 }
 
-int lws_acquire_state (lws_request_ctx_t *ctx) {
+lws_state_t *lws_get_state (ngx_http_request_t *r) {
 	lws_state_t      *state;
 	ngx_queue_t      *q;
 	lws_loc_conf_t   *llcf;
 	lws_main_conf_t  *lmcf;
 
-	llcf = ngx_http_get_module_loc_conf(ctx->r, lws_module);
+	llcf = ngx_http_get_module_loc_conf(r, lws_module);
 	if (!ngx_queue_empty(&llcf->states)) {
 		q = ngx_queue_head(&llcf->states);
-		ngx_queue_remove(q);
 		state = ngx_queue_data(q, lws_state_t, queue);
-		if (llcf->state_timeout > 0) {
-			state->timeout = NGX_TIMER_INFINITE;
-			lws_set_state_timer(state);
-		}
+		lws_reuse_state(state);
 	} else {
-		state = lws_create_state(ctx);
+		state = lws_create_state(ngx_http_get_module_main_conf(r, lws_module), llcf,
+				r->connection->log);
 		if (!state) {
-			return -1;
+			return NULL;
 		}
 	}
 	lmcf = state->lmcf;
 	state->profiler = lmcf->monitor ? lmcf->monitor->profiler : 0;
 	state->in_use = 1;
-	ctx->state = state;
-	return 0;
+	return state;
 }
 
-void lws_release_state (lws_request_ctx_t *ctx) {
-	lws_state_t      *state;
+lws_state_t *lws_get_idle_state (lws_loc_conf_t *llcf) {
+	lws_state_t      *state, *idle;
+	ngx_queue_t      *q;
+	lws_main_conf_t  *lmcf;
+
+	/* get an inactive state, preferring states that have run the init chunk */
+	state = NULL;
+	for (q = ngx_queue_head(&llcf->states); q != ngx_queue_sentinel(&llcf->states);
+			q = ngx_queue_next(q)) {
+		idle = ngx_queue_data(q, lws_state_t, queue);
+		if (idle->init) {
+			state = idle;
+			break;
+		}
+	}
+	if (!state && !ngx_queue_empty(&llcf->states)) {
+		state = ngx_queue_data(ngx_queue_head(&llcf->states), lws_state_t, queue);
+	}
+	if (state) {
+		lws_reuse_state(state);
+	} else {
+		/* create a state; the init chunk runs in the thread before the timer function */
+		if (llcf->states_max > 0 && llcf->states_n >= llcf->states_max) {
+			return NULL;
+		}
+		lmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, lws_module);
+		state = lws_create_state(lmcf, llcf, ngx_cycle->log);
+		if (!state) {
+			return NULL;
+		}
+	}
+	state->profiler = 0;
+	state->in_use = 1;
+	return state;
+}
+
+void lws_put_state (lws_state_t *state, ngx_log_t *log) {
 	lws_loc_conf_t   *llcf;
 	lws_main_conf_t  *lmcf;
 
-	/* count request */
-	state = ctx->state;
-	state->request_count++;
+	/* start timers registered by the init chunk of the first initialized state */
 	lmcf = state->lmcf;
-	if (lmcf->monitor) {
-		ngx_atomic_fetch_add(&lmcf->monitor->request_count, 1);
+	llcf = state->llcf;
+	if (state->init && !llcf->timers_started) {
+		lws_start_timers(llcf, state->timers, state->timers_n);
+		state->timers = NULL;
 	}
+	ngx_free(state->timers);
+	state->timers = NULL;
+	state->timers_n = 0;
 
-	/* close state? */
-	llcf = state->llcf;
+	/* close state? states beyond the maximum, as created for subrequests, are closed */
 	if (state->close || state->tev.timedout || (llcf->state_requests_max > 0
-			&& state->request_count >= llcf->state_requests_max)) {
-		lws_close_state(state, ctx->r->connection->log);
-		return;
+			&& state->request_count >= llcf->state_requests_max)
+			|| (llcf->states_max > 0 && llcf->states_n > llcf->states_max)) {
+		lws_close_state(state, log);
+		goto done;
+	}
+
+	/* release strings anchored for a response body */
+	if (state->anchored) {
+		lua_pushnil(state->L);
+		lua_setfield(state->L, LUA_REGISTRYINDEX, LWS_RESPONSE_ANCHORS);
+		state->anchored = 0;
 	}
 
 	/* perform GC and update monitor as needed */
@@ -323,7 +378,7 @@ void lws_release_state (lws_request_ctx_t *ctx) {
 			state->memory_used = (size_t)lua_gc(state->L, LUA_GCCOUNT, 0) * 1024
 					+ lua_gc(state->L, LUA_GCCOUNTB, 0);
 		}
-		ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ctx->r->connection->log, 0,
+		ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0,
 				"[LWS] GC L:%p before:%z after:%z", state->L, memory_used,
 				state->memory_used);
 	}
@@ -339,9 +394,36 @@ void lws_release_state (lws_request_ctx_t *ctx) {
 		lws_set_state_timer(state);
 	}
 
-	/* done */
+	/* return to inactive states */
 	state->in_use = 0;
 	ngx_queue_insert_head(&llcf->states, &state->queue);
+
+	/* check for queued requests */
+	done:
+	if (!ngx_queue_empty(&llcf->requests) && !llcf->qev.timer_set) {
+		ngx_add_timer(&llcf->qev, 0);
+	}
+}
+
+int lws_acquire_state (lws_request_ctx_t *ctx) {
+	ctx->state = lws_get_state(ctx->r);
+	return ctx->state ? 0 : -1;
+}
+
+void lws_release_state (lws_request_ctx_t *ctx) {
+	lws_state_t      *state;
+	lws_main_conf_t  *lmcf;
+
+	/* count request */
+	state = ctx->state;
+	state->request_count++;
+	lmcf = state->lmcf;
+	if (lmcf->monitor) {
+		ngx_atomic_fetch_add(&lmcf->monitor->request_count, 1);
+	}
+
+	/* release */
+	lws_put_state(state, ctx->r->connection->log);
 }
 
 int lws_run_state (lws_request_ctx_t *ctx) {
@@ -361,6 +443,7 @@ int lws_run_state (lws_request_ctx_t *ctx) {
 	} else {
 		/* set error result, mark for close */
 		result = -1;
+		ctx->yield = LWS_YIELD_NONE;
 		ctx->state->close = 1;
 
 		/* log error */
@@ -385,5 +468,11 @@ int lws_run_state (lws_request_ctx_t *ctx) {
 	done:
 	lua_pop(L, 1);  /* [traceback] */
 
+	/* compress and tag a response that is about to be sent */
+	if (result == 0 && ctx->yield == LWS_YIELD_NONE && !ctx->after_response) {
+		lws_compress_response(ctx);
+		lws_etag_response(ctx);
+	}
+
 	return result;
 }
@@ -14,6 +14,10 @@
 #include <lua.h>
 
 
+#define lws_observe_invalidations(state)  \
+		((state)->generation = (state)->lmcf->tags->generation)
+
+
 typedef struct lws_state_s lws_state_t;
 
 
@@ -21,25 +25,32 @@ typedef struct lws_state_s lws_state_t;
 
 
 struct lws_state_s {
-	ngx_queue_t       queue;           /* location configuration queue */
-	lws_main_conf_t  *lmcf;            /* main configuration */
-	lws_loc_conf_t   *llcf;            /* location configuration */
-	lua_State        *L;               /* Lua state */
-	size_t            memory_used;     /* used memory */
-	size_t            memory_max;      /* maximum memory */
-	size_t            memory_monitor;  /* memory accounted for in monitor */
-	ngx_int_t         request_count;   /* requests served */
-	ngx_msec_t        time_max;        /* maximum lifetime */
-	ngx_msec_t        timeout;         /* idle timeout */
-	ngx_event_t       tev;             /* time event */
-	unsigned          in_use:1;        /* state in use */
-	unsigned          init:1;          /* state initialized */
-	unsigned          close:1;         /* state is to be closed */
-	unsigned          profiler:2;      /* profiler state; 0 = disabled, 1 = CPU, 2 = wall */
+	ngx_queue_t        queue;           /* location configuration queue */
+	lws_main_conf_t   *lmcf;            /* main configuration */
+	lws_loc_conf_t    *llcf;            /* location configuration */
+	lua_State         *L;               /* Lua state */
+	size_t             memory_used;     /* used memory */
+	size_t             memory_max;      /* maximum memory */
+	size_t             memory_monitor;  /* memory accounted for in monitor */
+	ngx_int_t          request_count;   /* requests served */
+	ngx_msec_t         time_max;        /* maximum lifetime */
+	ngx_msec_t         timeout;         /* idle timeout */
+	ngx_event_t        tev;             /* time event */
+	lws_timer_t       *timers;          /* timers registered by the init chunk */
+	ngx_uint_t         timers_n;        /* number of registered timers */
+	ngx_atomic_uint_t  generation;      /* invalidation generation observed */
+	unsigned           in_use:1;        /* state in use */
+	unsigned           init:1;          /* state initialized */
+	unsigned           close:1;         /* state is to be closed */
+	unsigned           anchored:1;      /* strings are anchored for a response body */
+	unsigned           profiler:2;      /* profiler state; 0 = disabled, 1 = CPU, 2 = wall */
 };
 
 
 void lws_close_state(lws_state_t *state, ngx_log_t *log);
+lws_state_t *lws_get_state(ngx_http_request_t *r);
+lws_state_t *lws_get_idle_state(lws_loc_conf_t *llcf);
+void lws_put_state(lws_state_t *state, ngx_log_t *log);
 int lws_acquire_state(lws_request_ctx_t *ctx);
 void lws_release_state(lws_request_ctx_t *ctx);
 int lws_run_state(lws_request_ctx_t *ctx);
@@ -8,32 +8,24 @@
 #include <lws_table.h>
 
 
+#if (defined __SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+#define lws_table_fingerprint(hash)  ((u_char)((hash) >> (sizeof(ngx_uint_t) * 8 - 7)))
+
+
 static ngx_uint_t lws_table_hash(lws_table_t *t, ngx_str_t *key);
-static size_t lws_table_size(lws_table_t *t, size_t size);
-static size_t lws_table_load(lws_table_t *t, size_t alloc);
+static int lws_table_alloc(lws_table_t *t, size_t alloc);
 static int lws_table_rehash(lws_table_t *t, size_t alloc);
-static lws_table_entry_t *lws_table_find(lws_table_t *t, ngx_str_t *key, ngx_uint_t hash);
-static lws_table_entry_t *lws_table_insert(lws_table_t *t, ngx_str_t *key, ngx_uint_t hash);
-static void lws_table_remove(lws_table_t *t, lws_table_entry_t *entry);
-
-
-static size_t lws_table_sizes[] = {
-	3, 5, 7, 11, 13, 17, 23, 29, 41, 53, 67, 89, 127, 157, 211, 277, 373, 499, 659, 877, 1171,
-	1553, 2081, 2767, 3691, 4909, 6547, 8731, 11633, 15511, 20681, 27581, 36749, 49003, 65353,
-	87107, 116141, 154871, 206477, 275299, 367069, 489427, 652559, 870083, 1160111, 1546799,
-	2062391, 2749847, 3666461, 4888619, 6518173, 8690917, 11587841, 15450437, 20600597,
-	27467443, 36623261, 48831017, 65107997, 86810681, 115747549, 154330079, 205773427,
-	274364561, 365819417, 487759219, 650345651, 867127501, 1156170011, 1541560037, 2055413317,
-	2740551103, 3654068141, 4872090871, 6496121063, 8661494753, 11548659701, 15398212901,
-	20530950533, 27374600677, 36499467569, 48665956771, 64887942367, 86517256433,
-	115356341911, 153808455923, 205077941191, 273437254897, 364583006561, 486110675443,
-	648147567293, 864196756231, 1152262341641, 1536349788871, 2048466385123, 2731288513529,
-	3641718017983, 4855624023953, 6474165365293, 8632220487029, 11509627316059,
-	15346169754719, 20461559672951, 27282079563967, 36376106085223, 48501474780299,
-	64668633040457, 86224844053847, 114966458738489, 153288611651291, 204384815535079,
-	272513087380099
-};
-static int lws_table_sizes_n = 112;
+static ngx_inline ngx_uint_t lws_table_match(u_char *ctrl, u_char c);
+static ngx_inline ngx_uint_t lws_table_match_free(u_char *ctrl);
+static ngx_inline ngx_uint_t lws_table_first(ngx_uint_t mask);
+static size_t lws_table_find(lws_table_t *t, ngx_str_t *key, ngx_uint_t hash);
+static size_t lws_table_insert(lws_table_t *t, ngx_uint_t hash);
+static void lws_table_remove(lws_table_t *t, size_t i);
+static void lws_table_free_value(lws_table_t *t, void *value);
 
 
 lws_table_t *lws_table_create (size_t load, ngx_log_t *log) {
@@ -45,14 +37,11 @@ lws_table_t *lws_table_create (size_t load, ngx_log_t *log) {
 		return NULL;
 	}
 	t->log = log;
-	alloc = load + (load < lws_table_sizes[lws_table_sizes_n - 1] ? load / 7 + 3 : 0);
-	if ((t->alloc = lws_table_size(t, alloc)) == (size_t)-1) {
-		ngx_free(t);
-		return NULL;
+	alloc = LWS_TABLE_GROUP;
+	while (alloc - (alloc >> 3) < load && alloc <= ((size_t)-1 >> 1)) {
+		alloc <<= 1;
 	}
-	t->load = lws_table_load(t, t->alloc);  /* t->load >= load */
-	t->entries = ngx_calloc(t->alloc * sizeof(lws_table_entry_t), t->log);
-	if (!t->entries) {
+	if (lws_table_alloc(t, alloc) != 0) {  /* t->load >= load */
 		ngx_free(t);
 		return NULL;
 	}
@@ -61,14 +50,14 @@ lws_table_t *lws_table_create (size_t load, ngx_log_t *log) {
 }
 
 void lws_table_free (lws_table_t *t) {
-	ngx_queue_t        *q;
-	lws_table_entry_t  *entry;
+	ngx_queue_t       *q;
+	lws_table_meta_t  *meta;
 
 	if (t->dup || t->free) {
 		while (!ngx_queue_empty(&t->order)) {
 			q = ngx_queue_last(&t->order);
-			entry = ngx_queue_data(q, lws_table_entry_t, order);
-			lws_table_remove(t, entry);
+			meta = ngx_queue_data(q, lws_table_meta_t, order);
+			lws_table_remove(t, meta - t->meta);
 		}
 	}
 	ngx_free(t->entries);
@@ -76,20 +65,21 @@ void lws_table_free (lws_table_t *t) {
 }
 
 void lws_table_clear (lws_table_t *t) {
-	ngx_queue_t        *q;
-	lws_table_entry_t  *entry;
+	ngx_queue_t       *q;
+	lws_table_meta_t  *meta;
 
 	if (t->dup || t->free) {
 		while (!ngx_queue_empty(&t->order)) {
 			q = ngx_queue_last(&t->order);
-			entry = ngx_queue_data(q, lws_table_entry_t, order);
-			lws_table_remove(t, entry);
+			meta = ngx_queue_data(q, lws_table_meta_t, order);
+			lws_table_remove(t, meta - t->meta);
 		}
 	} else {
 		ngx_queue_init(&t->order);
 		t->count = 0;
 	}
-	ngx_memzero(t->entries, t->alloc * sizeof(lws_table_entry_t));
+	ngx_memset(t->ctrl, LWS_TABLE_EMPTY, t->alloc);
+	t->deleted = 0;
 }
 
 int lws_table_set_dup (lws_table_t *t, int dup) {
@@ -108,6 +98,16 @@ int lws_table_set_free (lws_table_t *t, int free) {
 	return 0;
 }
 
+int lws_table_set_free_handler (lws_table_t *t, lws_table_free_pt handler, void *data) {
+	if (t->count) {
+		return -1;
+	}
+	t->free = 1;
+	t->free_handler = handler;
+	t->free_data = data;
+	return 0;
+}
+
 int lws_table_set_ci (lws_table_t *t, int ci) {
 	if (t->count) {
 		return -1;
@@ -126,7 +126,7 @@ int lws_table_set_timeout (lws_table_t *t, time_t timeout) {
 }
 
 int lws_table_set_cap (lws_table_t *t, size_t cap) {
-	if (t->count || t->cap < 1) {
+	if (t->count || cap < 1) {
 		return -1;
 	}
 	t->cap = cap;
@@ -135,102 +135,114 @@ int lws_table_set_cap (lws_table_t *t, size_t cap) {
 }
 
 void *lws_table_get (lws_table_t *t, ngx_str_t *key) {
-	ngx_uint_t          hash;
-	lws_table_entry_t  *entry;
+	size_t      i;
+	ngx_uint_t  hash;
 
 	hash = lws_table_hash(t, key);
-	entry = lws_table_find(t, key, hash);
-	if (!entry) {
+	i = lws_table_find(t, key, hash);
+	if (i == (size_t)-1) {
 		return NULL;
 	}
 	if (t->timed) {
-		if (entry->time + t->timeout <= time(NULL)) {
+		if (t->meta[i].time + t->timeout <= time(NULL)) {
 			return NULL;
 		}
 	}
 	if (t->capped) {
-		ngx_queue_remove(&entry->order);
-		ngx_queue_insert_tail(&t->order, &entry->order);
+		ngx_queue_remove(&t->meta[i].order);
+		ngx_queue_insert_tail(&t->order, &t->meta[i].order);
 	}
-	return entry->value;
+	return t->entries[i].value;
 }
 
 int lws_table_set (lws_table_t *t, ngx_str_t *key, void *value) {
-	ngx_uint_t          hash;
-	ngx_queue_t        *q;
-	lws_table_entry_t  *entry, *evict;
+	size_t             i;
+	u_char            *data;
+	ngx_uint_t         hash;
+	ngx_queue_t       *q;
+	lws_table_meta_t  *meta, *evict;
 
 	hash = lws_table_hash(t, key);
-	entry = lws_table_find(t, key, hash);
+	i = lws_table_find(t, key, hash);
 	if (value) {
-		if (entry) {
+		if (i != (size_t)-1) {
 			/* update existing */
+			meta = &t->meta[i];
 			if (t->capped) {
-				ngx_queue_remove(&entry->order);
-				ngx_queue_insert_tail(&t->order, &entry->order);
+				ngx_queue_remove(&meta->order);
+				ngx_queue_insert_tail(&t->order, &meta->order);
 			}
-			if (t->free && value != entry->value) {
-				ngx_free(entry->value);
+			if (t->free && value != t->entries[i].value) {
+				lws_table_free_value(t, t->entries[i].value);
 			}
-			entry->value = value;
+			t->entries[i].value = value;
 		} else {
+			/* duplicate key */
+			if (t->dup) {
+				data = ngx_alloc(key->len, t->log);
+				if (!data) {
+					return -1;
+				}
+				ngx_memcpy(data, key->data, key->len);
+			} else {
+				data = key->data;
+			}
+
 			/* evict as needed */
 			if (t->capped && t->count == t->cap) {
 				q = ngx_queue_head(&t->order);
-				evict = ngx_queue_data(q, lws_table_entry_t, order);
-				lws_table_remove(t, evict);
+				evict = ngx_queue_data(q, lws_table_meta_t, order);
+				lws_table_remove(t, evict - t->meta);
+				t->evicted++;
 			}
 
-			/* rehash as needed */
-			if (t->count == t->load) {
-				if (lws_table_rehash(t, t->alloc + 1) != 0) {
+			/* rehash as needed; mostly deleted slots are reclaimed at the same size */
+			if (t->count + t->deleted == t->load) {
+				if (lws_table_rehash(t, t->count < (t->load >> 1) ? t->alloc
+						: t->alloc << 1) != 0) {
+					if (t->dup) {
+						ngx_free(data);
+					}
 					return -1;
 				}
 			}
 
 			/* new entry */
-			entry = lws_table_insert(t, key, hash);
-			if (t->dup) {
-				entry->key.data = ngx_alloc(key->len, t->log);
-				if (!entry->key.data) {
-					return -1;
-				}
-				ngx_memcpy(entry->key.data, key->data, key->len);
-				entry->key.len = key->len;
-			} else {
-				entry->key = *key;
-			}
-			entry->value = value;
-			entry->hash = hash;
-			entry->state = LWS_TES_SET;
-			ngx_queue_insert_tail(&t->order, &entry->order);
+			i = lws_table_insert(t, hash);
+			t->entries[i].key.data = data;
+			t->entries[i].key.len = key->len;
+			t->entries[i].value = value;
+			meta = &t->meta[i];
+			meta->hash = hash;
+			ngx_queue_insert_tail(&t->order, &meta->order);
 			t->count++;
 		}
 		if (t->timed) {
-			entry->time = time(NULL);
+			meta->time = time(NULL);
 		}
 	} else {
 		/* remove */
-		if (entry) {
-			lws_table_remove(t, entry);
+		if (i != (size_t)-1) {
+			lws_table_remove(t, i);
 		}
 	}
 	return 0;
 }
 
 int lws_table_next (lws_table_t *t, ngx_str_t *key, ngx_str_t **next, void **value) {
-	ngx_uint_t          hash;
-	ngx_queue_t        *q;
-	lws_table_entry_t  *entry;
+	size_t             i;
+	ngx_uint_t         hash;
+	ngx_queue_t       *q;
+	lws_table_meta_t  *meta;
 
 	if (key) {
 		/* continuation */
 		hash = lws_table_hash(t, key);
-		entry = lws_table_find(t, key, hash);
-		if (!entry) {
+		i = lws_table_find(t, key, hash);
+		if (i == (size_t)-1) {
 			return -1;
 		}
-		q = ngx_queue_next(&entry->order);
+		q = ngx_queue_next(&t->meta[i].order);
 	} else {
 		/* start */
 		q = ngx_queue_head(&t->order);
@@ -238,9 +250,10 @@ int lws_table_next (lws_table_t *t, ngx_str_t *key, ngx_str_t **next, void **val
 	if (q == ngx_queue_sentinel(&t->order)) {
 		return -1;
 	}
-	entry = ngx_queue_data(q, lws_table_entry_t, order);
-	*next = &entry->key;
-	*value = entry->value;
+	meta = ngx_queue_data(q, lws_table_meta_t, order);
+	i = meta - t->meta;
+	*next = &t->entries[i].key;
+	*value = t->entries[i].value;
 	return 0;
 }
 
@@ -263,166 +276,187 @@ static ngx_uint_t lws_table_hash (lws_table_t *t, ngx_str_t *key) {
 			hash *= 1099511628211;
 		}
 	}
-	return hash;
+
+	/* fold; the slot is taken from the low bits, and the fingerprint from the high bits */
+	return hash ^ (hash >> (sizeof(ngx_uint_t) * 4));
 }
 
-static size_t lws_table_size (lws_table_t *t, size_t size) {
-	int  lower, upper, mid;
+static int lws_table_alloc (lws_table_t *t, size_t alloc) {
+	size_t   slot;
+	u_char  *p;
 
-	lower = 0;
-	upper = lws_table_sizes_n - 1;
-	while (lower <= upper) {
-		mid = (lower + upper) / 2;
-		if (lws_table_sizes[mid] < size) {
-			lower = mid + 1;
-		} else {
-			upper = mid - 1;
-		}
+	/* entries, metadata, and control bytes share one allocation */
+	slot = sizeof(lws_table_entry_t) + sizeof(lws_table_meta_t) + 1;
+	if (alloc > (size_t)-1 / slot) {
+		ngx_log_error(NGX_LOG_ERR, t->log, 0, "[LWS] table size too large: %z", alloc);
+		return -1;
 	}
-	if (lower >= lws_table_sizes_n) {
-		ngx_log_error(NGX_LOG_ERR, t->log, 0, "[LWS] table size too large: %z", size);
-		return (size_t)-1;
+	p = ngx_alloc(alloc * slot, t->log);
+	if (!p) {
+		return -1;
 	}
-	return lws_table_sizes[lower];
-}
-
-static size_t lws_table_load (lws_table_t *t, size_t alloc) {
-	return (alloc >> 1) + (alloc >> 2) + (alloc >> 3);  /* ~87.5 percent */
+	t->entries = (lws_table_entry_t *)p;
+	t->meta = (lws_table_meta_t *)(t->entries + alloc);
+	t->ctrl = (u_char *)(t->meta + alloc);
+	ngx_memset(t->ctrl, LWS_TABLE_EMPTY, alloc);
+	t->alloc = alloc;
+	t->load = alloc - (alloc >> 3);  /* 87.5 percent */
+	t->deleted = 0;
+	return 0;
 }
 
 static int lws_table_rehash (lws_table_t *t, size_t alloc) {
-	size_t              alloc_new;
-	lws_table_entry_t  *entries, *entries_new, *entry, *entry_new;
+	size_t              i;
 	ngx_queue_t        *q, *s;
+	lws_table_meta_t   *meta, *meta_old, *metas_old;
+	lws_table_entry_t  *entries_old;
 
 	/* allocate */
-	if ((alloc_new = lws_table_size(t, alloc)) == (size_t)-1) {
-		return -1;
-	}
 	ngx_log_debug3(NGX_LOG_DEBUG_HTTP, t->log, 0, "[LWS] table rehash t:%p old:%z new:%z", t,
-			t->alloc, alloc_new);
-	entries_new = ngx_calloc(alloc_new * sizeof(lws_table_entry_t), t->log);
-	if (!entries_new) {
+			t->alloc, alloc);
+	entries_old = t->entries;
+	metas_old = t->meta;
+	if (lws_table_alloc(t, alloc) != 0) {
 		return -1;
 	}
-
-	/* update table */
-	t->alloc = alloc_new;
-	t->load = lws_table_load(t, t->alloc);
-	entries = t->entries;
-	t->entries = entries_new;
-	q = ngx_queue_last(&t->order);
+	q = ngx_queue_head(&t->order);
 	s = ngx_queue_sentinel(&t->order);
 	ngx_queue_init(&t->order);
 
-	/* reinsert */
+	/* reinsert in order */
 	while (q != s) {
-		entry = ngx_queue_data(q, lws_table_entry_t, order);
-		entry_new = lws_table_insert(t, &entry->key, entry->hash);
-		*entry_new = *entry;
-		ngx_queue_insert_head(&t->order, &entry_new->order);
-		q = ngx_queue_prev(q);
+		meta_old = ngx_queue_data(q, lws_table_meta_t, order);
+		q = ngx_queue_next(q);
+		i = lws_table_insert(t, meta_old->hash);
+		t->entries[i] = entries_old[meta_old - metas_old];
+		meta = &t->meta[i];
+		meta->hash = meta_old->hash;
+		meta->time = meta_old->time;
+		ngx_queue_insert_tail(&t->order, &meta->order);
 	}
-	ngx_free(entries);
+	ngx_free(entries_old);
 	return 0;
 }
 
-static lws_table_entry_t *lws_table_find (lws_table_t *t, ngx_str_t *key, ngx_uint_t hash) {
-	size_t              r, h, q;
-	lws_table_entry_t  *entry;
+static ngx_inline ngx_uint_t lws_table_match (u_char *ctrl, u_char c) {
+#if (defined __SSE2__)
+	return (ngx_uint_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8((char)c),
+			_mm_loadu_si128((__m128i *)ctrl)));
+#else
+	ngx_uint_t  i, mask;
 
-	/* Brent's method; source: https://maths-people.anu.edu.au/~brent/pd/rpb013.pdf */
-	r = h = hash % t->alloc;
-	q = hash % (t->alloc - 2) + 1;
-	entry = &t->entries[h];
-	while (entry->state != LWS_TES_UNUSED) {
-		if (entry->hash == hash && entry->key.len == key->len && (t->ci
-				? ngx_strncasecmp(entry->key.data, key->data, key->len)
-				: ngx_strncmp(entry->key.data, key->data, key->len)) == 0) {
-			return entry;
-		}
-		h = (h + q) % t->alloc;
-		if (h == r) {
-			break;
-		}
-		entry = &t->entries[h];
+	mask = 0;
+	for (i = 0; i < LWS_TABLE_GROUP; i++) {
+		mask |= (ngx_uint_t)(ctrl[i] == c) << i;
 	}
-	return NULL;
+	return mask;
+#endif
 }
 
-static lws_table_entry_t *lws_table_insert (lws_table_t *t, ngx_str_t *key, ngx_uint_t hash) {
-	size_t              h, q, len_worst, len, q_move, h_move, len_move, len_entry_move;
-	lws_table_entry_t  *entry, *entry_move, *entry_move_old, *entry_move_new;
-
-	/* Brent's method; source: https://maths-people.anu.edu.au/~brent/pd/rpb013.pdf */
-	/* determine worst case */
-	h = hash % t->alloc;
-	q = hash % (t->alloc - 2) + 1;
-	entry = &t->entries[h];
-	len_worst = 1;
-	while (entry->state == LWS_TES_SET) {
-		h = (h + q) % t->alloc;
-		entry = &t->entries[h];
-		len_worst++;
+static ngx_inline ngx_uint_t lws_table_match_free (u_char *ctrl) {
+	/* empty and deleted slots have the high bit set */
+#if (defined __SSE2__)
+	return (ngx_uint_t)_mm_movemask_epi8(_mm_loadu_si128((__m128i *)ctrl));
+#else
+	ngx_uint_t  i, mask;
+
+	mask = 0;
+	for (i = 0; i < LWS_TABLE_GROUP; i++) {
+		mask |= (ngx_uint_t)(ctrl[i] >> 7) << i;
 	}
-	if (len_worst <= 2) {
-		/* "worst" case is optimal overall */
-		return entry;
+	return mask;
+#endif
+}
+
+static ngx_inline ngx_uint_t lws_table_first (ngx_uint_t mask) {
+#if (defined __GNUC__)
+	return (ngx_uint_t)__builtin_ctz((unsigned)mask);
+#else
+	ngx_uint_t  i;
+
+	for (i = 0; !(mask & 1); i++) {
+		mask >>= 1;
 	}
+	return i;
+#endif
+}
 
-	/* check for a better overall outcome by moving conflicting entries */
-	entry_move_old = entry_move_new = NULL;
-	len_entry_move = (size_t)-1;
-	h = hash % t->alloc;
-	entry = &t->entries[h];
-	len = 1;
-	do {
-		q_move = entry->hash % (t->alloc - 2) + 1;
-		h_move = (h + q_move) % t->alloc;
-		entry_move = &t->entries[h_move];
-		len_move = 1;
-		while (1) {
-			if (entry_move->state != LWS_TES_SET) {
-				/* we found a better overall outcome */
-				entry_move_old = entry;
-				entry_move_new = entry_move;
-				len_entry_move = len_move;
-				break;
+static size_t lws_table_find (lws_table_t *t, ngx_str_t *key, ngx_uint_t hash) {
+	size_t              g, mask, step, i;
+	u_char              fp;
+	ngx_uint_t          match;
+	lws_table_entry_t  *entry;
+
+	/* groups are probed triangularly, visiting each group once; a group with an empty slot
+	 * ends the probe */
+	fp = lws_table_fingerprint(hash);
+	mask = t->alloc / LWS_TABLE_GROUP - 1;
+	g = hash & mask;
+	for (step = 1; ; step++) {
+		for (match = lws_table_match(&t->ctrl[g * LWS_TABLE_GROUP], fp); match;
+				match &= match - 1) {
+			i = g * LWS_TABLE_GROUP + lws_table_first(match);
+			entry = &t->entries[i];
+			if (entry->key.len == key->len && (t->ci
+					? ngx_strncasecmp(entry->key.data, key->data, key->len)
+					: ngx_strncmp(entry->key.data, key->data, key->len)) == 0) {
+				return i;
 			}
-			if (len + len_move >= len_worst - 1) {  /* zero-sum at best otherwise */
-				break;
+		}
+		if (lws_table_match(&t->ctrl[g * LWS_TABLE_GROUP], LWS_TABLE_EMPTY)) {
+			return (size_t)-1;
+		}
+		g = (g + step) & mask;
+	}
+}
+
+static size_t lws_table_insert (lws_table_t *t, ngx_uint_t hash) {
+	size_t      g, mask, step, i;
+	ngx_uint_t  match;
+
+	/* the first empty or deleted slot along the probe sequence; the load limit ensures one */
+	mask = t->alloc / LWS_TABLE_GROUP - 1;
+	g = hash & mask;
+	for (step = 1; ; step++) {
+		match = lws_table_match_free(&t->ctrl[g * LWS_TABLE_GROUP]);
+		if (match) {
+			i = g * LWS_TABLE_GROUP + lws_table_first(match);
+			if (t->ctrl[i] == LWS_TABLE_DELETED) {
+				t->deleted--;
 			}
-			h_move = (h_move + q_move) % t->alloc;
-			entry_move = &t->entries[h_move];
-			len_move++;
+			t->ctrl[i] = lws_table_fingerprint(hash);
+			return i;
 		}
-		h = (h + q) % t->alloc;
-		entry = &t->entries[h];
-		len++;
-	} while (len < len_worst - 1 && len < len_entry_move);  /* zero-sum at best otherwise */
-
-	/* move if a better overall outcome was found */
-	if (entry_move_old) {  /* implied if len < len_entry_move is false */
-		*entry_move_new = *entry_move_old;
-		entry_move_new->order.prev->next = &entry_move_new->order;
-		entry_move_new->order.next->prev = &entry_move_new->order;
-		return entry_move_old;
-	}  /* len is invariably len_worst - 1 at this point */
-
-	/* cannot do better than the worst case */
-	h = (h + q) % t->alloc;
-	entry = &t->entries[h];
-	return entry;
+		g = (g + step) & mask;
+	}
 }
 
-static void lws_table_remove (lws_table_t *t, lws_table_entry_t *entry) {
-	ngx_queue_remove(&entry->order);
+static void lws_table_remove (lws_table_t *t, size_t i) {
+	u_char  *ctrl;
+
+	ngx_queue_remove(&t->meta[i].order);
 	if (t->dup) {
-		ngx_free(entry->key.data);
+		ngx_free(t->entries[i].key.data);
 	}
 	if (t->free) {
-		ngx_free(entry->value);
+		lws_table_free_value(t, t->entries[i].value);
+	}
+
+	/* a group with an empty slot has never been probed past, so the slot can become empty */
+	ctrl = &t->ctrl[i & ~(size_t)(LWS_TABLE_GROUP - 1)];
+	if (lws_table_match(ctrl, LWS_TABLE_EMPTY)) {
+		t->ctrl[i] = LWS_TABLE_EMPTY;
+	} else {
+		t->ctrl[i] = LWS_TABLE_DELETED;
+		t->deleted++;
 	}
-	entry->state = LWS_TES_DELETED;
 	t->count--;
 }
+
+static void lws_table_free_value (lws_table_t *t, void *value) {
+	if (t->free_handler) {
+		t->free_handler(value, t->free_data);
+	} else {
+		ngx_free(value);
+	}
+}
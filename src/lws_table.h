@@ -13,46 +13,55 @@
 #include <ngx_core.h>
 
 
+#define LWS_TABLE_GROUP    16    /* slots per probe group */
+#define LWS_TABLE_EMPTY    0x80  /* control byte of an empty slot */
+#define LWS_TABLE_DELETED  0xfe  /* control byte of a deleted slot */
+
+
 typedef struct lws_table_s lws_table_t;
 typedef struct lws_table_entry_s lws_table_entry_t;
+typedef struct lws_table_meta_s lws_table_meta_t;
+typedef void (*lws_table_free_pt)(void *value, void *data);
 
 struct lws_table_s {
-	ngx_log_t           *log;       /* log */
-	size_t               alloc;     /* allocated slots */
-	size_t               load;      /* load limit for rehash */
-	size_t               count;     /* number of entries */
-	lws_table_entry_t   *entries;   /* entries */
-	ngx_queue_t          order;     /* insert order; LRU if capped */
-	time_t               timeout;   /* timeout of entries */
-	size_t               cap;       /* cap */
-	unsigned             dup:1;     /* duplicate keys */
-	unsigned             free:1;    /* free values */
-	unsigned             ci:1;      /* case insensitive */
-	unsigned             timed:1;   /* with timeout */
-	unsigned             capped:1;  /* capped, e.g., for caches */
+	ngx_log_t          *log;           /* log */
+	size_t              alloc;         /* allocated slots; power of 2 */
+	size_t              load;          /* load limit for rehash, including deleted slots */
+	size_t              count;         /* number of entries */
+	size_t              deleted;       /* number of deleted slots */
+	u_char             *ctrl;          /* control bytes; hash fingerprint if set */
+	lws_table_entry_t  *entries;       /* entries; probed */
+	lws_table_meta_t   *meta;          /* entry metadata; not probed */
+	ngx_queue_t         order;         /* insert order; LRU if capped */
+	time_t              timeout;       /* timeout of entries */
+	size_t              cap;           /* cap */
+	size_t              evicted;       /* entries evicted due to the cap */
+	lws_table_free_pt   free_handler;  /* frees values; NULL = ngx_free */
+	void               *free_data;     /* data of free handler */
+	unsigned            dup:1;         /* duplicate keys */
+	unsigned            free:1;        /* free values */
+	unsigned            ci:1;          /* case insensitive */
+	unsigned            timed:1;       /* with timeout */
+	unsigned            capped:1;      /* capped, e.g., for caches */
 };
 
-typedef enum {
-	LWS_TES_UNUSED,
-	LWS_TES_SET,
-	LWS_TES_DELETED
-} lws_table_entry_state_e;
-
 struct lws_table_entry_s {
-	ngx_queue_t              order;  /* see above */
-	ngx_str_t                key;    /* key; managed if dup is set */
-	void                    *value;  /* value; managed if free is set */
-	ngx_uint_t               hash;   /* key hash */
-	time_t                   time;   /* set time; if timed is set */
-	lws_table_entry_state_e  state;  /* state [unused, set, deleted] */
+	ngx_str_t    key;    /* key; managed if dup is set */
+	void        *value;  /* value; managed if free is set */
 };
 
+struct lws_table_meta_s {
+	ngx_queue_t  order;  /* see above */
+	ngx_uint_t   hash;   /* key hash */
+	time_t       time;   /* set time; if timed is set */
+};
 
 lws_table_t *lws_table_create(size_t load, ngx_log_t *log);
 void lws_table_free(lws_table_t *t);
 void lws_table_clear(lws_table_t *t);
 int lws_table_set_dup(lws_table_t *t, int dup);
 int lws_table_set_free(lws_table_t *t, int free);
+int lws_table_set_free_handler(lws_table_t *t, lws_table_free_pt handler, void *data);
 int lws_table_set_ci(lws_table_t *t, int ci);
 int lws_table_set_timeout(lws_table_t *t, time_t timeout);
 int lws_table_set_cap(lws_table_t *t, size_t cap);
@@ -0,0 +1,149 @@
+/*
+ * LWS timer
+ *
+ * Copyright (C) 2024 Andre Naef
+ */
+
+
+#include <lws_timer.h>
+#include <lws_lib.h>
+
+
+#if LUA_VERSION_NUM < 502
+#define LUA_OK  0
+#endif
+
+
+static void lws_timer_handler(ngx_event_t *ev);
+static void lws_timer_thread_handler(void *data, ngx_log_t *log);
+static void lws_timer_completion_handler(ngx_event_t *ev);
+
+
+void lws_start_timers (lws_loc_conf_t *llcf, lws_timer_t *timers, ngx_uint_t n) {
+	ngx_uint_t    i;
+	lws_timer_t  *timer;
+
+	/* the location takes ownership of the timers */
+	llcf->timers = timers;
+	llcf->timers_n = n;
+	llcf->timers_started = 1;
+	for (i = 0; i < n; i++) {
+		timer = &timers[i];
+		timer->llcf = llcf;
+		timer->timers = timers;
+		timer->timers_n = n;
+		timer->stopped = 0;
+		timer->ev.data = timer;
+		timer->ev.handler = lws_timer_handler;
+		timer->ev.cancelable = 1;
+		timer->ev.log = ngx_cycle->log;
+		timer->task.ctx = timer;
+		timer->task.handler = lws_timer_thread_handler;
+		timer->task.event.handler = lws_timer_completion_handler;
+		timer->task.event.data = timer;
+		ngx_add_timer(&timer->ev, timer->delay);
+	}
+	if (n > 0) {
+		ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0, "[LWS] timers started n:%ui", n);
+	}
+}
+
+void lws_stop_timers (lws_loc_conf_t *llcf) {
+	ngx_uint_t    i, running;
+	lws_timer_t  *timer;
+
+	/* stop all timers */
+	running = 0;
+	for (i = 0; i < llcf->timers_n; i++) {
+		timer = &llcf->timers[i];
+		timer->stopped = 1;
+		if (timer->ev.timer_set) {
+			ngx_del_timer(&timer->ev);
+		}
+		if (timer->state) {
+			running = 1;
+		}
+	}
+
+	/* free; the last completing timer function frees timers that are running */
+	if (!running) {
+		ngx_free(llcf->timers);
+	}
+	llcf->timers = NULL;
+	llcf->timers_n = 0;
+}
+
+static void lws_timer_handler (ngx_event_t *ev) {
+	lws_timer_t      *timer;
+	lws_main_conf_t  *lmcf;
+
+	/* acquire or create an idle state; the maximum number of states is not exceeded */
+	timer = ev->data;
+	timer->state = lws_get_idle_state(timer->llcf);
+	if (!timer->state) {
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "[LWS] timer deferred index:%i",
+				timer->index);
+		ngx_add_timer(ev, LWS_TIMER_RETRY);
+		return;
+	}
+
+	/* post task */
+	lmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, lws_module);
+	if (ngx_thread_task_post(lmcf->thread_pool, &timer->task) != NGX_OK) {
+		ngx_log_error(NGX_LOG_CRIT, ev->log, 0, "[LWS] failed to post thread task");
+		lws_put_state(timer->state, ev->log);
+		timer->state = NULL;
+		ngx_add_timer(ev, LWS_TIMER_RETRY);
+	}
+}
+
+static void lws_timer_thread_handler (void *data, ngx_log_t *log) {
+	lua_State    *L;
+	ngx_str_t     msg;
+	lws_timer_t  *timer;
+
+	/* prepare stack */
+	timer = data;
+	L = timer->state->L;
+	lws_observe_invalidations(timer->state);
+	lua_pushcfunction(L, lws_run_timer);
+	lua_pushinteger(L, timer->index);  /* [traceback, function, index] */
+
+	/* call */
+	if (lua_pcall(L, 1, 0, 1) != LUA_OK) {
+		timer->state->close = 1;
+		lws_get_msg(L, -1, &msg);
+		ngx_log_error(NGX_LOG_ERR, log, 0, "[LWS] %s timer error: %V", LUA_VERSION, &msg);
+		lua_pop(L, 1);  /* [traceback] */
+	}
+}
+
+static void lws_timer_completion_handler (ngx_event_t *ev) {
+	ngx_uint_t    i;
+	lws_timer_t  *timer;
+
+	/* timers stopped? the state is closed detached from the location, which is gone */
+	timer = ev->data;
+	if (timer->stopped) {
+		timer->state->llcf = NULL;
+		timer->state->lmcf = NULL;
+		lws_close_state(timer->state, ngx_cycle->log);
+		timer->state = NULL;
+		for (i = 0; i < timer->timers_n; i++) {
+			if (timer->timers[i].state) {
+				return;
+			}
+		}
+		ngx_free(timer->timers);
+		return;
+	}
+
+	/* release state */
+	lws_put_state(timer->state, ngx_cycle->log);
+	timer->state = NULL;
+
+	/* schedule next run */
+	if (timer->interval > 0 && !ngx_exiting) {
+		ngx_add_timer(&timer->ev, timer->interval);
+	}
+}
@@ -0,0 +1,41 @@
+/*
+ * LWS timer
+ *
+ * Copyright (C) 2024 Andre Naef
+ */
+
+
+#ifndef _LWS_TIMER_INCLUDED
+#define _LWS_TIMER_INCLUDED
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_thread_pool.h>
+
+
+#define LWS_TIMER_RETRY  1000  /* retry delay if no Lua state is available [ms] */
+
+
+#include <lws_module.h>
+
+
+struct lws_timer_s {
+	lws_loc_conf_t     *llcf;      /* location configuration */
+	lws_timer_t        *timers;    /* timers of the location */
+	ngx_uint_t          timers_n;  /* number of timers of the location */
+	ngx_flag_t          stopped;   /* timers stopped; the location is gone */
+	lws_state_t        *state;     /* Lua state running the timer function */
+	ngx_int_t           index;     /* index of the timer function in the Lua states */
+	ngx_msec_t          delay;     /* delay of the first run */
+	ngx_msec_t          interval;  /* interval of subsequent runs; 0 = runs once */
+	ngx_event_t         ev;        /* timer event */
+	ngx_thread_task_t   task;      /* thread task */
+};
+
+
+void lws_start_timers(lws_loc_conf_t *llcf, lws_timer_t *timers, ngx_uint_t n);
+void lws_stop_timers(lws_loc_conf_t *llcf);
+
+
+#endif /* _LWS_TIMER_INCLUDED */
@@ -0,0 +1,230 @@
+/*
+ * LWS value
+ *
+ * Copyright (C) 2024 Andre Naef
+ */
+
+
+#include <lws_value.h>
+#include <lauxlib.h>
+
+
+static int lws_value_reserve(lws_value_buf_t *b, size_t n);
+static int lws_encode_value(lua_State *L, int index, lws_value_buf_t *b, int depth);
+static void lws_decode_value(lua_State *L, u_char **pos, u_char *last);
+
+
+static int lws_value_reserve (lws_value_buf_t *b, size_t n) {
+	size_t   size;
+	u_char  *data;
+
+	if (b->len + n <= b->size) {
+		return 0;
+	}
+	size = b->size ? b->size : 64;
+	while (size < b->len + n) {
+		size *= 2;
+	}
+	data = realloc(b->data, size);
+	if (!data) {
+		b->err = "failed to allocate values";
+		return -1;
+	}
+	b->data = data;
+	b->size = size;
+	return 0;
+}
+
+static int lws_encode_value (lua_State *L, int index, lws_value_buf_t *b, int depth) {
+	int          type;
+	size_t       len;
+	const char  *s;
+	lua_Number   number;
+#if LUA_VERSION_NUM >= 503
+	lua_Integer  integer;
+#endif
+
+	if (index < 0) {
+		index = lua_gettop(L) + index + 1;
+	}
+	type = lua_type(L, index);
+	switch (type) {
+	case LUA_TNIL:
+		if (lws_value_reserve(b, 1) != 0) {
+			return -1;
+		}
+		b->data[b->len++] = LWS_VT_NIL;
+		return 0;
+
+	case LUA_TBOOLEAN:
+		if (lws_value_reserve(b, 1) != 0) {
+			return -1;
+		}
+		b->data[b->len++] = lua_toboolean(L, index) ? LWS_VT_TRUE : LWS_VT_FALSE;
+		return 0;
+
+	case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+		if (lua_isinteger(L, index)) {
+			if (lws_value_reserve(b, 1 + sizeof(lua_Integer)) != 0) {
+				return -1;
+			}
+			integer = lua_tointeger(L, index);
+			b->data[b->len++] = LWS_VT_INTEGER;
+			ngx_memcpy(b->data + b->len, &integer, sizeof(lua_Integer));
+			b->len += sizeof(lua_Integer);
+			return 0;
+		}
+#endif
+		if (lws_value_reserve(b, 1 + sizeof(lua_Number)) != 0) {
+			return -1;
+		}
+		number = lua_tonumber(L, index);
+		b->data[b->len++] = LWS_VT_NUMBER;
+		ngx_memcpy(b->data + b->len, &number, sizeof(lua_Number));
+		b->len += sizeof(lua_Number);
+		return 0;
+
+	case LUA_TSTRING:
+		s = lua_tolstring(L, index, &len);
+		if (lws_value_reserve(b, 1 + sizeof(size_t) + len) != 0) {
+			return -1;
+		}
+		b->data[b->len++] = LWS_VT_STRING;
+		ngx_memcpy(b->data + b->len, &len, sizeof(size_t));
+		b->len += sizeof(size_t);
+		ngx_memcpy(b->data + b->len, s, len);
+		b->len += len;
+		return 0;
+
+	case LUA_TTABLE:
+		if (depth >= LWS_VALUE_DEPTH_MAX) {
+			b->err = "table nesting too deep";
+			return -1;
+		}
+		if (!lua_checkstack(L, 2)) {
+			b->err = "stack overflow";
+			return -1;
+		}
+		if (lws_value_reserve(b, 1) != 0) {
+			return -1;
+		}
+		b->data[b->len++] = LWS_VT_TABLE;
+		lua_pushnil(L);
+		while (lua_next(L, index)) {
+			if (lws_encode_value(L, -2, b, depth + 1) != 0
+					|| lws_encode_value(L, -1, b, depth + 1) != 0) {
+				lua_pop(L, 2);
+				return -1;
+			}
+			lua_pop(L, 1);
+		}
+		if (lws_value_reserve(b, 1) != 0) {
+			return -1;
+		}
+		b->data[b->len++] = LWS_VT_END;
+		return 0;
+
+	default:
+		b->type = lua_typename(L, type);
+		return -1;
+	}
+}
+
+void lws_encode_values (lua_State *L, int index, int n, ngx_str_t *dst) {
+	int              i;
+	lws_value_buf_t  b;
+
+	/* encode */
+	ngx_memzero(&b, sizeof(lws_value_buf_t));
+	for (i = 0; i < n; i++) {
+		if (lws_encode_value(L, index + i, &b, 0) != 0) {
+			free(b.data);
+			if (b.type) {
+				luaL_error(L, "bad value #%d (%s not supported)", i + 1, b.type);
+			}
+			luaL_error(L, "bad value #%d (%s)", i + 1, b.err);
+		}
+	}
+
+	/* values are owned by the caller, and freed with ngx_free */
+	dst->data = b.data;
+	dst->len = b.len;
+}
+
+static void lws_decode_value (lua_State *L, u_char **pos, u_char *last) {
+	u_char      *p;
+	size_t       len;
+	lua_Number   number;
+#if LUA_VERSION_NUM >= 503
+	lua_Integer  integer;
+#endif
+
+	p = *pos;
+	luaL_checkstack(L, 3, "too many values");
+	switch (*p++) {
+	case LWS_VT_NIL:
+		lua_pushnil(L);
+		break;
+
+	case LWS_VT_FALSE:
+		lua_pushboolean(L, 0);
+		break;
+
+	case LWS_VT_TRUE:
+		lua_pushboolean(L, 1);
+		break;
+
+#if LUA_VERSION_NUM >= 503
+	case LWS_VT_INTEGER:
+		ngx_memcpy(&integer, p, sizeof(lua_Integer));
+		p += sizeof(lua_Integer);
+		lua_pushinteger(L, integer);
+		break;
+#endif
+
+	case LWS_VT_NUMBER:
+		ngx_memcpy(&number, p, sizeof(lua_Number));
+		p += sizeof(lua_Number);
+		lua_pushnumber(L, number);
+		break;
+
+	case LWS_VT_STRING:
+		ngx_memcpy(&len, p, sizeof(size_t));
+		p += sizeof(size_t);
+		lua_pushlstring(L, (const char *)p, len);
+		p += len;
+		break;
+
+	case LWS_VT_TABLE:
+		lua_newtable(L);
+		while (p < last && *p != LWS_VT_END) {
+			lws_decode_value(L, &p, last);
+			lws_decode_value(L, &p, last);
+			lua_rawset(L, -3);
+		}
+		p++;
+		break;
+
+	default:
+		luaL_error(L, "bad encoded value");
+	}
+	if (p > last) {
+		luaL_error(L, "bad encoded value");
+	}
+	*pos = p;
+}
+
+int lws_decode_values (lua_State *L, ngx_str_t *src) {
+	int      n;
+	u_char  *p, *last;
+
+	n = 0;
+	p = src->data;
+	last = src->data + src->len;
+	while (p < last) {
+		lws_decode_value(L, &p, last);
+		n++;
+	}
+	return n;
+}
@@ -0,0 +1,46 @@
+/*
+ * LWS value
+ *
+ * Copyright (C) 2024 Andre Naef
+ */
+
+
+#ifndef _LWS_VALUE_INCLUDED
+#define _LWS_VALUE_INCLUDED
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <lua.h>
+
+
+#define LWS_VALUE_DEPTH_MAX  32  /* maximum table nesting */
+
+
+typedef struct lws_value_buf_s lws_value_buf_t;
+
+typedef enum {
+	LWS_VT_NIL,
+	LWS_VT_FALSE,
+	LWS_VT_TRUE,
+	LWS_VT_INTEGER,
+	LWS_VT_NUMBER,
+	LWS_VT_STRING,
+	LWS_VT_TABLE,
+	LWS_VT_END
+} lws_value_type_e;
+
+struct lws_value_buf_s {
+	u_char      *data;  /* encoded values */
+	size_t       len;   /* length of encoded values */
+	size_t       size;  /* allocated size */
+	const char  *err;   /* error message */
+	const char  *type;  /* unsupported type */
+};
+
+
+void lws_encode_values(lua_State *L, int index, int n, ngx_str_t *dst);
+int lws_decode_values(lua_State *L, ngx_str_t *src);
+
+
+#endif /* _LWS_VALUE_INCLUDED */